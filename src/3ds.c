@@ -6,10 +6,13 @@
 
 #include "cpu.h"
 #include "kernel/loader.h"
+#include "kernel/stats.h"
 #include "kernel/svc_types.h"
+#include "trace.h"
 
 bool e3ds_init(E3DS* s, char* romfile) {
     memset(s, 0, sizeof *s);
+    s->starttime = time_ns();
 
     s->sched.master = s;
 
@@ -36,6 +39,8 @@ bool e3ds_init(E3DS* s, char* romfile) {
     } else if (!strcmp(ext, ".cxi") || !strcmp(ext, ".app") ||
                !strcmp(ext, ".ncch")) {
         entrypoint = load_ncch(s, romfile, 0);
+    } else if (!strcmp(ext, ".3dz")) {
+        entrypoint = load_3dz(s, romfile);
     } else {
         eprintf("unsupported file format\n");
         e3ds_destroy(s);
@@ -67,6 +72,7 @@ bool e3ds_init(E3DS* s, char* romfile) {
     s->process.hdr.type = KOT_PROCESS;
     s->process.hdr.refcount = 2; // so closing this handle won't cause problems
     s->process.handles[1] = &s->process.hdr;
+    handle_sync(s);
 
     add_event(&s->sched, gsp_handle_event, GSPEVENT_VBLANK0, CPU_CLK / FPS);
 
@@ -74,19 +80,31 @@ bool e3ds_init(E3DS* s, char* romfile) {
 }
 
 void e3ds_destroy(E3DS* s) {
+    savestate_destroy(s);
+    rewind_destroy(s, &s->rewind);
+
     cpu_free(s);
 
     gpu_destroy(&s->gpu);
     renderer_gl_destroy(&s->gpu.gl);
 
+    if (g_infologs) {
+        kobject_print_counts();
+        stats_print();
+    }
+    stats_reset();
+
     for (int i = 0; i < HANDLE_MAX; i++) {
         if (s->process.handles[i] && !--s->process.handles[i]->refcount)
             kobject_destroy(s, s->process.handles[i]);
     }
 
     fs_close_all_files(s);
+    ldr_destroy();
+    y2r_destroy();
+    dsp_destroy();
 
-    if (s->romimage.fp) fclose(s->romimage.fp);
+    romimage_close(&s->romimage);
 
     memory_destroy(s);
 }
@@ -110,6 +128,7 @@ void e3ds_update_datetime(E3DS* s) {
 }
 
 void e3ds_run_frame(E3DS* s) {
+    TRACE_SCOPE("frame");
     while (!s->frame_complete) {
         e3ds_restore_context(s);
         if (!s->cpu.wfe) {
@@ -130,4 +149,11 @@ void e3ds_run_frame(E3DS* s) {
         e3ds_update_datetime(s);
     }
     s->frame_complete = false;
+
+    if (s->starttime) {
+        linfo("first frame after %.3lf ms", (time_ns() - s->starttime) / 1e6);
+        s->starttime = 0;
+    }
+
+    rewind_frame(s, &s->rewind);
 }
\ No newline at end of file
@@ -9,6 +9,8 @@
 #include "kernel/process.h"
 #include "kernel/thread.h"
 #include "pica/gpu.h"
+#include "rewind.h"
+#include "savestate.h"
 #include "scheduler.h"
 #include "services/services.h"
 #include "services/srv.h"
@@ -36,9 +38,15 @@ typedef struct _3DS {
     int mem_fd;
     u8* physmem;
     u8* virtmem;
+    bool hugepages;
 #endif
 
-    FCRAMHeapNode pheap;
+    StaticVector(MemSnapshot*, MEMSNAP_MAX) memsnaps;
+    SaveStateWriter* savewriter;
+    SaveStateBase savebase;
+    Rewind rewind;
+
+    FCRAMHeap pheap;
 
     KProcess process;
 
@@ -47,6 +55,8 @@ typedef struct _3DS {
     RomImage romimage;
 
     bool frame_complete;
+    // for logging the time until the first frame
+    u64 starttime;
 
     Scheduler sched;
 } E3DS;
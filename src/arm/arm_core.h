@@ -110,6 +110,8 @@ typedef struct _ArmCore {
     u32 vector_base;
 
     s64 cycles;
+    // cycles the current run was started with
+    s64 slice;
 
     bool wfe;
 
@@ -6,6 +6,7 @@
 #define backend_generate_code(ir, regalloc, cpu)                               \
     backend_x86_generate_code(ir, regalloc, cpu)
 #define backend_get_code(backend) backend_x86_get_code(backend)
+#define backend_get_code_size(backend) backend_x86_get_code_size(backend)
 #define backend_patch_links(block) backend_x86_patch_links(block)
 #define backend_free(backend) backend_x86_free(backend)
 #define backend_disassemble(backend) backend_x86_disassemble(backend)
@@ -14,6 +15,7 @@
 #define backend_generate_code(ir, regalloc, cpu)                               \
     backend_arm_generate_code(ir, regalloc, cpu)
 #define backend_get_code(backend) backend_arm_get_code(backend)
+#define backend_get_code_size(backend) backend_arm_get_code_size(backend)
 #define backend_patch_links(block) backend_arm_patch_links(block)
 #define backend_free(backend) backend_arm_free(backend)
 #define backend_disassemble(backend) backend_arm_disassemble(backend)
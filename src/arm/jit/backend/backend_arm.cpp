@@ -1407,6 +1407,10 @@ JITFunc backend_arm_get_code(void* backend) {
     return (JITFunc) ((Code*) backend)->getCode();
 }
 
+size_t backend_arm_get_code_size(void* backend) {
+    return ((Code*) backend)->getSize();
+}
+
 void backend_arm_patch_links(JITBlock* block) {
     Code* code = (Code*) block->backend;
     for (auto [offset, attrs, addr] : code->links) {
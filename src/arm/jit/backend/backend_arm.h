@@ -15,6 +15,7 @@ extern "C" {
 void* backend_arm_generate_code(IRBlock* ir, RegAllocation* regalloc,
                                 ArmCore* cpu);
 JITFunc backend_arm_get_code(void* backend);
+size_t backend_arm_get_code_size(void* backend);
 void backend_arm_patch_links(JITBlock* block);
 void backend_arm_free(void* backend);
 void backend_arm_disassemble(void* backend);
@@ -1308,6 +1308,10 @@ JITFunc backend_x86_get_code(void* backend) {
     return (JITFunc) ((Code*) backend)->getCode();
 }
 
+size_t backend_x86_get_code_size(void* backend) {
+    return ((Code*) backend)->getSize();
+}
+
 void backend_x86_patch_links(JITBlock* block) {
     Code* code = (Code*) block->backend;
     for (auto [offset, attrs, addr] : code->links) {
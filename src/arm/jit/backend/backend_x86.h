@@ -15,6 +15,7 @@ extern "C" {
 void* backend_x86_generate_code(IRBlock* ir, RegAllocation* regalloc,
                                 ArmCore* cpu);
 JITFunc backend_x86_get_code(void* backend);
+size_t backend_x86_get_code_size(void* backend);
 void backend_x86_patch_links(JITBlock* block);
 void backend_x86_free(void* backend);
 void backend_x86_disassemble(void* backend);
@@ -1,6 +1,7 @@
 #include "jit.h"
 
 #include "backend/backend.h"
+#include "perfmap.h"
 #include "optimizer.h"
 #include "register_allocator.h"
 #include "translator.h"
@@ -52,6 +53,8 @@ JITBlock* create_jit_block(ArmCore* cpu, u32 addr) {
 
     block->backend = backend_generate_code(&ir, &regalloc, cpu);
     block->code = backend_get_code(block->backend);
+    perfmap_add(block->code, backend_get_code_size(block->backend),
+                "arm_%08x_%02x_%u", addr, block->attrs, block->numinstr);
 
     block->cpu = cpu;
 
@@ -0,0 +1,121 @@
+#include "audio.h"
+
+#include <stdio.h>
+
+static AudioRing ring;
+
+static struct {
+    FILE* fp;
+    u32 rate;
+    u32 size;
+} wav;
+
+static u64 dropped;
+static u64 underrun;
+
+typedef struct {
+    char riff[4];
+    u32 riffsize;
+    char wave[4];
+    char fmt[4];
+    u32 fmtsize;
+    u16 format;
+    u16 channels;
+    u32 rate;
+    u32 byterate;
+    u16 align;
+    u16 bits;
+    char data[4];
+    u32 datasize;
+} WavHeader;
+
+static void wav_header() {
+    WavHeader hdr = {
+        .riff = "RIFF",
+        .riffsize = sizeof hdr - 8 + wav.size,
+        .wave = "WAVE",
+        .fmt = "fmt ",
+        .fmtsize = 16,
+        .format = 1,
+        .channels = 2,
+        .rate = wav.rate,
+        .byterate = wav.rate * 4,
+        .align = 4,
+        .bits = 16,
+        .data = "data",
+        .datasize = wav.size,
+    };
+    fseek(wav.fp, 0, SEEK_SET);
+    fwrite(&hdr, sizeof hdr, 1, wav.fp);
+}
+
+static void wav_write(s16 (*samples)[2], u32 n) {
+    if (!wav.fp) return;
+    fwrite(samples, sizeof *samples, n, wav.fp);
+    wav.size += n * sizeof *samples;
+}
+
+// samples which do not fit are dropped, which only happens when the
+// emulator runs faster than the audio plays
+void audio_push(s16 (*samples)[2], u32 n) {
+    wav_write(samples, n);
+
+    u32 tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+    u32 head = atomic_load_explicit(&ring.head, memory_order_acquire);
+    u32 space = AUDIO_RING_SIZE - (tail - head);
+    if (n > space) {
+        dropped += n - space;
+        n = space;
+    }
+    for (u32 i = 0; i < n; i++) {
+        ring.d[(tail + i) % AUDIO_RING_SIZE][0] = samples[i][0];
+        ring.d[(tail + i) % AUDIO_RING_SIZE][1] = samples[i][1];
+    }
+    atomic_store_explicit(&ring.tail, tail + n, memory_order_release);
+}
+
+// returns how many samples there were, the rest is left for the caller to
+// fill with silence
+u32 audio_pull(s16 (*samples)[2], u32 n) {
+    u32 head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+    u32 tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+    u32 avail = tail - head;
+    if (n > avail) {
+        underrun += n - avail;
+        n = avail;
+    }
+    for (u32 i = 0; i < n; i++) {
+        samples[i][0] = ring.d[(head + i) % AUDIO_RING_SIZE][0];
+        samples[i][1] = ring.d[(head + i) % AUDIO_RING_SIZE][1];
+    }
+    atomic_store_explicit(&ring.head, head + n, memory_order_release);
+    return n;
+}
+
+// the sizes in the header are filled in when the file is closed
+bool audio_wav_open(char* path, u32 rate) {
+    audio_wav_close();
+    wav.fp = fopen(path, "wb");
+    if (!wav.fp) {
+        lerror("could not open %s", path);
+        return false;
+    }
+    wav.rate = rate;
+    wav.size = 0;
+    wav_header();
+    return true;
+}
+
+void audio_wav_close() {
+    if (wav.fp) {
+        wav_header();
+        fclose(wav.fp);
+        wav.fp = nullptr;
+        linfo("wrote %u bytes of audio", wav.size);
+    }
+    if (dropped || underrun) {
+        linfo("audio: %lu samples dropped, %lu samples of silence", dropped,
+              underrun);
+    }
+    dropped = underrun = 0;
+}
@@ -0,0 +1,26 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdatomic.h>
+
+#include "common.h"
+
+// stereo output of the dsp, passed from the dsp thread to the host audio
+// callback through a ring where each side only moves its own index, and
+// optionally written to a wav file
+
+#define AUDIO_RING_SIZE BIT(12)
+
+typedef struct {
+    s16 d[AUDIO_RING_SIZE][2];
+    atomic_uint head;
+    atomic_uint tail;
+} AudioRing;
+
+void audio_push(s16 (*samples)[2], u32 n);
+u32 audio_pull(s16 (*samples)[2], u32 n);
+
+bool audio_wav_open(char* path, u32 rate);
+void audio_wav_close();
+
+#endif
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define eprintf(format, ...) fprintf(stderr, format __VA_OPT__(, ) __VA_ARGS__)
 #define printfln(format, ...) printf(format "\n" __VA_OPT__(, ) __VA_ARGS__)
@@ -61,6 +62,12 @@ typedef float fvec4[4];
 #define MASK(n) (BIT(n) - 1)
 #define MASKL(n) (BITL(n) - 1)
 
+static inline u64 time_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1'000'000'000ull + ts.tv_nsec;
+}
+
 #define FIFO(T, bits)                                                          \
     struct {                                                                   \
         T d[BIT(bits)];                                                        \
@@ -121,6 +128,19 @@ typedef float fvec4[4];
         }                                                                      \
     })
 #define SVec_remove Vec_remove
+// replaces n elements at i with the m elements of src
+#define Vec_splice(v, i, n, src, m)                                            \
+    ({                                                                         \
+        size_t _size = (v).size - (n) + (m);                                   \
+        if (_size > (v).cap) {                                                 \
+            (v).cap = _size > 2 * (v).cap ? _size : 2 * (v).cap;               \
+            (v).d = (typeof((v).d)) realloc((v).d, (v).cap * sizeof *(v).d);   \
+        }                                                                      \
+        memmove(&(v).d[(i) + (m)], &(v).d[(i) + (n)],                          \
+                ((v).size - (i) - (n)) * sizeof *(v).d);                       \
+        memcpy(&(v).d[i], src, (m) * sizeof *(v).d);                           \
+        (v).size = _size;                                                      \
+    })
 #define Vec_foreach(e, v) for (auto* e = (v).d; e < (v).d + (v).size; e++)
 #define SVec_foreach Vec_foreach
 
@@ -4,6 +4,7 @@
 #include "arm/jit/jit.h"
 #include "kernel/svc.h"
 #include "kernel/thread.h"
+#include "trace.h"
 
 // #define CPULOG
 // #define BREAK
@@ -38,7 +39,9 @@ void cpu_free(E3DS* s) {
 
 // returns number of cycles actually ran
 s64 cpu_run(E3DS* s, s64 cycles) {
+    TRACE_SCOPE("cpu_run");
     s->cpu.cycles = cycles;
+    s->cpu.slice = cycles;
 #ifdef BREAK
     if (s->cpu.pc == BREAK) {
         cpu_print_state(&s->cpu);
@@ -55,6 +58,8 @@ s64 cpu_run(E3DS* s, s64 cycles) {
     if (s->cpu.pc == PATCHFN) s->cpu.pc = s->cpu.lr;
 #endif
     arm_exec_jit(&s->cpu);
+    // the scheduler catches up with the whole run once this returns
+    s->cpu.slice = s->cpu.cycles;
     return cycles - s->cpu.cycles;
 }
 
@@ -12,6 +12,12 @@ void cpu_free(E3DS* s);
 
 s64 cpu_run(E3DS* s, s64 cycles);
 
+// the scheduler time only advances after each run, so this adds the cycles
+// already run in the current one
+static inline u64 cpu_now(E3DS* s) {
+    return s->sched.now + (s->cpu.slice - s->cpu.cycles);
+}
+
 u32 cpu_read8(E3DS* s, u32 addr, bool sx);
 u32 cpu_read16(E3DS* s, u32 addr, bool sx);
 u32 cpu_read32(E3DS* s, u32 addr);
@@ -19,6 +19,15 @@ void load_config() {
         CFG_INT("vsh_threads", 0, 0),
         CFG_BOOL("hw_vertexshaders", cfg_true, 0),
         CFG_BOOL("ubershader", cfg_false, 0),
+        CFG_BOOL("async_shaders", cfg_false, 0),
+        CFG_BOOL("software_renderer", cfg_false, 0),
+        CFG_INT("sw_threads", 0, 0),
+        CFG_BOOL("rewind", cfg_false, 0),
+        CFG_INT("rewind_interval", 4, 0),
+        CFG_INT("rewind_buffer_mb", 64, 0),
+        CFG_INT("run_ahead", 0, 0),
+        CFG_BOOL("huge_pages", cfg_false, 0),
+        CFG_BOOL("audio", cfg_true, 0),
         CFG_END(),
     };
     cfg_t* cfg = cfg_init(opts, 0);
@@ -38,6 +47,25 @@ void load_config() {
     cfg_setint(cfg, "vsh_threads", ctremu.vshthreads);
     ctremu.hwvshaders = cfg_getbool(cfg, "hw_vertexshaders");
     ctremu.ubershader = cfg_getbool(cfg, "ubershader");
+    ctremu.asyncshaders = cfg_getbool(cfg, "async_shaders");
+    ctremu.swrenderer = cfg_getbool(cfg, "software_renderer");
+    ctremu.swthreads = cfg_getint(cfg, "sw_threads");
+    if (ctremu.swthreads < 0) ctremu.swthreads = 0;
+    if (ctremu.swthreads > SW_MAX_THREADS) ctremu.swthreads = SW_MAX_THREADS;
+    cfg_setint(cfg, "sw_threads", ctremu.swthreads);
+    ctremu.rewind = cfg_getbool(cfg, "rewind");
+    ctremu.rewindinterval = cfg_getint(cfg, "rewind_interval");
+    if (ctremu.rewindinterval < 1) ctremu.rewindinterval = 1;
+    cfg_setint(cfg, "rewind_interval", ctremu.rewindinterval);
+    ctremu.rewindbuffer = cfg_getint(cfg, "rewind_buffer_mb");
+    if (ctremu.rewindbuffer < 1) ctremu.rewindbuffer = 1;
+    cfg_setint(cfg, "rewind_buffer_mb", ctremu.rewindbuffer);
+    ctremu.runahead = cfg_getint(cfg, "run_ahead");
+    if (ctremu.runahead < 0) ctremu.runahead = 0;
+    if (ctremu.runahead > RUNAHEAD_MAX) ctremu.runahead = RUNAHEAD_MAX;
+    cfg_setint(cfg, "run_ahead", ctremu.runahead);
+    ctremu.hugepages = cfg_getbool(cfg, "huge_pages");
+    ctremu.audio = cfg_getbool(cfg, "audio");
 
     FILE* fp = fopen("config.txt", "w");
     if (fp) {
@@ -53,13 +81,23 @@ void emulator_init() {
     mkdir("system/savedata", S_IRWXU);
     mkdir("system/extdata", S_IRWXU);
     mkdir("system/sdmc", S_IRWXU);
+    mkdir("system/shadercache", S_IRWXU);
+    mkdir("system/codecache", S_IRWXU);
+    mkdir("system/captures", S_IRWXU);
+    mkdir("system/savestates", S_IRWXU);
+#ifdef TRACING
+    mkdir("system/traces", S_IRWXU);
+#endif
 
     ctremu.videoscale = 1;
     ctremu.vsync = true;
     ctremu.shaderjit = true;
     ctremu.vshthreads = 0;
+    ctremu.audio = true;
 
     load_config();
+
+    if (ctremu.runahead) savestate_init(&ctremu.runaheadstate);
 }
 
 void emulator_quit() {
@@ -68,6 +106,8 @@ void emulator_quit() {
         ctremu.initialized = false;
     }
 
+    if (ctremu.runahead) savestate_free(&ctremu.runaheadstate);
+
     free(ctremu.romfilenoext);
     free(ctremu.romfile);
     ctremu.romfile = nullptr;
@@ -111,5 +151,69 @@ bool emulator_reset() {
 
     ctremu.initialized = true;
 
+    if (ctremu.rewind) {
+        rewind_init(&ctremu.system.rewind, ctremu.rewindinterval,
+                    (size_t) ctremu.rewindbuffer * BIT(20));
+    }
+
     return true;
 }
+
+char* savestate_path() {
+    char* path;
+    asprintf(&path, "system/savestates/%s.state", ctremu.romfilenoext);
+    return path;
+}
+
+bool emulator_save_state() {
+    if (!ctremu.initialized) return false;
+    char* path = savestate_path();
+    bool res = savestate_save(&ctremu.system, path);
+    free(path);
+    return res;
+}
+
+bool emulator_load_state() {
+    if (!ctremu.initialized) return false;
+    char* path = savestate_path();
+    rewind_reset(&ctremu.system, &ctremu.system.rewind);
+    bool res = savestate_load(&ctremu.system, path);
+    free(path);
+    return res;
+}
+
+// emulates a few frames past the real state with the latest input so the
+// frame shown reacts sooner, then puts everything back
+void emulator_run_ahead() {
+    E3DS* s = &ctremu.system;
+    if (!ctremu.initialized || !ctremu.runahead || s->rewind.hold) return;
+
+    u64 start = time_ns();
+    if (!savestate_take(s, &ctremu.runaheadstate)) return;
+    // these frames are thrown away so they should not become checkpoints
+    s->rewind.hold = true;
+    for (int i = 0; i < ctremu.runahead; i++) {
+        e3ds_run_frame(s);
+    }
+    s->rewind.hold = false;
+    savestate_restore(s, &ctremu.runaheadstate);
+    savestate_release(s, &ctremu.runaheadstate);
+    ctremu.runaheadtime += time_ns() - start;
+}
+
+// sets up only the gpu and memory to replay a capture without a rom
+bool emulator_replay(char* path, int iters) {
+    E3DS* s = &ctremu.system;
+    memset(s, 0, sizeof *s);
+    gpu_init(&s->gpu);
+    renderer_gl_init(&s->gpu.gl, &s->gpu);
+    memory_init(s);
+
+    renderer_gl_setup_gpu(&s->gpu.gl);
+    bool res = gpucapture_replay(&s->gpu, path, iters);
+
+    gpu_destroy(&s->gpu);
+    renderer_gl_destroy(&s->gpu.gl);
+    memory_destroy(s);
+    return res;
+}
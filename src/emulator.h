@@ -6,6 +6,8 @@
 #include "3ds.h"
 #include "common.h"
 
+#define RUNAHEAD_MAX 4
+
 typedef struct {
     char* romfile;
     char* romfilenodir;
@@ -22,6 +24,18 @@ typedef struct {
     int vshthreads;
     bool hwvshaders;
     bool ubershader;
+    bool asyncshaders;
+    bool swrenderer;
+    int swthreads;
+    bool rewind;
+    int rewindinterval;
+    int rewindbuffer;
+    int runahead;
+    bool hugepages;
+    bool audio;
+
+    SaveState runaheadstate;
+    u64 runaheadtime;
 
     mat4 freecam_mtx;
     bool freecam_enable;
@@ -39,4 +53,11 @@ void emulator_quit();
 
 bool emulator_reset();
 
+bool emulator_save_state();
+bool emulator_load_state();
+
+void emulator_run_ahead();
+
+bool emulator_replay(char* path, int iters);
+
 #endif
\ No newline at end of file
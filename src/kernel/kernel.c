@@ -2,18 +2,71 @@
 
 #include "3ds.h"
 
-u32 handle_new(E3DS* s) {
-    for (int i = 0; i < HANDLE_MAX; i++) {
-        if (!s->process.handles[i]) {
-            return HANDLE_BASE + i;
+// objects are allocated from per type free lists which are refilled a chunk
+// at a time, freed objects are kept for reuse
+#define POOL_CHUNK 64
+
+typedef struct _PoolEntry {
+    struct _PoolEntry* next;
+} PoolEntry;
+
+typedef struct {
+    PoolEntry* free;
+    u32 live;
+} KPool;
+
+// the last pool is for list nodes
+KPool g_kpools[KOT_MAX + 1];
+
+void* pool_alloc(KPool* p, size_t size) {
+    if (!p->free) {
+        u8* chunk = malloc(POOL_CHUNK * size);
+        for (int i = POOL_CHUNK - 1; i >= 0; i--) {
+            PoolEntry* e = (PoolEntry*) &chunk[i * size];
+            e->next = p->free;
+            p->free = e;
         }
     }
+    PoolEntry* e = p->free;
+    p->free = e->next;
+    p->live++;
+    return e;
+}
+
+void pool_free(KPool* p, void* ptr) {
+    PoolEntry* e = ptr;
+    e->next = p->free;
+    p->free = e;
+    p->live--;
+}
+
+// the handles in use are tracked in a bitmap so the lowest free one can be
+// found a word at a time
+u32 handle_new(E3DS* s) {
+    for (int i = 0; i < HANDLE_MAX / 64; i++) {
+        u64 free = ~s->process.handles_used[i];
+        if (free) return HANDLE_BASE + i * 64 + __builtin_ctzll(free);
+    }
     lerror("no free handles");
     return 0;
 }
 
+void handle_set(E3DS* s, u32 h, KObject* o) {
+    u32 i = h - HANDLE_BASE;
+    s->process.handles[i] = o;
+    if (o) s->process.handles_used[i / 64] |= BITL(i % 64);
+    else s->process.handles_used[i / 64] &= ~BITL(i % 64);
+}
+
+// must be called after writing to the handle table directly
+void handle_sync(E3DS* s) {
+    for (int i = 0; i < HANDLE_MAX; i++) {
+        handle_set(s, HANDLE_BASE + i, s->process.handles[i]);
+    }
+}
+
 void klist_insert(KListNode** l, KObject* o) {
-    KListNode* newNode = malloc(sizeof *newNode);
+    KListNode* newNode = pool_alloc(&g_kpools[KOT_MAX], sizeof *newNode);
     newNode->key = o;
     newNode->next = *l;
     *l = newNode;
@@ -22,7 +75,7 @@ void klist_insert(KListNode** l, KObject* o) {
 void klist_remove(KListNode** l) {
     KListNode* cur = *l;
     *l = cur->next;
-    free(cur);
+    pool_free(&g_kpools[KOT_MAX], cur);
 }
 
 u32 klist_remove_key(KListNode** l, KObject* o) {
@@ -47,46 +100,99 @@ u32 klist_remove_key(KListNode** l, KObject* o) {
         }                                                                      \
     })
 
+size_t kobject_size(KObjType t) {
+    switch (t) {
+        case KOT_THREAD:
+            return sizeof(KThread);
+        case KOT_EVENT:
+            return sizeof(KEvent);
+        case KOT_MUTEX:
+            return sizeof(KMutex);
+        case KOT_SEMAPHORE:
+            return sizeof(KSemaphore);
+        case KOT_ARBITER:
+            return sizeof(KArbiter);
+        case KOT_SESSION:
+            return sizeof(KSession);
+        case KOT_SHAREDMEM:
+            return sizeof(KSharedMem);
+        default:
+            return sizeof(KObject);
+    }
+}
+
+// returns a zeroed object with its type set
+void* kobject_alloc(KObjType t) {
+    size_t size = kobject_size(t);
+    KObject* o = pool_alloc(&g_kpools[t], size);
+    memset(o, 0, size);
+    o->type = t;
+    return o;
+}
+
+void kobject_free(KObject* o) {
+    pool_free(&g_kpools[o->type], o);
+}
+
+u32 kobject_count(KObjType t) {
+    return g_kpools[t].live;
+}
+
+void kobject_print_counts() {
+    static const char* names[KOT_MAX] = {
+        [KOT_PROCESS] = "process",     [KOT_THREAD] = "thread",
+        [KOT_MUTEX] = "mutex",         [KOT_SEMAPHORE] = "semaphore",
+        [KOT_EVENT] = "event",         [KOT_TIMER] = "timer",
+        [KOT_SHAREDMEM] = "sharedmem", [KOT_ARBITER] = "arbiter",
+        [KOT_SESSION] = "session",     [KOT_RESLIMIT] = "reslimit",
+    };
+    printf("live kernel objects:");
+    for (int i = 0; i < KOT_MAX; i++) {
+        if (g_kpools[i].live) printf(" %s=%u", names[i], g_kpools[i].live);
+    }
+    printf(" listnode=%u\n", g_kpools[KOT_MAX].live);
+}
+
 void kobject_destroy(E3DS* s, KObject* o) {
     switch (o->type) {
         case KOT_THREAD: {
             auto t = (KThread*) o;
             thread_kill(s, t);
-            free(t);
+            kobject_free(o);
             break;
         }
         case KOT_EVENT: {
             auto e = (KEvent*) o;
             FREE_SYNCOBJ(e);
-            free(e);
+            kobject_free(o);
             break;
         }
         case KOT_MUTEX: {
             auto m = (KMutex*) o;
             FREE_SYNCOBJ(m);
-            free(m);
+            kobject_free(o);
             break;
         }
         case KOT_SEMAPHORE: {
-            auto s = (KSemaphore*) o;
-            FREE_SYNCOBJ(s);
-            free(s);
+            auto sem = (KSemaphore*) o;
+            FREE_SYNCOBJ(sem);
+            kobject_free(o);
             break;
         }
         case KOT_ARBITER: {
             auto arb = (KArbiter*) o;
             FREE_SYNCOBJ(arb);
-            free(arb);
+            kobject_free(o);
             break;
         }
         case KOT_SESSION:
         case KOT_RESLIMIT:
         case KOT_SHAREDMEM:
-            free(o);
+            kobject_free(o);
             break;
         default:
             lwarn("unimpl free of a kobject type %d", o->type);
-            free(o);
+            kobject_free(o);
             break;
     }
 }
\ No newline at end of file
@@ -35,7 +35,9 @@ typedef struct _KListNode {
 } KListNode;
 
 u32 handle_new(E3DS* s);
-#define HANDLE_SET(h, o) (s->process.handles[h - HANDLE_BASE] = (KObject*) (o))
+void handle_set(E3DS* s, u32 h, KObject* o);
+void handle_sync(E3DS* s);
+#define HANDLE_SET(h, o) handle_set(s, h, (KObject*) (o))
 #define HANDLE_GET(h)                                                          \
     (((h - HANDLE_BASE) < HANDLE_MAX) ? s->process.handles[h - HANDLE_BASE]    \
                                       : nullptr)
@@ -49,6 +51,12 @@ void klist_insert(KListNode** l, KObject* o);
 void klist_remove(KListNode** l);
 u32 klist_remove_key(KListNode** l, KObject* o);
 
+size_t kobject_size(KObjType t);
+void* kobject_alloc(KObjType t);
+void kobject_free(KObject* o);
 void kobject_destroy(E3DS* s, KObject* o);
 
+u32 kobject_count(KObjType t);
+void kobject_print_counts();
+
 #endif
\ No newline at end of file
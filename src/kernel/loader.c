@@ -1,8 +1,11 @@
 #include "loader.h"
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "3ds.h"
 
@@ -50,111 +53,322 @@ u32 load_elf(E3DS* s, char* filename) {
 
     fclose(fp);
 
-    s->romimage.fp = nullptr;
+    s->romimage = (RomImage) {};
 
     memory_virtalloc(s, STACK_BASE - BIT(14), BIT(14), PERM_RW, MEMST_PRIVATE);
 
     return ehdr.e_entry;
 }
 
-u32 load_ncsd(E3DS* s, char* filename) {
-    FILE* fp = fopen(filename, "rb");
-    if (!fp) return -1;
+static u32 load_ncch_image(E3DS* s, u64 offset);
+
+static char* codecache_path(u8* hash) {
+    char hex[65];
+    for (int i = 0; i < 32; i++) {
+        sprintf(&hex[2 * i], "%02x", hash[i]);
+    }
+    char* path;
+    asprintf(&path, "system/codecache/%s.bin", hex);
+    return path;
+}
+
+// cached code is the decompressed image, so a hit is one copy from the page
+// cache into guest memory
+static u8* codecache_map(u8* hash, u32* size) {
+    char* path = codecache_path(hash);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) return nullptr;
+
+    struct stat st;
+    fstat(fd, &st);
+    u8* p = nullptr;
+    if (st.st_size > sizeof(CodeCacheHeader)) {
+        p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) p = nullptr;
+    }
+    close(fd);
+    if (!p) return nullptr;
+
+    CodeCacheHeader* hdr = (CodeCacheHeader*) p;
+    if (hdr->magic != CODECACHE_MAGIC || hdr->version != CODECACHE_VERSION ||
+        hdr->size != st.st_size - sizeof *hdr || memcmp(hdr->hash, hash, 32)) {
+        linfo("discarding stale code cache");
+        munmap(p, st.st_size);
+        return nullptr;
+    }
+    *size = hdr->size;
+    return p;
+}
+
+static void codecache_save(u8* hash, u8* code, u32 size) {
+    char* path = codecache_path(hash);
+    char* tmppath;
+    asprintf(&tmppath, "%s.tmp", path);
+
+    CodeCacheHeader hdr = {
+        .magic = CODECACHE_MAGIC, .version = CODECACHE_VERSION, .size = size};
+    memcpy(hdr.hash, hash, 32);
+
+    // written under another name first so a partial file is never loaded
+    FILE* fp = fopen(tmppath, "wb");
+    if (fp) {
+        bool ok = fwrite(&hdr, sizeof hdr, 1, fp) == 1 &&
+                  fwrite(code, 1, size, fp) == size;
+        if (fclose(fp) || !ok || rename(tmppath, path)) {
+            lwarn("could not write code cache");
+            remove(tmppath);
+        }
+    }
+    free(tmppath);
+    free(path);
+}
+
+// the decompressed code has the same layout as the segments in memory, so
+// when they are contiguous it is read and decompressed directly in place
+static bool load_code(E3DS* s, ExHeader* exhdr, u64 offset, u32 codesize,
+                      u8* hash) {
+    u64 start = time_ns();
+
+    u32 textsz = exhdr->sci.text.pages * PAGE_SIZE;
+    u32 rodatasz = exhdr->sci.rodata.pages * PAGE_SIZE;
+    u32 datasz = (exhdr->sci.data.pages * PAGE_SIZE + exhdr->sci.bss +
+                  PAGE_SIZE - 1) &
+                 ~(PAGE_SIZE - 1);
+
+    memory_virtalloc(s, exhdr->sci.text.vaddr, textsz, PERM_RX, MEMST_CODE);
+    memory_virtalloc(s, exhdr->sci.rodata.vaddr, rodatasz, PERM_R,
+                     MEMST_CODE);
+    memory_virtalloc(s, exhdr->sci.data.vaddr, datasz, PERM_RW, MEMST_CODE);
+    u8* text = PTR(exhdr->sci.text.vaddr);
+    u8* rodata = PTR(exhdr->sci.rodata.vaddr);
+    u8* data = PTR(exhdr->sci.data.vaddr);
+
+    u32 imagesz = textsz + rodatasz + datasz;
+    bool inplace = rodata == text + textsz && data == rodata + rodatasz &&
+                   memory_host_contiguous(s, exhdr->sci.text.vaddr, imagesz);
+
+    u32 dstsize = codesize;
+    if (exhdr->sci.flags.compressed) {
+        u32 tail;
+        if (codesize < 8 || romimage_read(&s->romimage, &tail,
+                                          offset + codesize - 4, 4) < 4)
+            return false;
+        dstsize = codesize + tail;
+    }
+    if (dstsize > imagesz) inplace = false;
+
+    bool hit = false;
+    u8* code = nullptr;
+    u8* cached = nullptr;
+    u32 cachedsize;
+    u64 readtime = 0, decomptime = 0;
+    if (exhdr->sci.flags.compressed && hash &&
+        (cached = codecache_map(hash, &cachedsize))) {
+        hit = true;
+        code = cached + sizeof(CodeCacheHeader);
+        dstsize = cachedsize;
+    } else {
+        code = inplace ? text : malloc(dstsize);
+        u32 n = romimage_read(&s->romimage, code, offset, codesize);
+        readtime = time_ns() - start;
+        if (n < codesize) {
+            if (!inplace) free(code);
+            return false;
+        }
+        if (exhdr->sci.flags.compressed) {
+            lzssrev_decompress_inplace(code, codesize);
+            decomptime = time_ns() - start - readtime;
+            if (hash) codecache_save(hash, code, dstsize);
+        }
+    }
+
+    // the old code was copied segment by segment, so anything past the end
+    // of a segment is zeroed to match
+    u32 sizes[3] = {exhdr->sci.text.size, exhdr->sci.rodata.size,
+                    exhdr->sci.data.size};
+    u8* dsts[3] = {text, rodata, data};
+    u32 segsz[3] = {textsz, rodatasz, datasz};
+    u32 srcoff = 0;
+    for (int i = 0; i < 3; i++) {
+        u32 n = sizes[i] < segsz[i] ? sizes[i] : segsz[i];
+        if (srcoff > dstsize) n = 0;
+        else if (n > dstsize - srcoff) n = dstsize - srcoff;
+        if (code + srcoff != dsts[i]) memcpy(dsts[i], code + srcoff, n);
+        memset(dsts[i] + n, 0, segsz[i] - n);
+        srcoff += segsz[i];
+    }
+
+    if (cached) munmap(cached, cachedsize + sizeof(CodeCacheHeader));
+    else if (!inplace) free(code);
 
+    u64 total = time_ns() - start;
+    if (hit) {
+        linfo("loaded code from cache in %.3lf ms", total / 1e6);
+    } else {
+        linfo("loaded code in %.3lf ms (read %.3lf ms, decompress %.3lf ms%s)",
+              total / 1e6, readtime / 1e6, decomptime / 1e6,
+              inplace ? ", in place" : "");
+    }
+    return true;
+}
+
+static u32 load_ncsd_image(E3DS* s) {
     NCSDHeader hdrncsd;
-    fread(&hdrncsd, sizeof hdrncsd, 1, fp);
+    if (romimage_read(&s->romimage, &hdrncsd, 0, sizeof hdrncsd) <
+        sizeof hdrncsd)
+        return -1;
 
     u32 ncchbase = hdrncsd.part[0].offset * 0x200;
-    fclose(fp);
 
-    return load_ncch(s, filename, ncchbase);
+    return load_ncch_image(s, ncchbase);
+}
+
+u32 load_ncsd(E3DS* s, char* filename) {
+    if (!romimage_open(&s->romimage, filename)) return -1;
+    return load_ncsd_image(s);
 }
 
 u32 load_ncch(E3DS* s, char* filename, u64 offset) {
-    FILE* fp = fopen(filename, "rb");
-    if (!fp) return -1;
+    if (!romimage_open(&s->romimage, filename)) return -1;
+    return load_ncch_image(s, offset);
+}
+
+// compressed images can hold either an ncsd or a bare ncch
+u32 load_3dz(E3DS* s, char* filename) {
+    if (!romimage_open(&s->romimage, filename)) return -1;
+    char magic[4];
+    if (romimage_read(&s->romimage, magic, 0x100, 4) < 4) return -1;
+    if (!memcmp(magic, "NCSD", 4)) return load_ncsd_image(s);
+    if (!memcmp(magic, "NCCH", 4)) return load_ncch_image(s, 0);
+    lerror("unknown image in compressed rom");
+    return -1;
+}
+
+static u32 load_ncch_image(E3DS* s, u64 offset) {
+    RomImage* r = &s->romimage;
 
     u64 base = offset;
     u64 ncchbase = base;
 
-    fseek(fp, base, SEEK_SET);
-
     NCCHHeader hdrncch;
-    fread(&hdrncch, sizeof hdrncch, 1, fp);
+    romimage_read(r, &hdrncch, base, sizeof hdrncch);
+    base += sizeof hdrncch;
 
     ExHeader exhdr;
-    fread(&exhdr, sizeof exhdr, 1, fp);
+    romimage_read(r, &exhdr, base, sizeof exhdr);
 
     linfo("loading code from exefs");
 
-    base += hdrncch.exefs.offset * 0x200;
+    base = ncchbase + hdrncch.exefs.offset * 0x200;
 
-    fseek(fp, base, SEEK_SET);
-
-    ExeFSHeader hdrexefs;
-    fread(&hdrexefs, sizeof hdrexefs, 1, fp);
+    ExeFSHeader hdrexefs = {};
+    romimage_read(r, &hdrexefs, base, sizeof hdrexefs);
 
     base += 0x200;
 
     u32 codeoffset = 0;
     u32 codesize = 0;
+    u8* codehash = nullptr;
     for (int i = 0; i < 10; i++) {
         if (!strcmp(hdrexefs.file[i].name, ".code")) {
             codeoffset = hdrexefs.file[i].offset;
             codesize = hdrexefs.file[i].size;
+            codehash = hdrexefs.hash[9 - i];
         }
     }
     if (!codesize) return -1;
 
-    u8* code = malloc(codesize);
-    fseek(fp, base + codeoffset, SEEK_SET);
-    fread(code, 1, codesize, fp);
+    if (!load_code(s, &exhdr, base + codeoffset, codesize, codehash))
+        return -1;
+
+    r->exheader_off = ncchbase + 0x200;
+    r->exefs_off = ncchbase + hdrncch.exefs.offset * 0x200;
+    r->romfs_off = ncchbase + hdrncch.romfs.offset * 0x200 + 0x1000;
+
+    memory_virtalloc(s, STACK_BASE - exhdr.sci.stacksz, exhdr.sci.stacksz,
+                     PERM_RW, MEMST_PRIVATE);
+
+    return exhdr.sci.text.vaddr;
+}
+
+// compressed images are detected by their header, anything else is mapped
+bool romimage_open(RomImage* r, char* filename) {
+    *r = (RomImage) {};
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
 
-    if (exhdr.sci.flags.compressed) {
-        u8* buf = lzssrev_decompress(code, codesize, &codesize);
-        free(code);
-        code = buf;
+    r->zrom = zrom_open(fd);
+    if (r->zrom) {
+        r->size = r->zrom->hdr.size;
+        return true;
     }
 
-    memory_virtalloc(s, exhdr.sci.text.vaddr, exhdr.sci.text.pages * PAGE_SIZE,
-                     PERM_RX, MEMST_CODE);
-    void* text = PTR(exhdr.sci.text.vaddr);
-    memcpy(text, code, exhdr.sci.text.size);
+    struct stat st;
+    fstat(fd, &st);
+    r->size = st.st_size;
+    r->data = mmap(nullptr, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (r->data == MAP_FAILED) {
+        *r = (RomImage) {};
+        lerror("could not map rom image");
+        return false;
+    }
+    return true;
+}
 
-    memory_virtalloc(s, exhdr.sci.rodata.vaddr,
-                     exhdr.sci.rodata.pages * PAGE_SIZE, PERM_R, MEMST_CODE);
-    void* rodata = PTR(exhdr.sci.rodata.vaddr);
-    memcpy(rodata, code + exhdr.sci.text.pages * PAGE_SIZE,
-           exhdr.sci.rodata.size);
+void romimage_close(RomImage* r) {
+    if (r->zrom) zrom_close(r->zrom);
+    if (r->data) munmap(r->data, r->size);
+    *r = (RomImage) {};
+}
 
-    memory_virtalloc(s, exhdr.sci.data.vaddr,
-                     exhdr.sci.data.pages * PAGE_SIZE + exhdr.sci.bss, PERM_RW,
-                     MEMST_CODE);
-    void* data = PTR(exhdr.sci.data.vaddr);
-    memcpy(data,
-           code + exhdr.sci.text.pages * PAGE_SIZE +
-               exhdr.sci.rodata.pages * PAGE_SIZE,
-           exhdr.sci.data.size);
+static void romimage_advise(RomImage* r, u64 offset, u64 len, int advice) {
+    if (offset >= r->size) return;
+    if (len > r->size - offset) len = r->size - offset;
+    u64 start = offset & ~(u64) (PAGE_SIZE - 1);
+    madvise(r->data + start, len + offset - start, advice);
+}
 
-    free(code);
+// returns the number of bytes read, which is less than size at the end
+u32 romimage_read(RomImage* r, void* dst, u64 offset, u32 size) {
+    if (r->zrom) return zrom_read(r->zrom, dst, offset, size);
 
-    s->romimage.fp = fp;
-    s->romimage.exheader_off = ncchbase + 0x200;
-    s->romimage.exefs_off = ncchbase + hdrncch.exefs.offset * 0x200;
-    s->romimage.romfs_off = ncchbase + hdrncch.romfs.offset * 0x200 + 0x1000;
+    if (offset >= r->size) return 0;
+    if (size > r->size - offset) size = r->size - offset;
 
-    memory_virtalloc(s, STACK_BASE - exhdr.sci.stacksz, exhdr.sci.stacksz,
-                     PERM_RW, MEMST_PRIVATE);
+    if (offset == r->lastend) r->seqreads++;
+    else r->seqreads = 0;
+    r->lastend = offset + size;
 
-    return exhdr.sci.text.vaddr;
+    // large reads are faulted in with one request instead of page by page
+    if (size >= ROM_PREFETCH_MIN) {
+        romimage_advise(r, offset, size, MADV_WILLNEED);
+    }
+    memcpy(dst, r->data + offset, size);
+
+    // the window after a streaming read grows the longer it continues
+    if (r->seqreads >= 2) {
+        u64 window = (u64) size << (r->seqreads < 8 ? r->seqreads - 1 : 7);
+        if (window < ROM_PREFETCH_MIN) window = ROM_PREFETCH_MIN;
+        if (window > ROM_PREFETCH_MAX) window = ROM_PREFETCH_MAX;
+        romimage_advise(r, r->lastend, window, MADV_WILLNEED);
+    }
+    return size;
 }
 
 u8* lzssrev_decompress(u8* in, u32 src_size, u32* dst_size) {
     *dst_size = src_size + *(u32*) &in[src_size - 4];
     u8* out = malloc(*dst_size);
     memcpy(out, in, src_size);
+    lzssrev_decompress_inplace(out, src_size);
+    return out;
+}
 
-    u8* src = out + src_size;
+// the data is decompressed backwards from the end, so buf only has to have
+// room for the decompressed size after the compressed data
+void lzssrev_decompress_inplace(u8* buf, u32 src_size) {
+    u8* src = buf + src_size;
     u8* dst = src + *(u32*) (src - 4) - 1;
     u8* fin = src - (*(u32*) (src - 8) & MASK(24));
     src = src - src[-5] - 1;
@@ -184,6 +398,4 @@ u8* lzssrev_decompress(u8* in, u32 src_size, u32* dst_size) {
         flags <<= 1;
         count--;
     }
-
-    return out;
 }
\ No newline at end of file
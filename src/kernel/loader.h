@@ -2,6 +2,7 @@
 #define LOADER_H
 
 #include "common.h"
+#include "zrom.h"
 
 // elf format information copied from linux <elf.h>
 
@@ -110,21 +111,53 @@ typedef struct {
         u32 offset;
         u32 size;
     } file[10];
+    u8 res[0x20];
+    // sha256 of each file, in reverse order
+    u8 hash[10][0x20];
 } ExeFSHeader;
 
+#define CODECACHE_MAGIC 0x43433354 // T3CC
+#define CODECACHE_VERSION 1
+
+// followed by the decompressed code
+typedef struct {
+    u32 magic;
+    u32 version;
+    u32 size;
+    u32 _pad;
+    u8 hash[0x20];
+} CodeCacheHeader;
+
 typedef struct _3DS E3DS;
 
 typedef struct {
-    FILE* fp;
+    // the whole image is mapped so reads are copies from the page cache
+    // with no shared file position, unless it is compressed
+    u8* data;
+    ZRom* zrom;
+    u64 size;
     u32 exheader_off;
     u32 exefs_off;
     u32 romfs_off;
+
+    // reads which continue where the last one ended are prefetched ahead
+    u64 lastend;
+    u32 seqreads;
 } RomImage;
 
+#define ROM_PREFETCH_MIN BIT(18)
+#define ROM_PREFETCH_MAX BIT(24)
+
 u32 load_elf(E3DS* s, char* filename);
 u32 load_ncsd(E3DS* s, char* filename);
 u32 load_ncch(E3DS* s, char* filename, u64 offset);
+u32 load_3dz(E3DS* s, char* filename);
+
+bool romimage_open(RomImage* r, char* filename);
+void romimage_close(RomImage* r);
+u32 romimage_read(RomImage* r, void* dst, u64 offset, u32 size);
 
 u8* lzssrev_decompress(u8* in, u32 src_size, u32* dst_size);
+void lzssrev_decompress_inplace(u8* buf, u32 src_size);
 
 #endif
@@ -8,6 +8,7 @@
 #endif
 
 #include "3ds.h"
+#include "arm/jit/jit.h"
 #include "common.h"
 #include "emulator.h"
 
@@ -16,6 +17,16 @@
 #define PGROUNDDOWN(a) ((a) & ~(PAGE_SIZE - 1))
 #define PGROUNDUP(a) (((a) + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1))
 
+#define HUGE_PAGE_SIZE BIT(21)
+
+// allocation traces are recorded with -t and replayed with -m to benchmark
+// the block and heap bookkeeping
+FILE* g_memtrace;
+
+#define TRACE(op, a, b, c, d)                                                  \
+    (g_memtrace ? fprintf(g_memtrace, "%c %x %x %x %x\n", op, a, b, c, d)     \
+                : 0)
+
 #ifdef FASTMEM
 #ifndef __linux__
 #define memfd_create(name, x)                                                  \
@@ -26,8 +37,11 @@
     })
 #endif
 
+bool memory_snapshot_fault(E3DS* s, u8* addr);
+
 void sigsegv_handler(int sig, siginfo_t* info, void* ucontext) {
     u8* addr = info->si_addr;
+    if (memory_snapshot_fault(&ctremu.system, addr)) return;
     if (ctremu.system.virtmem <= addr &&
         addr < ctremu.system.virtmem + BITL(32)) {
         lerror("(FATAL) invalid 3DS virtual memory access at %08x (pc near "
@@ -45,8 +59,75 @@ void sigsegv_handler(int sig, siginfo_t* info, void* ucontext) {
     }
     sigaction(sig, &(struct sigaction) {.sa_handler = SIG_DFL}, nullptr);
 }
+
+// reserves address space aligned to a huge page so any huge page aligned
+// memory mapped into it can use huge pages on the host too
+void* reserve_aligned(size_t size) {
+    u8* p = mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) return p;
+    u8* aligned = (u8*) (((uintptr_t) p + HUGE_PAGE_SIZE - 1) &
+                         ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+    if (aligned > p) munmap(p, aligned - p);
+    munmap(aligned + size, p + HUGE_PAGE_SIZE - aligned);
+    return aligned;
+}
+
+// the memfd is shmem, so it can only get huge pages through transparent
+// huge pages which need to be allowed for shmem
+bool hugepages_available() {
+#ifdef MADV_HUGEPAGE
+    FILE* fp = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+    if (!fp) return false;
+    char buf[128] = {};
+    fread(buf, 1, sizeof buf - 1, fp);
+    fclose(fp);
+    return !strstr(buf, "[never]") && !strstr(buf, "[deny]");
+#else
+    return false;
+#endif
+}
+
+void advise_huge(E3DS* s, void* ptr, size_t size) {
+#ifdef MADV_HUGEPAGE
+    if (!s->hugepages || size < HUGE_PAGE_SIZE) return;
+    if (madvise(ptr, size, MADV_HUGEPAGE) < 0) {
+        lwarn("madvise failed, using regular pages");
+        s->hugepages = false;
+    }
+#endif
+}
+
+// pages of a virtual mapping can only be backed by huge pages if they are
+// aligned the same way in guest memory and in the memfd
+void advise_huge_virt(E3DS* s, u32 vaddr, u32 off, u32 size) {
+    if (!s->hugepages || (vaddr ^ off) & (HUGE_PAGE_SIZE - 1)) return;
+    u32 start = (vaddr + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    u32 end = (vaddr + size) & ~(HUGE_PAGE_SIZE - 1);
+    if (start < end) advise_huge(s, &s->virtmem[start], end - start);
+}
+
+// huge page mappings of the memfd in this process, to check whether they are
+// actually being used
+u64 hugepage_mapped_kb() {
+    FILE* fp = fopen("/proc/self/smaps_rollup", "r");
+    if (!fp) return 0;
+    char line[128];
+    u64 kb = 0;
+    while (fgets(line, sizeof line, fp)) {
+        if (sscanf(line, "ShmemPmdMapped: %lu kB", &kb) == 1) break;
+    }
+    fclose(fp);
+    return kb;
+}
 #endif
 
+bool is_backed_paddr(u32 paddr) {
+    return (FCRAM_PBASE <= paddr && paddr < FCRAM_PBASE + FCRAM_SIZE) ||
+           (VRAM_PBASE <= paddr && paddr < VRAM_PBASE + VRAM_SIZE) ||
+           (DSPRAM_PBASE <= paddr && paddr < DSPRAM_PBASE + DSPRAM_SIZE);
+}
+
 u32 physaddr2memoff(u32 paddr) {
     if (FCRAM_PBASE <= paddr && paddr < FCRAM_PBASE + FCRAM_SIZE) {
         return offsetof(E3DSMemory, fcram[paddr - FCRAM_PBASE]);
@@ -69,17 +150,31 @@ void memory_init(E3DS* s) {
         perror("memfd_create");
         exit(1);
     }
-    s->mem = mmap(nullptr, sizeof(E3DSMemory), PROT_READ | PROT_WRITE,
-                  MAP_SHARED, s->mem_fd, 0);
+
+    s->hugepages = ctremu.hugepages;
+    if (s->hugepages && !hugepages_available()) {
+        lwarn("transparent huge pages are disabled for shmem, using regular "
+              "pages");
+        s->hugepages = false;
+    }
+
+    s->mem = reserve_aligned(sizeof(E3DSMemory));
+    if (s->mem != MAP_FAILED) {
+        s->mem = mmap(s->mem, sizeof(E3DSMemory), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED, s->mem_fd, 0);
+    }
+    if (s->mem == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    advise_huge(s, s->mem, sizeof(E3DSMemory));
 #else
     s->mem = calloc(1, sizeof *s->mem);
 #endif
 
 #ifdef FASTMEM
-    s->physmem = mmap(nullptr, BITL(32), PROT_NONE,
-                      MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
-    s->virtmem = mmap(nullptr, BITL(32), PROT_NONE,
-                      MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    s->physmem = reserve_aligned(BITL(32));
+    s->virtmem = reserve_aligned(BITL(32));
     if (s->physmem == MAP_FAILED || s->virtmem == MAP_FAILED) {
         perror("mmap");
         exit(1);
@@ -99,12 +194,14 @@ void memory_init(E3DS* s) {
         perror("mmap");
         exit(1);
     }
+    advise_huge(s, ptr, FCRAM_SIZE);
     ptr = mmap(&s->physmem[VRAM_PBASE], VRAM_SIZE, PROT_READ | PROT_WRITE,
                MAP_SHARED | MAP_FIXED, s->mem_fd, offsetof(E3DSMemory, vram));
     if (ptr == MAP_FAILED) {
         perror("mmap");
         exit(1);
     }
+    advise_huge(s, ptr, VRAM_SIZE);
     ptr = mmap(&s->physmem[DSPRAM_PBASE], DSPRAM_SIZE, PROT_READ | PROT_WRITE,
                MAP_SHARED | MAP_FIXED, s->mem_fd, offsetof(E3DSMemory, dspram));
     if (ptr == MAP_FAILED) {
@@ -115,38 +212,28 @@ void memory_init(E3DS* s) {
     s->gpu.mem = s->mem;
 #endif
 
-    s->pheap.startpg = FCRAM_SIZE / PAGE_SIZE;
-    s->pheap.endpg = 0;
-    FCRAMHeapNode* linearnode = malloc(sizeof *linearnode);
-    linearnode->startpg = 0;
-    linearnode->endpg = 0;
-    s->pheap.next = linearnode;
-    linearnode->prev = &s->pheap;
-    s->pheap.prev = linearnode;
-    linearnode->next = &s->pheap;
-
-    VMBlock* initblk = malloc(sizeof *initblk);
-    *initblk = (VMBlock) {
-        .startpg = 0, .endpg = BIT(20), .perm = 0, .state = MEMST_FREE};
-    s->process.vmblocks.startpg = BIT(20);
-    s->process.vmblocks.endpg = BIT(20);
-    s->process.vmblocks.next = initblk;
-    s->process.vmblocks.prev = initblk;
-    initblk->prev = &s->process.vmblocks;
-    initblk->next = &s->process.vmblocks;
+    memory_blocks_init(s);
+}
+
+void memory_blocks_init(E3DS* s) {
+    Vec_init(s->pheap);
+    Vec_push(s->pheap, ((FCRAMHeapNode) {}));
+
+    Vec_init(s->process.vmblocks);
+    Vec_push(s->process.vmblocks,
+             ((VMBlock) {.startpg = 0,
+                         .endpg = BIT(20),
+                         .perm = 0,
+                         .state = MEMST_FREE}));
+}
+
+void memory_blocks_free(E3DS* s) {
+    Vec_free(s->pheap);
+    Vec_free(s->process.vmblocks);
 }
 
 void memory_destroy(E3DS* s) {
-    while (s->pheap.next != &s->pheap) {
-        auto tmp = s->pheap.next;
-        s->pheap.next = s->pheap.next->next;
-        free(tmp);
-    }
-    while (s->process.vmblocks.next != &s->process.vmblocks) {
-        VMBlock* tmp = s->process.vmblocks.next;
-        s->process.vmblocks.next = s->process.vmblocks.next->next;
-        free(tmp);
-    }
+    memory_blocks_free(s);
     for (int i = 0; i < BIT(10); i++) {
         free(s->process.ptab[i]);
     }
@@ -155,6 +242,11 @@ void memory_destroy(E3DS* s) {
     sigaction(SIGSEGV, &(struct sigaction) {.sa_handler = SIG_DFL}, nullptr);
     sigaction(SIGBUS, &(struct sigaction) {.sa_handler = SIG_DFL}, nullptr);
 
+    if (s->hugepages) {
+        linfo("%lu KiB of memory was mapped with huge pages",
+              hugepage_mapped_kb());
+    }
+
     munmap(s->physmem, BITL(32));
     munmap(s->virtmem, BITL(32));
     munmap(s->mem, sizeof(E3DSMemory));
@@ -165,33 +257,34 @@ void memory_destroy(E3DS* s) {
 #endif
 }
 
+// allocations are made from the top of fcram downwards, they are never
+// freed so the first gap is almost always right below the last one
 u32 memory_physalloc(E3DS* s, u32 size) {
     size = PGROUNDUP(size);
-    u32 npage = PGROUNDUP(size) / PAGE_SIZE;
+    u32 npage = size / PAGE_SIZE;
+    TRACE('p', size, 0, 0, 0);
 
-    auto cur = &s->pheap;
-    do {
-        u32 gap = cur->startpg - cur->prev->endpg;
-        if (gap < npage) {
-            cur = cur->prev;
+    u32 top = FCRAM_SIZE / PAGE_SIZE;
+    for (int i = s->pheap.size - 1; i >= 0; i--) {
+        if (top - s->pheap.d[i].endpg < npage) {
+            top = s->pheap.d[i].startpg;
             continue;
         }
 
-        FCRAMHeapNode* n = malloc(sizeof *n);
-
-        n->endpg = cur->startpg;
-        n->startpg = n->endpg - npage;
-        n->next = cur;
-        n->prev = cur->prev;
-        cur->prev = n;
-        n->prev->next = n;
+        // the range above can be extended unless it is the linear heap
+        FCRAMHeapNode n = {top - npage, top};
+        if (i + 1 < s->pheap.size && s->pheap.d[i + 1].startpg == top) {
+            s->pheap.d[i + 1].startpg = n.startpg;
+        } else {
+            Vec_splice(s->pheap, i + 1, 0, &n, 1);
+        }
 
-        u32 paddr = FCRAM_PBASE + n->startpg * PAGE_SIZE;
+        u32 paddr = FCRAM_PBASE + n.startpg * PAGE_SIZE;
 
         linfo("allocating physical memory at %08x with size %x", paddr, size);
 
         return paddr;
-    } while (cur != &s->pheap);
+    }
 
     lerror("ran out of physical memory");
     return 0;
@@ -232,80 +325,78 @@ void* sw_vptr(E3DS* s, u32 addr) {
     return sw_pptr(s->mem, ent.paddr + addr % PAGE_SIZE);
 }
 
-void insert_vmblock(E3DS* s, u32 base, u32 size, u32 perm, u32 state) {
-    VMBlock* n = malloc(sizeof(VMBlock));
-    *n = (VMBlock) {.startpg = base >> 12,
-                    .endpg = (base + size) >> 12,
-                    .perm = perm,
-                    .state = state};
-
-    VMBlock* l = s->process.vmblocks.next;
-    while (l != &s->process.vmblocks) {
-        if (l->startpg <= n->startpg && n->startpg < l->endpg) break;
-        l = l->next;
-    }
-    VMBlock* r = l->next;
-    n->next = r;
-    n->prev = l;
-    l->next = n;
-    r->prev = n;
-
-    while (r->startpg < n->endpg) {
-        if (r->endpg < n->endpg) {
-            n->next = r->next;
-            n->next->prev = n;
-            free(r);
-            r = n->next;
-        } else {
-            r->startpg = n->endpg;
-            break;
-        }
+// index of the block containing a page
+int vmblock_find(VMBlockList* v, u32 pg) {
+    int lo = 0;
+    int hi = v->size - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (v->d[mid].startpg <= pg) lo = mid;
+        else hi = mid - 1;
     }
-    if (n->startpg < l->endpg) {
-        if (n->endpg < l->endpg) {
-            VMBlock* nr = malloc(sizeof(VMBlock));
-            *nr = *l;
-            nr->prev = n;
-            nr->next = r;
-            n->next = nr;
-            r->prev = nr;
-            nr->startpg = n->endpg;
-            nr->endpg = l->endpg;
-            r = nr;
-        }
-        if (l->startpg == n->startpg) {
-            n->prev = l->prev;
-            n->prev->next = n;
-            free(l);
-            l = n->prev;
-        } else {
-            l->endpg = n->startpg;
-        }
-    }
-    if (r->startpg < BIT(20) && r->perm == n->perm && r->state == n->state) {
-        n->endpg = r->endpg;
-        n->next = r->next;
-        n->next->prev = n;
-        free(r);
+    return lo;
+}
+
+bool vmblock_same(VMBlock* a, VMBlock* b) {
+    return a->perm == b->perm && a->state == b->state;
+}
+
+// replaces the blocks overlapping the new one with what remains of the first
+// and last of them and the new block, merging it with equal neighbors
+void insert_vmblock(E3DS* s, u32 base, u32 size, u32 perm, u32 state) {
+    TRACE('v', base, size, perm, state);
+    VMBlock n = {.startpg = base >> 12,
+                 .endpg = ((u64) base + size) >> 12,
+                 .perm = perm,
+                 .state = state};
+    if (n.startpg >= n.endpg) return;
+
+    VMBlockList* v = &s->process.vmblocks;
+    int l = vmblock_find(v, n.startpg);
+    int r = vmblock_find(v, n.endpg - 1);
+
+    bool hasleft = v->d[l].startpg < n.startpg;
+    VMBlock left = hasleft || !l ? v->d[l] : v->d[l - 1];
+    if (hasleft) left.endpg = n.startpg;
+    if ((hasleft || l) && vmblock_same(&left, &n)) {
+        n.startpg = left.startpg;
+        if (!hasleft) l--;
+        hasleft = false;
     }
-    if (l->startpg < BIT(20) && l->perm == n->perm && l->state == n->state) {
-        l->endpg = n->endpg;
-        l->next = n->next;
-        l->next->prev = l;
-        free(n);
+
+    bool hasright = v->d[r].endpg > n.endpg;
+    bool last = r == v->size - 1;
+    VMBlock right = hasright || last ? v->d[r] : v->d[r + 1];
+    if (hasright) right.startpg = n.endpg;
+    if ((hasright || !last) && vmblock_same(&right, &n)) {
+        n.endpg = right.endpg;
+        if (!hasright) r++;
+        hasright = false;
     }
+
+    VMBlock new[3];
+    int nnew = 0;
+    if (hasleft) new[nnew++] = left;
+    new[nnew++] = n;
+    if (hasright) new[nnew++] = right;
+    Vec_splice(*v, l, r - l + 1, new, nnew);
 }
 
-void print_vmblocks(VMBlock* vmblocks) {
-    VMBlock* cur = vmblocks->next;
-    while (cur != vmblocks) {
-        printf("[%08x,%08x,%d,%d] ", cur->startpg << 12, cur->endpg << 12,
-               cur->perm, cur->state);
-        cur = cur->next;
+void print_vmblocks(VMBlockList* vmblocks) {
+    Vec_foreach(b, *vmblocks) {
+        printf("[%08x,%08x,%d,%d] ", b->startpg << 12, b->endpg << 12,
+               b->perm, b->state);
     }
     printf("\n");
 }
 
+#ifdef FASTMEM
+// new mappings must also be write protected while a snapshot is active
+int virtmem_prot(E3DS* s) {
+    return s->memsnaps.size ? PROT_READ : PROT_READ | PROT_WRITE;
+}
+#endif
+
 u32 memory_virtmap(E3DS* s, u32 paddr, u32 vaddr, u32 size, u32 perm,
                    u32 state) {
     vaddr = PGROUNDDOWN(vaddr);
@@ -318,13 +409,17 @@ u32 memory_virtmap(E3DS* s, u32 paddr, u32 vaddr, u32 size, u32 perm,
           "(perm=%d,state=%d)",
           vaddr, size, paddr, perm, state);
 
+#ifdef FASTMEM
+    u32 startvaddr = vaddr;
+    u32 startpaddr = paddr;
+#endif
     u32 npage = size / PAGE_SIZE;
 
     for (int i = 0; i < npage; i++, vaddr += PAGE_SIZE, paddr += PAGE_SIZE) {
         ptabwrite(s->process.ptab, vaddr, paddr, perm, state);
 #ifdef FASTMEM
         void* ptr =
-            mmap(&s->virtmem[vaddr], PAGE_SIZE, PROT_READ | PROT_WRITE,
+            mmap(&s->virtmem[vaddr], PAGE_SIZE, virtmem_prot(s),
                  MAP_SHARED | MAP_FIXED, s->mem_fd, physaddr2memoff(paddr));
         if (ptr == MAP_FAILED) {
             perror("mmap");
@@ -332,6 +427,11 @@ u32 memory_virtmap(E3DS* s, u32 paddr, u32 vaddr, u32 size, u32 perm,
         }
 #endif
     }
+#ifdef FASTMEM
+    if (is_backed_paddr(startpaddr)) {
+        advise_huge_virt(s, startvaddr, physaddr2memoff(startpaddr), size);
+    }
+#endif
     return vaddr;
 }
 
@@ -360,7 +460,7 @@ u32 memory_virtmirror(E3DS* s, u32 srcvaddr, u32 dstvaddr, u32 size, u32 perm) {
         ptabwrite(s->process.ptab, dstvaddr, ent.paddr, perm, MEMST_ALIAS);
 #ifdef FASTMEM
         void* ptr =
-            mmap(&s->virtmem[dstvaddr], PAGE_SIZE, PROT_READ | PROT_WRITE,
+            mmap(&s->virtmem[dstvaddr], PAGE_SIZE, virtmem_prot(s),
                  MAP_SHARED | MAP_FIXED, s->mem_fd, physaddr2memoff(ent.paddr));
         if (ptr == MAP_FAILED) {
             perror("mmap");
@@ -379,36 +479,396 @@ u32 memory_virtalloc(E3DS* s, u32 addr, u32 size, u32 perm, u32 state) {
     return addr;
 }
 
+// grows the range of fcram used by the linear heap and returns where the
+// new pages start, or -1 if it would run into other allocations
+u32 linearheap_grow_pages(E3DS* s, u32 npage) {
+    TRACE('l', npage, 0, 0, 0);
+    FCRAMHeapNode* linear = &s->pheap.d[0];
+    u32 limit =
+        s->pheap.size > 1 ? s->pheap.d[1].startpg : FCRAM_SIZE / PAGE_SIZE;
+    if (linear->endpg + npage > limit) return -1;
+    u32 startpg = linear->endpg;
+    linear->endpg += npage;
+    return startpg;
+}
+
 u32 memory_linearheap_grow(E3DS* s, u32 size, u32 perm) {
     size = PGROUNDUP(size);
 
-    auto linearblk = s->pheap.next;
-    u32 npage = PGROUNDUP(size) / PAGE_SIZE;
-
-    if (linearblk->endpg + npage > linearblk->next->startpg) {
+    u32 startpg = linearheap_grow_pages(s, size / PAGE_SIZE);
+    if (startpg == -1) {
         lerror("ran of physical memory");
         return 0;
     }
-    u32 startaddr = LINEAR_HEAP_BASE + linearblk->endpg * PAGE_SIZE;
-    linearblk->endpg += npage;
+    u32 startaddr = LINEAR_HEAP_BASE + startpg * PAGE_SIZE;
     linfo("extending linear heap by %x", size);
     memory_virtmap(s, FCRAM_PBASE, LINEAR_HEAP_BASE,
-                   (linearblk->endpg - linearblk->startpg) * PAGE_SIZE, perm,
-                   MEMST_CONTINUOUS);
+                   (s->pheap.d[0].endpg - s->pheap.d[0].startpg) * PAGE_SIZE,
+                   perm, MEMST_CONTINUOUS);
     s->process.used_memory += size;
     return startaddr;
 }
 
 VMBlock* memory_virtquery(E3DS* s, u32 addr) {
-    addr >>= 12;
-    VMBlock* b = s->process.vmblocks.next;
-    while (b != &s->process.vmblocks) {
-        if (b->startpg <= addr && addr < b->endpg) return b;
-        b = b->next;
+    TRACE('q', addr, 0, 0, 0);
+    VMBlockList* v = &s->process.vmblocks;
+    return &v->d[vmblock_find(v, addr >> 12)];
+}
+
+// whether the host pointers for a range of virtual memory can be used as one
+// buffer
+bool memory_host_contiguous(E3DS* s, u32 vaddr, u32 size) {
+    u8* p = PTR(vaddr);
+    for (u32 i = PAGE_SIZE; i < size; i += PAGE_SIZE) {
+        if (PTR(vaddr + i) != p + i) return false;
     }
-    return nullptr;
+    return true;
 }
 
 void sharedmem_alloc(E3DS* s, KSharedMem* shmem) {
     shmem->paddr = memory_physalloc(s, shmem->size);
-}
\ No newline at end of file
+}
+
+void memory_snapshot_init(MemSnapshot* m) {
+#ifdef FASTMEM
+    m->pages = mmap(nullptr, sizeof(E3DSMemory), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (m->pages == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+#else
+    m->pages = malloc(sizeof(E3DSMemory));
+#endif
+    m->pgstate = calloc(MEM_NPAGES, sizeof *m->pgstate);
+    m->saved = malloc(MEM_NPAGES * sizeof(u32));
+    m->nsaved = 0;
+}
+
+void memory_snapshot_init_tracking(MemSnapshot* m) {
+    m->pages = nullptr;
+    m->pgstate = calloc(MEM_NPAGES, sizeof *m->pgstate);
+    m->saved = malloc(MEM_NPAGES * sizeof(u32));
+    m->nsaved = 0;
+}
+
+void memory_snapshot_free(MemSnapshot* m) {
+#ifdef FASTMEM
+    if (m->pages) munmap(m->pages, sizeof(E3DSMemory));
+#else
+    free(m->pages);
+#endif
+    free((void*) m->pgstate);
+    free(m->saved);
+}
+
+#ifdef FASTMEM
+// finds the offset into emulated memory of a host address in any of the
+// mappings of the memfd
+bool host2memoff(E3DS* s, u8* addr, u32* off) {
+    if ((u8*) s->mem <= addr && addr < (u8*) s->mem + sizeof(E3DSMemory)) {
+        *off = addr - (u8*) s->mem;
+        return true;
+    }
+    if (s->physmem <= addr && addr < s->physmem + BITL(32)) {
+        u32 paddr = addr - s->physmem;
+        if (!is_backed_paddr(paddr)) return false;
+        *off = physaddr2memoff(paddr);
+        return true;
+    }
+    if (s->virtmem <= addr && addr < s->virtmem + BITL(32)) {
+        u32 vaddr = addr - s->virtmem;
+        PageEntry* t = s->process.ptab[vaddr >> 22];
+        if (!t) return false;
+        PageEntry ent = t[(vaddr >> 12) & MASK(10)];
+        if (ent.state == MEMST_FREE) return false;
+        *off = physaddr2memoff(ent.paddr + vaddr % PAGE_SIZE);
+        return true;
+    }
+    return false;
+}
+
+// the first writer of a page saves it, anyone else needs to wait until it is
+// done before the page can be changed
+void save_page(E3DS* s, MemSnapshot* m, u32 pg) {
+    u8 st = MEMPG_CLEAN;
+    if (atomic_compare_exchange_strong(&m->pgstate[pg], &st, MEMPG_COPYING)) {
+        if (m->pages)
+            memcpy(&m->pages[pg * PAGE_SIZE], &s->mem->raw[pg * PAGE_SIZE],
+                   PAGE_SIZE);
+        m->saved[atomic_fetch_add(&m->nsaved, 1)] = pg;
+        atomic_store(&m->pgstate[pg], MEMPG_SAVED);
+    } else {
+        while (atomic_load(&m->pgstate[pg]) != MEMPG_SAVED) {
+        }
+    }
+}
+
+// called from the signal handler on any thread which writes to a protected
+// page, every mapping is unprotected separately when it faults
+bool memory_snapshot_fault(E3DS* s, u8* addr) {
+    u32 off;
+    if (!s->memsnaps.size || !host2memoff(s, addr, &off)) return false;
+
+    SVec_foreach(m, s->memsnaps) {
+        save_page(s, *m, off / PAGE_SIZE);
+    }
+
+    mprotect((void*) ((uintptr_t) addr & ~(uintptr_t) (PAGE_SIZE - 1)),
+             PAGE_SIZE, PROT_READ | PROT_WRITE);
+    return true;
+}
+
+void memory_protect(E3DS* s, int prot) {
+    mprotect(s->mem, sizeof(E3DSMemory), prot);
+    mprotect(&s->physmem[FCRAM_PBASE], FCRAM_SIZE, prot);
+    mprotect(&s->physmem[VRAM_PBASE], VRAM_SIZE, prot);
+    mprotect(&s->physmem[DSPRAM_PBASE], DSPRAM_SIZE, prot);
+
+    // virtual mappings are changed in runs of consecutive mapped pages
+    u32 start = 0;
+    u32 len = 0;
+    for (u32 l1 = 0; l1 < BIT(10); l1++) {
+        PageEntry* t = s->process.ptab[l1];
+        for (u32 l2 = 0; l2 < BIT(10); l2++) {
+            if (t && t[l2].state != MEMST_FREE) {
+                if (!len) start = l1 << 22 | l2 << 12;
+                len += PAGE_SIZE;
+                continue;
+            }
+            if (len) mprotect(&s->virtmem[start], len, prot);
+            len = 0;
+            if (!t) break;
+        }
+    }
+    if (len) mprotect(&s->virtmem[start], len, prot);
+}
+
+// cached code for executable pages which are about to be restored is no
+// longer valid
+void invalidate_saved_code(E3DS* s, MemSnapshot* m) {
+    for (u32 l1 = 0; l1 < BIT(10); l1++) {
+        PageEntry* t = s->process.ptab[l1];
+        if (!t) continue;
+        for (u32 l2 = 0; l2 < BIT(10); l2++) {
+            if (t[l2].state == MEMST_FREE || !(t[l2].perm & PERM_X)) continue;
+            u32 pg = physaddr2memoff(t[l2].paddr) / PAGE_SIZE;
+            if (m->pgstate[pg] != MEMPG_SAVED) continue;
+            jit_invalidate_range(&s->cpu, l1 << 22 | l2 << 12, PAGE_SIZE);
+        }
+    }
+}
+#endif
+
+int snapshot_index(E3DS* s, MemSnapshot* m) {
+    for (int i = 0; i < s->memsnaps.size; i++) {
+        if (s->memsnaps.d[i] == m) return i;
+    }
+    return -1;
+}
+
+bool memory_snapshot_active(E3DS* s, MemSnapshot* m) {
+    return snapshot_index(s, m) >= 0;
+}
+
+// the snapshot only stays consistent if nothing else is running, so this
+// should be called between frames
+// multiple snapshots can be active at once, each page is saved separately
+// for all of them
+bool memory_snapshot_begin(E3DS* s, MemSnapshot* m) {
+#ifndef FASTMEM
+    // writes are only seen through the write protection
+    if (!m->pages) return false;
+#endif
+    if (!memory_snapshot_active(s, m)) {
+        if (SVec_full(s->memsnaps)) {
+            lerror("too many memory snapshots");
+            return false;
+        }
+        SVec_push(s->memsnaps, m);
+    }
+    for (u32 i = 0; i < m->nsaved; i++) {
+        m->pgstate[m->saved[i]] = MEMPG_CLEAN;
+    }
+    m->nsaved = 0;
+#ifdef FASTMEM
+    memory_protect(s, PROT_READ);
+#else
+    memcpy(m->pages, s->mem, sizeof(E3DSMemory));
+#endif
+    return true;
+}
+
+// puts back every page written since the snapshot was taken, the snapshot
+// stays active afterwards
+void memory_snapshot_restore(E3DS* s, MemSnapshot* m) {
+#ifdef FASTMEM
+    if (!m->nsaved) return;
+    mprotect(s->mem, sizeof(E3DSMemory), PROT_READ | PROT_WRITE);
+    invalidate_saved_code(s, m);
+    for (u32 i = 0; i < m->nsaved; i++) {
+        u32 pg = m->saved[i];
+        // restoring is a write as far as the other snapshots are concerned
+        SVec_foreach(o, s->memsnaps) {
+            if (*o != m) save_page(s, *o, pg);
+        }
+        memcpy(&s->mem->raw[pg * PAGE_SIZE], &m->pages[pg * PAGE_SIZE],
+               PAGE_SIZE);
+        m->pgstate[pg] = MEMPG_CLEAN;
+    }
+    m->nsaved = 0;
+    memory_protect(s, PROT_READ);
+#else
+    memcpy(s->mem, m->pages, sizeof(E3DSMemory));
+#endif
+}
+
+void memory_snapshot_end(E3DS* s, MemSnapshot* m) {
+    int i = snapshot_index(s, m);
+    if (i < 0) return;
+    SVec_remove(s->memsnaps, i);
+#ifdef FASTMEM
+    if (!s->memsnaps.size) memory_protect(s, PROT_READ | PROT_WRITE);
+#endif
+}
+
+// marks a page as saved so older contents can be put in the returned buffer
+// and written back by the next restore
+void* memory_snapshot_stage(MemSnapshot* m, u32 pg) {
+    if (m->pgstate[pg] == MEMPG_CLEAN) {
+        m->saved[m->nsaved++] = pg;
+        m->pgstate[pg] = MEMPG_SAVED;
+    }
+    return &m->pages[pg * PAGE_SIZE];
+}
+
+// returns the contents of a page at the time of the snapshot, this can be
+// used from another thread while the emulator keeps running
+void* memory_snapshot_read(E3DS* s, MemSnapshot* m, u32 pg, void* buf) {
+    void* saved = &m->pages[pg * PAGE_SIZE];
+#ifdef FASTMEM
+    if (atomic_load(&m->pgstate[pg]) == MEMPG_SAVED) return saved;
+    memcpy(buf, &s->mem->raw[pg * PAGE_SIZE], PAGE_SIZE);
+    // if the page was still clean after copying it then nothing wrote to it
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&m->pgstate[pg]) == MEMPG_CLEAN) return buf;
+    while (atomic_load(&m->pgstate[pg]) != MEMPG_SAVED) {
+    }
+#endif
+    return saved;
+}
+
+// host syscalls fail instead of faulting when writing to protected pages, so
+// they need to be saved beforehand
+void memory_snapshot_touch(E3DS* s, void* ptr, u32 size) {
+#ifdef FASTMEM
+    if (!s->memsnaps.size || !size) return;
+    uintptr_t end = (uintptr_t) ptr + size;
+    for (uintptr_t p = (uintptr_t) ptr & ~(uintptr_t) (PAGE_SIZE - 1); p < end;
+         p += PAGE_SIZE) {
+        volatile u8* b = (u8*) p;
+        *b = *b;
+    }
+#endif
+}
+
+// replaces the page table and updates the host mappings of any pages which
+// changed
+void memory_set_ptab(E3DS* s, PageTable ptab) {
+    for (u32 l1 = 0; l1 < BIT(10); l1++) {
+        PageEntry* old = s->process.ptab[l1];
+        PageEntry* new = ptab[l1];
+#ifdef FASTMEM
+        if ((old || new) &&
+            !(old && new && !memcmp(old, new, BIT(10) * sizeof(PageEntry)))) {
+            for (u32 l2 = 0; l2 < BIT(10); l2++) {
+                PageEntry o = old ? old[l2] : (PageEntry) {};
+                PageEntry n = new ? new[l2] : (PageEntry) {};
+                if (o.state == MEMST_FREE && n.state == MEMST_FREE) continue;
+                if (o.state != MEMST_FREE && n.state != MEMST_FREE &&
+                    o.paddr == n.paddr)
+                    continue;
+                void* ptr = &s->virtmem[l1 << 22 | l2 << 12];
+                if (n.state != MEMST_FREE) {
+                    ptr = mmap(ptr, PAGE_SIZE, virtmem_prot(s),
+                               MAP_SHARED | MAP_FIXED, s->mem_fd,
+                               physaddr2memoff(n.paddr));
+                } else {
+                    ptr = mmap(ptr, PAGE_SIZE, PROT_NONE,
+                               MAP_PRIVATE | MAP_ANON | MAP_NORESERVE |
+                                   MAP_FIXED,
+                               -1, 0);
+                }
+                if (ptr == MAP_FAILED) {
+                    perror("mmap");
+                    exit(1);
+                }
+            }
+        }
+#endif
+        free(old);
+        s->process.ptab[l1] = new;
+    }
+}
+
+// replays only the bookkeeping of a recorded trace, without mapping any memory
+bool memory_trace_replay(char* path, int iters) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        lerror("could not open memory trace %s", path);
+        return false;
+    }
+    typedef struct {
+        char op;
+        u32 a[4];
+    } TraceOp;
+    Vector(TraceOp) ops;
+    Vec_init(ops);
+    TraceOp o;
+    while (fscanf(fp, " %c %x %x %x %x", &o.op, &o.a[0], &o.a[1], &o.a[2],
+                  &o.a[3]) == 5) {
+        Vec_push(ops, o);
+    }
+    fclose(fp);
+
+    E3DS* s = calloc(1, sizeof *s);
+    u64 total = 0;
+    u64 best = -1;
+    u32 nblocks = 0;
+    u32 nheap = 0;
+    for (int it = 0; it < iters; it++) {
+        memory_blocks_init(s);
+        u64 start = time_ns();
+        Vec_foreach(op, ops) {
+            switch (op->op) {
+                case 'v':
+                    insert_vmblock(s, op->a[0], op->a[1], op->a[2], op->a[3]);
+                    break;
+                case 'q':
+                    memory_virtquery(s, op->a[0]);
+                    break;
+                case 'p':
+                    memory_physalloc(s, op->a[0]);
+                    break;
+                case 'l':
+                    linearheap_grow_pages(s, op->a[0]);
+                    break;
+            }
+        }
+        u64 elapsed = time_ns() - start;
+        total += elapsed;
+        if (elapsed < best) best = elapsed;
+        nblocks = s->process.vmblocks.size;
+        nheap = s->pheap.size;
+        memory_blocks_free(s);
+    }
+    free(s);
+
+    printfln("replayed %s %d times", path, iters);
+    printfln("%zu ops: avg %.3lf ms, best %.3lf ms, %.1lf ns per op",
+             ops.size, total / 1e6 / iters, best / 1e6,
+             ops.size ? (double) total / iters / ops.size : 0);
+    printfln("%u vm blocks, %u fcram ranges at the end", nblocks, nheap);
+    Vec_free(ops);
+    return true;
+}
@@ -1,6 +1,8 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <stdatomic.h>
+
 #include "common.h"
 
 #include "kernel.h"
@@ -25,16 +27,35 @@ typedef union {
     u8 raw[];
 } E3DSMemory;
 
+#define MEM_NPAGES (sizeof(E3DSMemory) / PAGE_SIZE)
+#define MEMSNAP_MAX 4
+
 typedef struct _3DS E3DS;
 
-typedef struct _FCRAMHeapNode {
+enum {
+    MEMPG_CLEAN,
+    MEMPG_COPYING,
+    MEMPG_SAVED,
+};
+
+// copy on write snapshot of emulated memory, pages are write protected and
+// their old contents are saved the first time they are written to
+// a snapshot without pages only keeps track of which pages were written
+typedef struct {
+    u8* pages;
+    _Atomic u8* pgstate;
+    u32* saved;
+    atomic_uint nsaved;
+} MemSnapshot;
+
+typedef struct {
     u32 startpg;
     u32 endpg;
-
-    struct _FCRAMHeapNode* next;
-    struct _FCRAMHeapNode* prev;
 } FCRAMHeapNode;
 
+// allocated ranges of fcram in order, the first one is the linear heap
+typedef Vector(FCRAMHeapNode) FCRAMHeap;
+
 typedef struct {
     u32 paddr;
     u16 perm;
@@ -43,15 +64,16 @@ typedef struct {
 
 typedef PageEntry* PageTable[BIT(10)];
 
-typedef struct _VMBlock {
+typedef struct {
     u32 startpg;
     u32 endpg;
     u32 perm;
     u32 state;
-    struct _VMBlock* next;
-    struct _VMBlock* prev;
 } VMBlock;
 
+// blocks are in order and cover the whole address space
+typedef Vector(VMBlock) VMBlockList;
+
 typedef struct {
     KObject hdr;
 
@@ -71,9 +93,14 @@ void* sw_vptr(E3DS* s, u32 addr);
 #define PTR(addr) sw_vptr(s, addr)
 #endif
 
+extern FILE* g_memtrace;
+
 void memory_init(E3DS* s);
 void memory_destroy(E3DS* s);
 
+void memory_blocks_init(E3DS* s);
+void memory_blocks_free(E3DS* s);
+
 u32 memory_physalloc(E3DS* s, u32 size);
 
 u32 memory_virtmap(E3DS* s, u32 paddr, u32 vaddr, u32 size, u32 perm,
@@ -82,7 +109,24 @@ u32 memory_virtmirror(E3DS* s, u32 srcvaddr, u32 dstvaddr, u32 size, u32 perm);
 u32 memory_virtalloc(E3DS* s, u32 addr, u32 size, u32 perm, u32 state);
 u32 memory_linearheap_grow(E3DS* s, u32 size, u32 perm);
 VMBlock* memory_virtquery(E3DS* s, u32 addr);
+bool memory_host_contiguous(E3DS* s, u32 vaddr, u32 size);
+void print_vmblocks(VMBlockList* vmblocks);
 
 void sharedmem_alloc(E3DS* s, KSharedMem* shmem);
 
+void memory_snapshot_init(MemSnapshot* m);
+void memory_snapshot_init_tracking(MemSnapshot* m);
+void memory_snapshot_free(MemSnapshot* m);
+bool memory_snapshot_active(E3DS* s, MemSnapshot* m);
+bool memory_snapshot_begin(E3DS* s, MemSnapshot* m);
+void memory_snapshot_restore(E3DS* s, MemSnapshot* m);
+void memory_snapshot_end(E3DS* s, MemSnapshot* m);
+void* memory_snapshot_stage(MemSnapshot* m, u32 pg);
+void* memory_snapshot_read(E3DS* s, MemSnapshot* m, u32 pg, void* buf);
+void memory_snapshot_touch(E3DS* s, void* ptr, u32 size);
+
+void memory_set_ptab(E3DS* s, PageTable ptab);
+
+bool memory_trace_replay(char* path, int iters);
+
 #endif
@@ -10,11 +10,17 @@ typedef struct _KProcess {
 
     PageTable ptab;
 
-    VMBlock vmblocks;
+    VMBlockList vmblocks;
 
     KObject* handles[HANDLE_MAX];
+    // set for each handle in use
+    u64 handles_used[HANDLE_MAX / 64];
 
     KThread* threads[THREAD_MAX];
+    // bit n is set if any thread of priority n is ready, with the ready thread
+    // ids of each priority in a mask
+    u64 ready_prios;
+    u32 ready_thrds[THRD_MAX_PRIO];
 
     u32 used_memory;
 } KProcess;
@@ -0,0 +1,102 @@
+#include "stats.h"
+
+#include "services/srv.h"
+#include "svc.h"
+
+static CallStats svcstats[SVC_MAX];
+// open addressing on (handler, arg, cmd), new commands are dropped once it
+// is full
+static IPCStats ipcstats[BIT(IPCSTATS_BITS)];
+static u32 nipcstats;
+
+static void update(CallStats* st, u64 now, u64 ns) {
+    if (st->calls && now > st->last) st->cycles += now - st->last;
+    st->last = now;
+    st->calls++;
+    st->ns += ns;
+}
+
+void stats_svc(u32 num, u64 now, u64 ns) {
+    update(&svcstats[num & (SVC_MAX - 1)], now, ns);
+}
+
+void stats_ipc(void* handler, u64 arg, u32 cmd, u64 now, u64 ns) {
+    u32 i = ((uintptr_t) handler >> 4 ^ arg ^ cmd * 0x9e3779b1) &
+            MASK(IPCSTATS_BITS);
+    while (ipcstats[i].handler) {
+        if (ipcstats[i].handler == handler && ipcstats[i].arg == arg &&
+            ipcstats[i].cmd == cmd)
+            break;
+        i = (i + 1) & MASK(IPCSTATS_BITS);
+    }
+    IPCStats* e = &ipcstats[i];
+    if (!e->handler) {
+        // keep one slot free so lookups always end
+        if (nipcstats == BIT(IPCSTATS_BITS) - 1) return;
+        nipcstats++;
+        e->handler = handler;
+        e->arg = arg;
+        e->cmd = cmd;
+    }
+    update(&e->st, now, ns);
+}
+
+static int cmp_ns(const void* a, const void* b) {
+    const CallStats* x = *(const CallStats**) a;
+    const CallStats* y = *(const CallStats**) b;
+    return (x->ns < y->ns) - (x->ns > y->ns);
+}
+
+static void print_row(const char* name, CallStats* st) {
+    printfln("%-32s %10lu %10.3lf %10.3lf %12.0lf", name, st->calls,
+             st->ns / 1e6, st->ns / 1e3 / st->calls,
+             st->calls > 1 ? (double) st->cycles / (st->calls - 1) : 0.0);
+}
+
+static void print_header(const char* kind) {
+    printfln("%-32s %10s %10s %10s %12s", kind, "calls", "total ms",
+             "avg us", "avg cycles");
+}
+
+// both tables are sorted by total host time
+void stats_print() {
+    CallStats* rows[BIT(IPCSTATS_BITS)];
+    int n = 0;
+    for (int i = 0; i < SVC_MAX; i++) {
+        if (svcstats[i].calls) rows[n++] = &svcstats[i];
+    }
+    qsort(rows, n, sizeof rows[0], cmp_ns);
+    print_header("svc");
+    for (int i = 0; i < n; i++) {
+        int num = rows[i] - svcstats;
+        char name[40];
+        snprintf(name, sizeof name, "%02x %s", num,
+                 svc_names[num] ? svc_names[num] : "unknown");
+        print_row(name, rows[i]);
+    }
+
+    n = 0;
+    for (int i = 0; i < BIT(IPCSTATS_BITS); i++) {
+        if (ipcstats[i].handler) rows[n++] = &ipcstats[i].st;
+    }
+    qsort(rows, n, sizeof rows[0], cmp_ns);
+    print_header("service command");
+    for (int i = 0; i < n; i++) {
+        IPCStats* e = (IPCStats*) ((u8*) rows[i] - offsetof(IPCStats, st));
+        char name[40];
+        if (e->arg) {
+            snprintf(name, sizeof name, "%.8s (stub) %04x", (char*) &e->arg,
+                     e->cmd);
+        } else {
+            snprintf(name, sizeof name, "%s %04x", srv_port_name(e->handler),
+                     e->cmd);
+        }
+        print_row(name, rows[i]);
+    }
+}
+
+void stats_reset() {
+    memset(svcstats, 0, sizeof svcstats);
+    memset(ipcstats, 0, sizeof ipcstats);
+    nipcstats = 0;
+}
@@ -0,0 +1,32 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "common.h"
+
+// always on counters for each svc and each service command, used to find
+// which hle calls a game spends the most time in
+typedef struct {
+    u64 calls;
+    u64 ns;
+    // guest cycles from the previous call to this one
+    u64 cycles;
+    u64 last;
+} CallStats;
+
+typedef struct {
+    void* handler;
+    // only set for stubbed services, which share a handler
+    u64 arg;
+    u32 cmd;
+    CallStats st;
+} IPCStats;
+
+#define IPCSTATS_BITS 10
+
+void stats_svc(u32 num, u64 now, u64 ns);
+void stats_ipc(void* handler, u64 arg, u32 cmd, u64 now, u64 ns);
+
+void stats_print();
+void stats_reset();
+
+#endif
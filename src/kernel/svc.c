@@ -3,8 +3,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cpu.h"
 #include "services/srv.h"
+#include "trace.h"
 
+#include "stats.h"
 #include "svc_types.h"
 #include "thread.h"
 
@@ -18,6 +21,9 @@
     }
 
 void e3ds_handle_svc(E3DS* s, u32 num) {
+    TRACE_SCOPE("e3ds_handle_svc");
+    u64 start = time_ns();
+    u64 now = cpu_now(s);
     e3ds_save_context(s);
 
     KThread* caller = CUR_THREAD;
@@ -32,6 +38,7 @@ void e3ds_handle_svc(E3DS* s, u32 num) {
     }
 
     e3ds_restore_context(s);
+    stats_svc(num, now, time_ns() - start);
 }
 
 DECL_SVC(ControlMemory) {
@@ -119,9 +126,9 @@ DECL_SVC(SleepThread) {
         // thread
         // since the scheduler always picks the thread with highest priority
         // we need to temporarily sleep this one so it does not get picked
-        caller->state = THRD_SLEEP;
+        thread_set_state(s, caller, THRD_SLEEP);
         thread_reschedule(s);
-        caller->state = THRD_READY;
+        thread_set_state(s, caller, THRD_READY);
     } else {
         thread_sleep(s, caller, timeout);
     }
@@ -149,7 +156,7 @@ DECL_SVC(SetThreadPriority) {
         return;
     }
 
-    t->priority = R(1);
+    thread_set_priority(s, t, R(1));
     thread_reschedule(s);
 
     R(0) = 0;
@@ -230,8 +237,7 @@ DECL_SVC(CreateMemoryBlock) {
     u32 size = R(2);
     u32 perm = R(3);
 
-    KSharedMem* shm = calloc(1, sizeof *shm);
-    shm->hdr.type = KOT_SHAREDMEM;
+    KSharedMem* shm = kobject_alloc(KOT_SHAREDMEM);
     shm->mapaddr = addr;
     shm->size = size;
     shm->hdr.refcount = 1;
@@ -275,8 +281,7 @@ DECL_SVC(MapMemoryBlock) {
 DECL_SVC(CreateAddressArbiter) {
     MAKE_HANDLE(h);
 
-    KArbiter* arbiter = calloc(1, sizeof *arbiter);
-    arbiter->hdr.type = KOT_ARBITER;
+    KArbiter* arbiter = kobject_alloc(KOT_ARBITER);
     arbiter->hdr.refcount = 1;
     linfo("handle=%x", h);
 
@@ -305,43 +310,20 @@ DECL_SVC(ArbitrateAddress) {
     switch (type) {
         case ARBITRATE_SIGNAL:
             linfo("signaling address %08x", addr);
-            if (value < 0) {
-                KListNode** cur = &arbiter->waiting_thrds;
-                while (*cur) {
-                    KThread* t = (KThread*) (*cur)->key;
-                    if (t->waiting_addr == addr) {
-                        thread_wakeup(s, t, &arbiter->hdr);
-                        klist_remove(cur);
-                    } else {
-                        cur = &(*cur)->next;
-                    }
-                }
-            } else {
-                for (int i = 0; i < value; i++) {
-                    u32 maxprio = THRD_MAX_PRIO;
-                    KListNode** toRemove = nullptr;
-                    KListNode** cur = &arbiter->waiting_thrds;
-                    while (*cur) {
-                        KThread* t = (KThread*) (*cur)->key;
-                        if (t->waiting_addr == addr) {
-                            if (t->priority < maxprio) {
-                                maxprio = t->priority;
-                                toRemove = cur;
-                            }
-                        }
-                        cur = &(*cur)->next;
-                    }
-                    if (!toRemove) break;
-                    KThread* t = (KThread*) (*toRemove)->key;
-                    thread_wakeup(s, t, &arbiter->hdr);
-                    klist_remove(toRemove);
-                }
+            // waiters are keyed by address and in priority order, so a
+            // negative value wakes up all of them and otherwise the first few
+            KListNode** cur = waitqueue_find(&arbiter->waiting_thrds, addr);
+            for (s32 i = 0; (value < 0 || i < value) && *cur &&
+                            (*cur)->val == addr;
+                 i++) {
+                thread_wakeup(s, (KThread*) (*cur)->key, &arbiter->hdr);
+                klist_remove(cur);
             }
             break;
         case ARBITRATE_WAIT:
         case ARBITRATE_DEC_WAIT:
             if (*(s32*) PTR(addr) < value) {
-                klist_insert(&arbiter->waiting_thrds, &caller->hdr);
+                waitqueue_insert(&arbiter->waiting_thrds, caller, addr);
                 klist_insert(&caller->waiting_objs, &arbiter->hdr);
                 caller->waiting_addr = addr;
                 linfo("waiting on address %08x", addr);
@@ -515,7 +497,12 @@ DECL_SVC(SendSyncRequest) {
     R(0) = 0;
     u32 cmd_addr = GETTLS(caller) + IPC_CMD_OFF;
     IPCHeader cmd = *(IPCHeader*) PTR(cmd_addr);
+    TRACE_SCOPE("ipc");
+    u64 start = time_ns();
     session->handler(s, cmd, cmd_addr, session->arg);
+    stats_ipc(session->handler,
+              session->handler == port_handle_stub ? session->arg : 0,
+              cmd.command, cpu_now(s), time_ns() - start);
 }
 
 DECL_SVC(GetProcessId) {
@@ -537,8 +524,7 @@ DECL_SVC(GetThreadId) {
 DECL_SVC(GetResourceLimit) {
     MAKE_HANDLE(h);
     R(0) = 0;
-    KObject* dummy = malloc(sizeof *dummy);
-    dummy->type = KOT_RESLIMIT;
+    KObject* dummy = kobject_alloc(KOT_RESLIMIT);
     dummy->refcount = 1;
     HANDLE_SET(h, dummy);
     R(1) = h;
@@ -42,41 +42,102 @@ u32 thread_create(E3DS* s, u32 entrypoint, u32 stacktop, u32 priority,
         lerror("not enough threads");
         return tid;
     }
-    KThread* thrd = calloc(1, sizeof *thrd);
-    thrd->hdr.type = KOT_THREAD;
+    KThread* thrd = kobject_alloc(KOT_THREAD);
     thrd->ctx.arg = arg;
     thrd->ctx.sp = stacktop;
     thrd->ctx.pc = entrypoint;
     thrd->ctx.cpsr = M_USER;
     thrd->priority = priority;
-    thrd->state = THRD_READY;
+    thrd->state = THRD_DEAD;
     thrd->id = tid;
     s->process.threads[tid] = thrd;
+    thread_set_state(s, thrd, THRD_READY);
 
     linfo("creating thread %d (entry %08x, stack %08x, priority %x, arg %x)",
           tid, entrypoint, stacktop, priority, arg);
     return tid;
 }
 
-void thread_reschedule(E3DS* s) {
-    if (CUR_THREAD->state == THRD_RUNNING) CUR_THREAD->state = THRD_READY;
-    u32 nexttid = -1;
-    u32 maxprio = THRD_MAX_PRIO;
-    for (u32 i = 0; i < THREAD_MAX; i++) {
+static bool is_ready(KThread* t) {
+    return (t->state == THRD_RUNNING || t->state == THRD_READY) &&
+           0 <= t->priority && t->priority < THRD_MAX_PRIO;
+}
+
+static void ready_add(E3DS* s, KThread* t) {
+    s->process.ready_thrds[t->priority] |= BIT(t->id);
+    s->process.ready_prios |= BITL(t->priority);
+}
+
+static void ready_remove(E3DS* s, KThread* t) {
+    s->process.ready_thrds[t->priority] &= ~BIT(t->id);
+    if (!s->process.ready_thrds[t->priority])
+        s->process.ready_prios &= ~BITL(t->priority);
+}
+
+// all changes to the state or priority of a thread must go through these so
+// the ready masks stay up to date
+void thread_set_state(E3DS* s, KThread* t, u32 state) {
+    if (is_ready(t)) ready_remove(s, t);
+    t->state = state;
+    if (is_ready(t)) ready_add(s, t);
+}
+
+// moves a waiting thread to its place for its new priority in a wait queue
+static void waitqueue_update(KThread* t, KObject* o) {
+    KListNode** l;
+    switch (o->type) {
+        case KOT_MUTEX:
+            l = &((KMutex*) o)->waiting_thrds;
+            break;
+        case KOT_SEMAPHORE:
+            l = &((KSemaphore*) o)->waiting_thrds;
+            break;
+        case KOT_ARBITER:
+            l = &((KArbiter*) o)->waiting_thrds;
+            break;
+        default:
+            return;
+    }
+    for (KListNode** cur = l; *cur; cur = &(*cur)->next) {
+        if ((*cur)->key != &t->hdr) continue;
+        u32 key = (*cur)->val;
+        klist_remove(cur);
+        waitqueue_insert(l, t, key);
+        return;
+    }
+}
+
+void thread_set_priority(E3DS* s, KThread* t, s32 priority) {
+    if (is_ready(t)) ready_remove(s, t);
+    t->priority = priority;
+    if (is_ready(t)) ready_add(s, t);
+    for (KListNode* n = t->waiting_objs; n; n = n->next) {
+        waitqueue_update(t, n->key);
+    }
+}
+
+// rebuilds the ready masks after the threads were changed directly
+void thread_sync_ready(E3DS* s) {
+    s->process.ready_prios = 0;
+    memset(s->process.ready_thrds, 0, sizeof s->process.ready_thrds);
+    for (int i = 0; i < THREAD_MAX; i++) {
         KThread* t = s->process.threads[i];
-        if (!t) continue;
-        if (t->state == THRD_READY && t->priority < maxprio) {
-            maxprio = t->priority;
-            nexttid = i;
-        }
+        if (t && is_ready(t)) ready_add(s, t);
     }
-    if (nexttid == -1) {
+}
+
+// picks the lowest id thread of the highest priority which is ready
+void thread_reschedule(E3DS* s) {
+    if (CUR_THREAD->state == THRD_RUNNING) CUR_THREAD->state = THRD_READY;
+    if (!s->process.ready_prios) {
         s->cpu.wfe = true;
         linfo("all threads sleeping");
         return;
     } else {
         s->cpu.wfe = false;
     }
+    u32 prio = __builtin_ctzll(s->process.ready_prios);
+    u32 nexttid = __builtin_ctz(s->process.ready_thrds[prio]);
 
     if (CUR_THREAD->id == nexttid) {
         linfo("not switching threads");
@@ -90,7 +151,7 @@ void thread_reschedule(E3DS* s) {
 
 void thread_sleep(E3DS* s, KThread* t, s64 timeout) {
     linfo("sleeping thread %d with timeout %ld", t->id, timeout);
-    t->state = THRD_SLEEP;
+    thread_set_state(s, t, THRD_SLEEP);
 
     if (timeout == 0) {
         // instantly wakup the thread and set the return to timeout
@@ -98,7 +159,6 @@ void thread_sleep(E3DS* s, KThread* t, s64 timeout) {
         thread_wakeup_timeout(s, t->id);
         return;
     } else if (timeout > 0) {
-        t->state = THRD_SLEEP;
         s64 timeCycles = timeout * CPU_CLK / 1'000'000'000;
         add_event(&s->sched, thread_wakeup_timeout, t->id, timeCycles);
     }
@@ -116,7 +176,7 @@ void thread_wakeup_timeout(E3DS* s, u32 tid) {
         sync_cancel(t, (*cur)->key);
         klist_remove(cur);
     }
-    t->state = THRD_READY;
+    thread_set_state(s, t, THRD_READY);
     thread_reschedule(s);
 }
 
@@ -131,7 +191,7 @@ bool thread_wakeup(E3DS* s, KThread* t, KObject* reason) {
             klist_remove(cur);
         }
         remove_event(&s->sched, thread_wakeup_timeout, t->id);
-        t->state = THRD_READY;
+        thread_set_state(s, t, THRD_READY);
         thread_reschedule(s);
         return true;
     }
@@ -143,7 +203,7 @@ void thread_kill(E3DS* s, KThread* t) {
 
     linfo("killing thread %d", t->id);
 
-    t->state = THRD_DEAD;
+    thread_set_state(s, t, THRD_DEAD);
     auto cur = &t->waiting_thrds;
     while (*cur) {
         thread_wakeup(s, (KThread*) (*cur)->key, &t->hdr);
@@ -162,8 +222,7 @@ void thread_kill(E3DS* s, KThread* t) {
 }
 
 KEvent* event_create(bool sticky) {
-    KEvent* ev = calloc(1, sizeof *ev);
-    ev->hdr.type = KOT_EVENT;
+    KEvent* ev = kobject_alloc(KOT_EVENT);
     ev->sticky = sticky;
     return ev;
 }
@@ -180,8 +239,7 @@ void event_signal(E3DS* s, KEvent* ev) {
 }
 
 KMutex* mutex_create() {
-    KMutex* mtx = calloc(1, sizeof *mtx);
-    mtx->hdr.type = KOT_MUTEX;
+    KMutex* mtx = kobject_alloc(KOT_MUTEX);
     return mtx;
 }
 
@@ -192,26 +250,37 @@ void mutex_release(E3DS* s, KMutex* mtx) {
     }
     if (!mtx->locker_thrd) return;
 
-    int maxprio = THRD_MAX_PRIO;
-    KListNode** cur = &mtx->waiting_thrds;
-    KListNode** toremove = nullptr;
-    KThread* wakeupthread = nullptr;
-    while (*cur) {
-        KThread* t = (KThread*) (*cur)->key;
-        if (t->priority < maxprio) {
-            maxprio = t->priority;
-            toremove = cur;
-            wakeupthread = t;
-        }
-        cur = &(*cur)->next;
-    }
+    // the waiters are ordered by priority
+    KThread* wakeupthread = (KThread*) mtx->waiting_thrds->key;
     thread_wakeup(s, wakeupthread, &mtx->hdr);
-    klist_remove(toremove);
+    klist_remove(&mtx->waiting_thrds);
     mtx->locker_thrd = wakeupthread;
 
     thread_reschedule(s);
 }
 
+// wait queues are sorted by key and then by priority, so the threads to wake
+// up for a key are always at the start of its run and equal priorities are
+// woken up in the order they started waiting
+void waitqueue_insert(KListNode** l, KThread* t, u32 key) {
+    while (*l) {
+        KThread* o = (KThread*) (*l)->key;
+        if ((*l)->val > key ||
+            ((*l)->val == key && o->priority > t->priority))
+            break;
+        l = &(*l)->next;
+    }
+    klist_insert(l, &t->hdr);
+    (*l)->val = key;
+}
+
+// returns the link to the first waiter with this key, or the link where it
+// would be
+KListNode** waitqueue_find(KListNode** l, u32 key) {
+    while (*l && (*l)->val < key) l = &(*l)->next;
+    return l;
+}
+
 bool sync_wait(E3DS* s, KThread* t, KObject* o) {
     switch (o->type) {
         case KOT_THREAD: {
@@ -229,7 +298,7 @@ bool sync_wait(E3DS* s, KThread* t, KObject* o) {
         case KOT_MUTEX: {
             auto mtx = (KMutex*) o;
             if (mtx->locker_thrd && mtx->locker_thrd != t) {
-                klist_insert(&mtx->waiting_thrds, &t->hdr);
+                waitqueue_insert(&mtx->waiting_thrds, t, 0);
                 return true;
             }
             mtx->locker_thrd = t;
@@ -237,7 +306,7 @@ bool sync_wait(E3DS* s, KThread* t, KObject* o) {
         }
         case KOT_SEMAPHORE: {
             auto sem = (KSemaphore*) o;
-            klist_insert(&sem->waiting_thrds, &t->hdr);
+            waitqueue_insert(&sem->waiting_thrds, t, 0);
             return true;
         }
         default:
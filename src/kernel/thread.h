@@ -94,6 +94,9 @@ void e3ds_save_context(E3DS* s);
 void thread_init(E3DS* s, u32 entrypoint);
 u32 thread_create(E3DS* s, u32 entrypoint, u32 stacktop, u32 priority, u32 arg);
 void thread_reschedule(E3DS* s);
+void thread_set_state(E3DS* s, KThread* t, u32 state);
+void thread_set_priority(E3DS* s, KThread* t, s32 priority);
+void thread_sync_ready(E3DS* s);
 
 void thread_sleep(E3DS* s, KThread* t, s64 timeout);
 void thread_wakeup_timeout(E3DS* s, u32 tid);
@@ -107,6 +110,9 @@ void event_signal(E3DS* s, KEvent* ev);
 KMutex* mutex_create();
 void mutex_release(E3DS* s, KMutex* mtx);
 
+void waitqueue_insert(KListNode** l, KThread* t, u32 key);
+KListNode** waitqueue_find(KListNode** l, u32 key);
+
 bool sync_wait(E3DS* s, KThread* t, KObject* o);
 void sync_cancel(KThread* t, KObject* o);
 
@@ -0,0 +1,177 @@
+#include "zrom.h"
+
+#include <unistd.h>
+
+static bool read_full(int fd, void* dst, size_t len, u64 offset) {
+    while (len) {
+        ssize_t n = pread(fd, dst, len, offset);
+        if (n <= 0) return false;
+        dst += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static u32 block_len(ZRom* z, u32 i) {
+    if (i == z->hdr.nblocks - 1) {
+        return z->hdr.size - (u64) i * z->hdr.blocksize;
+    }
+    return z->hdr.blocksize;
+}
+
+static bool load_block(ZRom* z, int ctx, u32 i, u8* dst) {
+    u64 start = z->index[i];
+    u64 clen = z->index[i + 1] - start;
+    u32 len = block_len(z, i);
+    if (clen == len) return read_full(z->fd, dst, len, start);
+    if (clen > ZSTD_compressBound(z->hdr.blocksize)) return false;
+    if (!read_full(z->fd, z->cbuf[ctx], clen, start)) return false;
+    size_t n = ZSTD_decompressDCtx(z->dctx[ctx], dst, len, z->cbuf[ctx], clen);
+    return !ZSTD_isError(n) && n == len;
+}
+
+// called with the lock held, which is released while decompressing, the
+// prefetch thread does not wait for blocks the reader is loading
+static ZRomBlock* get_block(ZRom* z, u32 i, int ctx) {
+    while (true) {
+        ZRomBlock* b = LRU_load(z->cache, i + 1);
+        if (b->key == i + 1 && !b->loading) {
+            if (ctx == ZROM_READER) z->hits++;
+            return b;
+        }
+        if (b->loading) {
+            if (b->key == i + 1 && ctx == ZROM_PREFETCH) return b;
+            pthread_cond_wait(&z->loadcv, &z->mtx);
+            continue;
+        }
+
+        if (ctx == ZROM_READER) z->misses++;
+        b->key = i + 1;
+        b->loading = true;
+        if (!b->data) b->data = malloc(z->hdr.blocksize);
+        pthread_mutex_unlock(&z->mtx);
+        bool ok = load_block(z, ctx, i, b->data);
+        pthread_mutex_lock(&z->mtx);
+        if (!ok) {
+            lerror("could not read compressed block %d", i);
+            memset(b->data, 0, z->hdr.blocksize);
+        }
+        b->loading = false;
+        pthread_cond_broadcast(&z->loadcv);
+        return b;
+    }
+}
+
+static void* zrom_thread(ZRom* z) {
+    pthread_mutex_lock(&z->mtx);
+    while (true) {
+        while (!z->queue.size && !z->die) {
+            pthread_cond_wait(&z->queuecv, &z->mtx);
+        }
+        if (z->die) break;
+        u32 i;
+        FIFO_pop(z->queue, i);
+        get_block(z, i, ZROM_PREFETCH);
+    }
+    pthread_mutex_unlock(&z->mtx);
+    return nullptr;
+}
+
+// returns null if this is not a compressed image, the fd is owned by it
+// after it is opened
+ZRom* zrom_open(int fd) {
+    ZRomHeader hdr;
+    if (!read_full(fd, &hdr, sizeof hdr, 0) || hdr.magic != ZROM_MAGIC)
+        return nullptr;
+    if (hdr.version != ZROM_VERSION || !hdr.blocksize || !hdr.nblocks ||
+        (u64) hdr.nblocks * hdr.blocksize < hdr.size) {
+        lerror("invalid compressed rom header");
+        return nullptr;
+    }
+
+    ZRom* z = calloc(1, sizeof *z);
+    z->fd = fd;
+    z->hdr = hdr;
+    z->index = malloc((hdr.nblocks + 1) * sizeof(u64));
+    if (!read_full(fd, z->index, (hdr.nblocks + 1) * sizeof(u64),
+                   sizeof hdr)) {
+        lerror("could not read compressed rom index");
+        free(z->index);
+        free(z);
+        return nullptr;
+    }
+
+    LRU_init(z->cache);
+    pthread_mutex_init(&z->mtx, nullptr);
+    pthread_cond_init(&z->loadcv, nullptr);
+    pthread_cond_init(&z->queuecv, nullptr);
+    for (int i = 0; i < 2; i++) {
+        z->dctx[i] = ZSTD_createDCtx();
+        z->cbuf[i] = malloc(ZSTD_compressBound(hdr.blocksize));
+    }
+    pthread_create(&z->thd, nullptr, (void*) zrom_thread, z);
+
+    linfo("opened compressed rom with %d blocks of 0x%x bytes", hdr.nblocks,
+          hdr.blocksize);
+    return z;
+}
+
+void zrom_close(ZRom* z) {
+    pthread_mutex_lock(&z->mtx);
+    z->die = true;
+    pthread_cond_signal(&z->queuecv);
+    pthread_mutex_unlock(&z->mtx);
+    pthread_join(z->thd, nullptr);
+
+    linfo("compressed rom cache: %lu hits, %lu misses", z->hits, z->misses);
+
+    for (int i = 0; i < ZROM_CACHE_SIZE; i++) {
+        free(z->cache.d[i].data);
+    }
+    for (int i = 0; i < 2; i++) {
+        ZSTD_freeDCtx(z->dctx[i]);
+        free(z->cbuf[i]);
+    }
+    pthread_mutex_destroy(&z->mtx);
+    pthread_cond_destroy(&z->loadcv);
+    pthread_cond_destroy(&z->queuecv);
+    close(z->fd);
+    free(z->index);
+    free(z);
+}
+
+// returns the number of bytes read, which is less than size at the end
+u32 zrom_read(ZRom* z, void* dst, u64 offset, u32 size) {
+    if (offset >= z->hdr.size) return 0;
+    if (size > z->hdr.size - offset) size = z->hdr.size - offset;
+    if (!size) return 0;
+
+    pthread_mutex_lock(&z->mtx);
+    u32 done = 0;
+    while (done < size) {
+        u64 pos = offset + done;
+        u32 i = pos / z->hdr.blocksize;
+        u32 off = pos % z->hdr.blocksize;
+        u32 n = z->hdr.blocksize - off;
+        if (n > size - done) n = size - done;
+        // copied with the lock held so the prefetch thread cannot evict it
+        memcpy(dst + done, get_block(z, i, ZROM_READER)->data + off, n);
+        done += n;
+    }
+
+    // reads which continue the last one are likely to keep going, so the
+    // next blocks are decompressed in the background
+    if (offset == z->lastend) {
+        u32 last = (offset + size - 1) / z->hdr.blocksize;
+        for (u32 i = last + 1;
+             i <= last + ZROM_READAHEAD && i < z->hdr.nblocks; i++) {
+            if (z->queue.size == FIFO_MAX(z->queue)) break;
+            FIFO_push(z->queue, i);
+        }
+        pthread_cond_signal(&z->queuecv);
+    }
+    z->lastend = offset + size;
+    pthread_mutex_unlock(&z->mtx);
+    return size;
+}
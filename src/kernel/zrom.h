@@ -0,0 +1,69 @@
+#ifndef ZROM_H
+#define ZROM_H
+
+#include <pthread.h>
+#include <zstd.h>
+
+#include "common.h"
+
+// rom images compressed as fixed size zstd blocks with an index of where
+// each one starts, so any offset can be read by only decompressing the
+// blocks it is in
+#define ZROM_MAGIC 0x5a443354 // T3DZ
+#define ZROM_VERSION 1
+#define ZROM_BLOCK_SIZE BIT(18)
+
+#define ZROM_CACHE_SIZE 64
+#define ZROM_READAHEAD 4
+
+// followed by nblocks + 1 file offsets of the blocks, a block whose stored
+// size equals its size is not compressed
+typedef struct {
+    u32 magic;
+    u32 version;
+    u32 blocksize;
+    u32 nblocks;
+    u64 size;
+} ZRomHeader;
+
+typedef struct _ZRomBlock {
+    // block index + 1
+    u64 key;
+    u8* data;
+    bool loading;
+
+    struct _ZRomBlock *next, *prev;
+} ZRomBlock;
+
+enum { ZROM_READER, ZROM_PREFETCH };
+
+typedef struct {
+    int fd;
+    ZRomHeader hdr;
+    u64* index;
+
+    // the cache is shared with the prefetch thread, blocks are decompressed
+    // without holding the lock while loading is set
+    pthread_mutex_t mtx;
+    pthread_cond_t loadcv;
+    LRUCache(ZRomBlock, ZROM_CACHE_SIZE) cache;
+
+    pthread_t thd;
+    pthread_cond_t queuecv;
+    FIFO(u32, 4) queue;
+    bool die;
+
+    // one of each for the reader and the prefetch thread
+    ZSTD_DCtx* dctx[2];
+    u8* cbuf[2];
+
+    u64 lastend;
+    u64 hits;
+    u64 misses;
+} ZRom;
+
+ZRom* zrom_open(int fd);
+void zrom_close(ZRom* z);
+u32 zrom_read(ZRom* z, void* dst, u64 offset, u32 size);
+
+#endif
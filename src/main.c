@@ -5,8 +5,12 @@
 #include <unistd.h>
 
 #include "3ds.h"
+#include "audio.h"
 #include "cpu.h"
 #include "emulator.h"
+#include "kernel/stats.h"
+#include "perfmap.h"
+#include "trace.h"
 #include "pica/renderer_gl.h"
 
 const char usage[] =
@@ -15,6 +19,13 @@ const char usage[] =
 -l -- enable info logging
 -v -- disable vsync
 -sN -- upscale by N
+-b <file> -- replay a gpu capture and print timings
+-m <file> -- replay a memory allocation trace and print timings
+-t <file> -- record memory allocations to a trace
+-nN -- number of times to replay the capture or trace
+-p -- write a perf map of jit code to /tmp/perf-<pid>.map
+-j -- write a jitdump of jit code to /tmp/jit-<pid>.dump
+-w <file> -- write the audio output to a wav file
 )";
 
 SDL_Window* g_window;
@@ -22,7 +33,17 @@ SDL_Window* g_window;
 SDL_JoystickID g_gamepad_id;
 SDL_Gamepad* g_gamepad;
 
+SDL_AudioStream* g_audio;
+
 bool g_pending_reset;
+bool g_pending_capture;
+bool g_pending_savestate;
+bool g_pending_loadstate;
+bool g_pending_trace;
+
+char* g_replayfile;
+char* g_memreplayfile;
+int g_replayiters = 100;
 
 char* oldcwd;
 
@@ -38,7 +59,7 @@ void glDebugOutput(GLenum source, GLenum type, unsigned int id, GLenum severity,
 
 void read_args(int argc, char** argv) {
     char c;
-    while ((c = getopt(argc, argv, "hlvs:")) != (char) -1) {
+    while ((c = getopt(argc, argv, "hlvs:b:m:t:n:pjw:")) != (char) -1) {
         switch (c) {
             case 'l':
                 g_infologs = true;
@@ -53,6 +74,31 @@ void read_args(int argc, char** argv) {
                 ctremu.vsync = false;
                 break;
             }
+            case 'b':
+                g_replayfile = optarg;
+                break;
+            case 'm':
+                g_memreplayfile = optarg;
+                break;
+            case 't':
+                g_memtrace = fopen(optarg, "w");
+                if (!g_memtrace) eprintf("could not open %s\n", optarg);
+                break;
+            case 'n': {
+                int iters = atoi(optarg);
+                if (iters <= 0) eprintf("invalid replay count");
+                else g_replayiters = iters;
+                break;
+            }
+            case 'p':
+                perfmap_open(PERFMAP_MAP);
+                break;
+            case 'j':
+                perfmap_open(PERFMAP_JITDUMP);
+                break;
+            case 'w':
+                audio_wav_open(optarg, DSP_SAMPLE_RATE);
+                break;
             case '?':
             case 'h':
             default:
@@ -74,6 +120,20 @@ void read_args(int argc, char** argv) {
     }
 }
 
+// sdl asks for more audio from its own thread, anything the dsp has not
+// produced yet is played as silence
+void audio_callback(void*, SDL_AudioStream* stream, int additional, int) {
+    s16 buf[DSP_FRAME_SAMPLES][2];
+    u32 n = additional / sizeof *buf;
+    while (n) {
+        u32 count = n < DSP_FRAME_SAMPLES ? n : DSP_FRAME_SAMPLES;
+        u32 got = audio_pull(buf, count);
+        memset(&buf[got], 0, (count - got) * sizeof *buf);
+        SDL_PutAudioStreamData(stream, buf, count * sizeof *buf);
+        n -= count;
+    }
+}
+
 void file_callback(void*, char** files, int n) {
     if (files && files[0]) {
         emulator_set_rom(files[0]);
@@ -84,7 +144,7 @@ void file_callback(void*, char** files, int n) {
 void load_rom_dialog() {
     SDL_DialogFileFilter filetypes = {
         .name = "3DS Executables",
-        .pattern = "3ds;cci;cxi;app;elf",
+        .pattern = "3ds;cci;cxi;app;3dz;elf",
     };
 
     ctremu.pause = true;
@@ -106,9 +166,26 @@ void hotkey_press(SDL_Keycode key) {
         case SDLK_F2:
             load_rom_dialog();
             break;
+        case SDLK_F3:
+            g_pending_savestate = true;
+            break;
         case SDLK_F4:
             g_cpulog = !g_cpulog;
             break;
+        case SDLK_F6:
+            g_pending_loadstate = true;
+            break;
+        case SDLK_F9:
+            g_pending_capture = true;
+            break;
+        case SDLK_F10:
+            stats_print();
+            break;
+#ifdef TRACING
+        case SDLK_F8:
+            g_pending_trace = true;
+            break;
+#endif
         case SDLK_F7:
             ctremu.freecam_enable = !ctremu.freecam_enable;
             glm_mat4_identity(ctremu.freecam_mtx);
@@ -119,6 +196,16 @@ void hotkey_press(SDL_Keycode key) {
     }
 }
 
+#ifdef TRACING
+void save_trace(u64 frame) {
+    char* path;
+    asprintf(&path, "system/traces/%s_%lu.json",
+             ctremu.romfilenoext ? ctremu.romfilenoext : "trace", frame);
+    trace_write(path);
+    free(path);
+}
+#endif
+
 void update_input(E3DS* s, SDL_Gamepad* controller, int view_w, int view_h) {
     const bool* keys = SDL_GetKeyboardState(nullptr);
 
@@ -255,6 +342,8 @@ int main(int argc, char** argv) {
 
     oldcwd = realpath(".", nullptr);
 
+    trace_thread_name("main");
+
 #ifdef NOPORTABLE
     char* prefpath = SDL_GetPrefPath("", "Tanuki3DS");
     chdir(prefpath);
@@ -269,7 +358,14 @@ int main(int argc, char** argv) {
 
     read_args(argc, argv);
 
-    SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMEPAD);
+    if (g_memreplayfile) {
+        int res = memory_trace_replay(g_memreplayfile, g_replayiters) ? 0 : 1;
+        emulator_quit();
+        free(oldcwd);
+        return res;
+    }
+
+    SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMEPAD | SDL_INIT_AUDIO);
 
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 1);
@@ -299,6 +395,24 @@ int main(int argc, char** argv) {
                           GL_TRUE);
 #endif
 
+    if (g_replayfile) {
+        int res = emulator_replay(g_replayfile, g_replayiters) ? 0 : 1;
+        SDL_GL_DestroyContext(glcontext);
+        SDL_DestroyWindow(g_window);
+        SDL_Quit();
+        emulator_quit();
+        free(oldcwd);
+        return res;
+    }
+
+    if (ctremu.audio) {
+        SDL_AudioSpec spec = {SDL_AUDIO_S16, 2, DSP_SAMPLE_RATE};
+        g_audio = SDL_OpenAudioDeviceStream(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK,
+                                            &spec, audio_callback, nullptr);
+        if (g_audio) SDL_ResumeAudioStreamDevice(g_audio);
+        else lwarn("could not open audio device: %s", SDL_GetError());
+    }
+
     if (!ctremu.romfile) {
         load_rom_dialog();
     } else {
@@ -314,6 +428,7 @@ int main(int argc, char** argv) {
     Uint64 prev_time = SDL_GetTicksNS();
     Uint64 prev_fps_update = prev_time;
     Uint64 prev_fps_frame = 0;
+    Uint64 emu_time = 0;
     const Uint64 frame_ticks = SDL_NS_PER_SECOND / FPS;
     Uint64 frame = 0;
 
@@ -334,16 +449,48 @@ int main(int argc, char** argv) {
             SDL_RaiseWindow(g_window);
         }
 
+        // save states are only taken and loaded between frames
+        if (g_pending_savestate) {
+            g_pending_savestate = false;
+            emulator_save_state();
+        }
+        if (g_pending_loadstate) {
+            g_pending_loadstate = false;
+            emulator_load_state();
+        }
+
         if (!ctremu.pause) {
             renderer_gl_setup_gpu(&ctremu.system.gpu.gl);
 
+            if (g_pending_capture) {
+                g_pending_capture = false;
+                char* path;
+                asprintf(&path, "system/captures/%s_%lu.cap",
+                         ctremu.romfilenoext, frame);
+                gpucapture_begin(&ctremu.system.gpu, path);
+                free(path);
+            }
+
+            // while rewinding each frame steps back one checkpoint and
+            // then runs from there without taking new ones
+            Rewind* rw = &ctremu.system.rewind;
+            rw->hold = SDL_GetKeyboardState(nullptr)[SDL_SCANCODE_BACKSPACE];
+
+            Uint64 emu_start = SDL_GetTicksNS();
             do {
+                if (rw->hold) rewind_step(&ctremu.system, rw);
                 e3ds_run_frame(&ctremu.system);
                 frame++;
+                // captures only cover a single frame
+                gpucapture_end(&ctremu.system.gpu);
+                savestate_finish(&ctremu.system, false);
 
                 cur_time = SDL_GetTicksNS();
                 elapsed = cur_time - prev_time;
             } while (ctremu.uncap && elapsed < frame_ticks);
+            emu_time += SDL_GetTicksNS() - emu_start;
+
+            emulator_run_ahead();
         }
 
         int w, h;
@@ -351,7 +498,17 @@ int main(int argc, char** argv) {
 
         render_gl_main(&ctremu.system.gpu.gl, w, h);
 
-        SDL_GL_SwapWindow(g_window);
+        {
+            TRACE_SCOPE("swap");
+            SDL_GL_SwapWindow(g_window);
+        }
+
+#ifdef TRACING
+        if (g_pending_trace) {
+            g_pending_trace = false;
+            save_trace(frame);
+        }
+#endif
 
         SDL_Event e;
         while (SDL_PollEvent(&e)) {
@@ -402,8 +559,21 @@ int main(int argc, char** argv) {
                 (double) SDL_NS_PER_SECOND * (frame - prev_fps_frame) / elapsed;
 
             char* wintitle;
-            asprintf(&wintitle, "Tanuki3DS | %s | %.2lf FPS",
-                     ctremu.romfilenodir, fps);
+            if (ctremu.runahead) {
+                // extra time spent on run-ahead compared to the real frames
+                u64 nframes = frame - prev_fps_frame;
+                double ms = ctremu.runaheadtime / 1e6 / (nframes ?: 1);
+                double pct = 100.0 * ctremu.runaheadtime / (emu_time ?: 1);
+                asprintf(&wintitle,
+                         "Tanuki3DS | %s | %.2lf FPS | run-ahead %d: "
+                         "%.2lf ms/frame (+%.0lf%%)",
+                         ctremu.romfilenodir, fps, ctremu.runahead, ms, pct);
+            } else {
+                asprintf(&wintitle, "Tanuki3DS | %s | %.2lf FPS",
+                         ctremu.romfilenodir, fps);
+            }
+            ctremu.runaheadtime = 0;
+            emu_time = 0;
             SDL_SetWindowTitle(g_window, wintitle);
             free(wintitle);
             prev_fps_update = cur_time;
@@ -412,13 +582,22 @@ int main(int argc, char** argv) {
         prev_time = cur_time;
     }
 
+#ifdef TRACING
+    save_trace(frame);
+#endif
+
     SDL_GL_DestroyContext(glcontext);
     SDL_DestroyWindow(g_window);
     SDL_CloseGamepad(g_gamepad);
+    SDL_DestroyAudioStream(g_audio);
 
     SDL_Quit();
 
     emulator_quit();
+    audio_wav_close();
+
+    if (g_memtrace) fclose(g_memtrace);
+    perfmap_close();
 
     free(oldcwd);
 
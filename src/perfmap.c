@@ -0,0 +1,157 @@
+#include "perfmap.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <elf.h>
+#endif
+
+int g_perfmap;
+
+static FILE* perffp;
+static void* marker;
+static size_t markersize;
+static u64 codeindex;
+static pthread_mutex_t perfmtx = PTHREAD_MUTEX_INITIALIZER;
+
+#define JITDUMP_MAGIC 0x4a695444 // JiTD
+#define JITDUMP_VERSION 1
+
+enum { JIT_CODE_LOAD = 0, JIT_CODE_CLOSE = 3 };
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u32 total_size;
+    u32 elf_mach;
+    u32 pad1;
+    u32 pid;
+    u64 timestamp;
+    u64 flags;
+} JitDumpHeader;
+
+typedef struct {
+    u32 id;
+    u32 total_size;
+    u64 timestamp;
+} JitDumpRecord;
+
+typedef struct {
+    JitDumpRecord r;
+    u32 pid;
+    u32 tid;
+    u64 vma;
+    u64 code_addr;
+    u64 code_size;
+    u64 code_index;
+} JitDumpLoad;
+
+#ifdef __linux__
+static bool open_jitdump() {
+    char path[64];
+    snprintf(path, sizeof path, "/tmp/jit-%d.dump", getpid());
+    perffp = fopen(path, "w+");
+    if (!perffp) return false;
+
+    // perf finds the dump through the executable mapping of it in the
+    // recorded process
+    markersize = sysconf(_SC_PAGESIZE);
+    marker = mmap(nullptr, markersize, PROT_READ | PROT_EXEC, MAP_PRIVATE,
+                  fileno(perffp), 0);
+    if (marker == MAP_FAILED) {
+        marker = nullptr;
+        fclose(perffp);
+        perffp = nullptr;
+        return false;
+    }
+
+    // perf needs the same clock, so record with perf record -k mono
+    JitDumpHeader h = {
+        .magic = JITDUMP_MAGIC,
+        .version = JITDUMP_VERSION,
+        .total_size = sizeof h,
+#ifdef __x86_64__
+        .elf_mach = EM_X86_64,
+#else
+        .elf_mach = EM_AARCH64,
+#endif
+        .pid = getpid(),
+        .timestamp = time_ns(),
+    };
+    fwrite(&h, sizeof h, 1, perffp);
+    return true;
+}
+#endif
+
+void perfmap_open(int mode) {
+    if (mode == PERFMAP_NONE) return;
+    if (mode == PERFMAP_JITDUMP) {
+#ifdef __linux__
+        if (!open_jitdump()) {
+            lerror("could not create jitdump file");
+            return;
+        }
+#else
+        lerror("jitdump is only supported on linux");
+        return;
+#endif
+    } else {
+        char path[64];
+        snprintf(path, sizeof path, "/tmp/perf-%d.map", getpid());
+        perffp = fopen(path, "w");
+        if (!perffp) {
+            lerror("could not create %s", path);
+            return;
+        }
+    }
+    g_perfmap = mode;
+}
+
+void perfmap_close() {
+    if (!g_perfmap) return;
+    if (g_perfmap == PERFMAP_JITDUMP) {
+        JitDumpRecord r = {JIT_CODE_CLOSE, sizeof r, time_ns()};
+        fwrite(&r, sizeof r, 1, perffp);
+        munmap(marker, markersize);
+        marker = nullptr;
+    }
+    fclose(perffp);
+    perffp = nullptr;
+    g_perfmap = PERFMAP_NONE;
+}
+
+// the map format has no way to remove an entry, so code freed by the jit is
+// left in it and perf may show the old name if the address is reused, a
+// jitdump records when each block was loaded so it does not have this issue
+void perfmap_add(const void* code, size_t size, const char* fmt, ...) {
+    if (!g_perfmap || !size) return;
+
+    char name[128];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(name, sizeof name, fmt, args);
+    va_end(args);
+
+    pthread_mutex_lock(&perfmtx);
+    if (g_perfmap == PERFMAP_MAP) {
+        fprintf(perffp, "%lx %zx %s\n", (uintptr_t) code, size, name);
+    } else {
+        size_t namelen = strlen(name) + 1;
+        JitDumpLoad l = {
+            .r = {JIT_CODE_LOAD, sizeof l + namelen + size, time_ns()},
+            .pid = getpid(),
+            .tid = gettid(),
+            .vma = (uintptr_t) code,
+            .code_addr = (uintptr_t) code,
+            .code_size = size,
+            .code_index = codeindex++,
+        };
+        fwrite(&l, sizeof l, 1, perffp);
+        fwrite(name, namelen, 1, perffp);
+        fwrite(code, size, 1, perffp);
+    }
+    pthread_mutex_unlock(&perfmtx);
+}
@@ -0,0 +1,26 @@
+#ifndef PERFMAP_H
+#define PERFMAP_H
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// lets linux perf symbolize jit code, either with a /tmp/perf-<pid>.map file
+// or a jitdump file for perf inject --jit
+enum { PERFMAP_NONE, PERFMAP_MAP, PERFMAP_JITDUMP };
+
+extern int g_perfmap;
+
+void perfmap_open(int mode);
+void perfmap_close();
+
+[[gnu::format(printf, 3, 4)]] void perfmap_add(const void* code, size_t size,
+                                               const char* fmt, ...);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
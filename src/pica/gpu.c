@@ -1,8 +1,12 @@
 #include "gpu.h"
 
+#define XXH_INLINE_ALL
+#include <xxh3.h>
+
 #include "3ds.h"
 #include "emulator.h"
 #include "kernel/memory.h"
+#include "trace.h"
 
 #include "etc1.h"
 #include "renderer_gl.h"
@@ -52,174 +56,286 @@ void gpu_init(GPU* gpu) {
     gpu->curfb = &gpu->fbs.root;
     LRU_init(gpu->textures);
     LRU_init(gpu->vshaders_sw);
+    LRU_init(gpu->vshaders_interp);
     LRU_init(gpu->vshaders_hw);
     LRU_init(gpu->fshaders);
+    LRU_init(gpu->cmdlists);
 
     gpu_vshrunner_init(gpu);
+    renderer_sw_init(&gpu->sw, gpu);
 }
 
 void gpu_destroy(GPU* gpu) {
     shaderjit_free_all(gpu);
+    for (int i = 0; i < VSH_MAX; i++) {
+        pica_shader_free(gpu->vshaders_interp.d[i].prog);
+    }
 
     gpu_vshrunner_destroy(gpu);
+    renderer_sw_destroy(&gpu->sw);
+
+    for (int i = 0; i < CMDLIST_MAX; i++) {
+        Vec_free(gpu->cmdlists.d[i].cmds);
+        Vec_free(gpu->cmdlists.d[i].data);
+    }
 }
 
-void gpu_write_internalreg(GPU* gpu, u16 id, u32 param, u32 mask) {
-    if (id >= GPUREG_MAX) {
-        lerror("out of bounds gpu reg");
-        return;
+static void reg_drawarrays(GPU* gpu, u32 param) {
+    gpu_drawarrays(gpu);
+}
+
+static void reg_drawelements(GPU* gpu, u32 param) {
+    gpu_drawelements(gpu);
+}
+
+static void reg_fixattr_data(GPU* gpu, u32 param) {
+    fvec4* fattr;
+    bool immediatemode = false;
+    if (gpu->regs.geom.fixattr_idx == 0xf) {
+        if (gpu->immattrs.size == gpu->immattrs.cap) {
+            gpu->immattrs.cap = gpu->immattrs.cap ? 2 * gpu->immattrs.cap : 8;
+            gpu->immattrs.d =
+                realloc(gpu->immattrs.d, gpu->immattrs.cap * sizeof(fvec4));
+        }
+        fattr = &gpu->immattrs.d[gpu->immattrs.size];
+        immediatemode = true;
+    } else {
+        fattr = &gpu->fixattrs[gpu->regs.geom.fixattr_idx];
     }
-    linfo("command %03x (0x%08x) & %08x (%f)", id, param, mask, I2F(param));
-    gpu->regs.w[id] &= ~mask;
-    gpu->regs.w[id] |= param & mask;
-    switch (id) {
-        // this is a slow way to ensure texture cache coherency
-        // case GPUREG(tex.config):
-        //     if (gpu->regs.tex.config.clearcache) {
-        //         while (gpu->textures.size) {
-        //             TexInfo* t = LRU_eject(gpu->textures);
-        //             t->paddr = 0;
-        //             t->width = 0;
-        //             t->height = 0;
-        //         }
-        //     }
-        //     break;
-        case GPUREG(geom.drawarrays):
-            gpu_drawarrays(gpu);
+    switch (gpu->curfixi) {
+        case 0: {
+            (*fattr)[3] = cvtf24(param >> 8);
+            gpu->curfixattr = (param & 0xff) << 16;
+            gpu->curfixi = 1;
+            break;
+        }
+        case 1: {
+            (*fattr)[2] = cvtf24(param >> 16 | gpu->curfixattr);
+            gpu->curfixattr = (param & MASK(16)) << 8;
+            gpu->curfixi = 2;
             break;
-        case GPUREG(geom.drawelements):
-            gpu_drawelements(gpu);
+        }
+        case 2: {
+            (*fattr)[1] = cvtf24(param >> 24 | gpu->curfixattr);
+            (*fattr)[0] = cvtf24(param & MASK(24));
+            gpu->curfixi = 0;
+            if (immediatemode) gpu->immattrs.size++;
             break;
-        case GPUREG(geom.fixattr_data[0])... GPUREG(geom.fixattr_data[2]): {
-            fvec4* fattr;
-            bool immediatemode = false;
-            if (gpu->regs.geom.fixattr_idx == 0xf) {
-                if (gpu->immattrs.size == gpu->immattrs.cap) {
-                    gpu->immattrs.cap =
-                        gpu->immattrs.cap ? 2 * gpu->immattrs.cap : 8;
-                    gpu->immattrs.d = realloc(
-                        gpu->immattrs.d, gpu->immattrs.cap * sizeof(fvec4));
+        }
+    }
+}
+
+static void reg_start_draw_func0(GPU* gpu, u32 param) {
+    // this register must be written to after any draw call so we can
+    // use it to end an immediate draw call, since there is no explicit
+    // way to end an immediate mode draw call like glEnd
+    if (gpu->immattrs.size) {
+        gpu_drawimmediate(gpu);
+    }
+}
+
+// uploads any number of float uniform words, whole uniforms are converted
+// directly and partial ones go through the same state machine as single
+// register writes
+static void upload_floatuniforms(GPU* gpu, u32* data, u32 n) {
+    gpu->uniform_dirty = true;
+    u32 i = 0;
+    while (i < n) {
+        u32 idx = gpu->regs.vsh.floatuniform_idx;
+        if (idx >= 96) {
+            lwarn("writing to out of bound uniform");
+            return;
+        }
+        fvec4* uniform = &gpu->floatuniform[idx];
+        if (gpu->regs.vsh.floatuniform_mode) {
+            if (gpu->curunifi == 0 && n - i >= 4) {
+                for (int j = 0; j < 4; j++) {
+                    (*uniform)[3 - j] = I2F(data[i + j]);
                 }
-                fattr = &gpu->immattrs.d[gpu->immattrs.size];
-                immediatemode = true;
-            } else {
-                fattr = &gpu->fixattrs[gpu->regs.geom.fixattr_idx];
+                i += 4;
+                gpu->regs.vsh.floatuniform_idx++;
+                continue;
+            }
+            (*uniform)[3 - gpu->curunifi] = I2F(data[i++]);
+            if (++gpu->curunifi == 4) {
+                gpu->curunifi = 0;
+                gpu->regs.vsh.floatuniform_idx++;
+            }
+        } else {
+            if (gpu->curunifi == 0 && n - i >= 3) {
+                u32 a = data[i];
+                u32 b = data[i + 1];
+                u32 c = data[i + 2];
+                (*uniform)[3] = cvtf24(a >> 8);
+                (*uniform)[2] = cvtf24((a & 0xff) << 16 | b >> 16);
+                (*uniform)[1] = cvtf24((b & MASK(16)) << 8 | c >> 24);
+                (*uniform)[0] = cvtf24(c & MASK(24));
+                i += 3;
+                gpu->regs.vsh.floatuniform_idx++;
+                continue;
             }
-            switch (gpu->curfixi) {
+            u32 param = data[i++];
+            switch (gpu->curunifi) {
                 case 0: {
-                    (*fattr)[3] = cvtf24(param >> 8);
-                    gpu->curfixattr = (param & 0xff) << 16;
-                    gpu->curfixi = 1;
+                    (*uniform)[3] = cvtf24(param >> 8);
+                    gpu->curuniform = (param & 0xff) << 16;
+                    gpu->curunifi = 1;
                     break;
                 }
                 case 1: {
-                    (*fattr)[2] = cvtf24(param >> 16 | gpu->curfixattr);
-                    gpu->curfixattr = (param & MASK(16)) << 8;
-                    gpu->curfixi = 2;
+                    (*uniform)[2] = cvtf24(param >> 16 | gpu->curuniform);
+                    gpu->curuniform = (param & MASK(16)) << 8;
+                    gpu->curunifi = 2;
                     break;
                 }
                 case 2: {
-                    (*fattr)[1] = cvtf24(param >> 24 | gpu->curfixattr);
-                    (*fattr)[0] = cvtf24(param & MASK(24));
-                    gpu->curfixi = 0;
-                    if (immediatemode) gpu->immattrs.size++;
-                    break;
-                }
-            }
-            break;
-        }
-        case GPUREG(geom.start_draw_func0):
-            // this register must be written to after any draw call so we can
-            // use it to end an immediate draw call, since there is no explicit
-            // way to end an immediate mode draw call like glEnd
-            if (gpu->immattrs.size) {
-                gpu_drawimmediate(gpu);
-            }
-            break;
-        case GPUREG(vsh.floatuniform_data[0])... GPUREG(
-            vsh.floatuniform_data[7]): {
-            gpu->uniform_dirty = true;
-            u32 idx = gpu->regs.vsh.floatuniform_idx;
-            if (idx >= 96) {
-                lwarn("writing to out of bound uniform");
-                break;
-            }
-            fvec4* uniform = &gpu->floatuniform[idx];
-            if (gpu->regs.vsh.floatuniform_mode) {
-                (*uniform)[3 - gpu->curunifi] = I2F(param);
-                if (++gpu->curunifi == 4) {
+                    (*uniform)[1] = cvtf24(param >> 24 | gpu->curuniform);
+                    (*uniform)[0] = cvtf24(param & MASK(24));
                     gpu->curunifi = 0;
                     gpu->regs.vsh.floatuniform_idx++;
-                }
-            } else {
-                switch (gpu->curunifi) {
-                    case 0: {
-                        (*uniform)[3] = cvtf24(param >> 8);
-                        gpu->curuniform = (param & 0xff) << 16;
-                        gpu->curunifi = 1;
-                        break;
-                    }
-                    case 1: {
-                        (*uniform)[2] = cvtf24(param >> 16 | gpu->curuniform);
-                        gpu->curuniform = (param & MASK(16)) << 8;
-                        gpu->curunifi = 2;
-                        break;
-                    }
-                    case 2: {
-                        (*uniform)[1] = cvtf24(param >> 24 | gpu->curuniform);
-                        (*uniform)[0] = cvtf24(param & MASK(24));
-                        gpu->curunifi = 0;
-                        gpu->regs.vsh.floatuniform_idx++;
-                        break;
-                    }
+                    break;
                 }
             }
-            break;
         }
-        case GPUREG(vsh.intuniform[0])... GPUREG(vsh.intuniform[3]):
-        case GPUREG(vsh.booluniform):
-            gpu->uniform_dirty = true;
-            break;
-        case GPUREG(vsh.entrypoint):
-        case GPUREG(raster.sh_outmap[0])... GPUREG(raster.sh_outmap[6]):
-            // entrypoint and outmap both affect the decompiled vs
-            gpu->sh_dirty = true;
-            break;
-        case GPUREG(vsh.codetrans_data[0])... GPUREG(vsh.codetrans_data[8]):
-            gpu->sh_dirty = true;
-            gpu->progdata[gpu->regs.vsh.codetrans_idx++ % SHADER_CODE_SIZE] =
-                param;
-            break;
-        case GPUREG(vsh.opdescs_data[0])... GPUREG(vsh.opdescs_data[8]):
-            gpu->sh_dirty = true;
-            gpu->opdescs[gpu->regs.vsh.opdescs_idx++ % SHADER_OPDESC_SIZE] =
-                param;
-            break;
-        case GPUREG(geom.restart_primitive):
-            Vec_free(gpu->immattrs);
-            break;
     }
 }
 
-#define NESTED_CMDLIST()                                                       \
-    ({                                                                         \
-        switch (c.id) {                                                        \
-            case GPUREG(geom.cmdbuf.jmp[0]):                                   \
-                gpu_run_command_list(gpu, gpu->regs.geom.cmdbuf.addr[0] << 3,  \
-                                     gpu->regs.geom.cmdbuf.size[0] << 3);      \
-                return;                                                        \
-            case GPUREG(geom.cmdbuf.jmp[1]):                                   \
-                gpu_run_command_list(gpu, gpu->regs.geom.cmdbuf.addr[1] << 3,  \
-                                     gpu->regs.geom.cmdbuf.size[1] << 3);      \
-                return;                                                        \
-        }                                                                      \
-    })
+static void upload_words(u32* dst, u32 dstsize, u32* idx, u32* data, u32 n) {
+    while (n) {
+        u32 i = *idx % dstsize;
+        u32 cnt = dstsize - i < n ? dstsize - i : n;
+        memcpy(&dst[i], data, cnt * sizeof(u32));
+        *idx += cnt;
+        data += cnt;
+        n -= cnt;
+    }
+}
 
-void gpu_run_command_list(GPU* gpu, u32 paddr, u32 size) {
-    paddr &= ~15;
-    size &= ~15;
+static void upload_code(GPU* gpu, u32* data, u32 n) {
+    gpu->sh_dirty = true;
+    upload_words(gpu->progdata, SHADER_CODE_SIZE, &gpu->regs.vsh.codetrans_idx,
+                 data, n);
+}
 
-    u32* cmds = PTR(paddr);
+static void upload_opdescs(GPU* gpu, u32* data, u32 n) {
+    gpu->sh_dirty = true;
+    upload_words(gpu->opdescs, SHADER_OPDESC_SIZE, &gpu->regs.vsh.opdescs_idx,
+                 data, n);
+}
+
+static void reg_floatuniform_data(GPU* gpu, u32 param) {
+    upload_floatuniforms(gpu, &param, 1);
+}
+
+static void reg_uniform_dirty(GPU* gpu, u32 param) {
+    gpu->uniform_dirty = true;
+}
+
+static void reg_sh_dirty(GPU* gpu, u32 param) {
+    // entrypoint and outmap both affect the decompiled vs
+    gpu->sh_dirty = true;
+}
+
+static void reg_codetrans_data(GPU* gpu, u32 param) {
+    upload_code(gpu, &param, 1);
+}
+
+static void reg_opdescs_data(GPU* gpu, u32 param) {
+    upload_opdescs(gpu, &param, 1);
+}
+
+static void reg_restart_primitive(GPU* gpu, u32 param) {
+    Vec_free(gpu->immattrs);
+}
+
+// registers with side effects when written, any other register just stores
+// the value
+static const RegHandler reg_handlers[GPUREG_MAX] = {
+    [GPUREG(geom.drawarrays)] = reg_drawarrays,
+    [GPUREG(geom.drawelements)] = reg_drawelements,
+    [GPUREG(geom.fixattr_data[0])... GPUREG(geom.fixattr_data[2])] =
+        reg_fixattr_data,
+    [GPUREG(geom.start_draw_func0)] = reg_start_draw_func0,
+    [GPUREG(vsh.floatuniform_data[0])... GPUREG(vsh.floatuniform_data[7])] =
+        reg_floatuniform_data,
+    [GPUREG(vsh.intuniform[0])... GPUREG(vsh.intuniform[3])] =
+        reg_uniform_dirty,
+    [GPUREG(vsh.booluniform)] = reg_uniform_dirty,
+    [GPUREG(vsh.entrypoint)] = reg_sh_dirty,
+    [GPUREG(raster.sh_outmap[0])... GPUREG(raster.sh_outmap[6])] =
+        reg_sh_dirty,
+    [GPUREG(vsh.codetrans_data[0])... GPUREG(vsh.codetrans_data[8])] =
+        reg_codetrans_data,
+    [GPUREG(vsh.opdescs_data[0])... GPUREG(vsh.opdescs_data[8])] =
+        reg_opdescs_data,
+    [GPUREG(geom.restart_primitive)] = reg_restart_primitive,
+};
+
+void gpu_write_internalreg(GPU* gpu, u16 id, u32 param, u32 mask) {
+    if (id >= GPUREG_MAX) {
+        lerror("out of bounds gpu reg");
+        return;
+    }
+    linfo("command %03x (0x%08x) & %08x (%f)", id, param, mask, I2F(param));
+    gpu->regs.w[id] &= ~mask;
+    gpu->regs.w[id] |= param & mask;
+    if (reg_handlers[id]) reg_handlers[id](gpu, param);
+}
+
+static bool is_jump(u16 id) {
+    return id == GPUREG(geom.cmdbuf.jmp[0]) || id == GPUREG(geom.cmdbuf.jmp[1]);
+}
+
+static void run_jump(GPU* gpu, u16 id) {
+    int i = id - GPUREG(geom.cmdbuf.jmp[0]);
+    gpu_run_command_list(gpu, gpu->regs.geom.cmdbuf.addr[i] << 3,
+                         gpu->regs.geom.cmdbuf.size[i] << 3);
+}
+
+// the registers which can be uploaded in bulk if written with a full mask
+static int bulk_op(u16 id, u32 mask) {
+    if (mask != 0xffffffff) return CMD_WRITE;
+    if (GPUREG(vsh.floatuniform_data[0]) <= id &&
+        id <= GPUREG(vsh.floatuniform_data[7]))
+        return CMD_UNIFORMS;
+    if (GPUREG(vsh.codetrans_data[0]) <= id &&
+        id <= GPUREG(vsh.codetrans_data[8]))
+        return CMD_CODE;
+    if (GPUREG(vsh.opdescs_data[0]) <= id && id <= GPUREG(vsh.opdescs_data[8]))
+        return CMD_OPDESCS;
+    return CMD_WRITE;
+}
+
+static void decode_write(CmdListCacheEntry* ent, u16 id, u32 param, u32 mask) {
+    if (id >= GPUREG_MAX) {
+        lerror("out of bounds gpu reg");
+        return;
+    }
+    int op = bulk_op(id, mask);
+    if (op != CMD_WRITE) {
+        // consecutive words for the same bulk register are merged
+        if (ent->cmds.size && ent->cmds.d[ent->cmds.size - 1].op == op) {
+            ent->cmds.d[ent->cmds.size - 1].id = id;
+            ent->cmds.d[ent->cmds.size - 1].param++;
+        } else {
+            Vec_push(ent->cmds, ((DecodedCmd) {.op = op,
+                                               .id = id,
+                                               .param = 1,
+                                               .off = ent->data.size}));
+        }
+        Vec_push(ent->data, param);
+        return;
+    }
+    Vec_push(ent->cmds, ((DecodedCmd) {.op = CMD_WRITE,
+                                       .id = id,
+                                       .mask = mask,
+                                       .param = param,
+                                       .handler = reg_handlers[id]}));
+}
+
+static void decode_command_list(CmdListCacheEntry* ent, u32* cmds, u32 size) {
+    ent->cmds.size = 0;
+    ent->data.size = 0;
 
     u32* cur = cmds;
     u32* end = cmds + (size / 4);
@@ -231,15 +347,21 @@ void gpu_run_command_list(GPU* gpu, u32 paddr, u32 size) {
         if (c.mask & BIT(2)) mask |= 0xff << 16;
         if (c.mask & BIT(3)) mask |= 0xff << 24;
 
-        // nested command lists are jumps, so we need to handle them over here
-        // to avoid possible stack overflow
-        NESTED_CMDLIST();
-        gpu_write_internalreg(gpu, c.id, cur[0], mask);
+        // nested command lists are jumps so nothing after them runs
+        if (is_jump(c.id)) {
+            Vec_push(ent->cmds, ((DecodedCmd) {.op = CMD_JUMP, .id = c.id}));
+            return;
+        }
+        decode_write(ent, c.id, cur[0], mask);
         cur += 2;
         if (c.incmode) c.id++;
         for (int i = 0; i < c.nparams; i++) {
-            NESTED_CMDLIST();
-            gpu_write_internalreg(gpu, c.id, *cur++, mask);
+            if (is_jump(c.id)) {
+                Vec_push(ent->cmds,
+                         ((DecodedCmd) {.op = CMD_JUMP, .id = c.id}));
+                return;
+            }
+            decode_write(ent, c.id, *cur++, mask);
             if (c.incmode) c.id++;
         }
         // each command must be 8 byte aligned
@@ -247,6 +369,58 @@ void gpu_run_command_list(GPU* gpu, u32 paddr, u32 size) {
     }
 }
 
+static void run_decoded(GPU* gpu, CmdListCacheEntry* ent) {
+    for (int i = 0; i < ent->cmds.size; i++) {
+        DecodedCmd* c = &ent->cmds.d[i];
+        switch (c->op) {
+            case CMD_WRITE:
+                linfo("command %03x (0x%08x) & %08x (%f)", c->id, c->param,
+                      c->mask, I2F(c->param));
+                gpu->regs.w[c->id] &= ~c->mask;
+                gpu->regs.w[c->id] |= c->param & c->mask;
+                if (c->handler) c->handler(gpu, c->param);
+                break;
+            case CMD_UNIFORMS:
+                gpu->regs.w[c->id] = ent->data.d[c->off + c->param - 1];
+                upload_floatuniforms(gpu, &ent->data.d[c->off], c->param);
+                break;
+            case CMD_CODE:
+                gpu->regs.w[c->id] = ent->data.d[c->off + c->param - 1];
+                upload_code(gpu, &ent->data.d[c->off], c->param);
+                break;
+            case CMD_OPDESCS:
+                gpu->regs.w[c->id] = ent->data.d[c->off + c->param - 1];
+                upload_opdescs(gpu, &ent->data.d[c->off], c->param);
+                break;
+            case CMD_JUMP:
+                run_jump(gpu, c->id);
+                return;
+        }
+    }
+}
+
+// games resubmit mostly the same command lists every frame, so they are
+// decoded once and cached by address and contents
+void gpu_run_command_list(GPU* gpu, u32 paddr, u32 size) {
+    TRACE_SCOPE("gpu_run_command_list");
+    paddr &= ~15;
+    size &= ~15;
+
+    if (gpu->capture) gpucapture_mem(gpu, paddr, size);
+
+    u32* cmds = PTR(paddr);
+
+    u64 key = XXH3_64bits_withSeed(cmds, size, (u64) size << 32 | paddr);
+    if (!key) key = 1;
+    auto ent = LRU_load(gpu->cmdlists, key);
+    if (ent->key != key) {
+        ent->key = key;
+        decode_command_list(ent, cmds, size);
+    }
+
+    run_decoded(gpu, ent);
+}
+
 // searches the framebuffer cache and return nullptr if not found
 FBInfo* fbcache_find(GPU* gpu, u32 color_paddr) {
     FBInfo* newfb = nullptr;
@@ -310,6 +484,13 @@ void gpu_display_transfer(GPU* gpu, u32 paddr, int yoff, bool scalex,
     linfo("display transfer fb at %x to %s", paddr,
           screenid == SCREEN_TOP ? "top" : "bot");
 
+    if (ctremu.swrenderer) {
+        renderer_sw_display(&gpu->sw, fb->color_paddr, fb->width, fb->height,
+                            fb->color_fmt, yoff + yoffsrc, scalex, scaley,
+                            screenid);
+        return;
+    }
+
     glBindTexture(GL_TEXTURE_2D, gpu->gl.screentex[screenid]);
     glBindFramebuffer(GL_READ_FRAMEBUFFER, fb->fbo);
 
@@ -330,7 +511,9 @@ void gpu_texture_copy(GPU* gpu, u32 srcpaddr, u32 dstpaddr, u32 size,
 
     linfo("texture copy from %x to %x size=%d", srcpaddr, dstpaddr, size);
 
-    if (srcfb && dsttex) {
+    // the software renderer keeps framebuffers in emulated memory so
+    // the copy below already sees the rendered data
+    if (srcfb && dsttex && !ctremu.swrenderer) {
         // do a hardware copy
 
         linfo("copying from fb at %x to texture at %x", srcfb->color_paddr,
@@ -392,7 +575,12 @@ void gpu_texture_copy(GPU* gpu, u32 srcpaddr, u32 dstpaddr, u32 size,
     }
 }
 
-void gpu_clear_fb(GPU* gpu, u32 paddr, u32 color) {
+void gpu_clear_fb(GPU* gpu, u32 paddr, u32 endpaddr, u32 color, int Bpp) {
+    if (ctremu.swrenderer) {
+        renderer_sw_fill(&gpu->sw, paddr, endpaddr, color, Bpp);
+        return;
+    }
+
     // some of the current gl state can affect gl clear
     // so we need to reset it
     glDisable(GL_SCISSOR_TEST);
@@ -434,6 +622,19 @@ void update_cur_fb(GPU* gpu) {
         gpu->curfb->width == w && gpu->curfb->height == h)
         return;
 
+    if (ctremu.swrenderer) {
+        // only the dimensions are needed to find the fb for display transfers
+        auto curfb = LRU_load(gpu->fbs, gpu->regs.fb.colorbuf_loc << 3);
+        curfb->color_paddr = gpu->regs.fb.colorbuf_loc << 3;
+        curfb->depth_paddr = gpu->regs.fb.depthbuf_loc << 3;
+        curfb->color_fmt = gpu->regs.fb.colorbuf_fmt.fmt;
+        curfb->color_Bpp = gpu->regs.fb.colorbuf_fmt.size + 2;
+        curfb->width = w;
+        curfb->height = h;
+        gpu->curfb = curfb;
+        return;
+    }
+
     // little hack to make arisoturas sm64 port work
     // it clears the depthbuffer by binding it as the colorbuffer
     // and drawing on it
@@ -691,6 +892,7 @@ void load_tex_image(void* rawdata, int w, int h, int level, int fmt) {
 }
 
 void load_texture(GPU* gpu, int id, TexUnitRegs* regs, u32 fmt) {
+    TRACE_SCOPE("load_texture");
 
     FBInfo* fb = fbcache_find(gpu, regs->addr << 3);
     glActiveTexture(GL_TEXTURE0 + id);
@@ -779,7 +981,59 @@ void load_texenv(UberUniforms* ubuf, FragUniforms* fbuf, int i,
     ubuf->tev[i].a.scale = 1 << (regs->scale.a);
 }
 
-void update_gl_state(GPU* gpu) {
+// fills in the fragment state shared by the gl and software renderers
+void gpu_load_frag_uniforms(GPU* gpu, UberUniforms* ubuf, FragUniforms* fbuf) {
+    ubuf->tex2coord = gpu->regs.tex.config.tex2coord;
+
+    load_texenv(ubuf, fbuf, 0, &gpu->regs.tex.tev0);
+    load_texenv(ubuf, fbuf, 1, &gpu->regs.tex.tev1);
+    load_texenv(ubuf, fbuf, 2, &gpu->regs.tex.tev2);
+    load_texenv(ubuf, fbuf, 3, &gpu->regs.tex.tev3);
+    load_texenv(ubuf, fbuf, 4, &gpu->regs.tex.tev4);
+    load_texenv(ubuf, fbuf, 5, &gpu->regs.tex.tev5);
+    ubuf->tev_update_rgb = gpu->regs.tex.tev_buffer.update_rgb;
+    ubuf->tev_update_alpha = gpu->regs.tex.tev_buffer.update_alpha;
+    COPYRGBA(fbuf->tev_buffer_color, gpu->regs.tex.tev5.buffer_color);
+
+    ubuf->alphatest = gpu->regs.fb.alpha_test.enable;
+    ubuf->alphafunc = gpu->regs.fb.alpha_test.func;
+    fbuf->alpharef = (float) gpu->regs.fb.alpha_test.ref / 255;
+
+    ubuf->numlights = gpu->regs.lighting.numlights + 1;
+    for (int i = 0; i < ubuf->numlights; i++) {
+        // TODO: handle light permutation
+        COPYRGB(fbuf->light[i].specular0,
+                gpu->regs.lighting.light[i].specular0);
+        COPYRGB(fbuf->light[i].specular1,
+                gpu->regs.lighting.light[i].specular1);
+        COPYRGB(fbuf->light[i].diffuse, gpu->regs.lighting.light[i].diffuse);
+        COPYRGB(fbuf->light[i].ambient, gpu->regs.lighting.light[i].ambient);
+        fbuf->light[i].vec[0] = cvtf16(gpu->regs.lighting.light[i].vec.x);
+        fbuf->light[i].vec[1] = cvtf16(gpu->regs.lighting.light[i].vec.y);
+        fbuf->light[i].vec[2] = cvtf16(gpu->regs.lighting.light[i].vec.z);
+        ubuf->light[i].config = gpu->regs.lighting.light[i].config;
+    }
+    COPYRGB(fbuf->ambient_color, gpu->regs.lighting.ambient);
+}
+
+// binds the program for these shaders, only generating and compiling the
+// shaders themselves if the program is not cached in memory or on disk
+static bool load_prog(GPU* gpu, u64 vshash, u64 fshash, UberUniforms* ubuf) {
+    auto ent = gpu_gl_find_prog(&gpu->gl, vshash, fshash);
+    if (!ent->prog) {
+        GLuint vs = vshash == gpu->gl.gpu_vs_hash
+                        ? gpu->gl.gpu_vs
+                        : shader_dec_get(gpu, vshash);
+        GLuint fs = fshash == gpu->gl.gpu_uberfs_hash
+                        ? gpu->gl.gpu_uberfs
+                        : shader_gen_get(gpu, ubuf, fshash);
+        gpu_gl_link_prog(&gpu->gl, ent, vs, fs);
+    }
+    return gpu_gl_use_prog(&gpu->gl, ent);
+}
+
+// returns whether the draw should use the hardware vertex shader
+bool update_gl_state(GPU* gpu) {
 
     update_cur_fb(gpu);
 
@@ -831,8 +1085,6 @@ void update_gl_state(GPU* gpu) {
         glDepthRangef(1, 0);
     }
 
-    ubuf.tex2coord = gpu->regs.tex.config.tex2coord;
-
     if (gpu->regs.tex.config.tex0enable) {
         load_texture(gpu, 0, &gpu->regs.tex.tex0, gpu->regs.tex.tex0_fmt);
     }
@@ -843,18 +1095,11 @@ void update_gl_state(GPU* gpu) {
         load_texture(gpu, 2, &gpu->regs.tex.tex2, gpu->regs.tex.tex2_fmt);
     }
 
-    load_texenv(&ubuf, &fbuf, 0, &gpu->regs.tex.tev0);
-    load_texenv(&ubuf, &fbuf, 1, &gpu->regs.tex.tev1);
-    load_texenv(&ubuf, &fbuf, 2, &gpu->regs.tex.tev2);
-    load_texenv(&ubuf, &fbuf, 3, &gpu->regs.tex.tev3);
-    load_texenv(&ubuf, &fbuf, 4, &gpu->regs.tex.tev4);
-    load_texenv(&ubuf, &fbuf, 5, &gpu->regs.tex.tev5);
-    ubuf.tev_update_rgb = gpu->regs.tex.tev_buffer.update_rgb;
-    ubuf.tev_update_alpha = gpu->regs.tex.tev_buffer.update_alpha;
-    COPYRGBA(fbuf.tev_buffer_color, gpu->regs.tex.tev5.buffer_color);
+    gpu_load_frag_uniforms(gpu, &ubuf, &fbuf);
 
     if (gpu->regs.fb.color_op.frag_mode != 0) {
-        return; // shadows or gas, ignore these for now
+        // shadows or gas, ignore these for now
+        return ctremu.hwvshaders && !gpu->gl.vs_fallback;
     }
     if (gpu->regs.fb.color_op.blend_mode) {
         glDisable(GL_COLOR_LOGIC_OP);
@@ -875,10 +1120,6 @@ void update_gl_state(GPU* gpu) {
         glLogicOp(logic_ops[gpu->regs.fb.logic_op]);
     }
 
-    ubuf.alphatest = gpu->regs.fb.alpha_test.enable;
-    ubuf.alphafunc = gpu->regs.fb.alpha_test.func;
-    fbuf.alpharef = (float) gpu->regs.fb.alpha_test.ref / 255;
-
     if (gpu->regs.fb.stencil_test.enable) {
         glEnable(GL_STENCIL_TEST);
         if (gpu->regs.fb.perms.depthbuf.write) {
@@ -920,21 +1161,7 @@ void update_gl_state(GPU* gpu) {
         glDepthFunc(GL_ALWAYS);
     }
 
-    ubuf.numlights = gpu->regs.lighting.numlights + 1;
-    for (int i = 0; i < ubuf.numlights; i++) {
-        // TODO: handle light permutation
-        COPYRGB(fbuf.light[i].specular0, gpu->regs.lighting.light[i].specular0);
-        COPYRGB(fbuf.light[i].specular1, gpu->regs.lighting.light[i].specular1);
-        COPYRGB(fbuf.light[i].diffuse, gpu->regs.lighting.light[i].diffuse);
-        COPYRGB(fbuf.light[i].ambient, gpu->regs.lighting.light[i].ambient);
-        fbuf.light[i].vec[0] = cvtf16(gpu->regs.lighting.light[i].vec.x);
-        fbuf.light[i].vec[1] = cvtf16(gpu->regs.lighting.light[i].vec.y);
-        fbuf.light[i].vec[2] = cvtf16(gpu->regs.lighting.light[i].vec.z);
-        ubuf.light[i].config = gpu->regs.lighting.light[i].config;
-    }
-    COPYRGB(fbuf.ambient_color, gpu->regs.lighting.ambient);
-
-    GLuint vs;
+    u64 vshash = gpu->gl.gpu_vs_hash;
     if (ctremu.hwvshaders) {
         if (gpu->uniform_dirty) {
             gpu->uniform_dirty = false;
@@ -952,28 +1179,50 @@ void update_gl_state(GPU* gpu) {
                          GL_DYNAMIC_DRAW);
         }
         if (gpu->sh_dirty) {
-            vs = shader_dec_get(gpu);
-        } else {
-            vs = LRU_mru(gpu->vshaders_hw)->vs;
+            gpu->vsh_hash = shader_dec_hash(gpu);
         }
-    } else {
-        vs = gpu->gl.gpu_vs;
+        vshash = gpu->vsh_hash;
     }
 
     // todo: do similar dirty checking for the fs
     glBindBuffer(GL_UNIFORM_BUFFER, gpu->gl.frag_ubo);
     glBufferData(GL_UNIFORM_BUFFER, sizeof fbuf, &fbuf, GL_STREAM_DRAW);
 
-    GLuint fs;
+    u64 fshash;
     if (ctremu.ubershader) {
         glBindBuffer(GL_UNIFORM_BUFFER, gpu->gl.uber_ubo);
         glBufferData(GL_UNIFORM_BUFFER, sizeof ubuf, &ubuf, GL_STREAM_DRAW);
-        fs = gpu->gl.gpu_uberfs;
+        fshash = gpu->gl.gpu_uberfs_hash;
     } else {
-        fs = shader_gen_get(gpu, &ubuf);
+        fshash = shader_gen_hash(&ubuf);
+    }
+
+    bool hwvsh = ctremu.hwvshaders;
+    if (!load_prog(gpu, vshash, fshash, &ubuf)) {
+        // the specialized program is still compiling so draw with the
+        // ubershader and if needed the software vertex shader for now
+        if (fshash != gpu->gl.gpu_uberfs_hash) {
+            glBindBuffer(GL_UNIFORM_BUFFER, gpu->gl.uber_ubo);
+            glBufferData(GL_UNIFORM_BUFFER, sizeof ubuf, &ubuf,
+                         GL_STREAM_DRAW);
+        }
+        if (!load_prog(gpu, vshash, gpu->gl.gpu_uberfs_hash, &ubuf)) {
+            load_prog(gpu, gpu->gl.gpu_vs_hash, gpu->gl.gpu_uberfs_hash,
+                      &ubuf);
+            hwvsh = false;
+        }
+    }
+    if (ctremu.hwvshaders && gpu->gl.async_shaders) {
+        gpu->gl.vs_fallback = !hwvsh;
+        if (hwvsh) {
+            glBindVertexArray(gpu->gl.gpu_vao);
+        } else {
+            glBindVertexArray(gpu->gl.gpu_sw_vao);
+            glBindBuffer(GL_ARRAY_BUFFER, gpu->gl.gpu_vbos[0]);
+        }
     }
 
-    gpu_gl_load_prog(&gpu->gl, vs, fs);
+    return hwvsh;
 }
 
 typedef struct {
@@ -1136,10 +1385,26 @@ void init_vsh(GPU* gpu, ShaderUnit* shu) {
     shu->c = gpu->floatuniform;
     shu->i = gpu->regs.vsh.intuniform;
     shu->b = gpu->regs.vsh.booluniform;
+    shu->prog = gpu->vsh_runner.prog;
+}
+
+// the decoded program depends on the operand descriptors as well as the code
+static ShaderProg* get_vsh_prog(GPU* gpu, ShaderUnit* shu) {
+    u64 hash = XXH3_64bits_withSeed(
+        shu->code, SHADER_CODE_SIZE * sizeof(PICAInstr),
+        XXH3_64bits(shu->opdescs, SHADER_OPDESC_SIZE * sizeof(OpDesc)));
+    auto block = LRU_load(gpu->vshaders_interp, hash);
+    if (block->hash != hash) {
+        block->hash = hash;
+        pica_shader_free(block->prog);
+        block->prog = pica_shader_decode(shu);
+    }
+    return block->prog;
 }
 
 void vsh_run_range(GPU* gpu, AttrConfig cfg, int srcoff, int dstoff, int count,
                    Vertex* vbuf) {
+    TRACE_SCOPE("vsh_run_range");
     ShaderUnit vsh;
     init_vsh(gpu, &vsh);
     for (int i = 0; i < count; i++) {
@@ -1151,6 +1416,7 @@ void vsh_run_range(GPU* gpu, AttrConfig cfg, int srcoff, int dstoff, int count,
 
 void vsh_thrd_func(GPU* gpu) {
     int id = gpu->vsh_runner.cur++;
+    trace_thread_name("vsh");
 
     while (true) {
         while (!gpu->vsh_runner.thread[id].ready) {
@@ -1202,14 +1468,23 @@ void gpu_vshrunner_destroy(GPU* gpu) {
 }
 
 void dispatch_vsh(GPU* gpu, void* attrcfg, int base, int count, void* vbuf) {
+    TRACE_SCOPE("dispatch_vsh");
     if (ctremu.shaderjit) {
         if (gpu->sh_dirty) {
+            TRACE_SCOPE("shaderjit_get");
             ShaderUnit shu;
             init_vsh(gpu, &shu);
             gpu->vsh_runner.shaderfunc = shaderjit_get(gpu, &shu);
             gpu->sh_dirty = false;
         }
     } else {
+        if (gpu->sh_dirty) {
+            TRACE_SCOPE("shader_decode");
+            ShaderUnit shu;
+            init_vsh(gpu, &shu);
+            gpu->vsh_runner.prog = get_vsh_prog(gpu, &shu);
+            gpu->sh_dirty = false;
+        }
         gpu->vsh_runner.shaderfunc = pica_shader_exec;
     }
 
@@ -1314,16 +1589,40 @@ void gpu_drawarrays(GPU* gpu) {
     linfo("drawing arrays nverts=%d primmode=%d", gpu->regs.geom.nverts,
           gpu->regs.geom.prim_config.mode);
 
-    update_gl_state(gpu);
+    if (gpu->capture) {
+        gpucapture_draw(gpu, gpu->regs.geom.vtx_off, gpu->regs.geom.nverts);
+    }
+    GPUPROF_START(gpu);
 
-    if (ctremu.hwvshaders) {
+    if (ctremu.swrenderer) {
+        update_cur_fb(gpu);
+        GPUPROF_MARK(gpu, state);
+        AttrConfig cfg;
+        vtx_loader_setup(gpu, cfg);
+        Vertex vbuf[gpu->regs.geom.nverts];
+        dispatch_vsh(gpu, cfg, gpu->regs.geom.vtx_off, gpu->regs.geom.nverts,
+                     vbuf);
+        GPUPROF_MARK(gpu, vtx);
+        renderer_sw_draw(&gpu->sw, vbuf, nullptr, gpu->regs.geom.nverts);
+        GPUPROF_MARK(gpu, draw);
+        if (gpu->prof) gpu->prof->ndraws++;
+        return;
+    }
+
+    bool hwvsh = update_gl_state(gpu);
+    GPUPROF_MARK(gpu, state);
+
+    if (hwvsh) {
         setup_vbos_hw(gpu, gpu->regs.geom.vtx_off, gpu->regs.geom.nverts);
     } else {
         setup_vbos_sw(gpu, gpu->regs.geom.vtx_off, gpu->regs.geom.nverts);
     }
+    GPUPROF_MARK(gpu, vtx);
 
     glDrawArrays(prim_mode[gpu->regs.geom.prim_config.mode], 0,
                  gpu->regs.geom.nverts);
+    GPUPROF_MARK(gpu, draw);
+    if (gpu->prof) gpu->prof->ndraws++;
 }
 
 static const GLuint indextypes[2] = {GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT};
@@ -1332,11 +1631,11 @@ void gpu_drawelements(GPU* gpu) {
     linfo("drawing elements nverts=%d primmode=%d", gpu->regs.geom.nverts,
           gpu->regs.geom.prim_config.mode);
 
-    update_gl_state(gpu);
+    GPUPROF_START(gpu);
 
     u32 minind = 0xffff, maxind = 0;
-    void* indexbuf =
-        PTR(gpu->regs.geom.attr_base * 8 + gpu->regs.geom.indexbufoff);
+    u32 indexpaddr = gpu->regs.geom.attr_base * 8 + gpu->regs.geom.indexbufoff;
+    void* indexbuf = PTR(indexpaddr);
     for (int i = 0; i < gpu->regs.geom.nverts; i++) {
         int idx;
         if (gpu->regs.geom.indexfmt) {
@@ -1347,19 +1646,54 @@ void gpu_drawelements(GPU* gpu) {
         if (idx < minind) minind = idx;
         if (idx > maxind) maxind = idx;
     }
+
+    if (gpu->capture) {
+        gpucapture_mem(gpu, indexpaddr,
+                       gpu->regs.geom.nverts << gpu->regs.geom.indexfmt);
+        gpucapture_draw(gpu, minind, maxind + 1 - minind);
+    }
+
+    if (ctremu.swrenderer) {
+        update_cur_fb(gpu);
+        GPUPROF_MARK(gpu, state);
+        AttrConfig cfg;
+        vtx_loader_setup(gpu, cfg);
+        Vertex vbuf[maxind + 1 - minind];
+        dispatch_vsh(gpu, cfg, minind, maxind + 1 - minind, vbuf);
+        u16 indices[gpu->regs.geom.nverts];
+        for (int i = 0; i < gpu->regs.geom.nverts; i++) {
+            if (gpu->regs.geom.indexfmt) {
+                indices[i] = ((u16*) indexbuf)[i] - minind;
+            } else {
+                indices[i] = ((u8*) indexbuf)[i] - minind;
+            }
+        }
+        GPUPROF_MARK(gpu, vtx);
+        renderer_sw_draw(&gpu->sw, vbuf, indices, gpu->regs.geom.nverts);
+        GPUPROF_MARK(gpu, draw);
+        if (gpu->prof) gpu->prof->ndraws++;
+        return;
+    }
+
+    bool hwvsh = update_gl_state(gpu);
+    GPUPROF_MARK(gpu, state);
+
     glBufferData(GL_ELEMENT_ARRAY_BUFFER,
                  gpu->regs.geom.nverts * BIT(gpu->regs.geom.indexfmt), indexbuf,
                  GL_STREAM_DRAW);
 
-    if (ctremu.hwvshaders) {
+    if (hwvsh) {
         setup_vbos_hw(gpu, minind, maxind + 1 - minind);
     } else {
         setup_vbos_sw(gpu, minind, maxind + 1 - minind);
     }
+    GPUPROF_MARK(gpu, vtx);
 
     glDrawElementsBaseVertex(prim_mode[gpu->regs.geom.prim_config.mode],
                              gpu->regs.geom.nverts,
                              indextypes[gpu->regs.geom.indexfmt], 0, -minind);
+    GPUPROF_MARK(gpu, draw);
+    if (gpu->prof) gpu->prof->ndraws++;
 }
 
 void gpu_drawimmediate(GPU* gpu) {
@@ -1369,9 +1703,29 @@ void gpu_drawimmediate(GPU* gpu) {
     linfo("drawing immediate mode nverts=%d primmode=%d", nverts,
           gpu->regs.geom.prim_config.mode);
 
-    update_gl_state(gpu);
+    // immediate mode vertices are in the command list itself
+    if (gpu->capture) gpucapture_draw(gpu, 0, 0);
+    GPUPROF_START(gpu);
 
-    if (ctremu.hwvshaders) {
+    if (ctremu.swrenderer) {
+        update_cur_fb(gpu);
+        GPUPROF_MARK(gpu, state);
+        AttrConfig cfg;
+        vtx_loader_imm_setup(gpu, cfg);
+        Vertex vbuf[nverts];
+        dispatch_vsh(gpu, cfg, 0, nverts, vbuf);
+        GPUPROF_MARK(gpu, vtx);
+        renderer_sw_draw(&gpu->sw, vbuf, nullptr, nverts);
+        GPUPROF_MARK(gpu, draw);
+        if (gpu->prof) gpu->prof->ndraws++;
+        Vec_free(gpu->immattrs);
+        return;
+    }
+
+    bool hwvsh = update_gl_state(gpu);
+    GPUPROF_MARK(gpu, state);
+
+    if (hwvsh) {
         setup_fixattrs_hw(gpu);
         // only need to use one vbo
         glBindBuffer(GL_ARRAY_BUFFER, gpu->gl.gpu_vbos[0]);
@@ -1391,8 +1745,11 @@ void gpu_drawimmediate(GPU* gpu) {
         dispatch_vsh(gpu, cfg, 0, nverts, vbuf);
         glBufferData(GL_ARRAY_BUFFER, sizeof vbuf, vbuf, GL_STREAM_DRAW);
     }
+    GPUPROF_MARK(gpu, vtx);
 
     glDrawArrays(prim_mode[gpu->regs.geom.prim_config.mode], 0, nverts);
+    GPUPROF_MARK(gpu, draw);
+    if (gpu->prof) gpu->prof->ndraws++;
 
     Vec_free(gpu->immattrs);
 }
\ No newline at end of file
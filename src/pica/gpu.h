@@ -7,8 +7,10 @@
 #include "common.h"
 #include "kernel/memory.h"
 
+#include "gpucapture.h"
 #include "gpuregs.h"
 #include "renderer_gl.h"
+#include "renderer_sw.h"
 #include "shader.h"
 #include "shaderdec.h"
 #include "shadergen.h"
@@ -16,7 +18,7 @@
 
 #define MAX_VSH_THREADS 16
 
-typedef union {
+typedef union _Vertex {
     float semantics[24];
     struct {
         fvec4 pos;
@@ -65,6 +67,40 @@ typedef struct _TexInfo {
     u32 tex;
 } TexInfo;
 
+#define CMDLIST_MAX 64
+
+typedef struct _GPU GPU;
+
+typedef void (*RegHandler)(GPU* gpu, u32 param);
+
+enum {
+    CMD_WRITE,
+    CMD_UNIFORMS,
+    CMD_CODE,
+    CMD_OPDESCS,
+    CMD_JUMP,
+};
+
+typedef struct {
+    u16 op;
+    u16 id;
+    u32 mask;
+    // the value for writes, or the number of words for bulk uploads
+    u32 param;
+    // offset of the words in data for bulk uploads
+    u32 off;
+    RegHandler handler;
+} DecodedCmd;
+
+typedef struct _CmdListCacheEntry {
+    u64 key;
+
+    Vector(DecodedCmd) cmds;
+    Vector(u32) data;
+
+    struct _CmdListCacheEntry *next, *prev;
+} CmdListCacheEntry;
+
 typedef struct _GPU {
 
 #ifdef FASTMEM
@@ -77,6 +113,7 @@ typedef struct _GPU {
     u32 opdescs[SHADER_OPDESC_SIZE];
     u32 sh_idx;
     bool sh_dirty;
+    u64 vsh_hash;
 
     fvec4 fixattrs[16];
     u32 curfixattr;
@@ -92,8 +129,10 @@ typedef struct _GPU {
     FBInfo* curfb;
     LRUCache(TexInfo, TEX_MAX) textures;
     LRUCache(ShaderJitBlock, VSH_MAX) vshaders_sw;
+    LRUCache(ShaderInterpBlock, VSH_MAX) vshaders_interp;
     LRUCache(VSHCacheEntry, VSH_MAX) vshaders_hw;
     LRUCache(FSHCacheEntry, FSH_MAX) fshaders;
+    LRUCache(CmdListCacheEntry, CMDLIST_MAX) cmdlists;
 
     struct {
         struct {
@@ -116,9 +155,14 @@ typedef struct _GPU {
         void* vbuf;
 
         ShaderJitFunc shaderfunc;
+        ShaderProg* prog;
     } vsh_runner;
 
     GLState gl;
+    SWRenderer sw;
+
+    GPUCapture* capture;
+    GPUProfile* prof;
 
     GPURegs regs;
 
@@ -135,6 +179,11 @@ typedef union {
     };
 } GPUCommand;
 
+float cvtf24(u32 i);
+bool is_valid_physmem(u32 addr);
+u32 morton_swizzle(u32 w, u32 x, u32 y);
+extern const int texfmtbpp[16];
+
 void gpu_init(GPU* gpu);
 void gpu_destroy(GPU* gpu);
 
@@ -145,9 +194,11 @@ void gpu_display_transfer(GPU* gpu, u32 paddr, int yoff, bool scalex,
                           bool scaley, int screenid);
 void gpu_texture_copy(GPU* gpu, u32 srcpaddr, u32 dstpaddr, u32 size,
                       u32 srcpitch, u32 srcgap, u32 dstpitch, u32 dstgap);
-void gpu_clear_fb(GPU* gpu, u32 paddr, u32 color);
+void gpu_clear_fb(GPU* gpu, u32 paddr, u32 endpaddr, u32 color, int Bpp);
 void gpu_run_command_list(GPU* gpu, u32 paddr, u32 size);
 
+void gpu_load_frag_uniforms(GPU* gpu, UberUniforms* ubuf, FragUniforms* fbuf);
+
 void gpu_drawarrays(GPU* gpu);
 void gpu_drawelements(GPU* gpu);
 void gpu_drawimmediate(GPU* gpu);
@@ -0,0 +1,274 @@
+#include "gpucapture.h"
+
+#define XXH_INLINE_ALL
+#include <xxh3.h>
+
+#include "gpu.h"
+
+#undef PTR
+#ifdef FASTMEM
+#define PTR(addr) ((void*) &gpu->mem[addr])
+#else
+#define PTR(addr) sw_pptr(gpu->mem, addr)
+#endif
+
+// gpu state which persists between frames and is not in emulated memory
+typedef struct {
+    GPURegs regs;
+    u32 progdata[SHADER_CODE_SIZE];
+    u32 opdescs[SHADER_OPDESC_SIZE];
+    fvec4 floatuniform[96];
+    fvec4 fixattrs[16];
+} CaptureState;
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u32 statesize;
+} CaptureHeader;
+
+static const char* cmdnames[6] = {
+    "dma", "command list", "memory fill", "display transfer", "texture copy",
+    "flush",
+};
+
+bool gpucapture_begin(GPU* gpu, char* path) {
+    GPUCapture* cap = calloc(1, sizeof *cap);
+    cap->fp = fopen(path, "wb");
+    if (!cap->fp) {
+        lerror("could not open %s for capture", path);
+        free(cap);
+        return false;
+    }
+    Vec_init(cap->ranges);
+
+    CaptureHeader hdr = {GPUCAPTURE_MAGIC, GPUCAPTURE_VERSION,
+                         sizeof(CaptureState)};
+    fwrite(&hdr, sizeof hdr, 1, cap->fp);
+
+    CaptureState* st = malloc(sizeof *st);
+    st->regs = gpu->regs;
+    memcpy(st->progdata, gpu->progdata, sizeof st->progdata);
+    memcpy(st->opdescs, gpu->opdescs, sizeof st->opdescs);
+    memcpy(st->floatuniform, gpu->floatuniform, sizeof st->floatuniform);
+    memcpy(st->fixattrs, gpu->fixattrs, sizeof st->fixattrs);
+    fwrite(st, sizeof *st, 1, cap->fp);
+    free(st);
+
+    gpu->capture = cap;
+    linfo("capturing gpu commands to %s", path);
+    return true;
+}
+
+void gpucapture_end(GPU* gpu) {
+    GPUCapture* cap = gpu->capture;
+    if (!cap) return;
+
+    u32 type = CAP_END;
+    fwrite(&type, sizeof type, 1, cap->fp);
+    fclose(cap->fp);
+    Vec_free(cap->ranges);
+    free(cap);
+    gpu->capture = nullptr;
+    linfo("finished gpu capture");
+}
+
+void gpucapture_mem(GPU* gpu, u32 paddr, u32 size) {
+    GPUCapture* cap = gpu->capture;
+    if (!size || !is_valid_physmem(paddr) ||
+        !is_valid_physmem(paddr + size - 1))
+        return;
+
+    void* data = PTR(paddr);
+    u64 hash = XXH3_64bits(data, size);
+
+    CaptureRange* r = nullptr;
+    Vec_foreach(e, cap->ranges) {
+        if (e->paddr == paddr && e->size == size) {
+            r = e;
+            break;
+        }
+    }
+    if (r) {
+        if (r->hash == hash) return;
+        r->hash = hash;
+    } else {
+        Vec_push(cap->ranges, ((CaptureRange) {paddr, size, hash}));
+    }
+
+    u32 rec[3] = {CAP_MEM, paddr, size};
+    fwrite(rec, sizeof rec, 1, cap->fp);
+    fwrite(data, size, 1, cap->fp);
+    // keep the records aligned
+    static const u8 pad[4] = {};
+    fwrite(pad, -size & 3, 1, cap->fp);
+}
+
+// records the vertex buffers and textures a draw reads from
+void gpucapture_draw(GPU* gpu, int start, int num) {
+    for (int i = 0; i < 12; i++) {
+        if (gpu->regs.geom.attrbuf[i].count == 0) continue;
+        u32 stride = gpu->regs.geom.attrbuf[i].size;
+        gpucapture_mem(gpu,
+                       gpu->regs.geom.attr_base * 8 +
+                           gpu->regs.geom.attrbuf[i].offset + start * stride,
+                       num * stride);
+    }
+
+    TexUnitRegs* units[3] = {&gpu->regs.tex.tex0, &gpu->regs.tex.tex1,
+                             &gpu->regs.tex.tex2};
+    u32 fmts[3] = {gpu->regs.tex.tex0_fmt, gpu->regs.tex.tex1_fmt,
+                   gpu->regs.tex.tex2_fmt};
+    bool enabled[3] = {gpu->regs.tex.config.tex0enable,
+                       gpu->regs.tex.config.tex1enable,
+                       gpu->regs.tex.config.tex2enable};
+    for (int i = 0; i < 3; i++) {
+        if (!enabled[i]) continue;
+        u32 size = 0;
+        for (int l = 0; l <= units[i]->lod.max; l++) {
+            size += (units[i]->width >> l) * (units[i]->height >> l) *
+                    texfmtbpp[fmts[i] & 15] / 8;
+        }
+        gpucapture_mem(gpu, units[i]->addr << 3, size);
+    }
+}
+
+// gsp commands are stored with physical addresses so they can be replayed
+// without the process memory map
+void gpucapture_cmd(GPU* gpu, u32 id, u32 args[7]) {
+    u32 rec[9] = {CAP_CMD, id};
+    memcpy(&rec[2], args, 7 * sizeof(u32));
+    fwrite(rec, sizeof rec, 1, gpu->capture->fp);
+}
+
+static void replay_cmd(GPU* gpu, u32 id, u32* args) {
+    switch (id) {
+        case 0x00:
+            if (is_valid_physmem(args[0]) && is_valid_physmem(args[1]) &&
+                is_valid_physmem(args[0] + args[2] - 1) &&
+                is_valid_physmem(args[1] + args[2] - 1)) {
+                memcpy(PTR(args[1]), PTR(args[0]), args[2]);
+            }
+            break;
+        case 0x01:
+            gpu_run_command_list(gpu, args[0], args[1]);
+            break;
+        case 0x02:
+            gpu_clear_fb(gpu, args[0], args[1], args[2], args[3]);
+            break;
+        case 0x03:
+            gpu_display_transfer(gpu, args[0], (s32) args[1], args[2], args[3],
+                                 args[4]);
+            break;
+        case 0x04:
+            gpu_texture_copy(gpu, args[0], args[1], args[2], args[3], args[4],
+                             args[5], args[6]);
+            break;
+    }
+}
+
+bool gpucapture_replay(GPU* gpu, char* path, int iters) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        lerror("could not open capture %s", path);
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    u8* buf = malloc(size);
+    fread(buf, 1, size, fp);
+    fclose(fp);
+
+    CaptureHeader* hdr = (void*) buf;
+    if (size < sizeof *hdr + sizeof(CaptureState) ||
+        hdr->magic != GPUCAPTURE_MAGIC || hdr->version != GPUCAPTURE_VERSION ||
+        hdr->statesize != sizeof(CaptureState)) {
+        lerror("invalid capture file %s", path);
+        free(buf);
+        return false;
+    }
+    CaptureState* st = (void*) (hdr + 1);
+    u8* recs = (u8*) (st + 1);
+    u8* end = buf + size;
+
+    GPUProfile prof = {};
+    u64 cmdtime[6] = {};
+    u64 cmdcount[6] = {};
+    u64 total = 0;
+    u64 best = -1;
+
+    gpu->prof = &prof;
+    for (int it = 0; it < iters; it++) {
+        gpu->regs = st->regs;
+        memcpy(gpu->progdata, st->progdata, sizeof st->progdata);
+        memcpy(gpu->opdescs, st->opdescs, sizeof st->opdescs);
+        memcpy(gpu->floatuniform, st->floatuniform, sizeof st->floatuniform);
+        memcpy(gpu->fixattrs, st->fixattrs, sizeof st->fixattrs);
+        gpu->curfixi = 0;
+        gpu->curunifi = 0;
+        gpu->sh_dirty = true;
+        gpu->uniform_dirty = true;
+        Vec_free(gpu->immattrs);
+
+        u64 start = gpuprof_now();
+
+        u8* p = recs;
+        while (p + sizeof(u32) <= end) {
+            u32 type = *(u32*) p;
+            if (type == CAP_MEM) {
+                if (p + 12 > end) break;
+                u32 paddr = ((u32*) p)[1];
+                u32 len = ((u32*) p)[2];
+                p += 12;
+                if (p + len > end) break;
+                // memory is restored in order between the commands, but the
+                // time spent copying it is left out of the frame time
+                u64 t = gpuprof_now();
+                if (len && is_valid_physmem(paddr) &&
+                    is_valid_physmem(paddr + len - 1)) {
+                    memcpy(PTR(paddr), p, len);
+                }
+                start += gpuprof_now() - t;
+                p += (len + 3) & ~3;
+            } else if (type == CAP_CMD) {
+                if (p + 36 > end) break;
+                u32 id = ((u32*) p)[1];
+                u32* args = &((u32*) p)[2];
+                p += 36;
+                if (id >= 6) continue;
+                u64 t = gpuprof_now();
+                replay_cmd(gpu, id, args);
+                cmdtime[id] += gpuprof_now() - t;
+                cmdcount[id]++;
+            } else {
+                break;
+            }
+        }
+
+        // include the time the host gpu takes to finish the frame
+        glFinish();
+        u64 elapsed = gpuprof_now() - start;
+        total += elapsed;
+        if (elapsed < best) best = elapsed;
+    }
+    gpu->prof = nullptr;
+    free(buf);
+
+    if (!iters) return true;
+
+    printfln("replayed %s %d times", path, iters);
+    printfln("frame: avg %.3lf ms, best %.3lf ms", total / 1e6 / iters,
+             best / 1e6);
+    for (int i = 0; i < 6; i++) {
+        if (!cmdcount[i]) continue;
+        printfln("%s: %lu per frame, %.3lf ms", cmdnames[i],
+                 cmdcount[i] / iters, cmdtime[i] / 1e6 / iters);
+    }
+    printfln("draws: %lu per frame", prof.ndraws / iters);
+    printfln("  state update: %.3lf ms", prof.state / 1e6 / iters);
+    printfln("  vertex upload: %.3lf ms", prof.vtx / 1e6 / iters);
+    printfln("  draw submit: %.3lf ms", prof.draw / 1e6 / iters);
+
+    return true;
+}
@@ -0,0 +1,70 @@
+#ifndef GPUCAPTURE_H
+#define GPUCAPTURE_H
+
+#include <stdio.h>
+#include <time.h>
+
+#include "common.h"
+
+#define GPUCAPTURE_MAGIC 0x50414350 // PCAP
+#define GPUCAPTURE_VERSION 1
+
+typedef struct _GPU GPU;
+
+enum {
+    CAP_END,
+    CAP_MEM,
+    CAP_CMD,
+};
+
+typedef struct {
+    u32 paddr;
+    u32 size;
+    u64 hash;
+} CaptureRange;
+
+typedef struct {
+    FILE* fp;
+    // memory already in the capture, so unchanged ranges are only stored once
+    Vector(CaptureRange) ranges;
+} GPUCapture;
+
+typedef struct {
+    u64 last;
+
+    u64 state;
+    u64 vtx;
+    u64 draw;
+    u64 ndraws;
+} GPUProfile;
+
+static inline u64 gpuprof_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1'000'000'000ull + ts.tv_nsec;
+}
+
+// these only do anything while replaying a capture
+#define GPUPROF_START(gpu)                                                     \
+    ({                                                                         \
+        if ((gpu)->prof) (gpu)->prof->last = gpuprof_now();                    \
+    })
+#define GPUPROF_MARK(gpu, stage)                                               \
+    ({                                                                         \
+        if ((gpu)->prof) {                                                     \
+            u64 _t = gpuprof_now();                                            \
+            (gpu)->prof->stage += _t - (gpu)->prof->last;                      \
+            (gpu)->prof->last = _t;                                            \
+        }                                                                      \
+    })
+
+bool gpucapture_begin(GPU* gpu, char* path);
+void gpucapture_end(GPU* gpu);
+
+void gpucapture_mem(GPU* gpu, u32 paddr, u32 size);
+void gpucapture_draw(GPU* gpu, int start, int num);
+void gpucapture_cmd(GPU* gpu, u32 id, u32 args[7]);
+
+bool gpucapture_replay(GPU* gpu, char* path, int iters);
+
+#endif
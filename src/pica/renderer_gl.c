@@ -1,9 +1,13 @@
 #include "renderer_gl.h"
 
+#define XXH_INLINE_ALL
+#include <xxh3.h>
+
 #include "3ds.h"
 #include "emulator.h"
 
 #include "gpu.h"
+#include "trace.h"
 
 const char mainvertsource[] = {
 #embed "hostshaders/main.vert"
@@ -19,6 +23,36 @@ const char gpufragsource[] = {
 #embed "hostshaders/gpu.frag"
     , '\0'};
 
+// vertices from the software vertex shader are stored as Vertex structs
+static void setup_sw_attrs(GLState* state) {
+    glBindBuffer(GL_ARRAY_BUFFER, state->gpu_vbos[0]);
+
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                          (void*) offsetof(Vertex, pos));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                          (void*) offsetof(Vertex, color));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                          (void*) offsetof(Vertex, texcoord0));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                          (void*) offsetof(Vertex, texcoord1));
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(4, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                          (void*) offsetof(Vertex, texcoord2));
+    glEnableVertexAttribArray(4);
+    glVertexAttribPointer(5, 1, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                          (void*) offsetof(Vertex, texcoordw));
+    glEnableVertexAttribArray(5);
+    glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                          (void*) offsetof(Vertex, normquat));
+    glEnableVertexAttribArray(6);
+    glVertexAttribPointer(7, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                          (void*) offsetof(Vertex, view));
+    glEnableVertexAttribArray(7);
+}
+
 void renderer_gl_init(GLState* state, GPU* gpu) {
     state->gpu = gpu;
 
@@ -53,7 +87,29 @@ void renderer_gl_init(GLState* state, GPU* gpu) {
                    nullptr);
     glCompileShader(state->gpu_uberfs);
 
+    state->gpu_vs_hash = XXH3_64bits(gpuvertsource, sizeof gpuvertsource);
+    state->gpu_uberfs_hash = XXH3_64bits(gpufragsource, sizeof gpufragsource);
+
     LRU_init(state->progcache);
+    shadercache_init(&state->diskcache, ctremu.romfilenoext);
+
+    // link the generic program up front since it is what we fall back to
+    // while specialized programs are compiling
+    auto ent =
+        gpu_gl_find_prog(state, state->gpu_vs_hash, state->gpu_uberfs_hash);
+    if (!ent->prog) {
+        gpu_gl_link_prog(state, ent, state->gpu_vs, state->gpu_uberfs);
+    }
+    gpu_gl_use_prog(state, ent);
+    if (ctremu.asyncshaders) {
+        if (GLEW_KHR_parallel_shader_compile) {
+            glMaxShaderCompilerThreadsKHR(0xffffffff);
+            state->async_shaders = true;
+        } else {
+            lwarn("GL_KHR_parallel_shader_compile not supported, shaders "
+                  "will be compiled synchronously");
+        }
+    }
 
     glGenBuffers(4, state->ubos);
     for (int i = 0; i < 4; i++) {
@@ -73,32 +129,12 @@ void renderer_gl_init(GLState* state, GPU* gpu) {
 
     // for hw vshaders attributes are setup at run time
     if (!ctremu.hwvshaders) {
-        glBindBuffer(GL_ARRAY_BUFFER, state->gpu_vbos[0]);
-
-        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-                              (void*) offsetof(Vertex, pos));
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-                              (void*) offsetof(Vertex, color));
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-                              (void*) offsetof(Vertex, texcoord0));
-        glEnableVertexAttribArray(2);
-        glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-                              (void*) offsetof(Vertex, texcoord1));
-        glEnableVertexAttribArray(3);
-        glVertexAttribPointer(4, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-                              (void*) offsetof(Vertex, texcoord2));
-        glEnableVertexAttribArray(4);
-        glVertexAttribPointer(5, 1, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-                              (void*) offsetof(Vertex, texcoordw));
-        glEnableVertexAttribArray(5);
-        glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-                              (void*) offsetof(Vertex, normquat));
-        glEnableVertexAttribArray(6);
-        glVertexAttribPointer(7, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-                              (void*) offsetof(Vertex, view));
-        glEnableVertexAttribArray(7);
+        setup_sw_attrs(state);
+    } else if (state->async_shaders) {
+        glGenVertexArrays(1, &state->gpu_sw_vao);
+        glBindVertexArray(state->gpu_sw_vao);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, state->gpu_ebo);
+        setup_sw_attrs(state);
     }
 
     glGenTextures(2, state->screentex);
@@ -141,6 +177,7 @@ void renderer_gl_destroy(GLState* state) {
     for (int i = 0; i < MAX_PROGRAM; i++) {
         glDeleteProgram(state->progcache.d[i].prog);
     }
+    shadercache_destroy(&state->diskcache);
     for (int i = 0; i < VSH_MAX; i++) {
         glDeleteShader(state->gpu->vshaders_hw.d[i].vs);
     }
@@ -149,6 +186,7 @@ void renderer_gl_destroy(GLState* state) {
     }
     glDeleteVertexArrays(1, &state->main_vao);
     glDeleteVertexArrays(1, &state->gpu_vao);
+    glDeleteVertexArrays(1, &state->gpu_sw_vao);
     glDeleteBuffers(1, &state->main_vbo);
     glDeleteBuffers(12, state->gpu_vbos);
     glDeleteBuffers(4, state->ubos);
@@ -175,6 +213,7 @@ void renderer_gl_setup_gpu(GLState* state) {
 // leaves framebuffer 0 bound at the end because on mac
 // swap buffers wont work if it is not
 void render_gl_main(GLState* state, int view_w, int view_h) {
+    TRACE_SCOPE("render_gl_main");
     // reset gl for drawing the main window
     glUseProgram(state->main_program);
     glBindVertexArray(state->main_vao);
@@ -214,42 +253,97 @@ void renderer_gl_update_freecam(GLState* state) {
     }
 }
 
-void gpu_gl_load_prog(GLState* state, GLuint vs, GLuint fs) {
-    if (LRU_mru(state->progcache)->vs == vs &&
-        LRU_mru(state->progcache)->fs == fs) {
-        return;
+// returns the cache entry for this pair of shaders, loading the program
+// from the disk cache if it is there. if the entry has no program the
+// caller needs to compile the shaders and call gpu_gl_link_prog
+ProgCacheEntry* gpu_gl_find_prog(GLState* state, u64 vshash, u64 fshash) {
+    if (LRU_mru(state->progcache)->vshash == vshash &&
+        LRU_mru(state->progcache)->fshash == fshash) {
+        return LRU_mru(state->progcache);
     }
 
-    auto ent = LRU_load(state->progcache, vs | ((u64) fs << 32));
-    if (ent->vs != vs || ent->fs != fs) {
-        glDeleteProgram(ent->prog);
-        ent->vs = vs;
-        ent->fs = fs;
+    u64 key = XXH3_64bits((u64[]) {vshash, fshash}, 2 * sizeof(u64));
+    auto ent = LRU_load(state->progcache, key);
+    if (ent->vshash == vshash && ent->fshash == fshash) return ent;
+
+    glDeleteProgram(ent->prog);
+    ent->key = key;
+    ent->vshash = vshash;
+    ent->fshash = fshash;
+    ent->prog = 0;
+    ent->ready = false;
+    ent->cached = false;
+
+    auto bin = shadercache_find(&state->diskcache, vshash, fshash);
+    if (bin) {
         ent->prog = glCreateProgram();
-        glAttachShader(ent->prog, ent->vs);
-        glAttachShader(ent->prog, ent->fs);
-        glLinkProgram(ent->prog);
-        glUseProgram(ent->prog);
-        glUniform1i(glGetUniformLocation(ent->prog, "tex0"), 0);
-        glUniform1i(glGetUniformLocation(ent->prog, "tex1"), 1);
-        glUniform1i(glGetUniformLocation(ent->prog, "tex2"), 2);
-        if (ent->vs != state->gpu_vs) {
-            glUniformBlockBinding(
-                ent->prog, glGetUniformBlockIndex(ent->prog, "VertUniforms"),
-                0);
-            glUniformBlockBinding(
-                ent->prog, glGetUniformBlockIndex(ent->prog, "FreecamUniforms"),
-                3);
+        glProgramBinary(ent->prog, bin->format, bin->data, bin->size);
+        GLint ok = GL_FALSE;
+        glGetProgramiv(ent->prog, GL_LINK_STATUS, &ok);
+        if (ok) {
+            ent->cached = true;
+        } else {
+            // the driver can reject binaries at any time
+            shadercache_remove(&state->diskcache, bin);
+            glDeleteProgram(ent->prog);
+            ent->prog = 0;
         }
-        if (ent->fs == state->gpu_uberfs)
-            glUniformBlockBinding(
-                ent->prog, glGetUniformBlockIndex(ent->prog, "UberUniforms"),
-                1);
-        glUniformBlockBinding(
-            ent->prog, glGetUniformBlockIndex(ent->prog, "FragUniforms"), 2);
+    }
 
-        linfo("linked new program");
-    } else {
+    return ent;
+}
+
+void gpu_gl_link_prog(GLState* state, ProgCacheEntry* ent, GLuint vs,
+                      GLuint fs) {
+    ent->prog = glCreateProgram();
+    glProgramParameteri(ent->prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                        GL_TRUE);
+    glAttachShader(ent->prog, vs);
+    glAttachShader(ent->prog, fs);
+    glLinkProgram(ent->prog);
+}
+
+// returns false without changing the current program if the program is
+// still being compiled in the background
+bool gpu_gl_use_prog(GLState* state, ProgCacheEntry* ent) {
+    if (ent->ready) {
         glUseProgram(ent->prog);
+        return true;
+    }
+
+    // the generic program is the last resort so we always wait for it
+    if (state->async_shaders && !(ent->vshash == state->gpu_vs_hash &&
+                                  ent->fshash == state->gpu_uberfs_hash)) {
+        GLint done = GL_FALSE;
+        glGetProgramiv(ent->prog, GL_COMPLETION_STATUS_KHR, &done);
+        if (!done) return false;
+    }
+
+    glUseProgram(ent->prog);
+    glUniform1i(glGetUniformLocation(ent->prog, "tex0"), 0);
+    glUniform1i(glGetUniformLocation(ent->prog, "tex1"), 1);
+    glUniform1i(glGetUniformLocation(ent->prog, "tex2"), 2);
+    if (ent->vshash != state->gpu_vs_hash) {
+        glUniformBlockBinding(
+            ent->prog, glGetUniformBlockIndex(ent->prog, "VertUniforms"), 0);
+        glUniformBlockBinding(
+            ent->prog, glGetUniformBlockIndex(ent->prog, "FreecamUniforms"),
+            3);
+    }
+    if (ent->fshash == state->gpu_uberfs_hash)
+        glUniformBlockBinding(
+            ent->prog, glGetUniformBlockIndex(ent->prog, "UberUniforms"), 1);
+    glUniformBlockBinding(
+        ent->prog, glGetUniformBlockIndex(ent->prog, "FragUniforms"), 2);
+    ent->ready = true;
+
+    if (!ent->cached) {
+        GLint ok = GL_FALSE;
+        glGetProgramiv(ent->prog, GL_LINK_STATUS, &ok);
+        if (ok) shadercache_add(&state->diskcache, ent->vshash, ent->fshash,
+                                ent->prog);
+        ent->cached = true;
+        linfo("linked new program");
     }
+    return true;
 }
\ No newline at end of file
@@ -9,20 +9,19 @@
 #endif
 
 #include "common.h"
+#include "shadercache.h"
 
 #define MAX_PROGRAM 1024
 
 typedef struct _GPU GPU;
 
 typedef struct _ProgCacheEntry {
-    union {
-        struct {
-            GLuint vs;
-            GLuint fs;
-        };
-        u64 key;
-    };
+    u64 key;
+    u64 vshash;
+    u64 fshash;
     GLuint prog;
+    bool ready;
+    bool cached;
 
     struct _ProgCacheEntry *next, *prev;
 } ProgCacheEntry;
@@ -35,13 +34,22 @@ typedef struct {
     GLuint main_program;
 
     GLuint gpu_vao;
+    // vao with the software vertex layout for drawing while the
+    // decompiled vertex shader is still compiling
+    GLuint gpu_sw_vao;
     GLuint gpu_vbos[12];
     GLuint gpu_ebo;
 
     GLuint gpu_vs;
     GLuint gpu_uberfs;
+    u64 gpu_vs_hash;
+    u64 gpu_uberfs_hash;
+
+    bool async_shaders;
+    bool vs_fallback;
 
     LRUCache(ProgCacheEntry, MAX_PROGRAM) progcache;
+    ShaderCache diskcache;
 
     GLuint screentex[2];
 
@@ -64,6 +72,9 @@ void renderer_gl_setup_gpu(GLState* state);
 void render_gl_main(GLState* state, int view_w, int view_h);
 void renderer_gl_update_freecam(GLState* state);
 
-void gpu_gl_load_prog(GLState* state, GLuint vs, GLuint fs);
+ProgCacheEntry* gpu_gl_find_prog(GLState* state, u64 vshash, u64 fshash);
+void gpu_gl_link_prog(GLState* state, ProgCacheEntry* ent, GLuint vs,
+                      GLuint fs);
+bool gpu_gl_use_prog(GLState* state, ProgCacheEntry* ent);
 
 #endif
@@ -0,0 +1,1156 @@
+#include "renderer_sw.h"
+
+#include <math.h>
+
+#define XXH_INLINE_ALL
+#include <xxh3.h>
+
+#include "3ds.h"
+#include "emulator.h"
+
+#include "etc1.h"
+#include "gpu.h"
+
+#undef PTR
+#ifdef FASTMEM
+#define PTR(addr) ((void*) &gpu->mem[addr])
+#else
+#define PTR(addr) sw_pptr(gpu->mem, addr)
+#endif
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// small draws are not worth waking up the other threads for
+#define SW_MIN_TRIS_MT 16
+
+static const int colorbpp[8] = {4, 3, 2, 2, 2, 4, 4, 4};
+static const int depthbpp[4] = {2, 2, 3, 4};
+
+static inline u8 cvt5(u32 v) {
+    return (v << 3) | (v >> 2);
+}
+
+static inline u8 cvt6(u32 v) {
+    return (v << 2) | (v >> 4);
+}
+
+static void read_color(int fmt, u8* p, u8 c[4]) {
+    switch (fmt) {
+        case 0: {
+            u32 v = *(u32*) p;
+            c[0] = v >> 24;
+            c[1] = v >> 16;
+            c[2] = v >> 8;
+            c[3] = v;
+            break;
+        }
+        case 1:
+            c[0] = p[2];
+            c[1] = p[1];
+            c[2] = p[0];
+            c[3] = 0xff;
+            break;
+        case 2: {
+            u16 v = *(u16*) p;
+            c[0] = cvt5(v >> 11 & 0x1f);
+            c[1] = cvt5(v >> 6 & 0x1f);
+            c[2] = cvt5(v >> 1 & 0x1f);
+            c[3] = (v & 1) ? 0xff : 0;
+            break;
+        }
+        case 3: {
+            u16 v = *(u16*) p;
+            c[0] = cvt5(v >> 11 & 0x1f);
+            c[1] = cvt6(v >> 5 & 0x3f);
+            c[2] = cvt5(v & 0x1f);
+            c[3] = 0xff;
+            break;
+        }
+        case 4: {
+            u16 v = *(u16*) p;
+            c[0] = (v >> 12 & 0xf) * 0x11;
+            c[1] = (v >> 8 & 0xf) * 0x11;
+            c[2] = (v >> 4 & 0xf) * 0x11;
+            c[3] = (v & 0xf) * 0x11;
+            break;
+        }
+        default:
+            c[0] = c[1] = c[2] = 0;
+            c[3] = 0xff;
+    }
+}
+
+static void write_color(int fmt, u8* p, u8 c[4]) {
+    switch (fmt) {
+        case 0:
+            *(u32*) p = c[0] << 24 | c[1] << 16 | c[2] << 8 | c[3];
+            break;
+        case 1:
+            p[0] = c[2];
+            p[1] = c[1];
+            p[2] = c[0];
+            break;
+        case 2:
+            *(u16*) p = (c[0] >> 3) << 11 | (c[1] >> 3) << 6 |
+                        (c[2] >> 3) << 1 | (c[3] >> 7);
+            break;
+        case 3:
+            *(u16*) p = (c[0] >> 3) << 11 | (c[1] >> 2) << 5 | (c[2] >> 3);
+            break;
+        case 4:
+            *(u16*) p = (c[0] >> 4) << 12 | (c[1] >> 4) << 8 |
+                        (c[2] >> 4) << 4 | (c[3] >> 4);
+            break;
+    }
+}
+
+#define RGBA(r, g, b, a)                                                       \
+    ((u32) (r) | (u32) (g) << 8 | (u32) (b) << 16 | (u32) (a) << 24)
+
+// returns texel i in morton order as rgba8 with r in the low byte
+static u32 fetch_texel(u8* data, int fmt, u32 i) {
+    switch (fmt) {
+        case 0: {
+            u32 v = ((u32*) data)[i];
+            return RGBA(v >> 24, v >> 16 & 0xff, v >> 8 & 0xff, v & 0xff);
+        }
+        case 1:
+            return RGBA(data[3 * i + 2], data[3 * i + 1], data[3 * i], 0xff);
+        case 2: {
+            u16 v = ((u16*) data)[i];
+            return RGBA(cvt5(v >> 11 & 0x1f), cvt5(v >> 6 & 0x1f),
+                        cvt5(v >> 1 & 0x1f), (v & 1) ? 0xff : 0);
+        }
+        case 3: {
+            u16 v = ((u16*) data)[i];
+            return RGBA(cvt5(v >> 11 & 0x1f), cvt6(v >> 5 & 0x3f),
+                        cvt5(v & 0x1f), 0xff);
+        }
+        case 4: {
+            u16 v = ((u16*) data)[i];
+            return RGBA((v >> 12 & 0xf) * 0x11, (v >> 8 & 0xf) * 0x11,
+                        (v >> 4 & 0xf) * 0x11, (v & 0xf) * 0x11);
+        }
+        case 5: // ia88
+            return RGBA(data[2 * i + 1], data[2 * i + 1], data[2 * i + 1],
+                        data[2 * i]);
+        case 6: // hilo8
+            return RGBA(data[2 * i], data[2 * i + 1], 0, 0xff);
+        case 7: // i8
+            return RGBA(data[i], data[i], data[i], 0xff);
+        case 8: // a8
+            return RGBA(0, 0, 0, data[i]);
+        case 9: { // ia44
+            u8 in = (data[i] >> 4) * 0x11;
+            return RGBA(in, in, in, (data[i] & 0xf) * 0x11);
+        }
+        case 10: { // i4
+            u8 in = ((data[i / 2] >> 4 * (i & 1)) & 0xf) * 0x11;
+            return RGBA(in, in, in, 0xff);
+        }
+        case 11: // a4
+            return RGBA(0, 0, 0, ((data[i / 2] >> 4 * (i & 1)) & 0xf) * 0x11);
+        default:
+            return RGBA(0, 0, 0, 0xff);
+    }
+}
+
+// textures are decoded into linear rgba8 with row 0 at the bottom, matching
+// what the gl renderer uploads
+static void decode_texture(SWRenderer* sw, int id, TexUnitRegs* regs, u32 fmt) {
+    GPU* gpu = sw->gpu;
+    SWTexture* tex = &sw->tex[id];
+
+    tex->wrap_s = regs->param.wrap_s;
+    tex->wrap_t = regs->param.wrap_t;
+    tex->linear = regs->param.mag_filter;
+    tex->border = (v4f) {regs->border.r, regs->border.g, regs->border.b,
+                         regs->border.a} /
+                  255;
+
+    u32 paddr = regs->addr << 3;
+    u32 w = regs->width;
+    u32 h = regs->height;
+    u32 size = w * h * texfmtbpp[fmt & 15] / 8;
+    if (!size || !is_valid_physmem(paddr) ||
+        !is_valid_physmem(paddr + size - 1)) {
+        tex->w = tex->h = 0;
+        return;
+    }
+    u8* data = PTR(paddr);
+
+    // only decode again if the texture actually changed
+    u64 hash = XXH3_64bits(data, size);
+    if (tex->d && tex->paddr == paddr && tex->w == w && tex->h == h &&
+        tex->fmt == fmt && tex->hash == hash)
+        return;
+
+    tex->paddr = paddr;
+    tex->fmt = fmt;
+    tex->hash = hash;
+    if (tex->w * tex->h != w * h) {
+        free(tex->d);
+        tex->d = malloc(w * h * sizeof(u32));
+    }
+    tex->w = w;
+    tex->h = h;
+
+    if (fmt == 12) {
+        u8 (*dec)[w][3] = malloc(w * h * 3);
+        etc1_decompress_texture(w, h, (void*) data, dec);
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                tex->d[y * w + x] =
+                    RGBA(dec[y][x][0], dec[y][x][1], dec[y][x][2], 0xff);
+            }
+        }
+        free(dec);
+    } else if (fmt == 13) {
+        u8 (*dec)[w][4] = malloc(w * h * 4);
+        etc1a4_decompress_texture(w, h, (void*) data, dec);
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                tex->d[y * w + x] = RGBA(dec[y][x][0], dec[y][x][1],
+                                         dec[y][x][2], dec[y][x][3]);
+            }
+        }
+        free(dec);
+    } else {
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                tex->d[(h - 1 - y) * w + x] =
+                    fetch_texel(data, fmt, morton_swizzle(w, x, y));
+            }
+        }
+    }
+}
+
+static inline int wrap_coord(int c, int size, int mode, bool* border) {
+    switch (mode) {
+        case 1: // clamp to border
+            if (c < 0 || c >= size) *border = true;
+            return c < 0 ? 0 : c >= size ? size - 1 : c;
+        case 2: // repeat
+            c %= size;
+            return c < 0 ? c + size : c;
+        case 3: { // mirrored repeat
+            c %= 2 * size;
+            if (c < 0) c += 2 * size;
+            return c < size ? c : 2 * size - 1 - c;
+        }
+        default: // clamp to edge
+            return c < 0 ? 0 : c >= size ? size - 1 : c;
+    }
+}
+
+static inline v4f texel(SWTexture* tex, int x, int y) {
+    bool border = false;
+    x = wrap_coord(x, tex->w, tex->wrap_s, &border);
+    y = wrap_coord(y, tex->h, tex->wrap_t, &border);
+    if (border) return tex->border;
+    u32 t = tex->d[y * tex->w + x];
+    return (v4f) {t & 0xff, t >> 8 & 0xff, t >> 16 & 0xff, t >> 24} / 255;
+}
+
+static v4f sample_tex(SWTexture* tex, float s, float t) {
+    if (!tex->w) return (v4f) {0, 0, 0, 1};
+
+    // only level 0 is sampled, so the mag filter is used for everything
+    float u = s * tex->w;
+    float v = t * tex->h;
+    if (!tex->linear) return texel(tex, floorf(u), floorf(v));
+
+    u -= 0.5f;
+    v -= 0.5f;
+    int x = floorf(u);
+    int y = floorf(v);
+    float fx = u - x;
+    float fy = v - y;
+    v4f t00 = texel(tex, x, y);
+    v4f t10 = texel(tex, x + 1, y);
+    v4f t01 = texel(tex, x, y + 1);
+    v4f t11 = texel(tex, x + 1, y + 1);
+    v4f top = t00 + (t10 - t00) * fx;
+    v4f bot = t01 + (t11 - t01) * fx;
+    return top + (bot - top) * fy;
+}
+
+// the fragment pipeline below mirrors the ubershader in gpu.frag
+
+static inline float dot3(v4f a, v4f b) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static inline v4f cross3(v4f a, v4f b) {
+    return (v4f) {a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2],
+                  a[0] * b[1] - a[1] * b[0], 0};
+}
+
+static inline v4f normalize3(v4f v) {
+    float l = sqrtf(dot3(v, v));
+    return l > 0 ? v / l : v;
+}
+
+// q * v * q^-1
+static inline v4f quatrot(v4f q, v4f v) {
+    return 2 * (q[3] * cross3(q, v) + q * dot3(q, v)) +
+           (q[3] * q[3] - dot3(q, q)) * v;
+}
+
+static inline v4f vmin(v4f a, float b) {
+    return (v4f) {fminf(a[0], b), fminf(a[1], b), fminf(a[2], b),
+                  fminf(a[3], b)};
+}
+
+static inline v4f vclamp(v4f a) {
+    return (v4f) {fminf(fmaxf(a[0], 0), 1), fminf(fmaxf(a[1], 0), 1),
+                  fminf(fmaxf(a[2], 0), 1), fminf(fmaxf(a[3], 0), 1)};
+}
+
+#define LOADV4(a) ((v4f) {(a)[0], (a)[1], (a)[2], (a)[3]})
+
+static void calc_lighting(SWRenderer* sw, Vertex* v, v4f* primary,
+                          v4f* secondary) {
+    UberUniforms* ubuf = &sw->ubuf;
+    FragUniforms* fbuf = &sw->fbuf;
+
+    *primary = LOADV4(fbuf->ambient_color);
+    (*primary)[3] = 1;
+    *secondary = (v4f) {0, 0, 0, 0.5f};
+
+    v4f nq = LOADV4(v->normquat);
+    float nl = sqrtf(dot3(nq, nq) + nq[3] * nq[3]);
+    if (nl > 0) nq /= nl;
+    v4f view = {v->view[0], v->view[1], v->view[2], 0};
+    v4f vv = normalize3(quatrot(nq, view));
+
+    for (int i = 0; i < ubuf->numlights; i++) {
+        v4f lvec = {fbuf->light[i].vec[0], fbuf->light[i].vec[1],
+                    fbuf->light[i].vec[2], 0};
+        *primary += LOADV4(fbuf->light[i].ambient) * (v4f) {1, 1, 1, 0};
+
+        v4f l;
+        if (ubuf->light[i].config & L_DIRECTIONAL) {
+            l = normalize3(quatrot(nq, lvec));
+        } else {
+            l = normalize3(quatrot(nq, view + lvec));
+        }
+        v4f h = normalize3(l + vv);
+
+        float diffuselevel = fmaxf(l[2], 0);
+        *primary += diffuselevel * LOADV4(fbuf->light[i].diffuse) *
+                    (v4f) {1, 1, 1, 0};
+        *primary = vmin(*primary, 1);
+
+        float speclevel = powf(fmaxf(h[2], 0), 3);
+        *secondary += speclevel * LOADV4(fbuf->light[i].specular0) *
+                      (v4f) {1, 1, 1, 0};
+        *secondary = vmin(*secondary, 1);
+    }
+    (*primary)[3] = 1;
+    (*secondary)[3] = 0.5f;
+}
+
+static inline v4f tev_operand_rgb(v4f v, int op) {
+    switch (op) {
+        case 0: return v;
+        case 1: return 1 - v;
+        case 2: return (v4f) {} + v[3];
+        case 3: return (v4f) {} + (1 - v[3]);
+        case 4: return (v4f) {} + v[0];
+        case 5: return (v4f) {} + (1 - v[0]);
+        case 8: return (v4f) {} + v[1];
+        case 9: return (v4f) {} + (1 - v[1]);
+        case 12: return (v4f) {} + v[2];
+        case 13: return (v4f) {} + (1 - v[2]);
+        default: return v;
+    }
+}
+
+static inline float tev_operand_alpha(v4f v, int op) {
+    switch (op) {
+        case 0: return v[3];
+        case 1: return 1 - v[3];
+        case 2: return v[0];
+        case 3: return 1 - v[0];
+        case 4: return v[1];
+        case 5: return 1 - v[1];
+        case 6: return v[2];
+        case 7: return 1 - v[2];
+        default: return v[3];
+    }
+}
+
+static v4f run_tev(SWRenderer* sw, Vertex* v) {
+    UberUniforms* ubuf = &sw->ubuf;
+    FragUniforms* fbuf = &sw->fbuf;
+
+    v4f srcs[16] = {};
+    srcs[TEVSRC_COLOR] = LOADV4(v->color);
+    calc_lighting(sw, v, &srcs[TEVSRC_LIGHT_PRIMARY],
+                  &srcs[TEVSRC_LIGHT_SECONDARY]);
+    srcs[TEVSRC_TEX0] =
+        sample_tex(&sw->tex[0], v->texcoord0[0], v->texcoord0[1]);
+    srcs[TEVSRC_TEX1] =
+        sample_tex(&sw->tex[1], v->texcoord1[0], v->texcoord1[1]);
+    if (ubuf->tex2coord) {
+        srcs[TEVSRC_TEX2] =
+            sample_tex(&sw->tex[2], v->texcoord1[0], v->texcoord1[1]);
+    } else {
+        srcs[TEVSRC_TEX2] =
+            sample_tex(&sw->tex[2], v->texcoord2[0], v->texcoord2[1]);
+    }
+    srcs[TEVSRC_BUFFER] = LOADV4(fbuf->tev_buffer_color);
+
+    v4f next_buf = srcs[TEVSRC_BUFFER];
+
+    for (int i = 0; i < 6; i++) {
+        auto tev = &ubuf->tev[i];
+        srcs[TEVSRC_CONSTANT] = LOADV4(fbuf->tev_color[i]);
+
+#define SRC(n) tev_operand_rgb(srcs[tev->rgb.src##n], tev->rgb.op##n)
+        v4f rgb;
+        switch (tev->rgb.combiner) {
+            case 0: rgb = SRC(0); break;
+            case 1: rgb = SRC(0) * SRC(1); break;
+            case 2: rgb = SRC(0) + SRC(1); break;
+            case 3: rgb = SRC(0) + SRC(1) - 0.5f; break;
+            case 4: {
+                v4f s2 = SRC(2);
+                rgb = SRC(1) * (1 - s2) + SRC(0) * s2;
+                break;
+            }
+            case 5: rgb = SRC(0) - SRC(1); break;
+            case 6:
+            case 7:
+                rgb = (v4f) {} + 4 * dot3(SRC(0) - 0.5f, SRC(1) - 0.5f);
+                break;
+            case 8: rgb = SRC(0) * SRC(1) + SRC(2); break;
+            case 9: rgb = (SRC(0) + SRC(1)) * SRC(2); break;
+            default: rgb = SRC(0);
+        }
+#undef SRC
+
+#define SRC(n) tev_operand_alpha(srcs[tev->a.src##n], tev->a.op##n)
+        float a;
+        if (tev->rgb.combiner == 7) {
+            a = rgb[0];
+        } else {
+            switch (tev->a.combiner) {
+                case 0: a = SRC(0); break;
+                case 1: a = SRC(0) * SRC(1); break;
+                case 2: a = SRC(0) + SRC(1); break;
+                case 3: a = SRC(0) + SRC(1) - 0.5f; break;
+                case 4: {
+                    float s2 = SRC(2);
+                    a = SRC(1) * (1 - s2) + SRC(0) * s2;
+                    break;
+                }
+                case 5: a = SRC(0) - SRC(1); break;
+                case 6:
+                case 7: a = 4 * (SRC(0) - 0.5f) * (SRC(1) - 0.5f); break;
+                case 8: a = SRC(0) * SRC(1) + SRC(2); break;
+                case 9: a = (SRC(0) + SRC(1)) * SRC(2); break;
+                default: a = SRC(0);
+            }
+        }
+#undef SRC
+
+        v4f res = rgb * tev->rgb.scale;
+        res[3] = a * tev->a.scale;
+        res = vclamp(res);
+
+        srcs[TEVSRC_BUFFER] = next_buf;
+
+        if (ubuf->tev_update_rgb & BIT(i)) {
+            next_buf[0] = res[0];
+            next_buf[1] = res[1];
+            next_buf[2] = res[2];
+        }
+        if (ubuf->tev_update_alpha & BIT(i)) {
+            next_buf[3] = res[3];
+        }
+
+        srcs[TEVSRC_PREVIOUS] = res;
+    }
+
+    return srcs[TEVSRC_PREVIOUS];
+}
+
+static inline bool compare(int func, u32 a, u32 b) {
+    switch (func) {
+        case 0: return false;
+        case 1: return true;
+        case 2: return a == b;
+        case 3: return a != b;
+        case 4: return a < b;
+        case 5: return a <= b;
+        case 6: return a > b;
+        case 7: return a >= b;
+        default: return true;
+    }
+}
+
+static inline bool comparef(int func, float a, float b) {
+    switch (func) {
+        case 0: return false;
+        case 1: return true;
+        case 2: return a == b;
+        case 3: return a != b;
+        case 4: return a < b;
+        case 5: return a <= b;
+        case 6: return a > b;
+        case 7: return a >= b;
+        default: return true;
+    }
+}
+
+static inline u8 stencil_op(int op, u8 s, u8 ref) {
+    switch (op) {
+        case 0: return s;
+        case 1: return 0;
+        case 2: return ref;
+        case 3: return s == 0xff ? s : s + 1;
+        case 4: return s == 0 ? s : s - 1;
+        case 5: return ~s;
+        case 6: return s + 1;
+        case 7: return s - 1;
+        default: return s;
+    }
+}
+
+static inline v4f blend_factor(int f, v4f src, v4f dst, v4f cst) {
+    switch (f) {
+        case 0: return (v4f) {};
+        case 1: return (v4f) {} + 1;
+        case 2: return src;
+        case 3: return 1 - src;
+        case 4: return dst;
+        case 5: return 1 - dst;
+        case 6: return (v4f) {} + src[3];
+        case 7: return (v4f) {} + (1 - src[3]);
+        case 8: return (v4f) {} + dst[3];
+        case 9: return (v4f) {} + (1 - dst[3]);
+        case 10: return cst;
+        case 11: return 1 - cst;
+        case 12: return (v4f) {} + cst[3];
+        case 13: return (v4f) {} + (1 - cst[3]);
+        case 14: {
+            float f = fminf(src[3], 1 - dst[3]);
+            return (v4f) {f, f, f, 1};
+        }
+        default: return (v4f) {};
+    }
+}
+
+static inline v4f blend_eq(int eq, v4f s, v4f d) {
+    switch (eq) {
+        case 1: return s - d;
+        case 2: return d - s;
+        case 3:
+            return (v4f) {fminf(s[0], d[0]), fminf(s[1], d[1]),
+                          fminf(s[2], d[2]), fminf(s[3], d[3])};
+        case 4:
+            return (v4f) {fmaxf(s[0], d[0]), fmaxf(s[1], d[1]),
+                          fmaxf(s[2], d[2]), fmaxf(s[3], d[3])};
+        default: return s + d;
+    }
+}
+
+static inline u8 logic_op(int op, u8 s, u8 d) {
+    switch (op) {
+        case 0: return 0;
+        case 1: return s & d;
+        case 2: return s & ~d;
+        case 3: return s;
+        case 4: return 0xff;
+        case 5: return ~s;
+        case 6: return d;
+        case 7: return ~d;
+        case 8: return ~(s & d);
+        case 9: return s | d;
+        case 10: return ~(s | d);
+        case 11: return s ^ d;
+        case 12: return ~(s ^ d);
+        case 13: return ~s & d;
+        case 14: return s | ~d;
+        case 15: return ~s | d;
+        default: return s;
+    }
+}
+
+static void shade_pixel(SWRenderer* sw, SWTriangle* t, int x, int y, float e0,
+                        float e1, float e2) {
+    GPU* gpu = sw->gpu;
+    auto fb = &gpu->regs.fb;
+
+    float b0 = e0 * t->invarea;
+    float b1 = e1 * t->invarea;
+    float b2 = e2 * t->invarea;
+
+    float depth = b0 * t->depth[0] + b1 * t->depth[1] + b2 * t->depth[2];
+    float w = 1 / (b0 * t->invw[0] + b1 * t->invw[1] + b2 * t->invw[2]);
+
+    Vertex v;
+    for (int i = 0; i < 24; i++) {
+        v.semantics[i] =
+            (b0 * t->attrs[0][i] + b1 * t->attrs[1][i] + b2 * t->attrs[2][i]) *
+            w;
+    }
+
+    v4f color = run_tev(sw, &v);
+
+    if (sw->ubuf.alphatest &&
+        !comparef(sw->ubuf.alphafunc, color[3], sw->fbuf.alpharef))
+        return;
+
+    u32 memy = sw->fb_h - 1 - y;
+
+    if (sw->depthbuf) {
+        int bpp = depthbpp[sw->depth_fmt];
+        u8* zp = sw->depthbuf + morton_swizzle(sw->fb_w, x, memy) * bpp;
+
+        u32 zmax = sw->depth_fmt == 0 ? 0xffff : 0xffffff;
+        u32 z = depth * zmax + 0.5f;
+        u32 oldz = zp[0] | zp[1] << 8;
+        if (bpp > 2) oldz |= zp[2] << 16;
+        u8 stencil = bpp == 4 ? zp[3] : 0;
+        u8 newstencil = stencil;
+
+        bool zwrite = fb->perms.depthbuf.write && fb->color_mask.depth;
+        u8 smask = fb->perms.depthbuf.write ? fb->stencil_test.bufmask : 0;
+
+        if (fb->stencil_test.enable && bpp == 4) {
+            u8 ref = fb->stencil_test.ref;
+            u8 mask = fb->stencil_test.mask;
+            if (!compare(fb->stencil_test.func, ref & mask, stencil & mask)) {
+                newstencil = stencil_op(fb->stencil_op.fail, stencil, ref);
+                zp[3] = (stencil & ~smask) | (newstencil & smask);
+                return;
+            }
+        }
+
+        int zfunc = fb->color_mask.depthtest ? fb->color_mask.depthfunc : 1;
+        if (!compare(zfunc, z, oldz)) {
+            if (fb->stencil_test.enable && bpp == 4) {
+                newstencil = stencil_op(fb->stencil_op.zfail, stencil,
+                                        fb->stencil_test.ref);
+                zp[3] = (stencil & ~smask) | (newstencil & smask);
+            }
+            return;
+        }
+        if (fb->stencil_test.enable && bpp == 4) {
+            newstencil = stencil_op(fb->stencil_op.zpass, stencil,
+                                    fb->stencil_test.ref);
+            zp[3] = (stencil & ~smask) | (newstencil & smask);
+        }
+        if (zwrite) {
+            zp[0] = z;
+            zp[1] = z >> 8;
+            if (bpp > 2) zp[2] = z >> 16;
+        }
+    }
+
+    if (!fb->perms.colorbuf.write) return;
+
+    u8* cp = sw->colorbuf +
+             morton_swizzle(sw->fb_w, x, memy) * colorbpp[sw->color_fmt];
+    u8 dst[4];
+    read_color(sw->color_fmt, cp, dst);
+
+    u8 out[4];
+    if (fb->color_op.blend_mode) {
+        v4f d = (v4f) {dst[0], dst[1], dst[2], dst[3]} / 255;
+        v4f cst = (v4f) {fb->blend_color.r, fb->blend_color.g,
+                         fb->blend_color.b, fb->blend_color.a} /
+                  255;
+        v4f s = vclamp(color);
+        v4f rgb =
+            blend_eq(fb->blend_func.rgb_eq,
+                     s * blend_factor(fb->blend_func.rgb_src, s, d, cst),
+                     d * blend_factor(fb->blend_func.rgb_dst, s, d, cst));
+        v4f a = blend_eq(fb->blend_func.a_eq,
+                         s * blend_factor(fb->blend_func.a_src, s, d, cst),
+                         d * blend_factor(fb->blend_func.a_dst, s, d, cst));
+        rgb[3] = a[3];
+        rgb = vclamp(rgb);
+        for (int i = 0; i < 4; i++) out[i] = rgb[i] * 255 + 0.5f;
+    } else {
+        color = vclamp(color);
+        for (int i = 0; i < 4; i++) {
+            out[i] = logic_op(fb->logic_op, color[i] * 255 + 0.5f, dst[i]);
+        }
+    }
+
+    if (!fb->color_mask.red) out[0] = dst[0];
+    if (!fb->color_mask.green) out[1] = dst[1];
+    if (!fb->color_mask.blue) out[2] = dst[2];
+    if (!fb->color_mask.alpha) out[3] = dst[3];
+
+    write_color(sw->color_fmt, cp, out);
+}
+
+static void raster_tile(SWRenderer* sw, int tile) {
+    int tx = tile % sw->tiles_w;
+    int ty = tile / sw->tiles_w;
+    int x0 = MAX(tx * SW_TILE_SIZE, sw->clip_x1);
+    int y0 = MAX(ty * SW_TILE_SIZE, sw->clip_y1);
+    int x1 = MIN(tx * SW_TILE_SIZE + SW_TILE_SIZE - 1, sw->clip_x2);
+    int y1 = MIN(ty * SW_TILE_SIZE + SW_TILE_SIZE - 1, sw->clip_y2);
+
+    // triangles are processed in submission order within each tile so the
+    // result does not depend on the number of threads
+    Vec_foreach(idx, sw->bins[tile]) {
+        SWTriangle* t = &sw->tris.d[*idx];
+        int minx = MAX(t->minx, x0);
+        int miny = MAX(t->miny, y0);
+        int maxx = MIN(t->maxx, x1);
+        int maxy = MIN(t->maxy, y1);
+
+        v4i tl[3];
+        for (int k = 0; k < 3; k++) tl[k] = (v4i) {} - (int) t->topleft[k];
+
+        for (int y = miny; y <= maxy; y++) {
+            float py = y + 0.5f;
+            // evaluate the edge functions for 4 pixels at once
+            for (int x = minx; x <= maxx; x += 4) {
+                v4f px = (v4f) {0.5f, 1.5f, 2.5f, 3.5f} + (float) x;
+                v4f e[3];
+                v4i inside = (v4i) {0, 1, 2, 3} + x <= maxx;
+                for (int k = 0; k < 3; k++) {
+                    e[k] = t->ea[k] * px + (t->eb[k] * py + t->ec[k]);
+                    inside &= (e[k] > 0) | ((e[k] == 0) & tl[k]);
+                }
+                for (int l = 0; l < 4; l++) {
+                    if (inside[l]) {
+                        shade_pixel(sw, t, x + l, y, e[0][l], e[1][l],
+                                    e[2][l]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void run_tiles(SWRenderer* sw) {
+    int ntiles = sw->tiles_w * sw->tiles_h;
+    int t;
+    while ((t = atomic_fetch_add(&sw->nexttile, 1)) < ntiles) {
+        if (sw->bins[t].size) raster_tile(sw, t);
+    }
+}
+
+static void* sw_thrd_func(SWRenderer* sw) {
+    u32 gen = 0;
+    pthread_mutex_lock(&sw->mtx);
+    while (true) {
+        while (sw->gen == gen && !sw->die) {
+            pthread_cond_wait(&sw->start, &sw->mtx);
+        }
+        if (sw->die) break;
+        gen = sw->gen;
+        pthread_mutex_unlock(&sw->mtx);
+
+        run_tiles(sw);
+
+        pthread_mutex_lock(&sw->mtx);
+        if (--sw->working == 0) pthread_cond_signal(&sw->done);
+    }
+    pthread_mutex_unlock(&sw->mtx);
+    return nullptr;
+}
+
+static void dispatch_tiles(SWRenderer* sw) {
+    atomic_store(&sw->nexttile, 0);
+
+    if (sw->nthreads == 0 || sw->tris.size < SW_MIN_TRIS_MT) {
+        run_tiles(sw);
+        return;
+    }
+
+    pthread_mutex_lock(&sw->mtx);
+    sw->working = sw->nthreads;
+    sw->gen++;
+    pthread_cond_broadcast(&sw->start);
+    pthread_mutex_unlock(&sw->mtx);
+
+    // this thread works on tiles too
+    run_tiles(sw);
+
+    pthread_mutex_lock(&sw->mtx);
+    while (sw->working) {
+        pthread_cond_wait(&sw->done, &sw->mtx);
+    }
+    pthread_mutex_unlock(&sw->mtx);
+}
+
+void renderer_sw_init(SWRenderer* sw, GPU* gpu) {
+    sw->gpu = gpu;
+
+    Vec_init(sw->tris);
+    sw->bins = nullptr;
+    sw->nbins = 0;
+    for (int i = 0; i < 3; i++) {
+        sw->tex[i] = (SWTexture) {};
+    }
+
+    sw->gen = 0;
+    sw->working = 0;
+    sw->die = false;
+    pthread_mutex_init(&sw->mtx, nullptr);
+    pthread_cond_init(&sw->start, nullptr);
+    pthread_cond_init(&sw->done, nullptr);
+
+    sw->nthreads = ctremu.swrenderer ? ctremu.swthreads : 0;
+    for (int i = 0; i < sw->nthreads; i++) {
+        pthread_create(&sw->thread[i].thd, nullptr, (void*) sw_thrd_func, sw);
+    }
+}
+
+void renderer_sw_destroy(SWRenderer* sw) {
+    pthread_mutex_lock(&sw->mtx);
+    sw->die = true;
+    pthread_cond_broadcast(&sw->start);
+    pthread_mutex_unlock(&sw->mtx);
+    for (int i = 0; i < sw->nthreads; i++) {
+        pthread_join(sw->thread[i].thd, nullptr);
+    }
+    pthread_mutex_destroy(&sw->mtx);
+    pthread_cond_destroy(&sw->start);
+    pthread_cond_destroy(&sw->done);
+
+    Vec_free(sw->tris);
+    for (int i = 0; i < sw->nbins; i++) {
+        Vec_free(sw->bins[i]);
+    }
+    free(sw->bins);
+    for (int i = 0; i < 3; i++) {
+        free(sw->tex[i].d);
+    }
+}
+
+static bool setup_draw(SWRenderer* sw) {
+    GPU* gpu = sw->gpu;
+
+    // shadows or gas, which are skipped like in the gl renderer
+    if (gpu->regs.fb.color_op.frag_mode != 0) return false;
+
+    sw->fb_w = gpu->regs.fb.dim.width;
+    sw->fb_h = gpu->regs.fb.dim.height + 1;
+    sw->color_fmt = gpu->regs.fb.colorbuf_fmt.fmt;
+    sw->depth_fmt = gpu->regs.fb.depthbuf_fmt & 3;
+
+    u32 color_paddr = gpu->regs.fb.colorbuf_loc << 3;
+    u32 depth_paddr = gpu->regs.fb.depthbuf_loc << 3;
+    u32 npixels = sw->fb_w * sw->fb_h;
+    if (!npixels || sw->color_fmt > 4 || !is_valid_physmem(color_paddr) ||
+        !is_valid_physmem(color_paddr +
+                          npixels * colorbpp[sw->color_fmt] - 1)) {
+        lwarn("invalid color buffer at %x", color_paddr);
+        return false;
+    }
+    sw->colorbuf = PTR(color_paddr);
+    if (depth_paddr && is_valid_physmem(depth_paddr) &&
+        is_valid_physmem(depth_paddr + npixels * depthbpp[sw->depth_fmt] -
+                         1)) {
+        sw->depthbuf = PTR(depth_paddr);
+    } else {
+        sw->depthbuf = nullptr;
+    }
+
+    sw->clip_x1 = 0;
+    sw->clip_y1 = 0;
+    sw->clip_x2 = sw->fb_w - 1;
+    sw->clip_y2 = sw->fb_h - 1;
+    if (gpu->regs.raster.scisssortest.enable) {
+        sw->clip_x1 = MAX(sw->clip_x1, gpu->regs.raster.scisssortest.x1);
+        sw->clip_y1 = MAX(sw->clip_y1, gpu->regs.raster.scisssortest.y1);
+        sw->clip_x2 = MIN(sw->clip_x2, gpu->regs.raster.scisssortest.x2);
+        sw->clip_y2 = MIN(sw->clip_y2, gpu->regs.raster.scisssortest.y2);
+    }
+
+    sw->tiles_w = (sw->fb_w + SW_TILE_SIZE - 1) / SW_TILE_SIZE;
+    sw->tiles_h = (sw->fb_h + SW_TILE_SIZE - 1) / SW_TILE_SIZE;
+    int ntiles = sw->tiles_w * sw->tiles_h;
+    if (ntiles > sw->nbins) {
+        sw->bins = realloc(sw->bins, ntiles * sizeof *sw->bins);
+        for (int i = sw->nbins; i < ntiles; i++) {
+            Vec_init(sw->bins[i]);
+        }
+        sw->nbins = ntiles;
+    }
+    for (int i = 0; i < ntiles; i++) {
+        sw->bins[i].size = 0;
+    }
+    sw->tris.size = 0;
+
+    sw->ubuf = (UberUniforms) {};
+    gpu_load_frag_uniforms(gpu, &sw->ubuf, &sw->fbuf);
+
+    if (gpu->regs.tex.config.tex0enable) {
+        decode_texture(sw, 0, &gpu->regs.tex.tex0, gpu->regs.tex.tex0_fmt);
+    } else {
+        sw->tex[0].w = 0;
+    }
+    if (gpu->regs.tex.config.tex1enable) {
+        decode_texture(sw, 1, &gpu->regs.tex.tex1, gpu->regs.tex.tex1_fmt);
+    } else {
+        sw->tex[1].w = 0;
+    }
+    if (gpu->regs.tex.config.tex2enable) {
+        decode_texture(sw, 2, &gpu->regs.tex.tex2, gpu->regs.tex.tex2_fmt);
+    } else {
+        sw->tex[2].w = 0;
+    }
+
+    return true;
+}
+
+static void setup_tri(SWRenderer* sw, Vertex* v0, Vertex* v1, Vertex* v2) {
+    GPU* gpu = sw->gpu;
+    Vertex* v[3] = {v0, v1, v2};
+
+    float vx = gpu->regs.raster.view_x;
+    float vy = gpu->regs.raster.view_y;
+    float vw = cvtf24(gpu->regs.raster.view_w);
+    float vh = cvtf24(gpu->regs.raster.view_h);
+    float zscale = cvtf24(gpu->regs.raster.depthmap_scale);
+    float zoffset = cvtf24(gpu->regs.raster.depthmap_offset);
+
+    float sx[3], sy[3], depth[3], invw[3];
+    for (int k = 0; k < 3; k++) {
+        invw[k] = 1 / v[k]->pos[3];
+        sx[k] = (v[k]->pos[0] * invw[k] + 1) * vw + vx;
+        sy[k] = (v[k]->pos[1] * invw[k] + 1) * vh + vy;
+        float zn = v[k]->pos[2] * invw[k];
+        // same mapping as the depth range used by the gl renderer
+        depth[k] = gpu->regs.raster.depthmap_enable ? zn * zscale + zoffset
+                                                     : -zn;
+        depth[k] = fminf(fmaxf(depth[k], 0), 1);
+    }
+
+    float area2 = (sx[1] - sx[0]) * (sy[2] - sy[0]) -
+                  (sx[2] - sx[0]) * (sy[1] - sy[0]);
+    if (area2 == 0 || isnan(area2)) return;
+    switch (gpu->regs.raster.cullmode) {
+        case 1:
+            if (area2 > 0) return;
+            break;
+        case 2:
+            if (area2 < 0) return;
+            break;
+    }
+    if (area2 < 0) {
+#define SWAP(a, b)                                                             \
+    ({                                                                         \
+        auto tmp = a;                                                          \
+        a = b;                                                                 \
+        b = tmp;                                                               \
+    })
+        SWAP(v[1], v[2]);
+        SWAP(sx[1], sx[2]);
+        SWAP(sy[1], sy[2]);
+        SWAP(depth[1], depth[2]);
+        SWAP(invw[1], invw[2]);
+#undef SWAP
+        area2 = -area2;
+    }
+
+    int minx = MAX(floorf(fminf(sx[0], fminf(sx[1], sx[2]))), sw->clip_x1);
+    int miny = MAX(floorf(fminf(sy[0], fminf(sy[1], sy[2]))), sw->clip_y1);
+    int maxx = MIN(ceilf(fmaxf(sx[0], fmaxf(sx[1], sx[2]))), sw->clip_x2);
+    int maxy = MIN(ceilf(fmaxf(sy[0], fmaxf(sy[1], sy[2]))), sw->clip_y2);
+    if (minx > maxx || miny > maxy) return;
+
+    SWTriangle t;
+    t.minx = minx;
+    t.miny = miny;
+    t.maxx = maxx;
+    t.maxy = maxy;
+    t.invarea = 1 / area2;
+    // edge k is opposite vertex k
+    for (int k = 0; k < 3; k++) {
+        int p = (k + 1) % 3;
+        int q = (k + 2) % 3;
+        t.ea[k] = sy[p] - sy[q];
+        t.eb[k] = sx[q] - sx[p];
+        t.ec[k] = -(t.ea[k] * sx[p] + t.eb[k] * sy[p]);
+        t.topleft[k] = t.ea[k] > 0 || (t.ea[k] == 0 && t.eb[k] < 0);
+
+        t.depth[k] = depth[k];
+        t.invw[k] = invw[k];
+        for (int i = 0; i < 24; i++) {
+            t.attrs[k][i] = v[k]->semantics[i] * invw[k];
+        }
+    }
+    u32 idx = Vec_push(sw->tris, t);
+
+    for (int ty = miny / SW_TILE_SIZE; ty <= maxy / SW_TILE_SIZE; ty++) {
+        for (int tx = minx / SW_TILE_SIZE; tx <= maxx / SW_TILE_SIZE; tx++) {
+            Vec_push(sw->bins[ty * sw->tiles_w + tx], idx);
+        }
+    }
+}
+
+// pica clip space has -w <= z <= 0, x and y are only clipped to a guard
+// band to keep the edge functions precise
+static const float clipplanes[][4] = {
+    {0, 0, 0, 1},  {0, 0, -1, 0}, {0, 0, 1, 1},  {-1, 0, 0, 2},
+    {1, 0, 0, 2},  {0, -1, 0, 2}, {0, 1, 0, 2},
+};
+#define NCLIPPLANES (sizeof clipplanes / sizeof clipplanes[0])
+
+#define CLIP_EPS 1e-5f
+
+static inline float clip_dist(int p, Vertex* v) {
+    return clipplanes[p][0] * v->pos[0] + clipplanes[p][1] * v->pos[1] +
+           clipplanes[p][2] * v->pos[2] + clipplanes[p][3] * v->pos[3] -
+           (p == 0 ? CLIP_EPS : 0);
+}
+
+static void clip_tri(SWRenderer* sw, Vertex* v0, Vertex* v1, Vertex* v2) {
+    bool inside = true;
+    for (int p = 0; p < NCLIPPLANES; p++) {
+        float d0 = clip_dist(p, v0);
+        float d1 = clip_dist(p, v1);
+        float d2 = clip_dist(p, v2);
+        if (d0 < 0 && d1 < 0 && d2 < 0) return;
+        if (d0 < 0 || d1 < 0 || d2 < 0) inside = false;
+    }
+    if (inside) {
+        setup_tri(sw, v0, v1, v2);
+        return;
+    }
+
+    Vertex buf[2][3 + NCLIPPLANES];
+    Vertex* in = buf[0];
+    Vertex* out = buf[1];
+    int n = 3;
+    in[0] = *v0;
+    in[1] = *v1;
+    in[2] = *v2;
+
+    for (int p = 0; p < NCLIPPLANES; p++) {
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            Vertex* cur = &in[i];
+            Vertex* next = &in[(i + 1) % n];
+            float dc = clip_dist(p, cur);
+            float dn = clip_dist(p, next);
+            if (dc >= 0) out[m++] = *cur;
+            if ((dc >= 0) != (dn >= 0)) {
+                float t = dc / (dc - dn);
+                for (int j = 0; j < 24; j++) {
+                    out[m].semantics[j] =
+                        cur->semantics[j] +
+                        (next->semantics[j] - cur->semantics[j]) * t;
+                }
+                m++;
+            }
+        }
+        if (m < 3) return;
+        n = m;
+        Vertex* tmp = in;
+        in = out;
+        out = tmp;
+    }
+
+    for (int i = 1; i < n - 1; i++) {
+        setup_tri(sw, &in[0], &in[i], &in[i + 1]);
+    }
+}
+
+void renderer_sw_draw(SWRenderer* sw, Vertex* vbuf, u16* indices, int count) {
+    if (!setup_draw(sw)) return;
+
+#define VTX(i) (&vbuf[indices ? indices[i] : (i)])
+    switch (sw->gpu->regs.geom.prim_config.mode) {
+        case 1: // strip
+            for (int i = 0; i + 2 < count; i++) {
+                if (i & 1) {
+                    clip_tri(sw, VTX(i + 1), VTX(i), VTX(i + 2));
+                } else {
+                    clip_tri(sw, VTX(i), VTX(i + 1), VTX(i + 2));
+                }
+            }
+            break;
+        case 2: // fan
+            for (int i = 1; i + 1 < count; i++) {
+                clip_tri(sw, VTX(0), VTX(i), VTX(i + 1));
+            }
+            break;
+        default:
+            for (int i = 0; i + 2 < count; i += 3) {
+                clip_tri(sw, VTX(i), VTX(i + 1), VTX(i + 2));
+            }
+    }
+#undef VTX
+
+    if (!sw->tris.size) return;
+
+    linfo("sw rasterizing %zu triangles", sw->tris.size);
+
+    dispatch_tiles(sw);
+}
+
+void renderer_sw_fill(SWRenderer* sw, u32 paddr, u32 endpaddr, u32 value,
+                      int Bpp) {
+    GPU* gpu = sw->gpu;
+    if (endpaddr <= paddr || !is_valid_physmem(paddr) ||
+        !is_valid_physmem(endpaddr - 1))
+        return;
+
+    u8* p = PTR(paddr);
+    u32 size = endpaddr - paddr;
+    switch (Bpp) {
+        case 2:
+            for (u32 i = 0; i < size / 2; i++) {
+                ((u16*) p)[i] = value;
+            }
+            break;
+        case 3:
+            for (u32 i = 0; i < size / 3; i++) {
+                p[3 * i] = value;
+                p[3 * i + 1] = value >> 8;
+                p[3 * i + 2] = value >> 16;
+            }
+            break;
+        case 4:
+            for (u32 i = 0; i < size / 4; i++) {
+                ((u32*) p)[i] = value;
+            }
+            break;
+    }
+}
+
+// copies the same region of the framebuffer that the gl renderer copies
+// into the screen texture
+void renderer_sw_display(SWRenderer* sw, u32 paddr, int w, int h, int fmt,
+                         int yoff, bool scalex, bool scaley, int screenid) {
+    GPU* gpu = sw->gpu;
+    if (fmt > 4 || !is_valid_physmem(paddr) ||
+        !is_valid_physmem(paddr + w * h * colorbpp[fmt] - 1))
+        return;
+    u8* src = PTR(paddr);
+
+    int outw = SCREEN_HEIGHT << scalex;
+    int outh = SCREEN_WIDTH(screenid) << scaley;
+    int starty = h - SCREEN_WIDTH(screenid) + yoff;
+
+    u8 (*pixels)[outw][4] = calloc(outh, sizeof *pixels);
+    for (int r = 0; r < outh; r++) {
+        int y = starty + r;
+        if (y < 0 || y >= h) continue;
+        for (int x = 0; x < outw && x < w; x++) {
+            read_color(fmt,
+                       src + morton_swizzle(w, x, h - 1 - y) * colorbpp[fmt],
+                       pixels[r][x]);
+        }
+    }
+
+    glBindTexture(GL_TEXTURE_2D, gpu->gl.screentex[screenid]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, outw, outh, 0, GL_RGBA,
+                 GL_UNSIGNED_BYTE, pixels);
+    free(pixels);
+}
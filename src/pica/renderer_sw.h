@@ -0,0 +1,91 @@
+#ifndef RENDERER_SW_H
+#define RENDERER_SW_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "common.h"
+
+#include "shadergen.h"
+
+#define SW_MAX_THREADS 16
+#define SW_TILE_SIZE 32
+
+typedef struct _GPU GPU;
+typedef union _Vertex Vertex;
+
+typedef float v4f __attribute__((vector_size(16)));
+typedef s32 v4i __attribute__((vector_size(16)));
+
+typedef struct {
+    // edge functions e(x,y) = a*x + b*y + c, positive inside
+    float ea[3], eb[3], ec[3];
+    bool topleft[3];
+    float invarea;
+    int minx, miny, maxx, maxy;
+
+    float depth[3];
+    float invw[3];
+    // vertex attributes premultiplied by 1/w
+    float attrs[3][24];
+} SWTriangle;
+
+typedef struct {
+    u32* d;
+    int w, h;
+    // identifies the decoded texture so it can be reused across draws
+    u32 paddr;
+    u32 fmt;
+    u64 hash;
+
+    int wrap_s, wrap_t;
+    bool linear;
+    v4f border;
+} SWTexture;
+
+typedef Vector(u32) SWTileBin;
+
+typedef struct {
+    GPU* gpu;
+
+    struct {
+        pthread_t thd;
+    } thread[SW_MAX_THREADS];
+    int nthreads;
+
+    pthread_mutex_t mtx;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    u32 gen;
+    int working;
+    bool die;
+    atomic_int nexttile;
+
+    Vector(SWTriangle) tris;
+    SWTileBin* bins;
+    int nbins;
+    int tiles_w, tiles_h;
+
+    // per draw state
+    u8* colorbuf;
+    u8* depthbuf;
+    int fb_w, fb_h;
+    int color_fmt;
+    int depth_fmt;
+    int clip_x1, clip_y1, clip_x2, clip_y2;
+
+    UberUniforms ubuf;
+    FragUniforms fbuf;
+    SWTexture tex[3];
+} SWRenderer;
+
+void renderer_sw_init(SWRenderer* sw, GPU* gpu);
+void renderer_sw_destroy(SWRenderer* sw);
+
+void renderer_sw_draw(SWRenderer* sw, Vertex* vbuf, u16* indices, int count);
+void renderer_sw_fill(SWRenderer* sw, u32 paddr, u32 endpaddr, u32 value,
+                      int Bpp);
+void renderer_sw_display(SWRenderer* sw, u32 paddr, int w, int h, int fmt,
+                         int yoff, bool scalex, bool scaley, int screenid);
+
+#endif
@@ -1,6 +1,7 @@
 #include "shader.h"
 
 #include <math.h>
+#include <stdlib.h>
 
 void readsrc(ShaderUnit* shu, fvec4 src, u32 n, u8 idx, u8 swizzle, bool neg) {
     fvec4* rn;
@@ -458,8 +459,656 @@ void shader_run(ShaderUnit* shu) {
     }
 }
 
+typedef float v4f __attribute__((vector_size(16)));
+typedef s32 v4i __attribute__((vector_size(16)));
+
+enum {
+    OP_ADD,
+    OP_DP3,
+    OP_DP4,
+    OP_DPH,
+    OP_DST,
+    OP_EX2,
+    OP_LG2,
+    OP_MUL,
+    OP_SGE,
+    OP_SLT,
+    OP_FLR,
+    OP_MAX,
+    OP_MIN,
+    OP_RCP,
+    OP_RSQ,
+    OP_MOVA,
+    OP_MOV,
+    OP_CMP,
+    OP_MAD,
+    OP_NOP,
+    OP_BREAK,
+    OP_END,
+    OP_CALL,
+    OP_IF,
+    OP_LOOP,
+    OP_JMP,
+    OP_UNKNOWN,
+    // past the end of the code
+    OP_EXIT,
+
+    OP_COUNT
+};
+
+enum {
+    COND_ALWAYS,
+    COND_CMP,
+    COND_BOOL,
+};
+
+typedef struct {
+    // v and r are at an offset in the shader unit, c is at an offset in the
+    // uniforms and may be indexed by idx
+    bool uniform;
+    u8 idx;
+    u16 off;
+    u8 sw[4];
+    bool neg;
+} ShaderOperand;
+
+typedef struct {
+    const void* handler;
+    u8 op;
+    // whether the instruction after this one can end a control flow block
+    bool check;
+
+    u8 mask;
+    u16 dest;
+    ShaderOperand src[3];
+
+    u8 cmpx;
+    u8 cmpy;
+
+    u8 cond;
+    u8 condop;
+    bool refx;
+    bool refy;
+    u8 bit;
+    bool inv;
+    u16 target;
+    u16 num;
+
+    u32 w;
+} ShaderOp;
+
+struct _ShaderProg {
+    ShaderOp ops[SHADER_CODE_SIZE + 1];
+};
+
+static ShaderOperand decode_src(u32 n, u8 idx, u8 swizzle, bool neg) {
+    ShaderOperand s = {.neg = neg};
+    if (n < 0x10) {
+        s.off = offsetof(ShaderUnit, v) + n * sizeof(fvec4);
+    } else if (n < 0x20) {
+        s.off = offsetof(ShaderUnit, r) + (n - 0x10) * sizeof(fvec4);
+    } else {
+        s.uniform = true;
+        s.idx = idx;
+        s.off = (n - 0x20) * sizeof(fvec4);
+    }
+    for (int i = 0; i < 4; i++) {
+        s.sw[i] = (swizzle >> 2 * (3 - i)) & 3;
+    }
+    return s;
+}
+
+static u16 decode_dest(u32 n) {
+    if (n < 0x10) return offsetof(ShaderUnit, o) + n * sizeof(fvec4);
+    else return offsetof(ShaderUnit, r) + (n - 0x10) * sizeof(fvec4);
+}
+
+#define DEC_SRC(i, _fmt)                                                       \
+    (op->src[i - 1] =                                                          \
+         decode_src(instr.fmt##_fmt.src##i, instr.fmt##_fmt.idx,               \
+                    desc.src##i##swizzle, desc.src##i##neg))
+#define DEC_DEST(_fmt)                                                         \
+    (op->dest = decode_dest(instr.fmt##_fmt.dest), op->mask = desc.destmask)
+
+static void decode_instr(ShaderOp* op, PICAInstr instr, OpDesc* opdescs) {
+    OpDesc desc = opdescs[instr.desc];
+    op->w = instr.w;
+    switch (instr.opcode) {
+        case PICA_ADD:
+        case PICA_DP3:
+        case PICA_DP4:
+        case PICA_DPH:
+        case PICA_DST:
+        case PICA_MUL:
+        case PICA_SGE:
+        case PICA_SLT:
+        case PICA_MAX:
+        case PICA_MIN:
+            DEC_SRC(1, 1);
+            DEC_SRC(2, 1);
+            DEC_DEST(1);
+            break;
+        case PICA_DPHI:
+        case PICA_DSTI:
+        case PICA_SGEI:
+        case PICA_SLTI:
+            DEC_SRC(1, 1i);
+            DEC_SRC(2, 1i);
+            DEC_DEST(1);
+            break;
+        case PICA_EX2:
+        case PICA_LG2:
+        case PICA_FLR:
+        case PICA_RCP:
+        case PICA_RSQ:
+        case PICA_MOVA:
+        case PICA_MOV:
+            DEC_SRC(1, 1);
+            DEC_DEST(1);
+            break;
+        case PICA_CMP ... PICA_CMP + 1:
+            DEC_SRC(1, 1c);
+            DEC_SRC(2, 1c);
+            op->cmpx = instr.fmt1c.cmpx;
+            op->cmpy = instr.fmt1c.cmpy;
+            break;
+        case PICA_MAD ... PICA_MAD + 0xf:
+            desc = opdescs[instr.fmt5.desc];
+            DEC_SRC(1, 5);
+            if (instr.fmt5.opcode & 1) {
+                DEC_SRC(2, 5);
+                DEC_SRC(3, 5);
+            } else {
+                DEC_SRC(2, 5i);
+                DEC_SRC(3, 5i);
+            }
+            DEC_DEST(5);
+            break;
+        case PICA_BREAKC:
+        case PICA_CALLC:
+        case PICA_IFC:
+        case PICA_JMPC:
+            op->cond = COND_CMP;
+            op->condop = instr.fmt2.op;
+            op->refx = instr.fmt2.refx;
+            op->refy = instr.fmt2.refy;
+            op->target = instr.fmt2.dest;
+            op->num = instr.fmt2.num;
+            break;
+        case PICA_CALLU:
+        case PICA_IFU:
+        case PICA_JMPU:
+            op->cond = COND_BOOL;
+            op->bit = instr.fmt3.c;
+            op->inv = instr.opcode == PICA_JMPU && (instr.fmt3.num & 1);
+            op->target = instr.fmt3.dest;
+            op->num = instr.fmt3.num;
+            break;
+        case PICA_CALL:
+        case PICA_LOOP:
+            op->target = instr.fmt3.dest;
+            op->num = instr.fmt3.num;
+            op->bit = instr.fmt3.c & 3;
+            break;
+    }
+
+    switch (instr.opcode) {
+        case PICA_ADD:
+            op->op = OP_ADD;
+            break;
+        case PICA_DP3:
+            op->op = OP_DP3;
+            break;
+        case PICA_DP4:
+            op->op = OP_DP4;
+            break;
+        case PICA_DPH:
+        case PICA_DPHI:
+            op->op = OP_DPH;
+            break;
+        case PICA_DST:
+        case PICA_DSTI:
+            op->op = OP_DST;
+            break;
+        case PICA_EX2:
+            op->op = OP_EX2;
+            break;
+        case PICA_LG2:
+            op->op = OP_LG2;
+            break;
+        case PICA_MUL:
+            op->op = OP_MUL;
+            break;
+        case PICA_SGE:
+        case PICA_SGEI:
+            op->op = OP_SGE;
+            break;
+        case PICA_SLT:
+        case PICA_SLTI:
+            op->op = OP_SLT;
+            break;
+        case PICA_FLR:
+            op->op = OP_FLR;
+            break;
+        case PICA_MAX:
+            op->op = OP_MAX;
+            break;
+        case PICA_MIN:
+            op->op = OP_MIN;
+            break;
+        case PICA_RCP:
+            op->op = OP_RCP;
+            break;
+        case PICA_RSQ:
+            op->op = OP_RSQ;
+            break;
+        case PICA_MOVA:
+            op->op = OP_MOVA;
+            break;
+        case PICA_MOV:
+            op->op = OP_MOV;
+            break;
+        case PICA_CMP ... PICA_CMP + 1:
+            op->op = OP_CMP;
+            break;
+        case PICA_MAD ... PICA_MAD + 0xf:
+            op->op = OP_MAD;
+            break;
+        case PICA_NOP:
+            op->op = OP_NOP;
+            break;
+        case PICA_BREAK:
+        case PICA_BREAKC:
+            op->op = OP_BREAK;
+            break;
+        case PICA_END:
+            op->op = OP_END;
+            break;
+        case PICA_CALL:
+        case PICA_CALLC:
+        case PICA_CALLU:
+            op->op = OP_CALL;
+            break;
+        case PICA_IFU:
+        case PICA_IFC:
+            op->op = OP_IF;
+            break;
+        case PICA_LOOP:
+            op->op = OP_LOOP;
+            break;
+        case PICA_JMPC:
+        case PICA_JMPU:
+            op->op = OP_JMP;
+            break;
+        default:
+            op->op = OP_UNKNOWN;
+            break;
+    }
+}
+
+// the pc values where a block on the control stack can end, only
+// instructions which fall through to one of these need to check the stack
+static void mark_block_ends(ShaderProg* prog, PICAInstr* code) {
+    bool ends[SHADER_CODE_SIZE + 1] = {};
+    for (u32 pc = 0; pc < SHADER_CODE_SIZE; pc++) {
+        PICAInstr instr = code[pc];
+        u32 end;
+        switch (instr.opcode) {
+            case PICA_CALL:
+            case PICA_CALLC:
+            case PICA_CALLU:
+                end = instr.fmt3.dest + instr.fmt3.num;
+                break;
+            case PICA_IFU:
+            case PICA_IFC:
+                end = instr.fmt2.dest;
+                break;
+            case PICA_LOOP:
+                end = instr.fmt3.dest + 1;
+                break;
+            default:
+                continue;
+        }
+        if (end <= SHADER_CODE_SIZE) ends[end] = true;
+    }
+    for (u32 pc = 0; pc < SHADER_CODE_SIZE; pc++) {
+        prog->ops[pc].check = ends[pc + 1];
+    }
+}
+
+static void run_prog(ShaderUnit* shu, ShaderProg* prog);
+
+ShaderProg* pica_shader_decode(ShaderUnit* shu) {
+    ShaderProg* prog = calloc(1, sizeof *prog);
+    for (u32 pc = 0; pc < SHADER_CODE_SIZE; pc++) {
+        decode_instr(&prog->ops[pc], shu->code[pc], shu->opdescs);
+    }
+    prog->ops[SHADER_CODE_SIZE].op = OP_EXIT;
+    mark_block_ends(prog, shu->code);
+    // fills in the handlers
+    run_prog(nullptr, prog);
+    return prog;
+}
+
+void pica_shader_free(ShaderProg* prog) {
+    free(prog);
+}
+
+static float* relsrc(ShaderUnit* shu, ShaderOperand* s) {
+    u32 n = s->off / sizeof(fvec4);
+    switch (s->idx) {
+        case 1:
+            n += shu->a[0];
+            break;
+        case 2:
+            n += shu->a[1];
+            break;
+        case 3:
+            n += shu->al;
+            break;
+    }
+    n &= 0x7f;
+    if (n < 0x60) return shu->c[n];
+    // out of bounds uniforms read as vec4(1)
+    static fvec4 dummy = {1, 1, 1, 1};
+    return dummy;
+}
+
+static inline v4f readop(ShaderUnit* shu, ShaderOperand* s) {
+    float* p;
+    if (!s->uniform) p = (float*) ((u8*) shu + s->off);
+    else if (!s->idx) p = (float*) ((u8*) shu->c + s->off);
+    else p = relsrc(shu, s);
+    v4f x = {p[s->sw[0]], p[s->sw[1]], p[s->sw[2]], p[s->sw[3]]};
+    return s->neg ? -x : x;
+}
+
+static const v4i destmasks[16] = {
+    {0, 0, 0, 0},   {0, 0, 0, -1},   {0, 0, -1, 0},   {0, 0, -1, -1},
+    {0, -1, 0, 0},  {0, -1, 0, -1},  {0, -1, -1, 0},  {0, -1, -1, -1},
+    {-1, 0, 0, 0},  {-1, 0, 0, -1},  {-1, 0, -1, 0},  {-1, 0, -1, -1},
+    {-1, -1, 0, 0}, {-1, -1, 0, -1}, {-1, -1, -1, 0}, {-1, -1, -1, -1},
+};
+
+static inline void writeop(ShaderUnit* shu, ShaderOp* op, v4f res) {
+    v4f* d = (v4f*) ((u8*) shu + op->dest);
+    v4i m = destmasks[op->mask];
+    *d = (v4f) (((v4i) *d & ~m) | ((v4i) res & m));
+}
+
+static inline bool opcond(ShaderUnit* shu, ShaderOp* op) {
+    switch (op->cond) {
+        case COND_CMP:
+            return condop(op->condop, shu->cmp[0], shu->cmp[1], op->refx,
+                          op->refy);
+        case COND_BOOL:
+            return ((shu->b >> op->bit) & 1) != op->inv;
+        default:
+            return true;
+    }
+}
+
+// MUL for each component
+static inline v4f vmul(v4f a, v4f b) {
+    return (v4f) ((v4i) (a * b) & (a != 0));
+}
+
+#define SPLAT(x) ((v4f) {x, x, x, x})
+#define ONES(c) ((v4f) ((c) & (v4i) SPLAT(1.0f)))
+
+#define A readop(shu, &op->src[0])
+#define B readop(shu, &op->src[1])
+#define C readop(shu, &op->src[2])
+#define RES(v) writeop(shu, op, v)
+#define PC ((u32) (op - prog->ops))
+
+#define DISPATCH() goto* op->handler
+#define NEXT()                                                                 \
+    ({                                                                         \
+        if (op->check) {                                                       \
+            pc = PC + 1;                                                       \
+            goto check;                                                        \
+        }                                                                      \
+        op++;                                                                  \
+        DISPATCH();                                                            \
+    })
+
+// each instruction jumps straight to the handler of the next, the control
+// stack is only checked after control flow and before block ends
+static void run_prog(ShaderUnit* shu, ShaderProg* prog) {
+    static const void* const handlers[OP_COUNT] = {
+        [OP_ADD] = &&op_add,
+        [OP_DP3] = &&op_dp3,
+        [OP_DP4] = &&op_dp4,
+        [OP_DPH] = &&op_dph,
+        [OP_DST] = &&op_dst,
+        [OP_EX2] = &&op_ex2,
+        [OP_LG2] = &&op_lg2,
+        [OP_MUL] = &&op_mul,
+        [OP_SGE] = &&op_sge,
+        [OP_SLT] = &&op_slt,
+        [OP_FLR] = &&op_flr,
+        [OP_MAX] = &&op_max,
+        [OP_MIN] = &&op_min,
+        [OP_RCP] = &&op_rcp,
+        [OP_RSQ] = &&op_rsq,
+        [OP_MOVA] = &&op_mova,
+        [OP_MOV] = &&op_mov,
+        [OP_CMP] = &&op_cmp,
+        [OP_MAD] = &&op_mad,
+        [OP_NOP] = &&op_nop,
+        [OP_BREAK] = &&op_break,
+        [OP_END] = &&op_end,
+        [OP_CALL] = &&op_call,
+        [OP_IF] = &&op_if,
+        [OP_LOOP] = &&op_loop,
+        [OP_JMP] = &&op_jmp,
+        [OP_UNKNOWN] = &&op_unknown,
+        [OP_EXIT] = &&op_end,
+    };
+
+    if (!shu) {
+        for (u32 i = 0; i <= SHADER_CODE_SIZE; i++) {
+            prog->ops[i].handler = handlers[prog->ops[i].op];
+        }
+        return;
+    }
+
+    Control stack[16];
+    for (int i = 0; i < 16; i++) stack[i].pc = -1;
+    u32 sp = 0;
+    TOP.dest = 0;
+
+    u32 pc = shu->entrypoint;
+    ShaderOp* op;
+    goto check;
+
+op_add: {
+    RES(A + B);
+    NEXT();
+}
+op_dp3: {
+    v4f m = vmul(A, B);
+    RES(SPLAT(m[0] + m[1] + m[2]));
+    NEXT();
+}
+op_dp4: {
+    v4f m = vmul(A, B);
+    RES(SPLAT(m[0] + m[1] + m[2] + m[3]));
+    NEXT();
+}
+op_dph: {
+    v4f b = B;
+    v4f m = vmul(A, b);
+    RES(SPLAT(m[0] + m[1] + m[2] + b[3]));
+    NEXT();
+}
+op_dst: {
+    v4f a = A;
+    v4f b = B;
+    RES(((v4f) {1, MUL(a[1], b[1]), a[2], b[3]}));
+    NEXT();
+}
+op_ex2: {
+    RES(SPLAT(exp2f(A[0])));
+    NEXT();
+}
+op_lg2: {
+    RES(SPLAT(log2f(A[0])));
+    NEXT();
+}
+op_mul: {
+    RES(vmul(A, B));
+    NEXT();
+}
+op_sge: {
+    RES(ONES(A >= B));
+    NEXT();
+}
+op_slt: {
+    RES(ONES(A < B));
+    NEXT();
+}
+op_flr: {
+    v4f a = A;
+    RES(((v4f) {floorf(a[0]), floorf(a[1]), floorf(a[2]), floorf(a[3])}));
+    NEXT();
+}
+op_max: {
+    v4f a = A;
+    v4f b = B;
+    RES(((v4f) {MAX(a[0], b[0]), MAX(a[1], b[1]), MAX(a[2], b[2]),
+                MAX(a[3], b[3])}));
+    NEXT();
+}
+op_min: {
+    v4f a = A;
+    v4f b = B;
+    RES(((v4f) {MIN(a[0], b[0]), MIN(a[1], b[1]), MIN(a[2], b[2]),
+                MIN(a[3], b[3])}));
+    NEXT();
+}
+op_rcp: {
+    float x = A[0];
+    if (x == -0.f) x = 0;
+    RES(SPLAT(1 / x));
+    NEXT();
+}
+op_rsq: {
+    float x = A[0];
+    if (x == -0.f) x = 0;
+    RES(SPLAT(1 / sqrtf(x)));
+    NEXT();
+}
+op_mova: {
+    v4f a = A;
+    if (op->mask & BIT(3 - 0)) shu->a[0] = a[0];
+    if (op->mask & BIT(3 - 1)) shu->a[1] = a[1];
+    NEXT();
+}
+op_mov: {
+    RES(A);
+    NEXT();
+}
+op_cmp: {
+    v4f a = A;
+    v4f b = B;
+    shu->cmp[0] = compare(op->cmpx, a[0], b[0]);
+    shu->cmp[1] = compare(op->cmpy, a[1], b[1]);
+    NEXT();
+}
+op_mad: {
+    RES(vmul(A, B) + C);
+    NEXT();
+}
+op_nop: {
+    NEXT();
+}
+op_unknown: {
+    lerror("unknown PICA instruction %08x (opcode %x)", op->w, op->w >> 26);
+    NEXT();
+}
+op_break: {
+    if (opcond(shu, op)) {
+        pc = TOP.pc + 1;
+        POP();
+    } else {
+        pc = PC + 1;
+    }
+    goto check;
+}
+op_call: {
+    pc = PC + 1;
+    if (opcond(shu, op)) {
+        PUSH();
+        TOP.dest = pc;
+        TOP.loop = false;
+        pc = op->target;
+        TOP.pc = pc + op->num;
+    }
+    goto check;
+}
+op_if: {
+    if (opcond(shu, op)) {
+        PUSH();
+        TOP.pc = op->target;
+        TOP.dest = op->target + op->num;
+        TOP.loop = false;
+        pc = PC + 1;
+    } else {
+        pc = op->target;
+    }
+    goto check;
+}
+op_loop: {
+    pc = PC + 1;
+    shu->al = shu->i[op->bit][1];
+    PUSH();
+    TOP.pc = op->target + 1;
+    TOP.dest = pc;
+    TOP.loop = true;
+    TOP.idx = 0;
+    TOP.inc = shu->i[op->bit][2];
+    TOP.max = shu->i[op->bit][0];
+    goto check;
+}
+op_jmp: {
+    pc = opcond(shu, op) ? op->target : PC + 1;
+    goto check;
+}
+
+check:
+    while (TOP.pc == pc) {
+        if (TOP.loop) {
+            shu->al += TOP.inc;
+            if (TOP.idx++ == TOP.max) {
+                POP();
+            } else {
+                pc = TOP.dest;
+            }
+        } else {
+            pc = TOP.dest;
+            POP();
+        }
+    }
+    if (pc >= SHADER_CODE_SIZE) return;
+    op = &prog->ops[pc];
+    DISPATCH();
+
+op_end:
+    return;
+}
+
+#undef A
+#undef B
+#undef C
+#undef RES
+#undef PC
+
+// shaders without a decoded program are run directly from the code
 void pica_shader_exec(ShaderUnit* shu) {
-    shader_run(shu);
+    if (shu->prog) run_prog(shu, shu->prog);
+    else shader_run(shu);
 }
 
 static char coordnames[4] = "xyzw";
@@ -127,6 +127,21 @@ typedef union {
     };
 } OpDesc;
 
+// a shader decoded once for the interpreter, with operands resolved to
+// offsets, swizzles to component indices and control flow to instruction
+// indices
+typedef struct _ShaderProg ShaderProg;
+
+typedef struct _ShaderInterpBlock {
+    union {
+        u64 hash;
+        u64 key;
+    };
+    ShaderProg* prog;
+
+    struct _ShaderInterpBlock *next, *prev;
+} ShaderInterpBlock;
+
 typedef struct {
     PICAInstr* code;
     OpDesc* opdescs;
@@ -145,10 +160,14 @@ typedef struct {
     u8 al;
     bool cmp[2];
 
+    ShaderProg* prog;
 } ShaderUnit;
 
 void pica_shader_exec(ShaderUnit* shu);
 
+ShaderProg* pica_shader_decode(ShaderUnit* shu);
+void pica_shader_free(ShaderProg* prog);
+
 void pica_shader_disasm(ShaderUnit* shu);
 
 #endif
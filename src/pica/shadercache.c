@@ -0,0 +1,229 @@
+#include "shadercache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define XXH_INLINE_ALL
+#include <xxh3.h>
+
+#define SHADERCACHE_MAGIC 0x43485354 // TSHC
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u64 driver;
+    u32 count;
+    u32 _pad;
+} ShaderCacheHeader;
+
+typedef struct {
+    u64 vshash;
+    u64 fshash;
+    u32 format;
+    u32 size;
+} ShaderCacheEntry;
+
+// binaries are only valid for the exact driver that produced them
+static u64 driver_hash() {
+    XXH3_state_t* xxst = XXH3_createState();
+    XXH3_64bits_reset(xxst);
+    const char* strs[] = {
+        (const char*) glGetString(GL_VENDOR),
+        (const char*) glGetString(GL_RENDERER),
+        (const char*) glGetString(GL_VERSION),
+    };
+    for (int i = 0; i < 3; i++) {
+        if (strs[i]) XXH3_64bits_update(xxst, strs[i], strlen(strs[i]));
+    }
+    u64 hash = XXH3_64bits_digest(xxst);
+    XXH3_freeState(xxst);
+    return hash;
+}
+
+static u32* index_slot(ShaderCache* c, u64 vshash, u64 fshash) {
+    u32 j = (vshash ^ fshash * 0x9e3779b97f4a7c15) & c->mask;
+    for (;; j = (j + 1) & c->mask) {
+        u32 i = c->index[j];
+        if (!i) break;
+        if (c->bins.d[i - 1].vshash == vshash &&
+            c->bins.d[i - 1].fshash == fshash)
+            break;
+    }
+    return &c->index[j];
+}
+
+static void index_rebuild(ShaderCache* c) {
+    u32 cap = 16;
+    while (cap < 2 * c->bins.size) cap *= 2;
+    free(c->index);
+    c->index = calloc(cap, sizeof(u32));
+    c->mask = cap - 1;
+    for (u32 i = 0; i < c->bins.size; i++) {
+        *index_slot(c, c->bins.d[i].vshash, c->bins.d[i].fshash) = i + 1;
+    }
+}
+
+// replaces the binary if there is already one for the same shaders
+static void insert(ShaderCache* c, ProgBinary bin) {
+    u32* slot = index_slot(c, bin.vshash, bin.fshash);
+    if (*slot) {
+        free(c->bins.d[*slot - 1].data);
+        c->bins.d[*slot - 1] = bin;
+        return;
+    }
+    Vec_push(c->bins, bin);
+    *slot = c->bins.size;
+    if (2 * c->bins.size > c->mask + 1) index_rebuild(c);
+}
+
+static void* shadercache_load(ShaderCache* c) {
+    FILE* fp = fopen(c->path, "rb");
+    if (!fp) goto done;
+
+    ShaderCacheHeader hdr;
+    if (fread(&hdr, sizeof hdr, 1, fp) != 1 || hdr.magic != SHADERCACHE_MAGIC ||
+        hdr.version != SHADERCACHE_VERSION || hdr.driver != c->driver) {
+        linfo("discarding stale shader cache %s", c->path);
+        fclose(fp);
+        goto done;
+    }
+
+    for (u32 i = 0; i < hdr.count; i++) {
+        ShaderCacheEntry ent;
+        if (fread(&ent, sizeof ent, 1, fp) != 1) break;
+        ProgBinary bin = {.vshash = ent.vshash,
+                          .fshash = ent.fshash,
+                          .format = ent.format,
+                          .size = ent.size,
+                          .data = malloc(ent.size)};
+        if (fread(bin.data, ent.size, 1, fp) != 1) {
+            free(bin.data);
+            break;
+        }
+        insert(c, bin);
+    }
+    fclose(fp);
+
+    linfo("loaded %zu programs from shader cache", c->bins.size);
+
+done:
+    atomic_store(&c->loaded, true);
+    return nullptr;
+}
+
+static void shadercache_wait(ShaderCache* c) {
+    if (c->joined) return;
+    pthread_join(c->loader, nullptr);
+    c->joined = true;
+
+    Vec_foreach(bin, c->pending) {
+        insert(c, *bin);
+    }
+    Vec_free(c->pending);
+}
+
+static void shadercache_save(ShaderCache* c) {
+    char* tmppath;
+    asprintf(&tmppath, "%s.tmp", c->path);
+    FILE* fp = fopen(tmppath, "wb");
+    if (!fp) {
+        lwarn("could not write shader cache %s", c->path);
+        free(tmppath);
+        return;
+    }
+
+    ShaderCacheHeader hdr = {.magic = SHADERCACHE_MAGIC,
+                             .version = SHADERCACHE_VERSION,
+                             .driver = c->driver,
+                             .count = c->bins.size};
+    fwrite(&hdr, sizeof hdr, 1, fp);
+    Vec_foreach(bin, c->bins) {
+        ShaderCacheEntry ent = {.vshash = bin->vshash,
+                                .fshash = bin->fshash,
+                                .format = bin->format,
+                                .size = bin->size};
+        fwrite(&ent, sizeof ent, 1, fp);
+        fwrite(bin->data, bin->size, 1, fp);
+    }
+    fclose(fp);
+
+    // replace the old cache only once the new one is complete
+    rename(tmppath, c->path);
+    free(tmppath);
+}
+
+void shadercache_init(ShaderCache* c, const char* title) {
+    Vec_init(c->bins);
+    Vec_init(c->pending);
+    c->index = nullptr;
+    index_rebuild(c);
+    c->dirty = false;
+    c->path = nullptr;
+
+    GLint nformats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &nformats);
+    if (!title || nformats == 0) {
+        atomic_store(&c->loaded, true);
+        c->joined = true;
+        return;
+    }
+
+    asprintf(&c->path, "system/shadercache/%s.bin", title);
+    c->driver = driver_hash();
+
+    // reading the cache can take a while so do it in the background
+    // and only start using it once it is done
+    atomic_store(&c->loaded, false);
+    c->joined = false;
+    pthread_create(&c->loader, nullptr, (void*) shadercache_load, c);
+}
+
+void shadercache_destroy(ShaderCache* c) {
+    shadercache_wait(c);
+    if (c->path && c->dirty) shadercache_save(c);
+
+    Vec_foreach(bin, c->bins) {
+        free(bin->data);
+    }
+    Vec_free(c->bins);
+    free(c->index);
+    c->index = nullptr;
+    free(c->path);
+    c->path = nullptr;
+}
+
+ProgBinary* shadercache_find(ShaderCache* c, u64 vshash, u64 fshash) {
+    if (!atomic_load(&c->loaded)) return nullptr;
+    shadercache_wait(c);
+
+    u32 i = *index_slot(c, vshash, fshash);
+    return i ? &c->bins.d[i - 1] : nullptr;
+}
+
+void shadercache_add(ShaderCache* c, u64 vshash, u64 fshash, GLuint prog) {
+    if (!c->path) return;
+
+    GLint size = 0;
+    glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &size);
+    if (size <= 0) return;
+
+    ProgBinary bin = {
+        .vshash = vshash, .fshash = fshash, .size = size, .data = malloc(size)};
+    glGetProgramBinary(prog, size, nullptr, &bin.format, bin.data);
+    c->dirty = true;
+
+    // the loader owns the cache until it is done, so this is added after
+    if (!atomic_load(&c->loaded)) {
+        Vec_push(c->pending, bin);
+        return;
+    }
+    shadercache_wait(c);
+    insert(c, bin);
+}
+
+void shadercache_remove(ShaderCache* c, ProgBinary* bin) {
+    free(bin->data);
+    *bin = c->bins.d[--c->bins.size];
+    index_rebuild(c);
+    c->dirty = true;
+}
@@ -0,0 +1,49 @@
+#ifndef SHADERCACHE_H
+#define SHADERCACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "common.h"
+
+#include <GL/glew.h>
+
+// bump this whenever the shader generators change
+#define SHADERCACHE_VERSION 1
+
+typedef struct {
+    u64 vshash;
+    u64 fshash;
+    GLenum format;
+    u32 size;
+    void* data;
+} ProgBinary;
+
+// persistent cache of linked program binaries for one title
+typedef struct {
+    char* path;
+    u64 driver;
+
+    Vector(ProgBinary) bins;
+    // open addressed table of indices into bins plus one, keyed by both
+    // hashes
+    u32* index;
+    u32 mask;
+    bool dirty;
+
+    // programs linked while the cache is still loading
+    Vector(ProgBinary) pending;
+
+    pthread_t loader;
+    atomic_bool loaded;
+    bool joined;
+} ShaderCache;
+
+void shadercache_init(ShaderCache* c, const char* title);
+void shadercache_destroy(ShaderCache* c);
+
+ProgBinary* shadercache_find(ShaderCache* c, u64 vshash, u64 fshash);
+void shadercache_add(ShaderCache* c, u64 vshash, u64 fshash, GLuint prog);
+void shadercache_remove(ShaderCache* c, ProgBinary* bin);
+
+#endif
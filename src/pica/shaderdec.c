@@ -7,10 +7,11 @@
 
 #include "gpu.h"
 #include "renderer_gl.h"
+#include "trace.h"
 
 // #define VSH_DEBUG
 
-int shader_dec_get(GPU* gpu) {
+u64 shader_dec_hash(GPU* gpu) {
     // we need to hash the shader code, entrypoint, and outmap
     XXH3_state_t* xxst = XXH3_createState();
     XXH3_64bits_reset(xxst);
@@ -21,9 +22,13 @@ int shader_dec_get(GPU* gpu) {
                        sizeof gpu->regs.raster.sh_outmap);
     u64 hash = XXH3_64bits_digest(xxst);
     XXH3_freeState(xxst);
+    return hash;
+}
 
+int shader_dec_get(GPU* gpu, u64 hash) {
     auto block = LRU_load(gpu->vshaders_hw, hash);
     if (block->hash != hash) {
+        TRACE_SCOPE("shader_dec_vs");
         block->hash = hash;
         glDeleteShader(block->vs);
 
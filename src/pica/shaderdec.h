@@ -21,7 +21,8 @@ typedef struct _VSHCacheEntry {
     struct _VSHCacheEntry *next, *prev;
 } VSHCacheEntry;
 
-int shader_dec_get(GPU* gpu);
+u64 shader_dec_hash(GPU* gpu);
+int shader_dec_get(GPU* gpu, u64 hash);
 
 char* shader_dec_vs(GPU* gpu);
 
@@ -6,11 +6,16 @@
 #include "dynstring.h"
 
 #include "gpu.h"
+#include "trace.h"
 
-int shader_gen_get(GPU* gpu, UberUniforms* ubuf) {
-    u64 hash = XXH3_64bits(ubuf, sizeof *ubuf);
+u64 shader_gen_hash(UberUniforms* ubuf) {
+    return XXH3_64bits(ubuf, sizeof *ubuf);
+}
+
+int shader_gen_get(GPU* gpu, UberUniforms* ubuf, u64 hash) {
     auto block = LRU_load(gpu->fshaders, hash);
     if (block->hash != hash) {
+        TRACE_SCOPE("shader_gen_fs");
         block->hash = hash;
         glDeleteShader(block->fs);
 
@@ -85,6 +85,7 @@ typedef struct _FSHCacheEntry {
 
 char* shader_gen_fs(UberUniforms* ubuf);
 
-int shader_gen_get(GPU* gpu, UberUniforms* ubuf);
+u64 shader_gen_hash(UberUniforms* ubuf);
+int shader_gen_get(GPU* gpu, UberUniforms* ubuf, u64 hash);
 
 #endif
@@ -13,7 +13,7 @@ ShaderJitFunc shaderjit_get(GPU* gpu, ShaderUnit* shu) {
     if (block->hash != hash) {
         block->hash = hash;
         shaderjit_backend_free(block->backend);
-        block->backend = shaderjit_backend_init();
+        block->backend = shaderjit_backend_init(hash);
     }
     return shaderjit_backend_get_code(block->backend, shu);
 }
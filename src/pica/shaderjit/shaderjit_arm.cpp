@@ -2,6 +2,8 @@
 
 #include "shaderjit_arm.h"
 
+#include "perfmap.h"
+
 #include <capstone/capstone.h>
 #include <cmath>
 #include <map>
@@ -40,8 +42,11 @@ struct ShaderCode : Xbyak_aarch64::CodeGenerator {
     bool usingex2;
     bool usinglg2;
 
-    ShaderCode()
-        : Xbyak_aarch64::CodeGenerator(4096, Xbyak_aarch64::AutoGrow) {}
+    u64 hash;
+
+    ShaderCode(u64 hash)
+        : Xbyak_aarch64::CodeGenerator(4096, Xbyak_aarch64::AutoGrow),
+          hash(hash) {}
 
     u32 compileWithEntry(ShaderUnit* shu, u32 entry);
     void compileBlock(ShaderUnit* shu, u32 start, u32 len,
@@ -62,6 +67,18 @@ struct ShaderCode : Xbyak_aarch64::CodeGenerator {
         ready();
     }
 
+    // entries are compiled in order so each one ends where the next starts
+    void addPerfMap() {
+        if (!g_perfmap) return;
+        for (auto e = entrypoints.begin(); e != entrypoints.end();) {
+            u32 entry = e->first;
+            u32 start = e->second;
+            u32 end = ++e == entrypoints.end() ? getSize() : e->second;
+            perfmap_add(getCode() + start, end - start, "vsh_%016lx_%03x",
+                        hash, entry);
+        }
+    }
+
     // it is possible to have multiple entrypoints in the same shader
     // we keep track of them and whenever there is a new one we recompile
     // the entire shader
@@ -72,6 +89,7 @@ struct ShaderCode : Xbyak_aarch64::CodeGenerator {
             entrypoints[shu->entrypoint] = 0;
             compileAllEntries(shu);
             offset = entrypoints[shu->entrypoint];
+            addPerfMap();
 #ifdef JIT_DISASM
             pica_shader_disasm(shu);
             shaderjit_arm_disassemble((void*) this);
@@ -845,8 +863,8 @@ void ShaderCode::compileLg2() {
 
 extern "C" {
 
-void* shaderjit_arm_init() {
-    return (void*) new ShaderCode();
+void* shaderjit_arm_init(u64 hash) {
+    return (void*) new ShaderCode(hash);
 }
 
 ShaderJitFunc shaderjit_arm_get_code(void* backend, ShaderUnit* shu) {
@@ -9,7 +9,7 @@ extern "C" {
 
 #include "shaderjit.h"
 
-void* shaderjit_arm_init();
+void* shaderjit_arm_init(u64 hash);
 ShaderJitFunc shaderjit_arm_get_code(void* backend, ShaderUnit* shu);
 void shaderjit_arm_free(void* backend);
 void shaderjit_arm_disassemble(void* backend);
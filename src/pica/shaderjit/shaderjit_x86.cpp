@@ -2,6 +2,8 @@
 
 #include "shaderjit_x86.h"
 
+#include "perfmap.h"
+
 #include <capstone/capstone.h>
 #include <map>
 #include <vector>
@@ -31,7 +33,10 @@ struct ShaderCode : Xbyak::CodeGenerator {
     std::vector<PICAInstr> calls;
     std::map<u32, u32> entrypoints;
 
-    ShaderCode() : Xbyak::CodeGenerator(4096, Xbyak::AutoGrow) {}
+    u64 hash;
+
+    ShaderCode(u64 hash)
+        : Xbyak::CodeGenerator(4096, Xbyak::AutoGrow), hash(hash) {}
 
     u32 compileWithEntry(ShaderUnit* shu, u32 entry);
     void compileBlock(ShaderUnit* shu, u32 start, u32 len);
@@ -45,6 +50,18 @@ struct ShaderCode : Xbyak::CodeGenerator {
         ready();
     }
 
+    // entries are compiled in order so each one ends where the next starts
+    void addPerfMap() {
+        if (!g_perfmap) return;
+        for (auto e = entrypoints.begin(); e != entrypoints.end();) {
+            u32 entry = e->first;
+            u32 start = e->second;
+            u32 end = ++e == entrypoints.end() ? getSize() : e->second;
+            perfmap_add(getCode() + start, end - start, "vsh_%016lx_%03x",
+                        hash, entry);
+        }
+    }
+
     // it is possible to have multiple entrypoints in the same shader
     // we keep track of them and whenever there is a new one we recompile
     // the entire shader
@@ -55,6 +72,7 @@ struct ShaderCode : Xbyak::CodeGenerator {
             entrypoints[shu->entrypoint] = 0;
             compileAllEntries(shu);
             offset = entrypoints[shu->entrypoint];
+            addPerfMap();
 #ifdef JIT_DISASM
             pica_shader_disasm(shu);
             shaderjit_x86_disassemble((void*) this);
@@ -531,8 +549,8 @@ void ShaderCode::compileBlock(ShaderUnit* shu, u32 start, u32 len) {
 
 extern "C" {
 
-void* shaderjit_x86_init() {
-    return (void*) new ShaderCode();
+void* shaderjit_x86_init(u64 hash) {
+    return (void*) new ShaderCode(hash);
 }
 
 ShaderJitFunc shaderjit_x86_get_code(void* backend, ShaderUnit* shu) {
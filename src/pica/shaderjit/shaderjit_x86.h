@@ -9,7 +9,7 @@ extern "C" {
 
 #include "shaderjit.h"
 
-void* shaderjit_x86_init();
+void* shaderjit_x86_init(u64 hash);
 ShaderJitFunc shaderjit_x86_get_code(void* backend, ShaderUnit* shu);
 void shaderjit_x86_free(void* backend);
 void shaderjit_x86_disassemble(void* backend);
@@ -0,0 +1,214 @@
+#include "rewind.h"
+
+#include "3ds.h"
+
+static void buf_write(StateBuf* b, const void* p, size_t n) {
+    if (b->size + n > b->cap) {
+        b->cap = b->cap ? 2 * b->cap : 4096;
+        if (b->cap < b->size + n) b->cap = b->size + n;
+        b->d = realloc(b->d, b->cap);
+    }
+    memcpy(&b->d[b->size], p, n);
+    b->size += n;
+}
+
+// xor deltas are mostly zero, so they are stored as runs of zero words each
+// followed by a run of literal words, base can be null to store data as is
+static void delta_encode(StateBuf* b, const u32* data, const u32* base,
+                         u32 n) {
+#define DELTA(i) (data[i] ^ (base ? base[i] : 0))
+    u32 i = 0;
+    while (i < n) {
+        u32 start = i;
+        while (i < n && !DELTA(i) && i - start < 0xffff) i++;
+        u16 run[2] = {i - start};
+        start = i;
+        while (i < n && DELTA(i) && i - start < 0xffff) i++;
+        run[1] = i - start;
+        buf_write(b, run, sizeof run);
+        for (u32 j = start; j < i; j++) {
+            u32 d = DELTA(j);
+            buf_write(b, &d, sizeof d);
+        }
+    }
+#undef DELTA
+}
+
+static u8* delta_decode(u8* p, u32* dst, const u32* base, u32 n) {
+    u32 i = 0;
+    while (i < n) {
+        u16 run[2];
+        memcpy(run, p, sizeof run);
+        p += sizeof run;
+        for (u32 j = 0; j < run[0] && i < n; j++, i++) {
+            dst[i] = base ? base[i] : 0;
+        }
+        for (u32 j = 0; j < run[1] && i < n; j++, i++) {
+            u32 d;
+            memcpy(&d, p, sizeof d);
+            p += sizeof d;
+            dst[i] = d ^ (base ? base[i] : 0);
+        }
+    }
+    return p;
+}
+
+static void swap_bufs(StateBuf* a, StateBuf* b) {
+    StateBuf tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void free_entry(Rewind* r, RewindEntry* e) {
+    r->used -= e->state.size + e->pages.size;
+    Vec_free(e->state);
+    Vec_free(e->pages);
+}
+
+void rewind_init(Rewind* r, int interval, size_t budget) {
+    r->enabled = true;
+    r->interval = interval;
+    r->budget = budget;
+    savestate_init(&r->cur);
+    Vec_init(r->tmp);
+}
+
+void rewind_reset(E3DS* s, Rewind* r) {
+    while (r->ring.size) {
+        RewindEntry e;
+        FIFO_pop(r->ring, e);
+        free_entry(r, &e);
+    }
+    savestate_release(s, &r->cur);
+    r->started = false;
+    r->frames = 0;
+}
+
+void rewind_destroy(E3DS* s, Rewind* r) {
+    if (!r->enabled) return;
+    rewind_reset(s, r);
+    savestate_free(&r->cur);
+    Vec_free(r->tmp);
+    if (r->ncheckpoints) {
+        linfo("rewind: %lu checkpoints, avg %.1lf KiB, avg %.3lf ms",
+              r->ncheckpoints, r->totalsize / 1024.0 / r->ncheckpoints,
+              r->totaltime / 1e6 / r->ncheckpoints);
+    }
+    r->enabled = false;
+}
+
+// the previous checkpoint goes into the ring as a delta against this one
+static void checkpoint(E3DS* s, Rewind* r) {
+    if (!r->started) {
+        r->started = savestate_take(s, &r->cur);
+        r->curframe = r->frame;
+        return;
+    }
+
+    u64 start = time_ns();
+
+    RewindEntry e = {.frame = r->curframe};
+    MemSnapshot* m = &r->cur.mem;
+#ifdef FASTMEM
+    for (u32 i = 0; i < m->nsaved; i++) {
+        u32 pg = m->saved[i];
+#else
+    // without write tracking every page has to be compared
+    for (u32 pg = 0; pg < MEM_NPAGES; pg++) {
+        if (!memcmp(&m->pages[pg * PAGE_SIZE], &s->mem->raw[pg * PAGE_SIZE],
+                    PAGE_SIZE))
+            continue;
+#endif
+        buf_write(&e.pages, &pg, sizeof pg);
+        delta_encode(&e.pages, (u32*) &m->pages[pg * PAGE_SIZE],
+                     (u32*) &s->mem->raw[pg * PAGE_SIZE], PAGE_SIZE / 4);
+        e.npages++;
+    }
+
+    savestate_put(s, &r->tmp);
+    e.statesize = r->cur.data.size;
+    e.statexor = r->cur.data.size == r->tmp.size;
+    delta_encode(&e.state, (u32*) r->cur.data.d,
+                 e.statexor ? (u32*) r->tmp.d : nullptr, e.statesize / 4);
+    swap_bufs(&r->cur.data, &r->tmp);
+    memory_snapshot_begin(s, m);
+    r->curframe = r->frame;
+
+    if (r->ring.size == FIFO_MAX(r->ring)) {
+        RewindEntry old;
+        FIFO_pop(r->ring, old);
+        free_entry(r, &old);
+    }
+    FIFO_push(r->ring, e);
+    r->used += e.state.size + e.pages.size;
+    while (r->used > r->budget && r->ring.size > 1) {
+        RewindEntry old;
+        FIFO_pop(r->ring, old);
+        free_entry(r, &old);
+    }
+
+    u64 elapsed = time_ns() - start;
+    r->ncheckpoints++;
+    r->totalsize += e.state.size + e.pages.size;
+    r->totaltime += elapsed;
+    linfo("rewind checkpoint: %u pages, %lu bytes, %.3lf ms, %u in history",
+          e.npages, e.state.size + e.pages.size, elapsed / 1e6,
+          r->ring.size);
+}
+
+void rewind_frame(E3DS* s, Rewind* r) {
+    if (!r->enabled || r->hold) return;
+    r->frame++;
+    if (r->started && ++r->frames < r->interval) return;
+    r->frames = 0;
+    checkpoint(s, r);
+}
+
+// goes back to the checkpoint before the last one, returns false once the
+// oldest one is reached
+bool rewind_step(E3DS* s, Rewind* r) {
+    if (!r->enabled || !r->started) return false;
+    r->frames = 0;
+    savestate_quiesce(s);
+
+    // memory is first put back to the last checkpoint, which the deltas are
+    // relative to
+    MemSnapshot* m = &r->cur.mem;
+    memory_snapshot_restore(s, m);
+    if (!r->ring.size) {
+        savestate_get(s, r->cur.data.d, r->cur.data.size);
+        return false;
+    }
+
+    RewindEntry e = FIFO_back(r->ring);
+    r->ring.tail--;
+    r->ring.size--;
+
+    u8* p = e.pages.d;
+    for (u32 i = 0; i < e.npages; i++) {
+        u32 pg;
+        memcpy(&pg, p, sizeof pg);
+        p += sizeof pg;
+        p = delta_decode(p, memory_snapshot_stage(m, pg),
+                         (u32*) &s->mem->raw[pg * PAGE_SIZE], PAGE_SIZE / 4);
+    }
+
+    r->tmp.size = 0;
+    if (r->tmp.cap < e.statesize) {
+        r->tmp.cap = e.statesize;
+        r->tmp.d = realloc(r->tmp.d, r->tmp.cap);
+    }
+    delta_decode(e.state.d, (u32*) r->tmp.d,
+                 e.statexor ? (u32*) r->cur.data.d : nullptr,
+                 e.statesize / 4);
+    r->tmp.size = e.statesize;
+    swap_bufs(&r->cur.data, &r->tmp);
+
+    savestate_get(s, r->cur.data.d, r->cur.data.size);
+    memory_snapshot_restore(s, m);
+    r->curframe = e.frame;
+    r->frame = e.frame;
+
+    free_entry(r, &e);
+    return true;
+}
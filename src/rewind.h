@@ -0,0 +1,53 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include "common.h"
+#include "savestate.h"
+
+typedef struct _3DS E3DS;
+
+typedef struct {
+    u64 frame;
+    // the state and the pages written before the next checkpoint, both
+    // stored as xor deltas against the next checkpoint
+    StateBuf state;
+    u32 statesize;
+    bool statexor;
+    StateBuf pages;
+    u32 npages;
+} RewindEntry;
+
+typedef struct {
+    bool enabled;
+    int interval;
+    size_t budget;
+
+    // the most recent checkpoint, memory written after it is tracked by its
+    // snapshot
+    SaveState cur;
+    bool started;
+    u64 curframe;
+
+    u64 frame;
+    int frames;
+    // set while rewinding so the frames shown do not make checkpoints
+    bool hold;
+
+    FIFO(RewindEntry, 10) ring;
+    size_t used;
+
+    StateBuf tmp;
+
+    u64 ncheckpoints;
+    u64 totalsize;
+    u64 totaltime;
+} Rewind;
+
+void rewind_init(Rewind* r, int interval, size_t budget);
+void rewind_destroy(E3DS* s, Rewind* r);
+void rewind_reset(E3DS* s, Rewind* r);
+
+void rewind_frame(E3DS* s, Rewind* r);
+bool rewind_step(E3DS* s, Rewind* r);
+
+#endif
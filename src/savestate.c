@@ -0,0 +1,1216 @@
+#include "savestate.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "3ds.h"
+#include "arm/jit/jit.h"
+#include "kernel/ipc.h"
+#include "services/fsio.h"
+#include "services/ldr.h"
+#include "services/savefile.h"
+#include "services/y2r.h"
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u32 e3dssize;
+    u32 datasize;
+    // distance between two functions, which catches most builds whose
+    // function pointers would not match
+    u64 layout;
+    // id of the base file with the pages at the time of the last full save,
+    // the state itself only has the pages written since
+    u64 base;
+} SaveStateHeader;
+
+typedef Vector(KObject*) KObjList;
+
+typedef struct {
+    E3DS* s;
+    // heap allocated kernel objects, referred to by index
+    KObjList objs;
+
+    // writing
+    StateBuf* b;
+
+    // reading
+    u8* p;
+    u8* end;
+    bool err;
+} StateCtx;
+
+// a host file open in an fs session
+typedef struct {
+    char* path;
+    int flags;
+    u64 dev;
+    u64 ino;
+    // files in save archives are reopened with their write buffering, and the
+    // writes which were not committed yet are part of the state
+    bool save;
+    u64 archive;
+    u64 size;
+    u64 keep;
+    bool dirty;
+    SaveRangeList ranges;
+} FileRef;
+
+// a state is read into this first and only replaces the running state once
+// all of it was read successfully
+typedef struct {
+    ArmCore cpu;
+    KProcess process;
+    FCRAMHeap pheap;
+    ServiceData services;
+    Vector(FileRef) files;
+    Scheduler sched;
+    GPU gpu;
+} LoadState;
+
+#define REF_EMBEDDED BITL(62)
+#define REF_HEAP BITL(63)
+
+#define EMBEDDED_MAX (16 + HIDEVENT_MAX)
+
+static u64 layout_id() {
+    return (uintptr_t) &savestate_load - (uintptr_t) &e3ds_init;
+}
+
+static void put(StateCtx* c, const void* p, size_t n) {
+    if (c->b->size + n > c->b->cap) {
+        c->b->cap = c->b->cap ? 2 * c->b->cap : 4096;
+        if (c->b->cap < c->b->size + n) c->b->cap = c->b->size + n;
+        c->b->d = realloc(c->b->d, c->b->cap);
+    }
+    memcpy(&c->b->d[c->b->size], p, n);
+    c->b->size += n;
+}
+#define PUT(c, v) put(c, &(v), sizeof(v))
+
+static void put_u64(StateCtx* c, u64 v) {
+    put(c, &v, sizeof v);
+}
+
+static void get(StateCtx* c, void* p, size_t n) {
+    if (c->err || n > c->end - c->p) {
+        c->err = true;
+        memset(p, 0, n);
+        return;
+    }
+    memcpy(p, c->p, n);
+    c->p += n;
+}
+#define GET(c, v) get(c, &(v), sizeof(v))
+
+static u64 get_u64(StateCtx* c) {
+    u64 v;
+    get(c, &v, sizeof v);
+    return v;
+}
+
+static bool in_e3ds(E3DS* s, void* p) {
+    return (void*) s <= p && p < (void*) (s + 1);
+}
+
+static int obj_index(KObjList* objs, KObject* o) {
+    for (int i = 0; i < objs->size; i++) {
+        if (objs->d[i] == o) return i;
+    }
+    return -1;
+}
+
+// objects inside E3DS are stored as offsets and heap objects as indices into
+// the object table
+static u64 enc_obj(StateCtx* c, void* o) {
+    if (!o) return 0;
+    if (in_e3ds(c->s, o)) return REF_EMBEDDED | (o - (void*) c->s);
+    return REF_HEAP | obj_index(&c->objs, o);
+}
+
+static void* dec_obj(StateCtx* c, u64 v) {
+    u64 idx = v & MASKL(62);
+    if ((v & ~MASKL(62)) == REF_EMBEDDED && idx < sizeof(E3DS))
+        return (void*) c->s + idx;
+    if ((v & ~MASKL(62)) == REF_HEAP && idx < c->objs.size)
+        return c->objs.d[idx];
+    return nullptr;
+}
+
+// function pointers are stored relative to a known function so they stay
+// valid for the same build at a different load address
+static u64 enc_fn(void* f) {
+    return f ? (uintptr_t) f - (uintptr_t) &e3ds_init : 0;
+}
+
+static void* dec_fn(u64 v) {
+    return v ? (void*) ((uintptr_t) &e3ds_init + v) : nullptr;
+}
+
+static int embedded_objs(KProcess* p, ServiceData* sv, KObject** objs) {
+    int n = 0;
+    objs[n++] = &p->hdr;
+    objs[n++] = &sv->notif_sem.hdr;
+    objs[n++] = &sv->apt.lock.hdr;
+    objs[n++] = &sv->apt.notif_event.hdr;
+    objs[n++] = &sv->apt.resume_event.hdr;
+    objs[n++] = &sv->apt.shared_font.hdr;
+    objs[n++] = &sv->apt.capture_block.hdr;
+    objs[n++] = &sv->gsp.sharedmem.hdr;
+    objs[n++] = &sv->dsp.semEvent.hdr;
+    objs[n++] = &sv->hid.sharedmem.hdr;
+    for (int i = 0; i < HIDEVENT_MAX; i++) {
+        objs[n++] = &sv->hid.events[i].hdr;
+    }
+    objs[n++] = &sv->cecd.cecinfo.hdr;
+    objs[n++] = &sv->y2r.transferend.hdr;
+    objs[n++] = &sv->ir.event.hdr;
+    return n;
+}
+
+// kernel objects referred to by the service state, apart from these it only
+// holds plain data, the embedded objects above and the fs session tables
+#define SERVICE_REFS_MAX 14
+
+static int service_refs(ServiceData* sv, KObject*** refs) {
+    int n = 0;
+    refs[n++] = (KObject**) &sv->gsp.event;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            refs[n++] = (KObject**) &sv->dsp.events[i][j];
+        }
+    }
+    refs[n++] = &sv->apt.nextparam.kobj;
+    return n;
+}
+
+// the service state is stored as raw bytes with only the pointers listed
+// above fixed up, so any service which changes size has to be checked for new
+// pointers
+static_assert(sizeof(APTData) == 4256);
+static_assert(sizeof(GSPData) == 88);
+static_assert(sizeof(HIDData) == 184);
+static_assert(sizeof(DSPData) == 25960);
+static_assert(sizeof(FSData) == 104);
+static_assert(sizeof(CECDData) == 32);
+static_assert(sizeof(Y2RData) == 176);
+static_assert(sizeof(LDRData) == 4);
+static_assert(sizeof(IRData) == 32);
+static_assert(sizeof(ServiceData) == 30856);
+
+static void collect_ref(E3DS* s, KObjList* objs, void* o) {
+    if (!o || in_e3ds(s, o) || obj_index(objs, o) >= 0) return;
+    Vec_push(*objs, (KObject*) o);
+}
+
+static void collect_list(E3DS* s, KObjList* objs, KListNode* l) {
+    for (; l; l = l->next) {
+        collect_ref(s, objs, l->key);
+    }
+}
+
+static void collect_obj_refs(E3DS* s, KObjList* objs, KObject* o) {
+    switch (o->type) {
+        case KOT_THREAD: {
+            auto t = (KThread*) o;
+            collect_list(s, objs, t->waiting_objs);
+            collect_list(s, objs, t->waiting_thrds);
+            break;
+        }
+        case KOT_EVENT:
+            collect_list(s, objs, ((KEvent*) o)->waiting_thrds);
+            break;
+        case KOT_MUTEX:
+            collect_ref(s, objs, ((KMutex*) o)->locker_thrd);
+            collect_list(s, objs, ((KMutex*) o)->waiting_thrds);
+            break;
+        case KOT_SEMAPHORE:
+            collect_list(s, objs, ((KSemaphore*) o)->waiting_thrds);
+            break;
+        case KOT_ARBITER:
+            collect_list(s, objs, ((KArbiter*) o)->waiting_thrds);
+            break;
+        default:
+            break;
+    }
+}
+
+// finds every heap allocated kernel object reachable from the process and
+// services
+static void collect_objects(E3DS* s, KObjList* objs) {
+    for (int i = 0; i < HANDLE_MAX; i++) {
+        collect_ref(s, objs, s->process.handles[i]);
+    }
+    for (int i = 0; i < THREAD_MAX; i++) {
+        collect_ref(s, objs, s->process.threads[i]);
+    }
+    KObject** refs[SERVICE_REFS_MAX];
+    int nrefs = service_refs(&s->services, refs);
+    for (int i = 0; i < nrefs; i++) {
+        collect_ref(s, objs, *refs[i]);
+    }
+
+    KObject* emb[EMBEDDED_MAX];
+    int nemb = embedded_objs(&s->process, &s->services, emb);
+    for (int i = 0; i < nemb; i++) {
+        collect_obj_refs(s, objs, emb[i]);
+    }
+    for (int i = 0; i < objs->size; i++) {
+        collect_obj_refs(s, objs, objs->d[i]);
+    }
+}
+
+static void put_list(StateCtx* c, KListNode* l) {
+    u32 n = 0;
+    for (KListNode* cur = l; cur; cur = cur->next) n++;
+    PUT(c, n);
+    for (; l; l = l->next) {
+        put_u64(c, enc_obj(c, l->key));
+        PUT(c, l->val);
+    }
+}
+
+static KListNode* get_list(StateCtx* c) {
+    u32 n;
+    GET(c, n);
+    KListNode* head = nullptr;
+    KListNode** tail = &head;
+    for (u32 i = 0; i < n && !c->err; i++) {
+        klist_insert(tail, dec_obj(c, get_u64(c)));
+        GET(c, (*tail)->val);
+        tail = &(*tail)->next;
+    }
+    return head;
+}
+
+static void free_list(KListNode** l) {
+    while (*l) klist_remove(l);
+}
+
+static void put_obj_refs(StateCtx* c, KObject* o) {
+    switch (o->type) {
+        case KOT_THREAD: {
+            auto t = (KThread*) o;
+            put_list(c, t->waiting_objs);
+            put_list(c, t->waiting_thrds);
+            break;
+        }
+        case KOT_EVENT: {
+            auto e = (KEvent*) o;
+            put_u64(c, enc_fn(e->callback));
+            put_list(c, e->waiting_thrds);
+            break;
+        }
+        case KOT_MUTEX: {
+            auto m = (KMutex*) o;
+            put_u64(c, enc_obj(c, m->locker_thrd));
+            put_list(c, m->waiting_thrds);
+            break;
+        }
+        case KOT_SEMAPHORE:
+            put_list(c, ((KSemaphore*) o)->waiting_thrds);
+            break;
+        case KOT_ARBITER:
+            put_list(c, ((KArbiter*) o)->waiting_thrds);
+            break;
+        case KOT_SESSION:
+            put_u64(c, enc_fn(((KSession*) o)->handler));
+            break;
+        default:
+            break;
+    }
+}
+
+static void get_obj_refs(StateCtx* c, KObject* o) {
+    switch (o->type) {
+        case KOT_THREAD: {
+            auto t = (KThread*) o;
+            t->waiting_objs = get_list(c);
+            t->waiting_thrds = get_list(c);
+            break;
+        }
+        case KOT_EVENT: {
+            auto e = (KEvent*) o;
+            e->callback = dec_fn(get_u64(c));
+            e->waiting_thrds = get_list(c);
+            break;
+        }
+        case KOT_MUTEX: {
+            auto m = (KMutex*) o;
+            m->locker_thrd = dec_obj(c, get_u64(c));
+            m->waiting_thrds = get_list(c);
+            break;
+        }
+        case KOT_SEMAPHORE:
+            ((KSemaphore*) o)->waiting_thrds = get_list(c);
+            break;
+        case KOT_ARBITER:
+            ((KArbiter*) o)->waiting_thrds = get_list(c);
+            break;
+        case KOT_SESSION:
+            ((KSession*) o)->handler = dec_fn(get_u64(c));
+            break;
+        default:
+            break;
+    }
+}
+
+static void free_obj_refs(KObject* o) {
+    switch (o->type) {
+        case KOT_THREAD:
+            free_list(&((KThread*) o)->waiting_objs);
+            free_list(&((KThread*) o)->waiting_thrds);
+            break;
+        case KOT_EVENT:
+            free_list(&((KEvent*) o)->waiting_thrds);
+            break;
+        case KOT_MUTEX:
+            free_list(&((KMutex*) o)->waiting_thrds);
+            break;
+        case KOT_SEMAPHORE:
+            free_list(&((KSemaphore*) o)->waiting_thrds);
+            break;
+        case KOT_ARBITER:
+            free_list(&((KArbiter*) o)->waiting_thrds);
+            break;
+        default:
+            break;
+    }
+}
+
+// this does not go through kobject_destroy since nothing else should happen
+// to the objects
+static void free_objects(E3DS* s) {
+    KObjList objs;
+    Vec_init(objs);
+    collect_objects(s, &objs);
+
+    KObject* emb[EMBEDDED_MAX];
+    int nemb = embedded_objs(&s->process, &s->services, emb);
+    for (int i = 0; i < nemb; i++) {
+        free_obj_refs(emb[i]);
+    }
+    Vec_foreach(o, objs) {
+        free_obj_refs(*o);
+        kobject_free(*o);
+    }
+    Vec_free(objs);
+}
+
+static bool fd_path(int fd, char* buf, size_t n) {
+#ifdef __APPLE__
+    return fcntl(fd, F_GETPATH, buf) != -1;
+#else
+    char link[32];
+    snprintf(link, sizeof link, "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(link, buf, n - 1);
+    if (len < 0) return false;
+    buf[len] = '\0';
+    return true;
+#endif
+}
+
+// host files are stored by path and only reopened if the file open at that
+// slot is different when loading
+static void put_fd(StateCtx* c, int fd, SaveFile* sf) {
+    char path[PATH_MAX];
+    struct stat st;
+    if (fd < 0 || !fd_path(fd, path, sizeof path) || fstat(fd, &st) < 0) {
+        u32 len = 0;
+        PUT(c, len);
+        return;
+    }
+    u32 len = strlen(path);
+    PUT(c, len);
+    put(c, path, len);
+    int flags = fcntl(fd, F_GETFL) & O_ACCMODE;
+    PUT(c, flags);
+    put_u64(c, st.st_dev);
+    put_u64(c, st.st_ino);
+    bool save = sf;
+    PUT(c, save);
+    if (!sf) return;
+    put_u64(c, sf->archive);
+    put_u64(c, sf->size);
+    put_u64(c, sf->keep);
+    PUT(c, sf->dirty);
+    u32 nranges = sf->ranges.size;
+    PUT(c, nranges);
+    Vec_foreach(r, sf->ranges) {
+        put_u64(c, r->offset);
+        put_u64(c, r->size);
+        put(c, r->data, r->size);
+    }
+}
+
+static void get_fd(StateCtx* c, FileRef* f) {
+    u32 len;
+    GET(c, len);
+    if (!len) return;
+    if (len >= PATH_MAX) {
+        c->err = true;
+        return;
+    }
+    f->path = malloc(len + 1);
+    get(c, f->path, len);
+    f->path[len] = '\0';
+    GET(c, f->flags);
+    f->dev = get_u64(c);
+    f->ino = get_u64(c);
+    GET(c, f->save);
+    if (!f->save) return;
+    f->archive = get_u64(c);
+    f->size = get_u64(c);
+    f->keep = get_u64(c);
+    GET(c, f->dirty);
+    u32 nranges;
+    GET(c, nranges);
+    u64 end = 0;
+    for (u32 i = 0; i < nranges && !c->err; i++) {
+        SaveRange r;
+        r.offset = get_u64(c);
+        r.size = get_u64(c);
+        // ranges must stay sorted and apart
+        if (c->err || r.offset < end || r.size > c->end - c->p) {
+            c->err = true;
+            break;
+        }
+        r.data = malloc(r.size);
+        get(c, r.data, r.size);
+        Vec_push(f->ranges, r);
+        end = r.offset + r.size + 1;
+    }
+}
+
+static void put_fs(StateCtx* c) {
+    FSData* fs = &c->s->services.fs;
+    u32 nfiles = fs->files.size;
+    PUT(c, nfiles);
+    for (u32 i = 0; i < nfiles; i++) {
+        FILE* fp = fs->files.d[i];
+        put_fd(c, fp ? fileno(fp) : -1, savefile_get(&fs->savefiles, i));
+    }
+    u32 ndirs = fs->dirs.size;
+    PUT(c, ndirs);
+    Vec_foreach(dir, fs->dirs) {
+        u32 len = dir->path ? strlen(dir->path) : 0;
+        PUT(c, len);
+        if (len) put(c, dir->path, len);
+        PUT(c, dir->pos);
+    }
+}
+
+static void close_file(FSData* fs, int i) {
+    if (!fs->files.d[i]) return;
+    SaveFile* sf = savefile_get(&fs->savefiles, i);
+    if (sf) savefile_close(sf);
+    fclose(fs->files.d[i]);
+    fs->files.d[i] = nullptr;
+    free(fs->filepaths.d[i]);
+    fs->filepaths.d[i] = nullptr;
+}
+
+static void get_fs(StateCtx* c, LoadState* ls) {
+    FSData* fs = &ls->services.fs;
+    Vec_init(fs->files);
+    Vec_init(fs->filepaths);
+    Vec_init(fs->dirs);
+    Vec_init(fs->savefiles);
+
+    u32 nfiles;
+    GET(c, nfiles);
+    if (nfiles > BIT(16)) c->err = true;
+    for (u32 i = 0; i < nfiles && !c->err; i++) {
+        FileRef f = {};
+        get_fd(c, &f);
+        Vec_push(ls->files, f);
+    }
+
+    u32 ndirs;
+    GET(c, ndirs);
+    if (ndirs > BIT(16)) c->err = true;
+    for (u32 i = 0; i < ndirs && !c->err; i++) {
+        FSDir dir = {};
+        u32 len;
+        GET(c, len);
+        if (len >= PATH_MAX) c->err = true;
+        if (len && !c->err) {
+            dir.path = malloc(len + 1);
+            get(c, dir.path, len);
+            dir.path[len] = '\0';
+        }
+        GET(c, dir.pos);
+        Vec_push(fs->dirs, dir);
+    }
+}
+
+// the session tables read with the service state belong to another run, so
+// the current ones are kept and resized to match the state, with files only
+// reopened if the one open at that slot is different
+static void set_fs(E3DS* s, LoadState* ls, FSData* old) {
+    FSData* fs = &s->services.fs;
+    Vec_assn(fs->files, old->files);
+    Vec_assn(fs->filepaths, old->filepaths);
+    Vec_assn(fs->savefiles, old->savefiles);
+    for (u32 i = ls->files.size; i < fs->files.size; i++) {
+        close_file(fs, i);
+    }
+    while (fs->files.size < ls->files.size) {
+        Vec_push(fs->files, nullptr);
+        Vec_push(fs->filepaths, nullptr);
+    }
+    fs->files.size = fs->filepaths.size = ls->files.size;
+    for (u32 i = 0; i < ls->files.size; i++) {
+        FileRef* f = &ls->files.d[i];
+        FILE* fp = fs->files.d[i];
+        bool save = savefile_get(&fs->savefiles, i);
+        struct stat st;
+        if (!(fp && f->path && fstat(fileno(fp), &st) == 0 &&
+              st.st_dev == f->dev && st.st_ino == f->ino && save == f->save)) {
+            close_file(fs, i);
+            if (!f->path) continue;
+            fp = fopen(f->path, f->flags == O_RDONLY ? "rb" : "r+b");
+            if (!fp) {
+                lwarn("could not reopen %s", f->path);
+                continue;
+            }
+            fs->files.d[i] = fp;
+            fs->filepaths.d[i] = strdup(f->path);
+            if (f->save)
+                savefile_open(&fs->savefiles, i, f->archive, f->path, fp);
+        }
+        // writes buffered after the state was taken are thrown away
+        SaveFile* sf = savefile_get(&fs->savefiles, i);
+        if (f->save && sf)
+            savefile_restore(sf, f->size, f->keep, f->dirty, &f->ranges);
+    }
+
+    Vec_foreach(dir, old->dirs) {
+        free(dir->path);
+    }
+    Vec_free(old->dirs);
+}
+
+static void put_state(StateCtx* c) {
+    E3DS* s = c->s;
+
+    collect_objects(s, &c->objs);
+
+    // objects come first so they can all be allocated before anything which
+    // refers to them is read
+    u32 nobjs = c->objs.size;
+    PUT(c, nobjs);
+    Vec_foreach(o, c->objs) {
+        PUT(c, (*o)->type);
+    }
+    Vec_foreach(o, c->objs) {
+        put(c, *o, kobject_size((*o)->type));
+        put_obj_refs(c, *o);
+    }
+
+    put(c, s->cpu.r, sizeof s->cpu.r);
+    PUT(c, s->cpu.cpsr.w);
+    put(c, s->cpu.d, sizeof s->cpu.d);
+    PUT(c, s->cpu.fpscr.w);
+    PUT(c, s->cpu.wfe);
+
+    PUT(c, s->process.hdr);
+    for (int i = 0; i < HANDLE_MAX; i++) {
+        put_u64(c, enc_obj(c, s->process.handles[i]));
+    }
+    for (int i = 0; i < THREAD_MAX; i++) {
+        put_u64(c, enc_obj(c, s->process.threads[i]));
+    }
+    for (u32 i = 0; i < BIT(10); i++) {
+        if (!s->process.ptab[i]) continue;
+        PUT(c, i);
+        put(c, s->process.ptab[i], BIT(10) * sizeof(PageEntry));
+    }
+    u32 end = -1;
+    PUT(c, end);
+    Vec_foreach(b, s->process.vmblocks) {
+        PUT(c, b->startpg);
+        PUT(c, b->endpg);
+        PUT(c, b->perm);
+        PUT(c, b->state);
+    }
+    PUT(c, end);
+    PUT(c, s->process.used_memory);
+
+    Vec_foreach(n, s->pheap) {
+        PUT(c, n->startpg);
+        PUT(c, n->endpg);
+    }
+    PUT(c, end);
+
+    PUT(c, s->services);
+    KObject* emb[EMBEDDED_MAX];
+    int nemb = embedded_objs(&s->process, &s->services, emb);
+    for (int i = 0; i < nemb; i++) {
+        put_obj_refs(c, emb[i]);
+    }
+    KObject** refs[SERVICE_REFS_MAX];
+    int nrefs = service_refs(&s->services, refs);
+    for (int i = 0; i < nrefs; i++) {
+        put_u64(c, enc_obj(c, *refs[i]));
+    }
+    put_fs(c);
+
+    PUT(c, s->sched.now);
+    u32 nevents = s->sched.event_queue.size;
+    PUT(c, nevents);
+    FIFO_foreach(i, s->sched.event_queue) {
+        PUT(c, s->sched.event_queue.d[i].time);
+        put_u64(c, enc_fn(s->sched.event_queue.d[i].handler));
+        PUT(c, s->sched.event_queue.d[i].arg);
+    }
+
+    PUT(c, s->gpu.regs);
+    PUT(c, s->gpu.progdata);
+    PUT(c, s->gpu.opdescs);
+    PUT(c, s->gpu.sh_idx);
+    PUT(c, s->gpu.fixattrs);
+    PUT(c, s->gpu.curfixattr);
+    PUT(c, s->gpu.curfixi);
+    PUT(c, s->gpu.curuniform);
+    PUT(c, s->gpu.curunifi);
+    PUT(c, s->gpu.floatuniform);
+}
+
+// reads the whole state without changing anything, the objects it refers
+// to are allocated into the object table
+static bool get_state(StateCtx* c, LoadState* ls) {
+    u32 nobjs;
+    GET(c, nobjs);
+    if (c->err || nobjs > (c->end - c->p) / sizeof(KObjType)) return false;
+
+    for (u32 i = 0; i < nobjs; i++) {
+        KObjType type;
+        GET(c, type);
+        if (c->err || type >= KOT_MAX) {
+            c->err = true;
+            break;
+        }
+        Vec_push(c->objs, kobject_alloc(type));
+    }
+    Vec_foreach(o, c->objs) {
+        KObjType type = (*o)->type;
+        get(c, *o, kobject_size(type));
+        if ((*o)->type != type) c->err = true;
+        if (c->err) (*o)->type = type;
+        get_obj_refs(c, *o);
+    }
+
+    get(c, ls->cpu.r, sizeof ls->cpu.r);
+    GET(c, ls->cpu.cpsr.w);
+    get(c, ls->cpu.d, sizeof ls->cpu.d);
+    GET(c, ls->cpu.fpscr.w);
+    GET(c, ls->cpu.wfe);
+
+    GET(c, ls->process.hdr);
+    for (int i = 0; i < HANDLE_MAX; i++) {
+        ls->process.handles[i] = dec_obj(c, get_u64(c));
+    }
+    for (int i = 0; i < THREAD_MAX; i++) {
+        ls->process.threads[i] = dec_obj(c, get_u64(c));
+    }
+    while (true) {
+        u32 i;
+        GET(c, i);
+        if (c->err || i >= BIT(10)) break;
+        if (!ls->process.ptab[i])
+            ls->process.ptab[i] = malloc(BIT(10) * sizeof(PageEntry));
+        get(c, ls->process.ptab[i], BIT(10) * sizeof(PageEntry));
+    }
+
+    while (true) {
+        VMBlock b;
+        GET(c, b.startpg);
+        if (c->err || b.startpg == -1) break;
+        GET(c, b.endpg);
+        GET(c, b.perm);
+        GET(c, b.state);
+        Vec_push(ls->process.vmblocks, b);
+    }
+    GET(c, ls->process.used_memory);
+
+    while (true) {
+        FCRAMHeapNode n;
+        GET(c, n.startpg);
+        if (c->err || n.startpg == -1) break;
+        GET(c, n.endpg);
+        Vec_push(ls->pheap, n);
+    }
+    // the block list and the linear heap must never be empty
+    if (!ls->process.vmblocks.size || !ls->pheap.size) c->err = true;
+
+    // every list in the embedded objects is read even after an error, so
+    // none of them are left pointing into another run
+    GET(c, ls->services);
+    KObject* emb[EMBEDDED_MAX];
+    int nemb = embedded_objs(&ls->process, &ls->services, emb);
+    for (int i = 0; i < nemb; i++) {
+        get_obj_refs(c, emb[i]);
+    }
+    KObject** refs[SERVICE_REFS_MAX];
+    int nrefs = service_refs(&ls->services, refs);
+    for (int i = 0; i < nrefs; i++) {
+        *refs[i] = dec_obj(c, get_u64(c));
+    }
+    get_fs(c, ls);
+
+    GET(c, ls->sched.now);
+    u32 nevents;
+    GET(c, nevents);
+    for (u32 i = 0; i < nevents && i < EVENT_MAX && !c->err; i++) {
+        SchedulerEvent e;
+        GET(c, e.time);
+        e.handler = dec_fn(get_u64(c));
+        GET(c, e.arg);
+        FIFO_push(ls->sched.event_queue, e);
+    }
+
+    GET(c, ls->gpu.regs);
+    GET(c, ls->gpu.progdata);
+    GET(c, ls->gpu.opdescs);
+    GET(c, ls->gpu.sh_idx);
+    GET(c, ls->gpu.fixattrs);
+    GET(c, ls->gpu.curfixattr);
+    GET(c, ls->gpu.curfixi);
+    GET(c, ls->gpu.curuniform);
+    GET(c, ls->gpu.curunifi);
+    GET(c, ls->gpu.floatuniform);
+
+    return !c->err;
+}
+
+static void free_load_state(LoadState* ls) {
+    Vec_foreach(f, ls->files) {
+        free(f->path);
+        Vec_foreach(r, f->ranges) {
+            free(r->data);
+        }
+        Vec_free(f->ranges);
+    }
+    Vec_free(ls->files);
+}
+
+// frees everything a state which could not be read had already allocated
+static void discard_state(StateCtx* c, LoadState* ls) {
+    KObject* emb[EMBEDDED_MAX];
+    int nemb = embedded_objs(&ls->process, &ls->services, emb);
+    for (int i = 0; i < nemb; i++) {
+        free_obj_refs(emb[i]);
+    }
+    Vec_foreach(o, c->objs) {
+        free_obj_refs(*o);
+        kobject_free(*o);
+    }
+    for (u32 i = 0; i < BIT(10); i++) {
+        free(ls->process.ptab[i]);
+    }
+    Vec_free(ls->process.vmblocks);
+    Vec_free(ls->pheap);
+    Vec_foreach(dir, ls->services.fs.dirs) {
+        free(dir->path);
+    }
+    Vec_free(ls->services.fs.dirs);
+    free_load_state(ls);
+}
+
+// replaces the running state with one that was read successfully
+static void set_state(StateCtx* c, LoadState* ls) {
+    E3DS* s = c->s;
+
+    free_objects(s);
+
+    memcpy(s->cpu.r, ls->cpu.r, sizeof s->cpu.r);
+    s->cpu.cpsr.w = ls->cpu.cpsr.w;
+    memcpy(s->cpu.d, ls->cpu.d, sizeof s->cpu.d);
+    s->cpu.fpscr.w = ls->cpu.fpscr.w;
+    s->cpu.wfe = ls->cpu.wfe;
+
+    s->process.hdr = ls->process.hdr;
+    memcpy(s->process.handles, ls->process.handles,
+           sizeof s->process.handles);
+    handle_sync(s);
+    memcpy(s->process.threads, ls->process.threads,
+           sizeof s->process.threads);
+    thread_sync_ready(s);
+    memory_set_ptab(s, ls->process.ptab);
+    Vec_free(s->process.vmblocks);
+    s->process.vmblocks = ls->process.vmblocks;
+    s->process.used_memory = ls->process.used_memory;
+    Vec_free(s->pheap);
+    s->pheap = ls->pheap;
+
+    FSData oldfs = s->services.fs;
+    s->services = ls->services;
+    set_fs(s, ls, &oldfs);
+
+    s->sched.now = ls->sched.now;
+    s->sched.event_queue = ls->sched.event_queue;
+
+    s->gpu.regs = ls->gpu.regs;
+    memcpy(s->gpu.progdata, ls->gpu.progdata, sizeof s->gpu.progdata);
+    memcpy(s->gpu.opdescs, ls->gpu.opdescs, sizeof s->gpu.opdescs);
+    s->gpu.sh_idx = ls->gpu.sh_idx;
+    memcpy(s->gpu.fixattrs, ls->gpu.fixattrs, sizeof s->gpu.fixattrs);
+    s->gpu.curfixattr = ls->gpu.curfixattr;
+    s->gpu.curfixi = ls->gpu.curfixi;
+    s->gpu.curuniform = ls->gpu.curuniform;
+    s->gpu.curunifi = ls->gpu.curunifi;
+    memcpy(s->gpu.floatuniform, ls->gpu.floatuniform,
+           sizeof s->gpu.floatuniform);
+    s->gpu.immattrs.size = 0;
+    s->gpu.sh_dirty = true;
+    s->gpu.uniform_dirty = true;
+
+    free_load_state(ls);
+}
+
+void savestate_init(SaveState* st) {
+    Vec_init(st->data);
+    memory_snapshot_init(&st->mem);
+}
+
+void savestate_free(SaveState* st) {
+    Vec_free(st->data);
+    memory_snapshot_free(&st->mem);
+}
+
+// transfers still write guest memory until they finish and the dsp thread
+// still writes its state, so this must be called before either is saved or
+// overwritten
+void savestate_quiesce(E3DS* s) {
+    fsio_wait(nullptr);
+    dsp_wait();
+}
+
+// serializes everything except emulated memory, padded to a whole number of
+// words
+void savestate_put(E3DS* s, StateBuf* b) {
+    savestate_quiesce(s);
+    StateCtx c = {.s = s, .b = b};
+    b->size = 0;
+    put_state(&c);
+    Vec_free(c.objs);
+    u32 pad = 0;
+    put(&c, &pad, -b->size & 3);
+}
+
+// a state which cannot be read leaves the running state unchanged
+bool savestate_get(E3DS* s, u8* data, size_t size) {
+    savestate_quiesce(s);
+    StateCtx c = {.s = s, .p = data, .end = data + size};
+    LoadState* ls = calloc(1, sizeof *ls);
+    bool ok = get_state(&c, ls);
+    if (ok) {
+        ldr_clear_symbols();
+        y2r_clear_job();
+        set_state(&c, ls);
+    } else {
+        discard_state(&c, ls);
+    }
+    free(ls);
+    Vec_free(c.objs);
+    return ok;
+}
+
+// this must be called between frames, afterwards emulated memory is only
+// copied as it gets written to
+bool savestate_take(E3DS* s, SaveState* st) {
+    savestate_put(s, &st->data);
+    return memory_snapshot_begin(s, &st->mem);
+}
+
+// the state stays valid and can be restored again
+void savestate_restore(E3DS* s, SaveState* st) {
+    if (!memory_snapshot_active(s, &st->mem)) {
+        lerror("save state is no longer active");
+        return;
+    }
+    if (!savestate_get(s, st->data.d, st->data.size)) {
+        lerror("corrupted save state");
+        return;
+    }
+    memory_snapshot_restore(s, &st->mem);
+}
+
+void savestate_release(E3DS* s, SaveState* st) {
+    memory_snapshot_end(s, &st->mem);
+}
+
+static char* base_path(char* path, u64 id) {
+    char* p;
+    asprintf(&p, "%s.%016llx", path, (unsigned long long) id);
+    return p;
+}
+
+static u64 base_id(char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return 0;
+    SaveStateHeader hdr;
+    u64 id = 0;
+    if (fread(&hdr, sizeof hdr, 1, fp) == 1 && hdr.magic == SAVESTATE_MAGIC &&
+        hdr.version == SAVESTATE_VERSION)
+        id = hdr.base;
+    fclose(fp);
+    return id;
+}
+
+static void write_page(FILE* fp, u32 pg, void* data) {
+    fwrite(&pg, sizeof pg, 1, fp);
+    fwrite(data, PAGE_SIZE, 1, fp);
+}
+
+// the base file has every page which is not zero, it is named after its id
+// so the state which uses the previous one stays valid until it is replaced
+static bool write_base(SaveStateWriter* w, char* path) {
+    FILE* fp = fopen(path, "wb");
+    if (!fp) return false;
+    SaveStateHeader hdr = {SAVESTATE_MAGIC, SAVESTATE_VERSION, sizeof(E3DS),
+                           0, layout_id(), w->base};
+    fwrite(&hdr, sizeof hdr, 1, fp);
+
+    static const u8 zeropage[PAGE_SIZE];
+    u8 buf[PAGE_SIZE];
+    for (u32 pg = 0; pg < MEM_NPAGES; pg++) {
+        void* data = memory_snapshot_read(w->s, &w->st.mem, pg, buf);
+        if (!memcmp(data, zeropage, PAGE_SIZE)) continue;
+        write_page(fp, pg, data);
+        w->npages++;
+    }
+    u32 end = -1;
+    fwrite(&end, sizeof end, 1, fp);
+
+    bool ok = !ferror(fp);
+    if (fclose(fp)) ok = false;
+    return ok;
+}
+
+// writes the snapshot while the emulator keeps running
+static void* savestate_write_thread(void* arg) {
+    SaveStateWriter* w = arg;
+    char* basepath = base_path(w->path, w->base);
+    u64 oldbase = base_id(w->path);
+    w->ok = !w->full || write_base(w, basepath);
+
+    char* tmppath;
+    asprintf(&tmppath, "%s.tmp", w->path);
+    FILE* fp = w->ok ? fopen(tmppath, "wb") : nullptr;
+    if (fp) {
+        SaveStateHeader hdr = {SAVESTATE_MAGIC, SAVESTATE_VERSION,
+                               sizeof(E3DS), w->st.data.size, layout_id(),
+                               w->base};
+        fwrite(&hdr, sizeof hdr, 1, fp);
+        fwrite(w->st.data.d, 1, w->st.data.size, fp);
+
+        u8 buf[PAGE_SIZE];
+        Vec_foreach(pg, w->pages) {
+            write_page(fp, *pg,
+                       memory_snapshot_read(w->s, &w->st.mem, *pg, buf));
+        }
+        u32 end = -1;
+        fwrite(&end, sizeof end, 1, fp);
+
+        w->ok = !ferror(fp);
+        if (fclose(fp)) w->ok = false;
+        // the old state is only replaced once the new one is complete
+        if (w->ok) w->ok = !rename(tmppath, w->path);
+        else remove(tmppath);
+    } else {
+        w->ok = false;
+    }
+
+    if (w->full && !w->ok) remove(basepath);
+    if (w->full && w->ok && oldbase && oldbase != w->base) {
+        char* oldpath = base_path(w->path, oldbase);
+        remove(oldpath);
+        free(oldpath);
+    }
+    free(basepath);
+    free(tmppath);
+    atomic_store(&w->done, true);
+    return nullptr;
+}
+
+static u64 new_base_id() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1'000'000'000ull + ts.tv_nsec;
+}
+
+static void drop_base(E3DS* s) {
+    memory_snapshot_end(s, &s->savebase.dirty);
+    free(s->savebase.path);
+    s->savebase.path = nullptr;
+}
+
+// only the pages written since the last full save to the same file are
+// stored, until they are more than half as many as the base has
+bool savestate_save(E3DS* s, char* path) {
+    if (s->savewriter) {
+        lwarn("a save state is already being written");
+        return false;
+    }
+    u64 start = time_ns();
+
+    SaveStateBase* base = &s->savebase;
+    if (!base->dirty.pgstate) memory_snapshot_init_tracking(&base->dirty);
+
+    SaveStateWriter* w = calloc(1, sizeof *w);
+    w->s = s;
+    w->path = strdup(path);
+    w->full = !base->path || strcmp(base->path, path) ||
+              !memory_snapshot_active(s, &base->dirty) ||
+              base->dirty.nsaved > base->npages / 2;
+    Vec_init(w->pages);
+    savestate_init(&w->st);
+    if (!savestate_take(s, &w->st)) {
+        savestate_free(&w->st);
+        free(w->path);
+        free(w);
+        return false;
+    }
+    if (w->full) {
+        // pages are tracked from the same point as the snapshot which the
+        // base is written from
+        drop_base(s);
+        w->base = new_base_id();
+        if (memory_snapshot_begin(s, &base->dirty)) {
+            base->path = strdup(path);
+            base->id = w->base;
+        }
+    } else {
+        w->base = base->id;
+        for (u32 i = 0; i < base->dirty.nsaved; i++) {
+            Vec_push(w->pages, base->dirty.saved[i]);
+        }
+    }
+    s->savewriter = w;
+    pthread_create(&w->thd, nullptr, savestate_write_thread, w);
+
+    linfo("took snapshot in %.3lf ms", (time_ns() - start) / 1e6);
+    return true;
+}
+
+// finishes writing a save state to disk, this only blocks if wait is set
+void savestate_finish(E3DS* s, bool wait) {
+    SaveStateWriter* w = s->savewriter;
+    if (!w || (!wait && !atomic_load(&w->done))) return;
+
+    pthread_join(w->thd, nullptr);
+    savestate_release(s, &w->st);
+    if (w->ok) linfo("saved state to %s", w->path);
+    else lerror("could not write save state to %s", w->path);
+
+    // later saves can only use the base once it was written
+    if (w->full && w->ok) s->savebase.npages = w->npages;
+    if (w->full && !w->ok && s->savebase.id == w->base) drop_base(s);
+
+    savestate_free(&w->st);
+    Vec_free(w->pages);
+    free(w->path);
+    free(w);
+    s->savewriter = nullptr;
+}
+
+void savestate_destroy(E3DS* s) {
+    savestate_finish(s, true);
+    drop_base(s);
+    if (s->savebase.dirty.pgstate) memory_snapshot_free(&s->savebase.dirty);
+}
+
+static bool read_pages(FILE* fp, u8* pages, u8* loaded) {
+    while (true) {
+        u32 pg;
+        if (fread(&pg, sizeof pg, 1, fp) != 1) return false;
+        if (pg == -1) return true;
+        if (pg >= MEM_NPAGES ||
+            fread(&pages[pg * PAGE_SIZE], PAGE_SIZE, 1, fp) != 1)
+            return false;
+        loaded[pg] = true;
+    }
+}
+
+// the pages of the base file are read first and then replaced by the ones
+// written since
+static bool read_all_pages(char* path, SaveStateHeader* hdr, FILE* fp,
+                           u8* pages, u8* loaded) {
+    if (hdr->base) {
+        char* basepath = base_path(path, hdr->base);
+        FILE* bfp = fopen(basepath, "rb");
+        free(basepath);
+        if (!bfp) return false;
+        SaveStateHeader bhdr;
+        bool ok = fread(&bhdr, sizeof bhdr, 1, bfp) == 1 &&
+                  bhdr.magic == SAVESTATE_MAGIC && bhdr.base == hdr->base &&
+                  read_pages(bfp, pages, loaded);
+        fclose(bfp);
+        if (!ok) return false;
+    }
+    return read_pages(fp, pages, loaded);
+}
+
+bool savestate_load(E3DS* s, char* path) {
+    savestate_finish(s, true);
+    // memory is replaced as a whole, so the next save has to be a full one
+    drop_base(s);
+    if (s->memsnaps.size) {
+        lwarn("cannot load state while a snapshot is active");
+        return false;
+    }
+
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        lerror("could not open save state %s", path);
+        return false;
+    }
+    SaveStateHeader hdr;
+    if (fread(&hdr, sizeof hdr, 1, fp) != 1 || hdr.magic != SAVESTATE_MAGIC ||
+        hdr.version != SAVESTATE_VERSION || hdr.e3dssize != sizeof(E3DS) ||
+        hdr.layout != layout_id()) {
+        lerror("save state %s is invalid or from a different build", path);
+        fclose(fp);
+        return false;
+    }
+    u8* data = malloc(hdr.datasize);
+    if (fread(data, 1, hdr.datasize, fp) != hdr.datasize) {
+        lerror("save state %s is truncated", path);
+        free(data);
+        fclose(fp);
+        return false;
+    }
+
+    u64 start = time_ns();
+
+    // memory is read into a separate buffer first, so nothing is changed
+    // unless the whole file could be read
+    u8* pages = malloc(sizeof(E3DSMemory));
+    u8* loaded = calloc(MEM_NPAGES, 1);
+    bool ok = read_all_pages(path, &hdr, fp, pages, loaded);
+    fclose(fp);
+
+    if (ok) ok = savestate_get(s, data, hdr.datasize);
+    free(data);
+
+    if (ok) {
+        // pages missing from the file were zero
+        static const u8 zeropage[PAGE_SIZE];
+        for (u32 pg = 0; pg < MEM_NPAGES; pg++) {
+            void* p = &s->mem->raw[pg * PAGE_SIZE];
+            if (loaded[pg]) memcpy(p, &pages[pg * PAGE_SIZE], PAGE_SIZE);
+            else if (memcmp(p, zeropage, PAGE_SIZE)) memset(p, 0, PAGE_SIZE);
+        }
+        jit_free_all(&s->cpu);
+    }
+    free(pages);
+    free(loaded);
+
+    if (ok) linfo("loaded state in %.3lf ms", (time_ns() - start) / 1e6);
+    else lerror("save state %s is corrupted", path);
+    return ok;
+}
@@ -0,0 +1,63 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "common.h"
+#include "kernel/memory.h"
+
+#define SAVESTATE_MAGIC 0x53533354 // T3SS
+#define SAVESTATE_VERSION 5
+
+typedef struct _3DS E3DS;
+
+typedef Vector(u8) StateBuf;
+
+// everything except emulated memory is serialized, memory is kept as a copy
+// on write snapshot so taking one does not need to copy it
+typedef struct {
+    StateBuf data;
+    MemSnapshot mem;
+} SaveState;
+
+typedef struct {
+    E3DS* s;
+    pthread_t thd;
+    SaveState st;
+    char* path;
+    // a full save writes every page to a new base file, otherwise only the
+    // pages written since the base was taken are stored with the state
+    bool full;
+    u64 base;
+    Vector(u32) pages;
+    u32 npages;
+    atomic_bool done;
+    bool ok;
+} SaveStateWriter;
+
+// the base file of the last full save and the pages written since then
+typedef struct {
+    MemSnapshot dirty;
+    char* path;
+    u64 id;
+    u32 npages;
+} SaveStateBase;
+
+void savestate_init(SaveState* st);
+void savestate_free(SaveState* st);
+
+void savestate_quiesce(E3DS* s);
+void savestate_put(E3DS* s, StateBuf* b);
+bool savestate_get(E3DS* s, u8* data, size_t size);
+
+bool savestate_take(E3DS* s, SaveState* st);
+void savestate_restore(E3DS* s, SaveState* st);
+void savestate_release(E3DS* s, SaveState* st);
+
+bool savestate_save(E3DS* s, char* path);
+bool savestate_load(E3DS* s, char* path);
+void savestate_finish(E3DS* s, bool wait);
+void savestate_destroy(E3DS* s);
+
+#endif
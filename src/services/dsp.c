@@ -1,12 +1,507 @@
 #include "dsp.h"
 
+#include <pthread.h>
+
 #include "3ds.h"
+#include "audio.h"
+
+typedef float v4f __attribute__((vector_size(16)));
+typedef s32 v4i __attribute__((vector_size(16)));
 
 u16 dsp_addrs[15] = {
     0xBFFF, 0x9E92, 0x8680, 0xA792, 0x9430, 0x8400, 0x8540, 0x9492,
     0x8710, 0x8410, 0xA912, 0xAA12, 0xAAD2, 0xAC52, 0xAC5C,
 };
 
+// each audio frame is mixed by a worker thread while the guest runs, the
+// result is given to the application at the start of the next frame
+static struct {
+    pthread_t thd;
+    bool started;
+    bool die;
+
+    pthread_mutex_t mtx;
+    pthread_cond_t queuecv;
+    pthread_cond_t donecv;
+
+    E3DS* s;
+    bool pending;
+    bool busy;
+
+    u64 frames;
+    u64 totaltime;
+    u64 maxtime;
+} worker = {
+    .mtx = PTHREAD_MUTEX_INITIALIZER,
+    .queuecv = PTHREAD_COND_INITIALIZER,
+    .donecv = PTHREAD_COND_INITIALIZER,
+};
+
+static inline u32 dsp32(u32 v) {
+    return v >> 16 | v << 16;
+}
+
+static inline s16 clamp16(s32 x) {
+    return x < -0x8000 ? -0x8000 : x > 0x7fff ? 0x7fff : x;
+}
+
+static void reset_source(DSPSource* src) {
+    *src = (DSPSource) {};
+    // the first output is the first sample read
+    src->need = 1;
+}
+
+static void enqueue(DSPSource* src, DSPBuffer b) {
+    if (src->nqueued == DSP_QUEUE_SIZE) {
+        lwarn("dsp buffer queue is full");
+        return;
+    }
+    src->queue[src->nqueued++] = b;
+}
+
+static u32 buffer_bytes(DSPBuffer* b) {
+    switch (b->format) {
+        case DSPFMT_PCM8:
+            return b->len * b->channels;
+        case DSPFMT_PCM16:
+            return b->len * b->channels * 2;
+        case DSPFMT_ADPCM:
+            return (b->len + 13) / 14 * 8;
+        default:
+            return -1;
+    }
+}
+
+static void parse_config(DSPAudio* a, int i) {
+    DSPSource* src = &a->sources[i];
+    DSPSourceConfig* c = &a->srccfg[i];
+    u32 dirty = c->dirty;
+
+    if (dirty & DSPSRC_RESET) reset_source(src);
+    if (dirty & DSPSRC_PARTIAL_RESET) src->nqueued = 0;
+    if (dirty & DSPSRC_ENABLE) src->enabled = c->enable;
+    if (dirty & DSPSRC_SYNC) src->sync = c->sync;
+    if (dirty & DSPSRC_RATE) src->rate = c->rate;
+    if (dirty & DSPSRC_INTERP) src->interp = c->interp;
+    if (dirty & DSPSRC_FILTERS_ENABLE) src->filters = c->filters;
+    if (dirty & DSPSRC_SIMPLE_FILTER) {
+        memcpy(src->simple, c->simple, sizeof src->simple);
+    }
+    if (dirty & DSPSRC_BIQUAD_FILTER) {
+        memcpy(src->biquad, c->biquad, sizeof src->biquad);
+    }
+    for (int m = 0; m < 3; m++) {
+        if (dirty & DSPSRC_GAIN0 << m) {
+            memcpy(src->gain[m], c->gain[m], sizeof src->gain[m]);
+        }
+    }
+    if (dirty & DSPSRC_ADPCM_COEFS) {
+        memcpy(src->coefs, a->coefs[i], sizeof src->coefs);
+    }
+    if (dirty & DSPSRC_FORMAT) src->format = c->flags1 >> 2 & 3;
+    if (dirty & DSPSRC_STEREO) src->channels = (c->flags1 & 3) == 2 ? 2 : 1;
+
+    if (dirty & DSPSRC_EMBEDDED) {
+        enqueue(src, (DSPBuffer) {
+                         .addr = dsp32(c->addr),
+                         .len = dsp32(c->len),
+                         .start = dirty & DSPSRC_PLAY_POS ? dsp32(c->play_pos)
+                                                          : 0,
+                         .id = c->id,
+                         .format = src->format,
+                         .channels = src->channels,
+                         .adpcm_dirty = c->flags2 & 1,
+                         .adpcm_yn = {c->adpcm_yn[0], c->adpcm_yn[1]},
+                         .loop = c->flags2 >> 1 & 1,
+                     });
+    }
+    if (dirty & DSPSRC_QUEUE) {
+        for (int b = 0; b < 4; b++) {
+            DSPBufferConfig* bc = &c->buffers[b];
+            if (!(c->buffers_dirty & BIT(b)) || !bc->len) continue;
+            enqueue(src, (DSPBuffer) {
+                             .addr = dsp32(bc->addr),
+                             .len = dsp32(bc->len),
+                             .id = bc->id,
+                             .format = src->format,
+                             .channels = src->channels,
+                             .adpcm_dirty = bc->adpcm_dirty,
+                             .adpcm_yn = {bc->adpcm_yn[0], bc->adpcm_yn[1]},
+                             .loop = bc->loop,
+                             .from_queue = true,
+                         });
+        }
+    }
+}
+
+static s16 adpcm_sample(DSPSource* src, u8* data, u32 pos) {
+    // frames of 8 bytes, a header with the scale and coefficient index
+    // followed by 14 4 bit samples
+    u8 hdr = data[pos / 14 * 8];
+    u8 b = data[pos / 14 * 8 + 1 + pos % 14 / 2];
+    s32 x = (s32) ((u32) (pos & 1 ? b : b >> 4) << 28) >> 28;
+    s32 c1 = src->coefs[(hdr >> 4 & 7) * 2];
+    s32 c2 = src->coefs[(hdr >> 4 & 7) * 2 + 1];
+    s32 y = ((x << (hdr & 0xf) << 11) + 0x400 + c1 * src->adpcm_yn[0] +
+             c2 * src->adpcm_yn[1]) >>
+            11;
+    src->adpcm_yn[1] = src->adpcm_yn[0];
+    src->adpcm_yn[0] = clamp16(y);
+    return src->adpcm_yn[0];
+}
+
+static bool read_sample(E3DS* s, DSPSource* src, s16* out);
+
+// buffers are played in order of their ids
+static bool dequeue(E3DS* s, DSPSource* src) {
+    while (src->nqueued) {
+        u32 best = 0;
+        for (u32 i = 1; i < src->nqueued; i++) {
+            if ((s16) (src->queue[i].id - src->queue[best].id) < 0) best = i;
+        }
+        src->cur = src->queue[best];
+        src->queue[best] = src->queue[--src->nqueued];
+
+        // the dma only uses word aligned addresses
+        src->cur.addr &= ~3;
+        u64 size = buffer_bytes(&src->cur);
+        if (!src->cur.len || src->cur.addr < FCRAM_PBASE ||
+            src->cur.addr - FCRAM_PBASE + size > FCRAM_SIZE) {
+            lwarn("invalid dsp buffer at %08x", src->cur.addr);
+            continue;
+        }
+
+        if (src->cur.adpcm_dirty) {
+            memcpy(src->adpcm_yn, src->cur.adpcm_yn, sizeof src->adpcm_yn);
+        }
+        src->playing = true;
+        src->played = false;
+        src->pos = 0;
+        src->id_dirty = src->cur.from_queue;
+        src->cur_id = src->cur.id;
+
+        if (src->cur.start >= src->cur.len) src->cur.start = 0;
+        if (src->cur.format == DSPFMT_ADPCM) {
+            // the decoder state depends on every sample before
+            s16 tmp[2];
+            while (src->pos < src->cur.start) read_sample(s, src, tmp);
+        } else {
+            src->pos = src->cur.start;
+        }
+        return true;
+    }
+    return false;
+}
+
+static bool read_sample(E3DS* s, DSPSource* src, s16* out) {
+    while (!src->playing || src->pos == src->cur.len) {
+        if (src->playing && src->cur.loop) {
+            src->pos = 0;
+            src->played = true;
+            if (src->cur.adpcm_dirty) {
+                memcpy(src->adpcm_yn, src->cur.adpcm_yn,
+                       sizeof src->adpcm_yn);
+            }
+            break;
+        }
+        src->playing = false;
+        if (!dequeue(s, src)) return false;
+    }
+
+    u8* data = &s->mem->fcram[src->cur.addr - FCRAM_PBASE];
+    u32 ch = src->cur.channels;
+    u32 pos = src->pos++;
+    switch (src->cur.format) {
+        case DSPFMT_PCM8:
+            out[0] = (s8) data[pos * ch] << 8;
+            out[1] = (s8) data[pos * ch + ch - 1] << 8;
+            break;
+        case DSPFMT_PCM16:
+            memcpy(&out[0], &data[pos * ch * 2], 2);
+            memcpy(&out[1], &data[(pos * ch + ch - 1) * 2], 2);
+            break;
+        case DSPFMT_ADPCM:
+            out[0] = out[1] = adpcm_sample(src, data, pos);
+            break;
+    }
+    return true;
+}
+
+// resamples the source to the output rate, the output is left silent once
+// there is nothing more to play
+static void source_frame(E3DS* s, DSPSource* src,
+                         s16 (*out)[2]) {
+    if (!src->playing && !dequeue(s, src)) {
+        src->enabled = false;
+        src->id_dirty = true;
+        src->last_id = src->cur_id;
+        src->cur_id = 0;
+        return;
+    }
+
+    float rate = src->rate > 0 && src->rate < 64 ? src->rate : 0;
+    u64 step = rate * BIT(24);
+    for (u32 n = 0; n < DSP_FRAME_SAMPLES; n++) {
+        for (; src->need; src->need--) {
+            s16 x[2];
+            if (!read_sample(s, src, x)) return;
+            memcpy(src->prev, src->next, sizeof src->prev);
+            memcpy(src->next, x, sizeof src->next);
+        }
+        if (src->interp == DSPINTERP_NONE) {
+            out[n][0] = src->next[0];
+            out[n][1] = src->next[1];
+        } else {
+            // polyphase is done as linear
+            for (int c = 0; c < 2; c++) {
+                s32 delta = src->next[c] - src->prev[c];
+                out[n][c] =
+                    clamp16(src->prev[c] + (s64) src->fpos * delta / BIT(24));
+            }
+        }
+        u64 f = src->fpos + step;
+        src->need = f >> 24;
+        src->fpos = f & (BIT(24) - 1);
+    }
+}
+
+// simple is y[n] = b0 x[n] + a1 y[n-1] with 15 fraction bits, biquad is
+// y[n] = b0 x[n] + b1 x[n-1] + b2 x[n-2] + a1 y[n-1] + a2 y[n-2] with 14
+static void filter_frame(DSPSource* src, s16 (*f)[2]) {
+    if (src->filters & BIT(0)) {
+        s32 b0 = src->simple[0];
+        s32 a1 = src->simple[1];
+        for (u32 n = 0; n < DSP_FRAME_SAMPLES; n++) {
+            for (int c = 0; c < 2; c++) {
+                f[n][c] = clamp16((b0 * f[n][c] + a1 * src->simple_y[c]) >> 15);
+                src->simple_y[c] = f[n][c];
+            }
+        }
+    }
+    if (src->filters & BIT(1)) {
+        s32 a2 = src->biquad[0];
+        s32 a1 = src->biquad[1];
+        s32 b2 = src->biquad[2];
+        s32 b1 = src->biquad[3];
+        s32 b0 = src->biquad[4];
+        for (u32 n = 0; n < DSP_FRAME_SAMPLES; n++) {
+            for (int c = 0; c < 2; c++) {
+                s16 x = f[n][c];
+                f[n][c] = clamp16(
+                    (b0 * x + b1 * src->biquad_x[c][0] +
+                     b2 * src->biquad_x[c][1] + a1 * src->biquad_y[c][0] +
+                     a2 * src->biquad_y[c][1]) >>
+                    14);
+                src->biquad_x[c][1] = src->biquad_x[c][0];
+                src->biquad_x[c][0] = x;
+                src->biquad_y[c][1] = src->biquad_y[c][0];
+                src->biquad_y[c][0] = f[n][c];
+            }
+        }
+    }
+}
+
+// the left and right channel go to the 4 channels of each intermediate mix
+// scaled by its gains
+static void mix_source(DSPSource* src, s16 (*f)[2],
+                       v4i mixes[3][DSP_FRAME_SAMPLES]) {
+    for (int m = 0; m < 3; m++) {
+        v4f g = {src->gain[m][0], src->gain[m][1], src->gain[m][2],
+                 src->gain[m][3]};
+        if (!g[0] && !g[1] && !g[2] && !g[3]) continue;
+        for (u32 n = 0; n < DSP_FRAME_SAMPLES; n++) {
+            v4f x = {f[n][0], f[n][1], f[n][0], f[n][1]};
+            mixes[m][n] += __builtin_convertvector(g * x, v4i);
+        }
+    }
+}
+
+static void final_mix(DSPAudio* a, v4i mixes[3][DSP_FRAME_SAMPLES]) {
+    memset(a->final, 0, sizeof a->final);
+    for (int m = 0; m < 3; m++) {
+        for (u32 n = 0; n < DSP_FRAME_SAMPLES; n++) {
+            v4f q = __builtin_convertvector(mixes[m][n], v4f) * a->volume[m];
+            s16 l, r;
+            if (a->output_format == DSPOUT_MONO) {
+                l = r = clamp16((q[0] + q[1] + q[2] + q[3]) / 2);
+            } else {
+                // surround is mixed as stereo
+                l = clamp16(q[0] + q[2]);
+                r = clamp16(q[1] + q[3]);
+            }
+            a->final[n][0] = clamp16(a->final[n][0] + l);
+            a->final[n][1] = clamp16(a->final[n][1] + r);
+        }
+    }
+}
+
+static void mix_frame(E3DS* s) {
+    DSPAudio* a = &s->services.dsp.audio;
+
+    u32 dirty = a->cfg.dirty;
+    if (dirty & DSPCFG_MASTER_VOLUME) a->volume[0] = a->cfg.master_volume;
+    for (int k = 0; k < 2; k++) {
+        if (dirty & DSPCFG_AUX0_VOLUME << k) {
+            a->volume[k + 1] = a->cfg.aux_volume[k];
+        }
+        if (dirty & DSPCFG_AUX0_ENABLE << k) {
+            a->aux_enable[k] = a->cfg.aux_enable[k];
+        }
+    }
+    if (dirty & DSPCFG_OUTPUT_FORMAT) a->output_format = a->cfg.output_format;
+
+    v4i mixes[3][DSP_FRAME_SAMPLES] = {};
+    for (int i = 0; i < DSP_SOURCES; i++) {
+        DSPSource* src = &a->sources[i];
+        parse_config(a, i);
+        if (src->enabled) {
+            s16 f[DSP_FRAME_SAMPLES][2] = {};
+            source_frame(s, src, f);
+            filter_frame(src, f);
+            mix_source(src, f, mixes);
+        }
+        a->status[i] = (DSPSourceStatus) {
+            .enabled = src->enabled,
+            .id_dirty = src->id_dirty,
+            .sync = src->sync,
+            .pos = dsp32(src->pos),
+            .cur_id = src->cur_id,
+            .last_id = src->last_id,
+        };
+        src->id_dirty = false;
+    }
+
+    // the aux mixes go through the application, which can add effects
+    for (int k = 0; k < 2; k++) {
+        if (!a->aux_enable[k]) continue;
+        for (int c = 0; c < 4; c++) {
+            for (u32 n = 0; n < DSP_FRAME_SAMPLES; n++) {
+                a->aux_send[k][c][n] = mixes[k + 1][n][c];
+                mixes[k + 1][n][c] = a->aux_return[k][c][n];
+            }
+        }
+    }
+
+    final_mix(a, mixes);
+    a->ready = true;
+
+    // frames emulated ahead or while rewinding are not heard
+    if (!a->mute) audio_push(a->final, DSP_FRAME_SAMPLES);
+}
+
+static void* dsp_thread(void*) {
+    pthread_mutex_lock(&worker.mtx);
+    while (true) {
+        while (!worker.pending && !worker.die) {
+            pthread_cond_wait(&worker.queuecv, &worker.mtx);
+        }
+        if (worker.die) break;
+        worker.pending = false;
+        pthread_mutex_unlock(&worker.mtx);
+
+        u64 start = time_ns();
+        mix_frame(worker.s);
+        u64 elapsed = time_ns() - start;
+
+        pthread_mutex_lock(&worker.mtx);
+        worker.frames++;
+        worker.totaltime += elapsed;
+        if (elapsed > worker.maxtime) worker.maxtime = elapsed;
+        linfo("dsp frame mixed in %.3lf ms", elapsed / 1e6);
+        worker.busy = false;
+        pthread_cond_broadcast(&worker.donecv);
+    }
+    pthread_mutex_unlock(&worker.mtx);
+    return nullptr;
+}
+
+// the region the application wrote last has the higher frame counter
+static u8* cur_region(E3DS* s) {
+    u8* r0 = &s->mem->dspram[DSP_REGION0];
+    u8* r1 = &s->mem->dspram[DSP_REGION1];
+    u16 c0 = *(u16*) &r0[DSPREG_FRAME_COUNTER];
+    u16 c1 = *(u16*) &r1[DSPREG_FRAME_COUNTER];
+    if (c0 == 0xffff && c1 != 0xfffe) return r1;
+    if (c1 == 0xffff && c0 != 0xfffe) return r0;
+    return c0 > c1 ? r0 : r1;
+}
+
+static void publish(E3DS* s, u8* region) {
+    DSPAudio* a = &s->services.dsp.audio;
+    if (!a->ready) return;
+    a->ready = false;
+    memcpy(&region[DSPREG_SOURCE_STATUS], a->status, sizeof a->status);
+    memcpy(&region[DSPREG_FINAL_SAMPLES], a->final, sizeof a->final);
+    u32* aux = (u32*) &region[DSPREG_AUX_SAMPLES];
+    for (int k = 0; k < 2; k++) {
+        if (!a->aux_enable[k]) continue;
+        for (int i = 0; i < 4 * DSP_FRAME_SAMPLES; i++) {
+            aux[k * 4 * DSP_FRAME_SAMPLES + i] =
+                dsp32((&a->aux_send[k][0][0])[i]);
+        }
+    }
+}
+
+// the dirty flags are cleared once the dsp has seen them
+static void snapshot(E3DS* s, u8* region) {
+    DSPAudio* a = &s->services.dsp.audio;
+    DSPSourceConfig* srccfg = (DSPSourceConfig*) &region[DSPREG_SOURCE_CONFIG];
+    DSPConfig* cfg = (DSPConfig*) &region[DSPREG_CONFIG];
+    memcpy(a->srccfg, srccfg, sizeof a->srccfg);
+    memcpy(a->coefs, &region[DSPREG_ADPCM_COEFS], sizeof a->coefs);
+    memcpy(&a->cfg, cfg, sizeof a->cfg);
+    for (int i = 0; i < DSP_SOURCES; i++) {
+        srccfg[i].dirty = 0;
+        srccfg[i].buffers_dirty = 0;
+    }
+    cfg->dirty = 0;
+    u32* aux = (u32*) &region[DSPREG_AUX_SAMPLES];
+    for (int i = 0; i < 2 * 4 * DSP_FRAME_SAMPLES; i++) {
+        (&a->aux_return[0][0][0])[i] = dsp32(aux[i]);
+    }
+}
+
+void dsp_frame(E3DS* s, u32) {
+    DSPData* dsp = &s->services.dsp;
+    if (!dsp->running) return;
+    add_event(&s->sched, dsp_frame, 0, DSP_FRAME_CYCLES);
+
+    dsp_wait();
+    u8* region = cur_region(s);
+    publish(s, region);
+    snapshot(s, region);
+    dsp->audio.mute = s->rewind.hold;
+
+    pthread_mutex_lock(&worker.mtx);
+    if (!worker.started) {
+        worker.started = true;
+        worker.die = false;
+        pthread_create(&worker.thd, nullptr, dsp_thread, nullptr);
+    }
+    worker.s = s;
+    worker.pending = true;
+    worker.busy = true;
+    pthread_cond_signal(&worker.queuecv);
+    pthread_mutex_unlock(&worker.mtx);
+
+    // int=2,ch=2 is for when audio is finished being processed
+    if (dsp->events[2][2]) event_signal(s, dsp->events[2][2]);
+}
+
+static void dsp_start(E3DS* s) {
+    if (s->services.dsp.running) return;
+    linfo("starting dsp");
+    s->services.dsp.running = true;
+    add_event(&s->sched, dsp_frame, 0, DSP_FRAME_CYCLES);
+}
+
+static void dsp_stop(E3DS* s) {
+    if (!s->services.dsp.running) return;
+    linfo("stopping dsp");
+    s->services.dsp.running = false;
+    remove_event(&s->sched, dsp_frame, 0);
+}
+
 DECL_PORT(dsp) {
     u32* cmdbuf = PTR(cmd_addr);
     switch (cmd.command) {
@@ -32,6 +527,21 @@ DECL_PORT(dsp) {
             cmdbuf[1] = 0;
             break;
         }
+        case 0x000d: {
+            u32 chan = cmdbuf[1];
+            u32 size = cmdbuf[2];
+            linfo("WriteProcessPipe chan=%d with size 0x%x", chan, size);
+            // the audio pipe takes a state change, 0 and 2 start the dsp and
+            // 1 and 3 stop it
+            if (chan == 2 && size >= 2) {
+                u16 state = *(u16*) PTR(cmdbuf[4]);
+                if (state == 0 || state == 2) dsp_start(s);
+                else dsp_stop(s);
+            }
+            cmdbuf[0] = IPCHDR(1, 0);
+            cmdbuf[1] = 0;
+            break;
+        }
         case 0x0010: {
             u32 chan = cmdbuf[1];
             u32 size = (u16) cmdbuf[3];
@@ -99,6 +609,7 @@ DECL_PORT(dsp) {
             *event = HANDLE_GET_TYPED(cmdbuf[4], KOT_EVENT);
             if (*event) {
                 (*event)->hdr.refcount++;
+                if (interrupt == 2 && channel == 2) dsp_start(s);
             }
 
             cmdbuf[0] = IPCHDR(1, 0);
@@ -126,3 +637,33 @@ DECL_PORT(dsp) {
             break;
     }
 }
+
+// the emulator only blocks here if the host takes longer to mix a frame
+// than the guest takes to run one
+void dsp_wait() {
+    pthread_mutex_lock(&worker.mtx);
+    while (worker.busy) {
+        pthread_cond_wait(&worker.donecv, &worker.mtx);
+    }
+    pthread_mutex_unlock(&worker.mtx);
+}
+
+void dsp_destroy() {
+    dsp_wait();
+    pthread_mutex_lock(&worker.mtx);
+    if (!worker.started) {
+        pthread_mutex_unlock(&worker.mtx);
+        return;
+    }
+    worker.die = true;
+    worker.started = false;
+    pthread_cond_broadcast(&worker.queuecv);
+    pthread_mutex_unlock(&worker.mtx);
+    pthread_join(worker.thd, nullptr);
+
+    if (worker.frames) {
+        linfo("dsp: %lu frames, avg %.3lf ms, max %.3lf ms", worker.frames,
+              worker.totaltime / 1e6 / worker.frames, worker.maxtime / 1e6);
+    }
+    worker.frames = worker.totaltime = worker.maxtime = 0;
+}
@@ -5,14 +5,232 @@
 
 #include "srv.h"
 
+// audio is mixed in frames of 160 samples, the dsp runs one every 160
+// samples at its sample rate
+#define DSP_SAMPLE_RATE 32728
+#define DSP_FRAME_SAMPLES 160
+#define DSP_FRAME_CYCLES ((s64) CPU_CLK * DSP_FRAME_SAMPLES / DSP_SAMPLE_RATE)
+
+#define DSP_SOURCES 24
+#define DSP_QUEUE_SIZE 8
+
+// the application and dsp share two copies of these structures, addresses
+// are in 16 bit dsp words and 32 bit values are stored high word first
+#define DSP_REGION0 0x50000
+#define DSP_REGION1 0x70000
+#define DSPREG(w) (((w) - 0x8000) * 2)
+
+#define DSPREG_FRAME_COUNTER DSPREG(0xbfff)
+#define DSPREG_FINAL_SAMPLES DSPREG(0x8540)
+#define DSPREG_SOURCE_STATUS DSPREG(0x8680)
+#define DSPREG_CONFIG DSPREG(0x9430)
+#define DSPREG_AUX_SAMPLES DSPREG(0x9492)
+#define DSPREG_SOURCE_CONFIG DSPREG(0x9e92)
+#define DSPREG_ADPCM_COEFS DSPREG(0xa792)
+
+enum {
+    DSPFMT_PCM8,
+    DSPFMT_PCM16,
+    DSPFMT_ADPCM,
+};
+
+enum {
+    DSPINTERP_POLYPHASE,
+    DSPINTERP_LINEAR,
+    DSPINTERP_NONE,
+};
+
+enum {
+    DSPOUT_MONO,
+    DSPOUT_STEREO,
+    DSPOUT_SURROUND,
+};
+
+// dirty bits of the source configuration
+enum {
+    DSPSRC_FORMAT = BIT(0),
+    DSPSRC_STEREO = BIT(1),
+    DSPSRC_ADPCM_COEFS = BIT(2),
+    DSPSRC_PARTIAL_RESET = BIT(4),
+    DSPSRC_ENABLE = BIT(16),
+    DSPSRC_INTERP = BIT(17),
+    DSPSRC_RATE = BIT(18),
+    DSPSRC_QUEUE = BIT(19),
+    DSPSRC_PLAY_POS = BIT(21),
+    DSPSRC_FILTERS_ENABLE = BIT(22),
+    DSPSRC_SIMPLE_FILTER = BIT(23),
+    DSPSRC_BIQUAD_FILTER = BIT(24),
+    DSPSRC_GAIN0 = BIT(25),
+    DSPSRC_SYNC = BIT(28),
+    DSPSRC_RESET = BIT(29),
+    DSPSRC_EMBEDDED = BIT(30),
+};
+
+// dirty bits of the dsp configuration
+enum {
+    DSPCFG_AUX0_ENABLE = BIT(8),
+    DSPCFG_AUX1_ENABLE = BIT(9),
+    DSPCFG_MASTER_VOLUME = BIT(16),
+    DSPCFG_AUX0_VOLUME = BIT(24),
+    DSPCFG_AUX1_VOLUME = BIT(25),
+    DSPCFG_OUTPUT_FORMAT = BIT(26),
+};
+
+typedef struct {
+    u32 addr;
+    u32 len;
+    u16 adpcm_ps;
+    s16 adpcm_yn[2];
+    u8 adpcm_dirty;
+    u8 loop;
+    u16 id;
+    u16 _pad;
+} DSPBufferConfig;
+
+typedef struct {
+    u32 dirty;
+    // how much of the left and right channel goes to each of the 4 channels
+    // of the 3 intermediate mixes
+    float gain[3][4];
+    float rate;
+    u8 interp;
+    u8 _pad1;
+    u16 filters;
+    s16 simple[2];
+    s16 biquad[5];
+    u16 buffers_dirty;
+    DSPBufferConfig buffers[4];
+    u32 loop_related;
+    u8 enable;
+    u8 _pad2;
+    u16 sync;
+    u32 play_pos;
+    u16 _pad3[2];
+
+    // the embedded buffer, which usually starts playback
+    u32 addr;
+    u32 len;
+    u16 flags1;
+    u16 adpcm_ps;
+    s16 adpcm_yn[2];
+    u16 flags2;
+    u16 id;
+} DSPSourceConfig;
+
+typedef struct {
+    u8 enabled;
+    u8 id_dirty;
+    u16 sync;
+    u32 pos;
+    u16 cur_id;
+    u16 last_id;
+} DSPSourceStatus;
+
+typedef struct {
+    u32 dirty;
+    float master_volume;
+    float aux_volume[2];
+    u16 output_buffers;
+    u16 _pad1[2];
+    u16 output_format;
+    u16 limiter;
+    u16 headphones;
+    u16 _pad2[6];
+    u16 aux_enable[2];
+} DSPConfig;
+
+typedef struct {
+    u32 addr;
+    u32 len;
+    u32 start;
+    u16 id;
+    u8 format;
+    u8 channels;
+    bool adpcm_dirty;
+    s16 adpcm_yn[2];
+    bool loop;
+    bool from_queue;
+} DSPBuffer;
+
+typedef struct {
+    bool enabled;
+    u16 sync;
+    float gain[3][4];
+    float rate;
+    u8 interp;
+    u8 format;
+    u8 channels;
+    u16 filters;
+    s16 simple[2];
+    s16 biquad[5];
+    s16 coefs[16];
+
+    DSPBuffer queue[DSP_QUEUE_SIZE];
+    u32 nqueued;
+
+    // the buffer being played and the next sample in it
+    bool playing;
+    bool played;
+    DSPBuffer cur;
+    u32 pos;
+    s16 adpcm_yn[2];
+
+    // the two most recent input samples and the position between them in
+    // 24 bit fixed point, plus how many samples to read before the next
+    // output
+    s16 prev[2];
+    s16 next[2];
+    u32 fpos;
+    u32 need;
+
+    s16 simple_y[2];
+    s16 biquad_x[2][2];
+    s16 biquad_y[2][2];
+
+    bool id_dirty;
+    u16 cur_id;
+    u16 last_id;
+} DSPSource;
+
+// everything the dsp thread works on, it is only touched by the emulator
+// thread between frames
+typedef struct {
+    DSPSource sources[DSP_SOURCES];
+
+    float volume[3];
+    bool aux_enable[2];
+    u16 output_format;
+
+    // the configuration of the frame being mixed
+    DSPSourceConfig srccfg[DSP_SOURCES];
+    s16 coefs[DSP_SOURCES][16];
+    DSPConfig cfg;
+    s32 aux_return[2][4][DSP_FRAME_SAMPLES];
+    bool mute;
+
+    // what the finished frame gives back to the application
+    bool ready;
+    DSPSourceStatus status[DSP_SOURCES];
+    s16 final[DSP_FRAME_SAMPLES][2];
+    s32 aux_send[2][4][DSP_FRAME_SAMPLES];
+} DSPAudio;
+
 typedef struct {
     // there are 3 interrupts and 4 channels to register
     // events for
     KEvent* events[3][4];
 
     KEvent semEvent;
+
+    bool running;
+    DSPAudio audio;
 } DSPData;
 
 DECL_PORT(dsp);
 
+void dsp_frame(E3DS* s, u32);
+
+void dsp_wait();
+void dsp_destroy();
+
 #endif
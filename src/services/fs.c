@@ -9,6 +9,10 @@
 #include "emulator.h"
 #include "kernel/loader.h"
 
+#include "fsindex.h"
+#include "fsio.h"
+#include "savefile.h"
+
 enum {
     SYSFILE_MIIDATA = 1,
     SYSFILE_BADWORDLIST = 2,
@@ -263,8 +267,21 @@ DECL_PORT(fs) {
             cmdbuf[3] = handle >> 32;
             break;
         }
+        case 0x080d: {
+            u64 archive = cmdbuf[1] | (u64) cmdbuf[2] << 32;
+            u32 action = cmdbuf[3];
+            linfo("ControlArchive %d", action);
+            // action 0 commits save data
+            if (action == 0)
+                savefile_commit_archive(&s->services.fs.savefiles, archive);
+            cmdbuf[0] = IPCHDR(1, 0);
+            cmdbuf[1] = 0;
+            break;
+        }
         case 0x080e: {
             linfo("CloseArchive");
+            savefile_commit_archive(&s->services.fs.savefiles,
+                                    cmdbuf[1] | (u64) cmdbuf[2] << 32);
             cmdbuf[0] = IPCHDR(1, 0);
             cmdbuf[1] = 0;
             break;
@@ -423,7 +440,7 @@ DECL_PORT(fs) {
 DECL_PORT_ARG(fs_selfncch, base) {
     u32* cmdbuf = PTR(cmd_addr);
 
-    if (!s->romimage.fp) {
+    if (!s->romimage.size) {
         lerror("there is no romfs");
         cmdbuf[0] = IPCHDR(1, 0);
         cmdbuf[1] = -1;
@@ -442,9 +459,9 @@ DECL_PORT_ARG(fs_selfncch, base) {
 
             cmdbuf[0] = IPCHDR(2, 0);
             cmdbuf[1] = 0;
-            fseek(s->romimage.fp, base + offset, SEEK_SET);
 
-            cmdbuf[2] = fread(data, 1, size, s->romimage.fp);
+            memory_snapshot_touch(s, data, size);
+            cmdbuf[2] = romimage_read(&s->romimage, data, base + offset, size);
             break;
         }
         case 0x0808: {
@@ -548,7 +565,8 @@ DECL_PORT_ARG(fs_sysfile, file) {
 DECL_PORT_ARG(fs_file, fd) {
     u32* cmdbuf = PTR(cmd_addr);
 
-    FILE* fp = s->services.fs.files[fd];
+    FILE* fp =
+        fd < s->services.fs.files.size ? s->services.fs.files.d[fd] : nullptr;
 
     if (!fp) {
         lerror("invalid fd");
@@ -557,8 +575,14 @@ DECL_PORT_ARG(fs_file, fd) {
         return;
     }
 
+    SaveFile* sf = savefile_get(&s->services.fs.savefiles, fd);
+    char* path = s->services.fs.filepaths.d[fd];
+
     linfo("fd is %d", fd);
 
+    // another thread may still have a transfer running on this file
+    fsio_wait(fp);
+
     switch (cmd.command) {
         case 0x0802: {
             u64 offset = cmdbuf[1];
@@ -570,6 +594,18 @@ DECL_PORT_ARG(fs_file, fd) {
 
             cmdbuf[0] = IPCHDR(2, 0);
             cmdbuf[1] = 0;
+            memory_snapshot_touch(s, data, size);
+            // save files are never read through the stream, whose buffer and
+            // position go stale when a commit swaps the file under it
+            if (sf && (sf->dirty || size < FSIO_MIN_SIZE)) {
+                cmdbuf[2] = savefile_read(sf, data, offset, size);
+                break;
+            }
+            if (size >= FSIO_MIN_SIZE) {
+                cmdbuf[2] =
+                    fsio_submit(s, fp, false, data, offset, size, nullptr);
+                break;
+            }
             fseek(fp, offset, SEEK_SET);
             cmdbuf[2] = fread(data, 1, size, fp);
             break;
@@ -584,14 +620,31 @@ DECL_PORT_ARG(fs_file, fd) {
 
             cmdbuf[0] = IPCHDR(2, 0);
             cmdbuf[1] = 0;
+            if (sf) {
+                cmdbuf[2] = savefile_write(sf, data, offset, size);
+                break;
+            }
+            // the size in the cached listing of the directory may change, which
+            // is only dropped once the write is done
+            if (size >= FSIO_MIN_SIZE) {
+                cmdbuf[2] =
+                    fsio_submit(s, fp, true, data, offset, size, path);
+                break;
+            }
             fseek(fp, offset, SEEK_SET);
             cmdbuf[2] = fwrite(data, 1, size, fp);
+            if (path) fsindex_invalidate(path);
             break;
         }
         case 0x0804: {
             linfo("GetSize");
-            fseek(fp, 0, SEEK_END);
-            long len = ftell(fp);
+            u64 len;
+            if (sf) {
+                len = sf->size;
+            } else {
+                fseek(fp, 0, SEEK_END);
+                len = ftell(fp);
+            }
             cmdbuf[0] = IPCHDR(3, 0);
             cmdbuf[1] = 0;
             cmdbuf[2] = len;
@@ -601,15 +654,23 @@ DECL_PORT_ARG(fs_file, fd) {
         case 0x0805: {
             linfo("SetSize");
             u64 size = cmdbuf[1] + ((u64) cmdbuf[2] << 32);
-            ftruncate(fileno(fp), size);
+            if (sf) {
+                savefile_set_size(sf, size);
+            } else {
+                ftruncate(fileno(fp), size);
+                if (path) fsindex_invalidate(path);
+            }
             cmdbuf[0] = IPCHDR(1, 0);
             cmdbuf[1] = 0;
             break;
         }
         case 0x0808: {
             linfo("closing file");
+            if (sf) savefile_close(sf);
             fclose(fp);
-            s->services.fs.files[fd] = nullptr;
+            s->services.fs.files.d[fd] = nullptr;
+            free(path);
+            s->services.fs.filepaths.d[fd] = nullptr;
             cmdbuf[0] = IPCHDR(1, 0);
             cmdbuf[1] = 0;
             break;
@@ -626,9 +687,10 @@ DECL_PORT_ARG(fs_file, fd) {
 DECL_PORT_ARG(fs_dir, fd) {
     u32* cmdbuf = PTR(cmd_addr);
 
-    DIR* dp = s->services.fs.dirs[fd];
+    FSDir* dir = fd < s->services.fs.dirs.size ? &s->services.fs.dirs.d[fd]
+                                               : nullptr;
 
-    if (!dp) {
+    if (!dir || !dir->path) {
         lerror("invalid fd");
         cmdbuf[0] = IPCHDR(1, 0);
         cmdbuf[1] = -1;
@@ -644,48 +706,41 @@ DECL_PORT_ARG(fs_dir, fd) {
 
             linfo("reading %d ents", count);
 
-            struct dirent* ent;
+            FSIndexDir* d = fsindex_dir(dir->path);
             int i = 0;
             for (; i < count; i++) {
-                while ((ent = readdir(dp)) &&
-                       (!strcmp(ent->d_name, ".") ||
-                        !strcmp(ent->d_name, "..") ||
-                        !strcmp(ent->d_name, ".formatinfo")));
-                if (!ent) {
+                if (!d || dir->pos >= d->ents.size) {
                     linfo("ran out of entries");
                     break;
                 }
+                FSIndexEntry* ent = &d->ents.d[dir->pos++];
 
                 memset(&ents[i], 0, sizeof ents[i]);
 
-                int namelen = strlen(ent->d_name);
+                int namelen = strlen(ent->name);
                 if (namelen > 0x105) namelen = 0x105;
                 int dotpos = -1;
                 for (int j = 0; j < namelen; j++) {
-                    ents[i].name[j] = ent->d_name[j];
+                    ents[i].name[j] = ent->name[j];
 
-                    if (ent->d_name[j] == '.') dotpos = j;
+                    if (ent->name[j] == '.') dotpos = j;
                     if (dotpos < 0 && j < 8) {
-                        ents[i].shortname[j] = ent->d_name[j];
+                        ents[i].shortname[j] = ent->name[j];
                     }
                     if (dotpos >= 0 && j > dotpos && j - (dotpos + 1) < 3) {
-                        ents[i].shortext[j - (dotpos + 1)] = ent->d_name[j];
+                        ents[i].shortext[j - (dotpos + 1)] = ent->name[j];
                     }
                 }
 
                 ents[i]._21a[0] = 1;
 
-                ents[i].isdir = ent->d_type == DT_DIR;
+                ents[i].isdir = ent->isdir;
                 ents[i].isarchive = 0;
-                ents[i].ishidden = ent->d_name[0] == '.';
-
-                struct stat st;
-                fstatat(dirfd(dp), ent->d_name, &st, 0);
-
-                ents[i].isreadonly = (st.st_mode & S_IWUSR) == 0;
-                ents[i].size = st.st_size;
+                ents[i].ishidden = ent->name[0] == '.';
+                ents[i].isreadonly = ent->isreadonly;
+                ents[i].size = ent->size;
 
-                linfo("entry %s (%s.%s)", ent->d_name, ents[i].shortname,
+                linfo("entry %s (%s.%s)", ent->name, ents[i].shortname,
                       ents[i].shortext);
             }
 
@@ -696,8 +751,8 @@ DECL_PORT_ARG(fs_dir, fd) {
         }
         case 0x0802: {
             linfo("closing dir");
-            closedir(dp);
-            s->services.fs.dirs[fd] = nullptr;
+            free(dir->path);
+            dir->path = nullptr;
             cmdbuf[0] = IPCHDR(1, 0);
             cmdbuf[1] = 0;
             break;
@@ -831,6 +886,23 @@ u64 fs_open_archive(u32 id, u32 pathtype, void* path) {
     }
 }
 
+// sessions are indexed by their fd, so freed slots are reused before the
+// tables grow
+static int new_file_fd(FSData* fs) {
+    for (int i = 0; i < fs->files.size; i++) {
+        if (!fs->files.d[i]) return i;
+    }
+    Vec_push(fs->filepaths, nullptr);
+    return Vec_push(fs->files, nullptr);
+}
+
+static int new_dir_fd(FSData* fs) {
+    for (int i = 0; i < fs->dirs.size; i++) {
+        if (!fs->dirs.d[i].path) return i;
+    }
+    return Vec_push(fs->dirs, (FSDir) {});
+}
+
 KSession* fs_open_file(E3DS* s, u64 archive, u32 pathtype, void* rawpath,
                        u32 pathsize, u32 flags) {
     switch (archive & MASKL(32)) {
@@ -845,9 +917,9 @@ KSession* fs_open_file(E3DS* s, u64 archive, u32 pathtype, void* rawpath,
                     }
                     case 2: {
                         char* filename = (char*) &path[1];
-                        ExeFSHeader hdr;
-                        fseek(s->romimage.fp, s->romimage.exefs_off, SEEK_SET);
-                        fread(&hdr, sizeof hdr, 1, s->romimage.fp);
+                        ExeFSHeader hdr = {};
+                        romimage_read(&s->romimage, &hdr,
+                                      s->romimage.exefs_off, sizeof hdr);
                         u32 offset = 0;
                         for (int i = 0; i < 10; i++) {
                             if (!strcmp(hdr.file[i].name, filename)) {
@@ -879,20 +951,16 @@ KSession* fs_open_file(E3DS* s, u64 archive, u32 pathtype, void* rawpath,
         case ARCHIVE_SYSTEMSAVEDATA:
         case ARCHIVE_SDMC: {
 
-            int fd = -1;
-            for (int i = 0; i < FS_FILE_MAX; i++) {
-                if (s->services.fs.files[i] == nullptr) {
-                    fd = i;
-                    break;
-                }
-            }
-            if (fd == -1) {
-                lerror("ran out of files");
-                return nullptr;
-            }
-
             char* filepath =
                 create_text_path(archive, pathtype, rawpath, pathsize);
+            if (!filepath) return nullptr;
+
+            // most missing files are found in the cached listing
+            if (!(flags & BIT(2)) && !fsindex_lookup(filepath)) {
+                lwarn("file %s not found", filepath);
+                free(filepath);
+                return nullptr;
+            }
 
             int mode = 0;
             switch (flags & 3) {
@@ -934,7 +1002,16 @@ KSession* fs_open_file(E3DS* s, u64 archive, u32 pathtype, void* rawpath,
                 free(filepath);
                 return nullptr;
             }
-            s->services.fs.files[fd] = fp;
+            if (flags & BIT(2)) fsindex_invalidate(filepath);
+
+            int fd = new_file_fd(&s->services.fs);
+            s->services.fs.files.d[fd] = fp;
+            s->services.fs.filepaths.d[fd] = strdup(filepath);
+
+            if ((flags & 0b10) && (archive & MASKL(32)) != ARCHIVE_SDMC) {
+                savefile_open(&s->services.fs.savefiles, fd, archive, filepath,
+                              fp);
+            }
 
             KSession* ses = session_create_arg(port_handle_fs_file, fd);
             linfo("opened file %s with fd %d", filepath, fd);
@@ -982,13 +1059,15 @@ bool fs_create_file(u64 archive, u32 pathtype, void* rawpath, u32 pathsize,
 
             int hostfd =
                 open(filepath, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-            free(filepath);
             if (hostfd < 0) {
                 linfo("cannot create file");
+                free(filepath);
                 return false;
             }
             ftruncate(hostfd, filesize);
             close(hostfd);
+            fsindex_invalidate(filepath);
+            free(filepath);
 
             return true;
         }
@@ -1011,6 +1090,7 @@ bool fs_delete_file(u64 archive, u32 pathtype, void* rawpath, u32 pathsize) {
             linfo("deleting file %s", filepath);
 
             remove(filepath);
+            fsindex_invalidate(filepath);
             free(filepath);
 
             return true;
@@ -1030,34 +1110,22 @@ KSession* fs_open_dir(E3DS* s, u64 archive, u32 pathtype, void* rawpath,
         case ARCHIVE_SYSTEMSAVEDATA:
         case ARCHIVE_SDMC: {
 
-            int fd = -1;
-            for (int i = 0; i < FS_FILE_MAX; i++) {
-                if (s->services.fs.dirs[i] == nullptr) {
-                    fd = i;
-                    break;
-                }
-            }
-            if (fd == -1) {
-                lerror("ran out of dirs");
-                return nullptr;
-            }
-
             char* filepath =
                 create_text_path(archive, pathtype, rawpath, pathsize);
+            if (!filepath) return nullptr;
 
-            DIR* dp = opendir(filepath);
-            if (!dp) {
+            if (!fsindex_dir(filepath)) {
                 linfo("failed to open directory %s", filepath);
                 free(filepath);
                 return nullptr;
             }
-            s->services.fs.dirs[fd] = dp;
+
+            int fd = new_dir_fd(&s->services.fs);
+            s->services.fs.dirs.d[fd] = (FSDir) {.path = filepath};
 
             KSession* ses = session_create_arg(port_handle_fs_dir, fd);
             linfo("opened directory %s with fd %d", filepath, fd);
 
-            free(filepath);
-
             return ses;
             break;
         }
@@ -1085,6 +1153,7 @@ bool fs_create_dir(u64 archive, u32 pathtype, void* rawpath, u32 pathsize) {
                 // stub until delete directory is implemented
                 return true;
             }
+            fsindex_invalidate(filepath);
             free(filepath);
             return true;
         }
@@ -1095,10 +1164,19 @@ bool fs_create_dir(u64 archive, u32 pathtype, void* rawpath, u32 pathsize) {
 }
 
 void fs_close_all_files(E3DS* s) {
-    for (int i = 0; i < FS_FILE_MAX; i++) {
-        if (s->services.fs.files[i]) fclose(s->services.fs.files[i]);
+    fsio_destroy();
+    savefile_close_all(&s->services.fs.savefiles);
+    Vec_foreach(fp, s->services.fs.files) {
+        if (*fp) fclose(*fp);
+    }
+    Vec_free(s->services.fs.files);
+    Vec_foreach(path, s->services.fs.filepaths) {
+        free(*path);
     }
-    for (int i = 0; i < FS_FILE_MAX; i++) {
-        if (s->services.fs.dirs[i]) closedir(s->services.fs.dirs[i]);
+    Vec_free(s->services.fs.filepaths);
+    Vec_foreach(dir, s->services.fs.dirs) {
+        free(dir->path);
     }
+    Vec_free(s->services.fs.dirs);
+    fsindex_destroy();
 }
\ No newline at end of file
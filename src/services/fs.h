@@ -1,13 +1,11 @@
 #ifndef FS_H
 #define FS_H
 
-#include <dirent.h>
 #include <stdio.h>
 
+#include "savefile.h"
 #include "srv.h"
 
-#define FS_FILE_MAX 32
-
 enum {
     ARCHIVE_SELFNCCH = 3,
     ARCHIVE_SAVEDATA = 4,
@@ -45,8 +43,20 @@ typedef struct {
 } FSDirent;
 
 typedef struct {
-    FILE* files[FS_FILE_MAX];
-    DIR* dirs[FS_FILE_MAX];
+    // host path of the directory, null if the slot is free
+    char* path;
+    u32 pos;
+} FSDir;
+
+typedef struct {
+    // indexed by the fd of the session, free slots are reused before the
+    // tables grow
+    Vector(FILE*) files;
+    // host path of each file, for dropping cached listings after writes
+    Vector(char*) filepaths;
+    Vector(FSDir) dirs;
+    // buffered writes of the files in save archives
+    SaveFileTable savefiles;
 
     u32 priority;
 } FSData;
@@ -54,6 +64,7 @@ typedef struct {
 DECL_PORT(fs);
 
 DECL_PORT_ARG(fs_selfncch, base);
+DECL_PORT_ARG(fs_sysfile, file);
 
 DECL_PORT_ARG(fs_file, fd);
 DECL_PORT_ARG(fs_dir, fd);
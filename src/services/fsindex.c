@@ -0,0 +1,174 @@
+#include "fsindex.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#define XXH_INLINE_ALL
+#include <xxh3.h>
+
+static struct {
+    LRUCache(FSIndexDir, FSINDEX_DIRS) cache;
+    bool init;
+
+    u64 hits;
+    u64 misses;
+} idx;
+
+// trailing slashes are not part of the key so both forms of a directory
+// share one listing
+static size_t path_len(char* path) {
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') len--;
+    return len;
+}
+
+static char* last_slash(char* path, size_t len) {
+    while (len--) {
+        if (path[len] == '/') return &path[len];
+    }
+    return nullptr;
+}
+
+static u64 path_key(char* path, size_t len) {
+    u64 key = XXH3_64bits(path, len);
+    return key ? key : 1;
+}
+
+static void free_ents(FSIndexDir* d) {
+    Vec_foreach(e, d->ents) {
+        free(e->name);
+    }
+    Vec_free(d->ents);
+}
+
+#ifdef __APPLE__
+// the default filesystem on macos is case insensitive
+#define name_cmp strcasecmp
+#else
+#define name_cmp strcmp
+#endif
+
+static int cmp_ents(const void* a, const void* b) {
+    return name_cmp(((FSIndexEntry*) a)->name, ((FSIndexEntry*) b)->name);
+}
+
+static bool scan_dir(FSIndexDir* d) {
+    DIR* dp = opendir(d->path);
+    if (!dp) return false;
+
+    free_ents(d);
+    struct dirent* ent;
+    while ((ent = readdir(dp))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..") ||
+            !strcmp(ent->d_name, ".formatinfo"))
+            continue;
+        struct stat st;
+        if (fstatat(dirfd(dp), ent->d_name, &st, 0) < 0) continue;
+        FSIndexEntry e = {
+            .name = strdup(ent->d_name),
+            .isdir = S_ISDIR(st.st_mode),
+            .isreadonly = !(st.st_mode & S_IWUSR),
+            .size = st.st_size,
+        };
+        Vec_push(d->ents, e);
+    }
+    closedir(dp);
+    if (d->ents.size) {
+        qsort(d->ents.d, d->ents.size, sizeof *d->ents.d, cmp_ents);
+    }
+    return true;
+}
+
+static struct timespec mtime_of(struct stat* st) {
+#ifdef __APPLE__
+    return st->st_mtimespec;
+#else
+    return st->st_mtim;
+#endif
+}
+
+static FSIndexDir* get_dir(char* path, size_t len) {
+    if (!idx.init) {
+        LRU_init(idx.cache);
+        idx.init = true;
+    }
+
+    u64 key = path_key(path, len);
+    FSIndexDir* d = LRU_load(idx.cache, key);
+    if (d->key != key) {
+        free_ents(d);
+        free(d->path);
+        d->key = key;
+        d->path = strndup(path, len);
+        d->valid = false;
+    }
+
+    u64 now = time_ns();
+    if (d->valid && now - d->checked < FSINDEX_RECHECK_NS) {
+        idx.hits++;
+        return d;
+    }
+
+    struct stat st;
+    if (stat(d->path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        d->valid = false;
+        return nullptr;
+    }
+    struct timespec mtime = mtime_of(&st);
+    d->checked = now;
+    if (d->valid && mtime.tv_sec == d->mtime.tv_sec &&
+        mtime.tv_nsec == d->mtime.tv_nsec) {
+        idx.hits++;
+        return d;
+    }
+
+    idx.misses++;
+    d->mtime = mtime;
+    d->valid = scan_dir(d);
+    return d->valid ? d : nullptr;
+}
+
+// returns null if the path is not a directory
+FSIndexDir* fsindex_dir(char* path) {
+    return get_dir(path, path_len(path));
+}
+
+// returns null if the path does not exist
+FSIndexEntry* fsindex_lookup(char* path) {
+    size_t len = path_len(path);
+    char* slash = last_slash(path, len);
+    if (!slash) return nullptr;
+    FSIndexDir* d = get_dir(path, slash - path);
+    if (!d) return nullptr;
+
+    char* name = strndup(slash + 1, len - (slash + 1 - path));
+    FSIndexEntry* e = bsearch(&(FSIndexEntry) {.name = name}, d->ents.d,
+                              d->ents.size, sizeof *d->ents.d, cmp_ents);
+    free(name);
+    return e;
+}
+
+static void invalidate_key(u64 key) {
+    for (int i = 0; i < FSINDEX_DIRS; i++) {
+        if (idx.cache.d[i].key == key) idx.cache.d[i].valid = false;
+    }
+}
+
+// drops the listing of the directory containing path and of path itself
+void fsindex_invalidate(char* path) {
+    size_t len = path_len(path);
+    invalidate_key(path_key(path, len));
+    char* slash = last_slash(path, len);
+    if (slash) invalidate_key(path_key(path, slash - path));
+}
+
+void fsindex_destroy() {
+    linfo("fs index: %lu hits, %lu misses", idx.hits, idx.misses);
+    for (int i = 0; i < FSINDEX_DIRS; i++) {
+        free_ents(&idx.cache.d[i]);
+        free(idx.cache.d[i].path);
+    }
+    memset(&idx, 0, sizeof idx);
+}
@@ -0,0 +1,41 @@
+#ifndef FSINDEX_H
+#define FSINDEX_H
+
+#include <time.h>
+
+#include "common.h"
+
+// listings of host directories are cached so opening and reading
+// directories and checking if files exist do not go to the host filesystem
+// each time, changes made through fs drop the affected listings and others
+// are noticed by the directory mtime
+#define FSINDEX_DIRS 64
+// a listing checked this recently is trusted without checking the mtime
+#define FSINDEX_RECHECK_NS (100 * 1'000'000)
+
+typedef struct {
+    char* name;
+    bool isdir;
+    bool isreadonly;
+    u64 size;
+} FSIndexEntry;
+
+typedef struct _FSIndexDir {
+    u64 key;
+    char* path;
+    bool valid;
+    struct timespec mtime;
+    u64 checked;
+    // sorted by name
+    Vector(FSIndexEntry) ents;
+
+    struct _FSIndexDir *next, *prev;
+} FSIndexDir;
+
+FSIndexDir* fsindex_dir(char* path);
+FSIndexEntry* fsindex_lookup(char* path);
+
+void fsindex_invalidate(char* path);
+void fsindex_destroy();
+
+#endif
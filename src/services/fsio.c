@@ -0,0 +1,172 @@
+#include "fsio.h"
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "3ds.h"
+#include "fsindex.h"
+
+typedef struct {
+    int fd;
+    bool write;
+    void* buf;
+    u64 offset;
+    u32 size;
+    // set from submission until a worker has finished the transfer
+    bool busy;
+    // the file written, whose cached listing is dropped once it is done
+    char* path;
+} FSIOJob;
+
+// a sleeping thread can only have one request, so jobs are indexed by the
+// id of the thread which made them
+static struct {
+    pthread_t thd[FSIO_THREADS];
+    bool started;
+    bool die;
+
+    pthread_mutex_t mtx;
+    pthread_cond_t queuecv;
+    pthread_cond_t donecv;
+
+    FSIOJob jobs[THREAD_MAX];
+    FIFO(u32, 5) queue;
+} io = {
+    .mtx = PTHREAD_MUTEX_INITIALIZER,
+    .queuecv = PTHREAD_COND_INITIALIZER,
+    .donecv = PTHREAD_COND_INITIALIZER,
+};
+
+static void transfer(FSIOJob* j) {
+    u32 done = 0;
+    while (done < j->size) {
+        ssize_t n =
+            j->write
+                ? pwrite(j->fd, j->buf + done, j->size - done, j->offset + done)
+                : pread(j->fd, j->buf + done, j->size - done, j->offset + done);
+        if (n <= 0) {
+            lerror("%s failed at offset 0x%lx",
+                   j->write ? "write" : "read", j->offset + done);
+            break;
+        }
+        done += n;
+    }
+}
+
+static void* fsio_thread(void*) {
+    pthread_mutex_lock(&io.mtx);
+    while (true) {
+        while (!io.queue.size && !io.die) {
+            pthread_cond_wait(&io.queuecv, &io.mtx);
+        }
+        if (io.die) break;
+        u32 tid;
+        FIFO_pop(io.queue, tid);
+        FSIOJob* j = &io.jobs[tid];
+        pthread_mutex_unlock(&io.mtx);
+
+        transfer(j);
+
+        pthread_mutex_lock(&io.mtx);
+        j->busy = false;
+        pthread_cond_broadcast(&io.donecv);
+    }
+    pthread_mutex_unlock(&io.mtx);
+    return nullptr;
+}
+
+// returns the number of bytes which will be transferred, which the guest is
+// told right away since it only sees the result after waking up
+u32 fsio_submit(E3DS* s, FILE* fp, bool write, void* buf, u64 offset,
+                u32 size, char* path) {
+    KThread* t = CUR_THREAD;
+
+    // anything written through the stdio buffer must reach the file first
+    fflush(fp);
+    int fd = fileno(fp);
+    if (!write) {
+        struct stat st;
+        fstat(fd, &st);
+        if (offset >= st.st_size) size = 0;
+        else if (size > st.st_size - offset) size = st.st_size - offset;
+    }
+
+    pthread_mutex_lock(&io.mtx);
+    if (!io.started) {
+        io.started = true;
+        io.die = false;
+        for (int i = 0; i < FSIO_THREADS; i++) {
+            pthread_create(&io.thd[i], nullptr, fsio_thread, nullptr);
+        }
+    }
+    // a job whose completion was dropped by loading a state still has its path
+    free(io.jobs[t->id].path);
+    io.jobs[t->id] = (FSIOJob) {fd, write, buf, offset, size, true};
+    if (write && path) io.jobs[t->id].path = strdup(path);
+    FIFO_push(io.queue, t->id);
+    pthread_cond_signal(&io.queuecv);
+    pthread_mutex_unlock(&io.mtx);
+
+    s64 cycles = (s64) FSIO_LATENCY_US * CPU_CLK / 1'000'000 +
+                 (s64) size * CPU_CLK / FSIO_BANDWIDTH;
+    add_event(&s->sched, fsio_complete, t->id, cycles);
+    thread_sleep(s, t, -1);
+    return size;
+}
+
+// the emulator only blocks here if the host is slower than the simulated
+// transfer
+void fsio_complete(E3DS* s, u32 tid) {
+    pthread_mutex_lock(&io.mtx);
+    while (io.jobs[tid].busy) {
+        pthread_cond_wait(&io.donecv, &io.mtx);
+    }
+    pthread_mutex_unlock(&io.mtx);
+
+    FSIOJob* j = &io.jobs[tid];
+    if (j->path) {
+        fsindex_invalidate(j->path);
+        free(j->path);
+        j->path = nullptr;
+    }
+
+    KThread* t = s->process.threads[tid];
+    if (!t || t->state != THRD_SLEEP) return;
+    linfo("file transfer for thread %d done", tid);
+    thread_set_state(s, t, THRD_READY);
+    thread_reschedule(s);
+}
+
+// waits for the transfers on a file, or all of them if it is null, so it can
+// be used or the guest memory they touch can be saved
+void fsio_wait(FILE* fp) {
+    int fd = fp ? fileno(fp) : -1;
+    pthread_mutex_lock(&io.mtx);
+    for (int i = 0; i < THREAD_MAX; i++) {
+        while (io.jobs[i].busy && (fd < 0 || io.jobs[i].fd == fd)) {
+            pthread_cond_wait(&io.donecv, &io.mtx);
+        }
+    }
+    pthread_mutex_unlock(&io.mtx);
+}
+
+void fsio_destroy() {
+    fsio_wait(nullptr);
+    pthread_mutex_lock(&io.mtx);
+    if (!io.started) {
+        pthread_mutex_unlock(&io.mtx);
+        return;
+    }
+    io.die = true;
+    io.started = false;
+    pthread_cond_broadcast(&io.queuecv);
+    pthread_mutex_unlock(&io.mtx);
+    for (int i = 0; i < FSIO_THREADS; i++) {
+        pthread_join(io.thd[i], nullptr);
+    }
+    for (int i = 0; i < THREAD_MAX; i++) {
+        free(io.jobs[i].path);
+        io.jobs[i].path = nullptr;
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef FSIO_H
+#define FSIO_H
+
+#include <stdio.h>
+
+#include "common.h"
+
+typedef struct _3DS E3DS;
+
+// large file transfers are done by worker threads, the requesting guest
+// thread sleeps until the time the transfer would take on the sd card while
+// the others keep running
+#define FSIO_MIN_SIZE BIT(16)
+#define FSIO_THREADS 2
+#define FSIO_LATENCY_US 100
+#define FSIO_BANDWIDTH (32 * BIT(20))
+
+u32 fsio_submit(E3DS* s, FILE* fp, bool write, void* buf, u64 offset,
+                u32 size, char* path);
+void fsio_complete(E3DS* s, u32 tid);
+
+void fsio_wait(FILE* fp);
+void fsio_destroy();
+
+#endif
@@ -129,11 +129,6 @@ void gsp_handle_event(E3DS* s, u32 arg) {
 
         gsp_handle_event(s, GSPEVENT_VBLANK1);
 
-        // dsp stub for now
-        // int=2,ch=2 is for when audio is finished being processed
-        if (s->services.dsp.events[2][2])
-            event_signal(s, s->services.dsp.events[2][2]);
-
         linfo("vblank");
 
         update_fbinfos(s);
@@ -170,7 +165,15 @@ void gsp_handle_command(E3DS* s) {
             u32 size = cmds->d[cmds->cur].args[2];
             linfo("dma request from %08x to %08x of size 0x%x", src, dest,
                   size);
+            if (s->gpu.capture) {
+                gpucapture_mem(&s->gpu, vaddr_to_paddr(src), size);
+            }
             memcpy(PTR(dest), PTR(src), size);
+            if (s->gpu.capture) {
+                gpucapture_cmd(&s->gpu, 0x00,
+                               (u32[7]) {vaddr_to_paddr(src),
+                                         vaddr_to_paddr(dest), size});
+            }
             gsp_handle_event(s, GSPEVENT_DMA);
             break;
         }
@@ -179,8 +182,11 @@ void gsp_handle_command(E3DS* s) {
             u32 bufsize = cmds->d[cmds->cur].args[1];
             linfo("sending command list at %08x with size 0x%x", bufaddr,
                   bufsize);
-            gpu_run_command_list(&s->gpu, vaddr_to_paddr(bufaddr & ~7),
-                                 bufsize);
+            u32 bufpaddr = vaddr_to_paddr(bufaddr & ~7);
+            gpu_run_command_list(&s->gpu, bufpaddr, bufsize);
+            if (s->gpu.capture) {
+                gpucapture_cmd(&s->gpu, 0x01, (u32[7]) {bufpaddr, bufsize});
+            }
             gsp_handle_event(s, GSPEVENT_P3D);
             break;
         }
@@ -198,8 +204,17 @@ void gsp_handle_command(E3DS* s) {
                 if (cmd->buf[i].st) {
                     linfo("memory fill at fb %08x-%08x with %x", cmd->buf[i].st,
                           cmd->buf[i].end, cmd->buf[i].val);
-                    gpu_clear_fb(&s->gpu, vaddr_to_paddr(cmd->buf[i].st),
-                                 cmd->buf[i].val);
+                    // bits 8-9 of the control select the fill value width
+                    static const int fillBpp[4] = {2, 3, 4, 4};
+                    u32 st = vaddr_to_paddr(cmd->buf[i].st);
+                    u32 end = vaddr_to_paddr(cmd->buf[i].end);
+                    int Bpp = fillBpp[cmd->ctl[i] >> 8 & 3];
+                    gpu_clear_fb(&s->gpu, st, end, cmd->buf[i].val, Bpp);
+                    if (s->gpu.capture) {
+                        gpucapture_cmd(&s->gpu, 0x02,
+                                       (u32[7]) {st, end, cmd->buf[i].val,
+                                                 Bpp});
+                    }
                     gsp_handle_event(s, GSPEVENT_PSC0 + i);
                 }
             }
@@ -236,6 +251,12 @@ void gsp_handle_command(E3DS* s) {
                     if (abs(yoff) < hout / 2) {
                         gpu_display_transfer(&s->gpu, vaddr_to_paddr(addrin),
                                              yoff, scalex, scaley, screen);
+                        if (s->gpu.capture) {
+                            gpucapture_cmd(&s->gpu, 0x03,
+                                           (u32[7]) {vaddr_to_paddr(addrin),
+                                                     yoff, scalex, scaley,
+                                                     screen});
+                        }
                         break;
                     }
                 }
@@ -264,15 +285,27 @@ void gsp_handle_command(E3DS* s) {
                   addrin, pitchin, gapin, addrout, pitchout, gapout, copysize,
                   flags);
 
+            if (s->gpu.capture) {
+                gpucapture_mem(&s->gpu, vaddr_to_paddr(addrin),
+                               copysize / (pitchin ? pitchin : 1) *
+                                   (pitchin + gapin));
+            }
             gpu_texture_copy(&s->gpu, vaddr_to_paddr(addrin),
                              vaddr_to_paddr(addrout), copysize, pitchin, gapin,
                              pitchout, gapout);
+            if (s->gpu.capture) {
+                gpucapture_cmd(&s->gpu, 0x04,
+                               (u32[7]) {vaddr_to_paddr(addrin),
+                                         vaddr_to_paddr(addrout), copysize,
+                                         pitchin, gapin, pitchout, gapout});
+            }
 
             gsp_handle_event(s, GSPEVENT_PPF);
             break;
         }
         case 0x05:
             linfo("flush cache regions");
+            if (s->gpu.capture) gpucapture_cmd(&s->gpu, 0x05, (u32[7]) {});
             break;
         default:
             lwarn("unknown gsp queue command 0x%02x", cmds->d[cmds->cur].id);
@@ -1,10 +1,46 @@
 #include "ldr.h"
 
+#define XXH_INLINE_ALL
+#include <xxh3.h>
+
 #include "3ds.h"
 #include "arm/jit/jit.h"
 #include "kernel/memory.h"
 #include "kernel/svc_types.h"
 
+// named exports of each loaded module by the hash of their name
+typedef struct {
+    u64 hash;
+    u32 name_addr;
+    SegmentTag loc;
+} CROSymbol;
+
+typedef struct {
+    u32 vaddr;
+    // the export table it was built from, to notice if another module was
+    // loaded at the same address
+    u32 exports_addr;
+    u32 nexports;
+    u32 mask;
+    CROSymbol* table;
+} CROSymIndex;
+
+// modules relocated to their load address but not yet linked, keyed by the
+// hash of the image and where it and its data and bss are
+typedef struct _CROCacheEntry {
+    u64 key;
+    u32 size;
+    u8* image;
+
+    struct _CROCacheEntry *next, *prev;
+} CROCacheEntry;
+
+static struct {
+    Vector(CROSymIndex) syms;
+    LRUCache(CROCacheEntry, CRO_CACHE_SIZE) cache;
+    bool init;
+} ldr;
+
 DECL_PORT(ldr_ro) {
     u32* cmdbuf = PTR(cmd_addr);
     switch (cmd.command) {
@@ -50,7 +86,7 @@ DECL_PORT(ldr_ro) {
 
             memory_virtmirror(s, srcaddr, dstaddr, size, PERM_RX);
 
-            ldr_load_cro(s, dstaddr, dataaddr, bssaddr, autolink);
+            ldr_load_cro(s, dstaddr, size, dataaddr, bssaddr, autolink);
 
             jit_invalidate_range(&s->cpu, dstaddr, size);
 
@@ -182,14 +218,62 @@ void import_symbols(E3DS* s, u32 srcaddr, u32 dstaddr,
     }
 }
 
-SegmentTag search_named_symbol(E3DS* s, u32 croaddr, char* name) {
+static u64 name_hash(char* name) {
+    return XXH3_64bits(name, strlen(name));
+}
+
+static void build_symindex(E3DS* s, CROSymIndex* idx, u32 croaddr) {
     CROHeader* hdr = PTR(croaddr);
 
-    CRONamedExport* syms = PTR(hdr->exports.named_symbols.addr);
-    for (int i = 0; i < hdr->exports.named_symbols.size; i++) {
-        if (!strcmp(PTR(syms[i].name_addr), name)) {
-            return syms[i].loc;
-        }
+    free(idx->table);
+    idx->vaddr = croaddr;
+    idx->exports_addr = hdr->exports.named_symbols.addr;
+    idx->nexports = hdr->exports.named_symbols.size;
+
+    u32 cap = 8;
+    while (cap < 2 * idx->nexports) cap *= 2;
+    idx->mask = cap - 1;
+    idx->table = calloc(cap, sizeof(CROSymbol));
+
+    CRONamedExport* syms = PTR(idx->exports_addr);
+    for (int i = 0; i < idx->nexports; i++) {
+        u64 hash = name_hash(PTR(syms[i].name_addr));
+        u32 j = hash & idx->mask;
+        while (idx->table[j].name_addr) j = (j + 1) & idx->mask;
+        idx->table[j] = (CROSymbol) {hash, syms[i].name_addr, syms[i].loc};
+    }
+}
+
+static CROSymIndex* get_symindex(E3DS* s, u32 croaddr) {
+    CROHeader* hdr = PTR(croaddr);
+    Vec_foreach(idx, ldr.syms) {
+        if (idx->vaddr != croaddr) continue;
+        if (idx->exports_addr != hdr->exports.named_symbols.addr ||
+            idx->nexports != hdr->exports.named_symbols.size)
+            build_symindex(s, idx, croaddr);
+        return idx;
+    }
+    Vec_push(ldr.syms, (CROSymIndex) {});
+    build_symindex(s, &ldr.syms.d[ldr.syms.size - 1], croaddr);
+    return &ldr.syms.d[ldr.syms.size - 1];
+}
+
+static void drop_symindex(u32 croaddr) {
+    for (int i = 0; i < ldr.syms.size; i++) {
+        if (ldr.syms.d[i].vaddr != croaddr) continue;
+        free(ldr.syms.d[i].table);
+        Vec_remove(ldr.syms, i);
+        return;
+    }
+}
+
+SegmentTag search_named_symbol(E3DS* s, u32 croaddr, char* name, u64 hash) {
+    CROSymIndex* idx = get_symindex(s, croaddr);
+    for (u32 j = hash & idx->mask; idx->table[j].name_addr;
+         j = (j + 1) & idx->mask) {
+        if (idx->table[j].hash == hash &&
+            !strcmp(PTR(idx->table[j].name_addr), name))
+            return idx->table[j].loc;
     }
     return (SegmentTag) {.raw = -1};
 }
@@ -207,12 +291,9 @@ void import_named_symbols(E3DS* s, u32 srcaddr, u32 dstaddr) {
     CRONamedImport* named = PTR(dst->imports.named_symbols.addr);
     for (int i = 0; i < dst->imports.named_symbols.size; i++) {
         char* name = PTR(named[i].name_addr);
-        SegmentTag loc;
-        if (strcmp(name, "__aeabi_atexit")) {
-            loc = search_named_symbol(s, srcaddr, name);
-        } else {
-            loc = search_named_symbol(s, srcaddr, "nnroAeabiAtexit_");
-        }
+        if (!strcmp(name, "__aeabi_atexit")) name = "nnroAeabiAtexit_";
+        SegmentTag loc =
+            search_named_symbol(s, srcaddr, name, name_hash(name));
         if (loc.raw == -1) continue;
 
         linfo("symbol %s", name);
@@ -221,16 +302,15 @@ void import_named_symbols(E3DS* s, u32 srcaddr, u32 dstaddr) {
     }
 }
 
-void ldr_load_cro(E3DS* s, u32 vaddr, u32 data, u32 bss, bool autolink) {
-    CROHeader* crs = PTR(s->services.ldr.crs_addr);
-
+// rebases the module and applies its internal relocations, which only
+// depend on where it is loaded, returns whether everything it wrote is inside
+// the image
+static bool cro_relocate_internal(E3DS* s, u32 vaddr, u32 size, u32 data,
+                                  u32 bss) {
     CROHeader* hdr = PTR(vaddr);
 
     cro_relocate(s, vaddr);
 
-    char* name = PTR(hdr->name_addr);
-    linfo("loading cro %s", name);
-
     CROSegment* segs = PTR(hdr->segmenttable.addr);
     // when patching symbols in data it needs to be done in
     // the cro itself not in the external data buffer
@@ -257,12 +337,60 @@ void ldr_load_cro(E3DS* s, u32 vaddr, u32 data, u32 bss, bool autolink) {
 
     // relocations
     linfo("applying internal relocations");
+    bool inside = true;
     CROInternalPatch* rels = PTR(hdr->internal_patches.addr);
     for (int i = 0; i < hdr->internal_patches.size; i++) {
         u32 base = segs[rels[i].segid].addr;
         PATCH(rels[i], base, patchsegs);
+        if (SEGTAGADDR(patchsegs, rels[i].loc) - vaddr > size - 4)
+            inside = false;
+    }
+    return inside;
+}
+
+void ldr_load_cro(E3DS* s, u32 vaddr, u32 size, u32 data, u32 bss,
+                  bool autolink) {
+    CROHeader* crs = PTR(s->services.ldr.crs_addr);
+
+    CROHeader* hdr = PTR(vaddr);
+
+    u64 start = time_ns();
+
+    if (!ldr.init) {
+        LRU_init(ldr.cache);
+        ldr.init = true;
     }
 
+    // a module reloaded at the same place is copied from the cache instead
+    // of being relocated again
+    CROCacheEntry* ent = nullptr;
+    bool hit = false;
+    if (memory_host_contiguous(s, vaddr, size)) {
+        u64 key = XXH3_64bits_withSeed(
+            PTR(vaddr), size, vaddr ^ (u64) data << 32 ^ (u64) bss * 31);
+        ent = LRU_load(ldr.cache, key);
+        if (ent->key == key && ent->size == size) {
+            memcpy(PTR(vaddr), ent->image, size);
+            hit = true;
+        } else {
+            ent->key = key;
+            ent->size = 0;
+        }
+    }
+    if (!hit) {
+        bool inside = cro_relocate_internal(s, vaddr, size, data, bss);
+        if (ent && inside) {
+            ent->image = realloc(ent->image, size);
+            memcpy(ent->image, PTR(vaddr), size);
+            ent->size = size;
+        }
+    }
+
+    u64 reloctime = time_ns() - start;
+
+    char* name = PTR(hdr->name_addr);
+    linfo("loading cro %s", name);
+
     // exports
     u32 cur = s->services.ldr.crs_addr;
     while (cur) {
@@ -304,7 +432,8 @@ void ldr_load_cro(E3DS* s, u32 vaddr, u32 data, u32 bss, bool autolink) {
         import_symbols(s, cur, vaddr, &modtab[i]);
     }
 
-    // named symbols (this is going to be really inefficient)
+    // named symbols both ways with every loaded module, looked up in the
+    // export index of each
     cur = s->services.ldr.crs_addr;
     while (cur) {
         CROHeader* curhdr = PTR(cur);
@@ -332,6 +461,12 @@ void ldr_load_cro(E3DS* s, u32 vaddr, u32 data, u32 bss, bool autolink) {
         *llhd = vaddr;
         hdr->prev = vaddr;
     }
+
+    u64 total = time_ns() - start;
+    linfo("loaded cro %s in %.3lf ms (relocation %.3lf ms%s, linking %.3lf "
+          "ms)",
+          name, total / 1e6, reloctime / 1e6, hit ? " cached" : "",
+          (total - reloctime) / 1e6);
 }
 
 void ldr_unload_cro(E3DS* s, u32 vaddr) {
@@ -341,6 +476,8 @@ void ldr_unload_cro(E3DS* s, u32 vaddr) {
 
     linfo("unloading cro %s", PTR(hdr->name_addr));
 
+    drop_symindex(vaddr);
+
     // remove from link list
     // see the diagram in the cro doc (this is so dumb)
     if (hdr->next) {
@@ -442,4 +579,21 @@ void ldr_unload_cro(E3DS* s, u32 vaddr) {
     REL(internal_patches);
     REL(static_anon_patches);
 #undef REL
-}
\ No newline at end of file
+}
+
+// the index is rebuilt on demand, so it is dropped whenever guest memory may
+// have changed under it
+void ldr_clear_symbols() {
+    Vec_foreach(idx, ldr.syms) {
+        free(idx->table);
+    }
+    Vec_free(ldr.syms);
+}
+
+void ldr_destroy() {
+    ldr_clear_symbols();
+    for (int i = 0; i < CRO_CACHE_SIZE; i++) {
+        free(ldr.cache.d[i].image);
+    }
+    memset(&ldr, 0, sizeof ldr);
+}
@@ -3,6 +3,8 @@
 
 #include "srv.h"
 
+#define CRO_CACHE_SIZE 8
+
 typedef struct {
     u32 crs_addr;
 } LDRData;
@@ -120,7 +122,11 @@ typedef struct {
 DECL_PORT(ldr_ro);
 
 void cro_relocate(E3DS* s, u32 vaddr);
-void ldr_load_cro(E3DS* s, u32 vaddr, u32 data, u32 bss, bool autolink);
+void ldr_load_cro(E3DS* s, u32 vaddr, u32 size, u32 data, u32 bss,
+                  bool autolink);
 void ldr_unload_cro(E3DS* s, u32 vaddr);
 
+void ldr_clear_symbols();
+void ldr_destroy();
+
 #endif
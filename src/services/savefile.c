@@ -0,0 +1,254 @@
+#include "savefile.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fsindex.h"
+
+static void clear_ranges(SaveFile* sf) {
+    for (int i = 0; i < sf->ranges.size; i++) {
+        free(sf->ranges.d[i].data);
+    }
+    Vec_free(sf->ranges);
+    sf->buffered = 0;
+}
+
+SaveFile* savefile_open(SaveFileTable* t, int fd, u64 archive, char* path,
+                        FILE* fp) {
+    // another handle to the same file would not see the buffered writes
+    Vec_foreach(f, *t) {
+        if (*f && (*f)->used && !strcmp((*f)->path, path))
+            savefile_commit(*f);
+    }
+
+    while (t->size <= fd) Vec_push(*t, nullptr);
+    if (!t->d[fd]) t->d[fd] = malloc(sizeof(SaveFile));
+    SaveFile* sf = t->d[fd];
+    *sf = (SaveFile) {};
+    sf->used = true;
+    sf->archive = archive;
+    sf->path = strdup(path);
+    sf->fp = fp;
+    struct stat st;
+    fstat(fileno(fp), &st);
+    sf->size = sf->keep = st.st_size;
+    return sf;
+}
+
+SaveFile* savefile_get(SaveFileTable* t, int fd) {
+    if (fd >= t->size || !t->d[fd] || !t->d[fd]->used) return nullptr;
+    return t->d[fd];
+}
+
+void savefile_close(SaveFile* sf) {
+    savefile_commit(sf);
+    clear_ranges(sf);
+    free(sf->path);
+    *sf = (SaveFile) {};
+}
+
+u32 savefile_read(SaveFile* sf, void* dst, u64 offset, u32 size) {
+    if (offset >= sf->size) return 0;
+    if (size > sf->size - offset) size = sf->size - offset;
+
+    u32 ondisk = 0;
+    if (offset < sf->keep) {
+        ondisk = sf->keep - offset < size ? sf->keep - offset : size;
+        ssize_t n = pread(fileno(sf->fp), dst, ondisk, offset);
+        if (n < 0) n = 0;
+        ondisk = n;
+    }
+    memset(dst + ondisk, 0, size - ondisk);
+
+    for (int i = 0; i < sf->ranges.size; i++) {
+        SaveRange* r = &sf->ranges.d[i];
+        if (r->offset >= offset + size) break;
+        if (r->offset + r->size <= offset) continue;
+        u64 start = r->offset > offset ? r->offset : offset;
+        u64 end = r->offset + r->size < offset + size ? r->offset + r->size
+                                                      : offset + size;
+        memcpy(dst + (start - offset), r->data + (start - r->offset),
+               end - start);
+    }
+    return size;
+}
+
+// the write is merged with every range it overlaps or touches, so many small
+// sequential writes become one range
+u32 savefile_write(SaveFile* sf, void* src, u64 offset, u32 size) {
+    if (!size) return 0;
+
+    u64 start = offset;
+    u64 end = offset + size;
+    size_t i = 0;
+    while (i < sf->ranges.size &&
+           sf->ranges.d[i].offset + sf->ranges.d[i].size < start)
+        i++;
+    size_t j = i;
+    while (j < sf->ranges.size && sf->ranges.d[j].offset <= end) j++;
+    if (i < j) {
+        if (sf->ranges.d[i].offset < start) start = sf->ranges.d[i].offset;
+        SaveRange* last = &sf->ranges.d[j - 1];
+        if (last->offset + last->size > end) end = last->offset + last->size;
+    }
+
+    SaveRange r = {.offset = start, .size = end - start};
+    if (j - i == 1 && sf->ranges.d[i].offset == start) {
+        // extending a range in place is the common case for sequential writes
+        r.data = realloc(sf->ranges.d[i].data, r.size);
+        sf->buffered -= sf->ranges.d[i].size;
+    } else {
+        r.data = malloc(r.size);
+        for (size_t k = i; k < j; k++) {
+            SaveRange* old = &sf->ranges.d[k];
+            memcpy(r.data + (old->offset - start), old->data, old->size);
+            free(old->data);
+            sf->buffered -= old->size;
+        }
+    }
+    memcpy(r.data + (offset - start), src, size);
+    Vec_splice(sf->ranges, i, j - i, &r, 1);
+    sf->buffered += r.size;
+    sf->dirty = true;
+
+    if (end > sf->size) sf->size = end;
+    if (sf->buffered > SAVEFILE_MAX_BUFFER) savefile_commit(sf);
+    return size;
+}
+
+// replaces the buffered writes with ones from a save state, taking over the
+// vector of ranges
+void savefile_restore(SaveFile* sf, u64 size, u64 keep, bool dirty,
+                      SaveRangeList* ranges) {
+    clear_ranges(sf);
+    sf->ranges = *ranges;
+    Vec_init(*ranges);
+    Vec_foreach(r, sf->ranges) {
+        sf->buffered += r->size;
+    }
+    sf->size = size;
+    // the file on disk may have been committed since the state was taken
+    struct stat st;
+    fstat(fileno(sf->fp), &st);
+    sf->keep = keep < st.st_size ? keep : st.st_size;
+    sf->dirty = dirty || sf->keep != keep;
+}
+
+void savefile_set_size(SaveFile* sf, u64 size) {
+    sf->size = size;
+    if (sf->keep > size) sf->keep = size;
+    while (sf->ranges.size) {
+        SaveRange* r = &sf->ranges.d[sf->ranges.size - 1];
+        if (r->offset + r->size <= size) break;
+        if (r->offset < size) {
+            sf->buffered -= r->offset + r->size - size;
+            r->size = size - r->offset;
+            break;
+        }
+        sf->buffered -= r->size;
+        free(r->data);
+        sf->ranges.size--;
+    }
+    sf->dirty = true;
+}
+
+static bool write_full(int fd, void* src, u64 size, u64 offset) {
+    while (size) {
+        ssize_t n = pwrite(fd, src, size, offset);
+        if (n <= 0) return false;
+        src += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool copy_file(int dst, int src, u64 size) {
+    u8 buf[BIT(16)];
+    u64 done = 0;
+    while (done < size) {
+        u64 len = size - done < sizeof buf ? size - done : sizeof buf;
+        ssize_t n = pread(src, buf, len, done);
+        if (n <= 0 || !write_full(dst, buf, n, done)) return false;
+        done += n;
+    }
+    return true;
+}
+
+static void sync_dir(char* path) {
+    char* dir = strdup(path);
+    char* slash = strrchr(dir, '/');
+    if (slash) {
+        *slash = '\0';
+        int fd = open(dir, O_RDONLY);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+    free(dir);
+}
+
+bool savefile_commit(SaveFile* sf) {
+    if (!sf->dirty) return true;
+
+    u64 start = time_ns();
+
+    char* tmppath;
+    asprintf(&tmppath, "%s.tmp", sf->path);
+    int out = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (out < 0) {
+        lerror("could not create %s", tmppath);
+        free(tmppath);
+        return false;
+    }
+
+    bool ok = copy_file(out, fileno(sf->fp), sf->keep);
+    for (int i = 0; ok && i < sf->ranges.size; i++) {
+        SaveRange* r = &sf->ranges.d[i];
+        ok = write_full(out, r->data, r->size, r->offset);
+    }
+    ok = ok && !ftruncate(out, sf->size) && !fsync(out);
+    ok = !close(out) && ok;
+    if (!ok || rename(tmppath, sf->path)) {
+        lerror("could not write %s", sf->path);
+        remove(tmppath);
+        free(tmppath);
+        return false;
+    }
+    free(tmppath);
+    sync_dir(sf->path);
+    fsindex_invalidate(sf->path);
+
+    // the stream still refers to the replaced file
+    int fd = open(sf->path, O_RDWR);
+    if (fd >= 0) {
+        dup2(fd, fileno(sf->fp));
+        close(fd);
+        // drop anything the stream buffered from the old file
+        fseek(sf->fp, 0, SEEK_SET);
+    }
+
+    linfo("committed %s with %zu ranges, %lu bytes in %.3lf ms", sf->path,
+          sf->ranges.size, sf->buffered, (time_ns() - start) / 1e6);
+
+    clear_ranges(sf);
+    sf->keep = sf->size;
+    sf->dirty = false;
+    return true;
+}
+
+void savefile_commit_archive(SaveFileTable* t, u64 archive) {
+    Vec_foreach(f, *t) {
+        if (*f && (*f)->used && (*f)->archive == archive) savefile_commit(*f);
+    }
+}
+
+void savefile_close_all(SaveFileTable* t) {
+    Vec_foreach(f, *t) {
+        if (*f && (*f)->used) savefile_close(*f);
+        free(*f);
+    }
+    Vec_free(*t);
+}
@@ -0,0 +1,55 @@
+#ifndef SAVEFILE_H
+#define SAVEFILE_H
+
+#include <stdio.h>
+
+#include "common.h"
+
+// writes to save files are kept in memory and only reach the disk when the
+// file is closed or the archive is committed, by writing a new copy of the
+// file and renaming it over the old one, so a crash leaves either the old or
+// the new save and never a mix of both
+#define SAVEFILE_MAX_BUFFER BIT(24)
+
+typedef struct {
+    u64 offset;
+    u64 size;
+    u8* data;
+} SaveRange;
+
+// sorted and never overlapping or adjacent
+typedef Vector(SaveRange) SaveRangeList;
+
+typedef struct {
+    bool used;
+    u64 archive;
+    char* path;
+    FILE* fp;
+
+    u64 size;
+    // bytes of the file on disk which are still part of the file
+    u64 keep;
+    SaveRangeList ranges;
+    u64 buffered;
+    bool dirty;
+} SaveFile;
+
+// indexed by the fd of the file session
+typedef Vector(SaveFile*) SaveFileTable;
+
+SaveFile* savefile_open(SaveFileTable* t, int fd, u64 archive, char* path,
+                        FILE* fp);
+SaveFile* savefile_get(SaveFileTable* t, int fd);
+void savefile_close(SaveFile* sf);
+
+u32 savefile_read(SaveFile* sf, void* dst, u64 offset, u32 size);
+u32 savefile_write(SaveFile* sf, void* src, u64 offset, u32 size);
+void savefile_set_size(SaveFile* sf, u64 size);
+
+bool savefile_commit(SaveFile* sf);
+void savefile_restore(SaveFile* sf, u64 size, u64 keep, bool dirty,
+                      SaveRangeList* ranges);
+void savefile_commit_archive(SaveFileTable* t, u64 archive);
+void savefile_close_all(SaveFileTable* t);
+
+#endif
@@ -83,10 +83,32 @@ void services_init(E3DS* s) {
 
     srvobj_init(&s->services.y2r.transferend.hdr, KOT_EVENT);
     s->services.y2r.transferend.sticky = true;
+    memcpy(s->services.y2r.params.coefs, yuv_std_coefs[0],
+           sizeof yuv_std_coefs[0]);
 
     srvobj_init(&s->services.ir.event.hdr, KOT_EVENT);
 }
 
+// services with several ports share a handler so they are named after it
+const char* srv_port_name(void* handler) {
+    static const struct {
+        void* handler;
+        const char* name;
+    } names[] = {
+#define NAME(name) {port_handle_##name, #name}
+        NAME(srv),      NAME(errf),        NAME(apt),        NAME(fs),
+        NAME(fs_file),  NAME(fs_dir),      NAME(fs_sysfile), NAME(fs_selfncch),
+        NAME(gsp_gpu),  NAME(hid),         NAME(dsp),        NAME(cfg),
+        NAME(y2r),      NAME(cecd),        NAME(ldr_ro),     NAME(nwm_uds),
+        NAME(ir),       NAME(stub),
+#undef NAME
+    };
+    for (int i = 0; i < sizeof names / sizeof names[0]; i++) {
+        if (names[i].handler == handler) return names[i].name;
+    }
+    return "unknown";
+}
+
 DECL_PORT_ARG(stub, name) {
     u32* cmdbuf = PTR(cmd_addr);
     lwarn("stubbed service '%.8s' command 0x%04x (%x,%x,%x,%x,%x)",
@@ -11,6 +11,10 @@ void services_init(E3DS* s);
 
 u32 srvobj_make_handle(E3DS* s, KObject* o);
 
+const char* srv_port_name(void* handler);
+
+DECL_PORT_ARG(stub, name);
+
 DECL_PORT(srv);
 
 DECL_PORT(errf);
@@ -1,17 +1,219 @@
 #include "y2r.h"
 
+#include <pthread.h>
+
 #include "3ds.h"
 
+// the conversion is done by a worker thread from copies of the input, the
+// result is written to guest memory when the transfer end event is due
+static struct {
+    pthread_t thd;
+    bool started;
+    bool die;
+
+    pthread_mutex_t mtx;
+    pthread_cond_t queuecv;
+    pthread_cond_t donecv;
+
+    // seq of the job in the buffers, 0 if there is none
+    u32 seq;
+    bool pending;
+    bool busy;
+
+    YUVParams params;
+    u8* planes[3];
+    u32* tmp;
+    u8* out;
+} job = {
+    .mtx = PTHREAD_MUTEX_INITIALIZER,
+    .queuecv = PTHREAD_COND_INITIALIZER,
+    .donecv = PTHREAD_COND_INITIALIZER,
+};
+
+static void* y2r_thread(void*) {
+    pthread_mutex_lock(&job.mtx);
+    while (true) {
+        while (!job.pending && !job.die) {
+            pthread_cond_wait(&job.queuecv, &job.mtx);
+        }
+        if (job.die) break;
+        job.pending = false;
+        pthread_mutex_unlock(&job.mtx);
+
+        yuv_convert(&job.params, job.planes, job.out, job.tmp);
+
+        pthread_mutex_lock(&job.mtx);
+        job.busy = false;
+        pthread_cond_broadcast(&job.donecv);
+    }
+    pthread_mutex_unlock(&job.mtx);
+    return nullptr;
+}
+
+static void wait_job() {
+    pthread_mutex_lock(&job.mtx);
+    while (job.busy) {
+        pthread_cond_wait(&job.donecv, &job.mtx);
+    }
+    pthread_mutex_unlock(&job.mtx);
+}
+
+static void guest_copy(E3DS* s, u32 addr, u8* buf, u32 size, bool write) {
+    while (size) {
+        u32 n = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+        if (n > size) n = size;
+        if (write) memcpy(PTR(addr), buf, n);
+        else memcpy(buf, PTR(addr), n);
+        addr += n;
+        buf += n;
+        size -= n;
+    }
+}
+
+// moves size bytes between a packed host buffer and a guest buffer
+static void transfer(E3DS* s, Y2RBuffer* b, u8* buf, u32 size, bool write) {
+    if (size > b->size) {
+        lwarn("y2r buffer is 0x%x bytes but 0x%x are needed", b->size, size);
+        if (!write) memset(buf + b->size, 0, size - b->size);
+        size = b->size;
+    }
+    u32 unit = b->unit ? b->unit : size;
+    u32 addr = b->addr;
+    for (u32 done = 0; done < size; done += unit) {
+        u32 n = size - done < unit ? size - done : unit;
+        guest_copy(s, addr, buf + done, n, write);
+        addr += unit + b->gap;
+    }
+}
+
+static void read_input(E3DS* s, YUVParams* p) {
+    for (int i = 0; i < 3; i++) {
+        u32 size = yuv_input_size(p, i);
+        if (!size) continue;
+        job.planes[i] = realloc(job.planes[i], size);
+        transfer(s, &s->services.y2r.bufs[i], job.planes[i], size, false);
+    }
+    job.tmp = realloc(job.tmp, p->width * p->lines * sizeof(u32));
+    job.out = realloc(job.out, yuv_output_size(p));
+}
+
+static void start_conversion(E3DS* s) {
+    Y2RData* y2r = &s->services.y2r;
+    YUVParams* p = &y2r->params;
+
+    if (y2r->busy) remove_event(&s->sched, y2r_complete, y2r->seq);
+    wait_job();
+
+    linfo("converting %dx%d from format %d to format %d rotation %d %s",
+          p->width, p->lines, p->infmt, p->outfmt, p->rotation,
+          p->block == YUV_BLOCK8 ? "blocks" : "lines");
+
+    read_input(s, p);
+
+    if (!++y2r->seq) y2r->seq = 1;
+    y2r->busy = true;
+
+    pthread_mutex_lock(&job.mtx);
+    if (!job.started) {
+        job.started = true;
+        job.die = false;
+        pthread_create(&job.thd, nullptr, y2r_thread, nullptr);
+    }
+    job.params = *p;
+    job.seq = y2r->seq;
+    job.pending = true;
+    job.busy = true;
+    pthread_cond_signal(&job.queuecv);
+    pthread_mutex_unlock(&job.mtx);
+
+    add_event(&s->sched, y2r_complete, y2r->seq,
+              (s64) p->width * p->lines * Y2R_CYCLES_PER_PIXEL);
+}
+
+// the emulator only blocks here if the host is slower than the hardware
+void y2r_complete(E3DS* s, u32 seq) {
+    Y2RData* y2r = &s->services.y2r;
+
+    wait_job();
+    if (job.seq != seq) {
+        // the job was lost by loading a state, so it is redone now
+        read_input(s, &y2r->params);
+        job.params = y2r->params;
+        job.seq = seq;
+        yuv_convert(&job.params, job.planes, job.out, job.tmp);
+    }
+
+    u32 size = yuv_output_size(&job.params);
+    transfer(s, &y2r->bufs[Y2R_BUF_OUT], job.out, size, true);
+
+    y2r->busy = false;
+    if (y2r->enableInterrupt) {
+        event_signal(s, &y2r->transferend);
+    }
+}
+
+static void set_buffer(E3DS* s, int i, u32* cmdbuf) {
+    s->services.y2r.bufs[i] = (Y2RBuffer) {
+        .addr = cmdbuf[1],
+        .size = cmdbuf[2],
+        .unit = cmdbuf[3],
+        .gap = cmdbuf[4],
+    };
+}
+
+static void set_width(E3DS* s, u32 width) {
+    if (!width || width > YUV_MAX_WIDTH || width % 8) {
+        lwarn("invalid input line width %d", width);
+        return;
+    }
+    s->services.y2r.params.width = width;
+}
+
+static void set_lines(E3DS* s, u32 lines) {
+    if (!lines || lines > YUV_MAX_LINES) {
+        lwarn("invalid input lines %d", lines);
+        return;
+    }
+    s->services.y2r.params.lines = lines;
+}
+
+static void set_stdcoef(E3DS* s, u32 idx) {
+    if (idx >= 4) {
+        lwarn("invalid standard coefficient %d", idx);
+        return;
+    }
+    s->services.y2r.stdcoef = idx;
+    memcpy(s->services.y2r.params.coefs, yuv_std_coefs[idx],
+           sizeof yuv_std_coefs[idx]);
+}
+
 DECL_PORT(y2r) {
     u32* cmdbuf = PTR(cmd_addr);
+    Y2RData* y2r = &s->services.y2r;
+    YUVParams* p = &y2r->params;
     switch (cmd.command) {
-        case 0x000d: {
-            s->services.y2r.enableInterrupt = cmdbuf[1];
-            linfo("SetTransferEndInterrupt");
-            cmdbuf[0] = IPCHDR(1, 0);
-            cmdbuf[1] = 0;
-            break;
-        }
+#define SETTER(c, name, field)                                                 \
+    case c:                                                                    \
+        linfo("Set" #name " %d", cmdbuf[1]);                                   \
+        field = cmdbuf[1];                                                     \
+        cmdbuf[0] = IPCHDR(1, 0);                                              \
+        cmdbuf[1] = 0;                                                         \
+        break;                                                                 \
+    case c + 1:                                                                \
+        linfo("Get" #name);                                                    \
+        cmdbuf[0] = IPCHDR(2, 0);                                              \
+        cmdbuf[1] = 0;                                                         \
+        cmdbuf[2] = field;                                                     \
+        break
+        SETTER(0x0001, InputFormat, p->infmt);
+        SETTER(0x0003, OutputFormat, p->outfmt);
+        SETTER(0x0005, Rotation, p->rotation);
+        SETTER(0x0007, BlockAlignment, p->block);
+        SETTER(0x0009, SpacialDithering, y2r->spatial_dither);
+        SETTER(0x000b, TemporalDithering, y2r->temporal_dither);
+        SETTER(0x000d, TransferEndInterrupt, y2r->enableInterrupt);
+        SETTER(0x0022, Alpha, p->alpha);
+#undef SETTER
         case 0x000f: {
             cmdbuf[0] = IPCHDR(1, 2);
             cmdbuf[1] = 0;
@@ -19,17 +221,115 @@ DECL_PORT(y2r) {
             linfo("GetTransferEndEvent with handle %x", cmdbuf[3]);
             break;
         }
+        case 0x0010:
+        case 0x0011:
+        case 0x0012:
+        case 0x0013: {
+            // yuyv goes in the y buffer
+            int i = cmd.command == 0x0013 ? Y2R_BUF_Y : cmd.command - 0x0010;
+            linfo("SetSending%s addr=%08x size=%x unit=%x gap=%x",
+                  (char*[]) {"Y", "U", "V", "YUYV"}[cmd.command - 0x0010],
+                  cmdbuf[1], cmdbuf[2], cmdbuf[3], cmdbuf[4]);
+            set_buffer(s, i, cmdbuf);
+            cmdbuf[0] = IPCHDR(1, 0);
+            cmdbuf[1] = 0;
+            break;
+        }
+        case 0x0014:
+        case 0x0015:
+        case 0x0016:
+        case 0x0017:
+        case 0x0019:
+            linfo("IsFinished%s", cmd.command == 0x0019 ? "Receiving"
+                                                         : "Sending");
+            cmdbuf[0] = IPCHDR(2, 0);
+            cmdbuf[1] = 0;
+            cmdbuf[2] = !y2r->busy;
+            break;
+        case 0x0018:
+            linfo("SetReceiving addr=%08x size=%x unit=%x gap=%x", cmdbuf[1],
+                  cmdbuf[2], cmdbuf[3], cmdbuf[4]);
+            set_buffer(s, Y2R_BUF_OUT, cmdbuf);
+            cmdbuf[0] = IPCHDR(1, 0);
+            cmdbuf[1] = 0;
+            break;
+        case 0x001a:
+            linfo("SetInputLineWidth %d", cmdbuf[1]);
+            set_width(s, cmdbuf[1]);
+            cmdbuf[0] = IPCHDR(1, 0);
+            cmdbuf[1] = 0;
+            break;
+        case 0x001b:
+            linfo("GetInputLineWidth");
+            cmdbuf[0] = IPCHDR(2, 0);
+            cmdbuf[1] = 0;
+            cmdbuf[2] = p->width;
+            break;
+        case 0x001c:
+            linfo("SetInputLines %d", cmdbuf[1]);
+            set_lines(s, cmdbuf[1]);
+            cmdbuf[0] = IPCHDR(1, 0);
+            cmdbuf[1] = 0;
+            break;
+        case 0x001d:
+            linfo("GetInputLines");
+            cmdbuf[0] = IPCHDR(2, 0);
+            cmdbuf[1] = 0;
+            cmdbuf[2] = p->lines;
+            break;
+        case 0x001e:
+            linfo("SetCoefficient");
+            memcpy(p->coefs, &cmdbuf[1], sizeof p->coefs);
+            cmdbuf[0] = IPCHDR(1, 0);
+            cmdbuf[1] = 0;
+            break;
+        case 0x001f:
+            linfo("GetCoefficient");
+            cmdbuf[0] = IPCHDR(5, 0);
+            cmdbuf[1] = 0;
+            memcpy(&cmdbuf[2], p->coefs, sizeof p->coefs);
+            break;
+        case 0x0020:
+            linfo("SetStandardCoefficient %d", cmdbuf[1]);
+            set_stdcoef(s, cmdbuf[1]);
+            cmdbuf[0] = IPCHDR(1, 0);
+            cmdbuf[1] = 0;
+            break;
+        case 0x0021: {
+            u32 idx = cmdbuf[1];
+            linfo("GetStandardCoefficient %d", idx);
+            cmdbuf[0] = IPCHDR(5, 0);
+            cmdbuf[1] = 0;
+            memcpy(&cmdbuf[2], yuv_std_coefs[idx & 3],
+                   sizeof yuv_std_coefs[0]);
+            break;
+        }
+        case 0x0024:
+            linfo("SetDitheringWeightParams");
+            memcpy(y2r->dither_weights, &cmdbuf[1],
+                   sizeof y2r->dither_weights);
+            cmdbuf[0] = IPCHDR(1, 0);
+            cmdbuf[1] = 0;
+            break;
+        case 0x0025:
+            linfo("GetDitheringWeightParams");
+            cmdbuf[0] = IPCHDR(9, 0);
+            cmdbuf[1] = 0;
+            memcpy(&cmdbuf[2], y2r->dither_weights,
+                   sizeof y2r->dither_weights);
+            break;
         case 0x0026:
             linfo("StartConversion");
+            start_conversion(s);
             cmdbuf[0] = IPCHDR(1, 0);
             cmdbuf[1] = 0;
-            // todo: actually do the conversion
-            if (s->services.y2r.enableInterrupt) {
-                event_signal(s, &s->services.y2r.transferend);
-            }
             break;
         case 0x0027:
             linfo("StopConversion");
+            if (y2r->busy) {
+                remove_event(&s->sched, y2r_complete, y2r->seq);
+                y2r->busy = false;
+            }
             cmdbuf[0] = IPCHDR(1, 0);
             cmdbuf[1] = 0;
             break;
@@ -37,8 +337,25 @@ DECL_PORT(y2r) {
             linfo("IsBusyConversion");
             cmdbuf[0] = IPCHDR(2, 0);
             cmdbuf[1] = 0;
-            cmdbuf[2] = 0; // not busy
+            cmdbuf[2] = y2r->busy;
+            break;
+        case 0x0029: {
+            // input format, output format, rotation, block alignment, line
+            // width, lines, standard coefficient, alpha
+            u8* params = (u8*) &cmdbuf[1];
+            linfo("SetPackageParameter");
+            p->infmt = params[0];
+            p->outfmt = params[1];
+            p->rotation = params[2];
+            p->block = params[3];
+            set_width(s, params[4] | params[5] << 8);
+            set_lines(s, params[6] | params[7] << 8);
+            set_stdcoef(s, params[8]);
+            p->alpha = params[10] | params[11] << 8;
+            cmdbuf[0] = IPCHDR(1, 0);
+            cmdbuf[1] = 0;
             break;
+        }
         case 0x002a:
             linfo("PingProcess");
             cmdbuf[0] = IPCHDR(2, 0);
@@ -47,9 +364,40 @@ DECL_PORT(y2r) {
             break;
         case 0x002b:
             linfo("DriverInitialize");
+            p->infmt = YUV_IN_422;
+            p->outfmt = YUV_OUT_RGBA8;
+            p->rotation = YUV_ROT_NONE;
+            p->block = YUV_LINEAR;
+            p->width = 400;
+            p->lines = 240;
+            set_stdcoef(s, 0);
+            cmdbuf[0] = IPCHDR(1, 0);
+            cmdbuf[1] = 0;
+            break;
+        case 0x002c:
+            linfo("DriverFinalize");
             cmdbuf[0] = IPCHDR(1, 0);
             cmdbuf[1] = 0;
             break;
+        case 0x002d: {
+            linfo("GetPackageParameter");
+            cmdbuf[0] = IPCHDR(4, 0);
+            cmdbuf[1] = 0;
+            u8* params = (u8*) &cmdbuf[2];
+            params[0] = p->infmt;
+            params[1] = p->outfmt;
+            params[2] = p->rotation;
+            params[3] = p->block;
+            params[4] = p->width;
+            params[5] = p->width >> 8;
+            params[6] = p->lines;
+            params[7] = p->lines >> 8;
+            params[8] = y2r->stdcoef;
+            params[9] = 0;
+            params[10] = p->alpha;
+            params[11] = p->alpha >> 8;
+            break;
+        }
         default:
             linfo("unknown command 0x%04x (%x,%x,%x,%x,%x)", cmd.command,
                   cmdbuf[1], cmdbuf[2], cmdbuf[3], cmdbuf[4], cmdbuf[5]);
@@ -57,4 +405,34 @@ DECL_PORT(y2r) {
             cmdbuf[1] = 0;
             break;
     }
-}
\ No newline at end of file
+}
+
+// a pending transfer end from a loaded state redoes the conversion instead
+// of using whatever the worker last made
+void y2r_clear_job() {
+    wait_job();
+    job.seq = 0;
+}
+
+void y2r_destroy() {
+    wait_job();
+    pthread_mutex_lock(&job.mtx);
+    if (job.started) {
+        job.die = true;
+        job.started = false;
+        pthread_cond_broadcast(&job.queuecv);
+        pthread_mutex_unlock(&job.mtx);
+        pthread_join(job.thd, nullptr);
+    } else {
+        pthread_mutex_unlock(&job.mtx);
+    }
+    for (int i = 0; i < 3; i++) {
+        free(job.planes[i]);
+        job.planes[i] = nullptr;
+    }
+    free(job.tmp);
+    free(job.out);
+    job.tmp = nullptr;
+    job.out = nullptr;
+    job.seq = 0;
+}
@@ -4,12 +4,46 @@
 #include "kernel/thread.h"
 
 #include "srv.h"
+#include "yuv.h"
+
+// the hardware converts about one 400x240 frame per millisecond
+#define Y2R_CYCLES_PER_PIXEL 3
+
+enum {
+    Y2R_BUF_Y,
+    Y2R_BUF_U,
+    Y2R_BUF_V,
+    Y2R_BUF_OUT,
+};
+
+// guest buffers are transferred in units with a gap skipped after each
+typedef struct {
+    u32 addr;
+    u32 size;
+    u32 unit;
+    u32 gap;
+} Y2RBuffer;
 
 typedef struct {
     bool enableInterrupt;
     KEvent transferend;
+
+    YUVParams params;
+    u8 stdcoef;
+    bool spatial_dither;
+    bool temporal_dither;
+    u16 dither_weights[16];
+    Y2RBuffer bufs[4];
+
+    bool busy;
+    u32 seq;
 } Y2RData;
 
 DECL_PORT(y2r);
 
+void y2r_complete(E3DS* s, u32 seq);
+
+void y2r_clear_job();
+void y2r_destroy();
+
 #endif
@@ -0,0 +1,216 @@
+#include "yuv.h"
+
+#include <string.h>
+
+// rows are converted 8 pixels at a time with vector extensions, which become
+// sse or avx2 on x86 and neon on arm
+typedef s32 v8i __attribute__((vector_size(32)));
+typedef u8 v8b __attribute__((vector_size(8)));
+
+#if defined(__x86_64__) && defined(__linux__)
+#define YUV_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define YUV_KERNEL
+#endif
+
+// rec 601, rec 709, and both scaled from video range
+const s16 yuv_std_coefs[4][8] = {
+    {0x100, 0x166, 0xb6, 0x58, 0x1c5, -0x166f, 0x10ee, -0x1c5b},
+    {0x100, 0x193, 0x77, 0x2f, 0x1db, -0x1933, 0xa7c, -0x1d51},
+    {0x12a, 0x198, 0xd0, 0x64, 0x204, -0x1bde, 0x10f2, -0x229b},
+    {0x12a, 0x1ca, 0x88, 0x36, 0x21c, -0x1f04, 0x99c, -0x2421},
+};
+
+static const u32 outbpp[4] = {4, 3, 2, 2};
+
+static bool is16(YUVParams* p) {
+    return p->infmt == YUV_IN_422_16 || p->infmt == YUV_IN_420_16;
+}
+
+static bool is420(YUVParams* p) {
+    return p->infmt == YUV_IN_420 || p->infmt == YUV_IN_420_16;
+}
+
+u32 yuv_input_size(YUVParams* p, int plane) {
+    u32 w = p->width;
+    u32 h = p->lines;
+    if (p->infmt == YUV_IN_YUYV) return plane == YUV_Y ? 2 * w * h : 0;
+    u32 size = plane == YUV_Y ? w * h : w / 2 * (is420(p) ? (h + 1) / 2 : h);
+    return is16(p) ? 2 * size : size;
+}
+
+static bool rotated(YUVParams* p) {
+    return p->rotation == YUV_ROT_90 || p->rotation == YUV_ROT_270;
+}
+
+u32 yuv_output_size(YUVParams* p) {
+    u32 ow = rotated(p) ? p->lines : p->width;
+    u32 oh = rotated(p) ? p->width : p->lines;
+    if (p->block == YUV_BLOCK8) {
+        ow = (ow + 7) & ~7;
+        oh = (oh + 7) & ~7;
+    }
+    return ow * oh * outbpp[p->outfmt & 3];
+}
+
+static inline v8i load8(u8* p) {
+    v8b b;
+    memcpy(&b, p, sizeof b);
+    return __builtin_convertvector(b, v8i);
+}
+
+static inline v8i clamp8(v8i x) {
+    x >>= 5;
+    x &= ~(x < 0);
+    v8i over = x > 255;
+    return (x & ~over) | (255 & over);
+}
+
+// this matches the hardware bit for bit, pixels are rgba with r in the low
+// byte
+YUV_KERNEL static void convert_row(u32* dst, u8* y, u8* u, u8* v, u32 n,
+                                   const s16* c, u32 alpha) {
+    for (u32 i = 0; i < n; i += 8) {
+        v8i Y = load8(&y[i]) * c[0];
+        v8i U = load8(&u[i]);
+        v8i V = load8(&v[i]);
+        v8i r = ((Y + c[1] * V) >> 3) + (c[5] + 0x18);
+        v8i g = ((Y - c[2] * V - c[3] * U) >> 3) + (c[6] + 0x18);
+        v8i b = ((Y + c[4] * U) >> 3) + (c[7] + 0x18);
+        v8i px = clamp8(r) | clamp8(g) << 8 | clamp8(b) << 16 |
+                 (s32) (alpha << 24);
+        memcpy(&dst[i], &px, sizeof px);
+    }
+}
+
+// puts the samples of one line into separate full width rows
+static void load_line(YUVParams* p, u8* planes[3], u32 line, u8* yr, u8* ur,
+                      u8* vr) {
+    u32 w = p->width;
+    if (p->infmt == YUV_IN_YUYV) {
+        u8* src = &planes[YUV_Y][2 * line * w];
+        for (u32 x = 0; x < w; x += 2) {
+            yr[x] = src[2 * x];
+            yr[x + 1] = src[2 * x + 2];
+            ur[x] = ur[x + 1] = src[2 * x + 1];
+            vr[x] = vr[x + 1] = src[2 * x + 3];
+        }
+        return;
+    }
+
+    // only the low byte of 16 bit samples is used
+    u32 step = is16(p) ? 2 : 1;
+    u32 cline = is420(p) ? line / 2 : line;
+    u8* ysrc = &planes[YUV_Y][line * w * step];
+    u8* usrc = &planes[YUV_U][cline * w / 2 * step];
+    u8* vsrc = &planes[YUV_V][cline * w / 2 * step];
+    if (step == 1) {
+        memcpy(yr, ysrc, w);
+    } else {
+        for (u32 x = 0; x < w; x++) {
+            yr[x] = ysrc[x * step];
+        }
+    }
+    for (u32 x = 0; x < w; x += 2) {
+        ur[x] = ur[x + 1] = usrc[x / 2 * step];
+        vr[x] = vr[x + 1] = vsrc[x / 2 * step];
+    }
+}
+
+static inline u32 block_index(u32 tilesw, u32 x, u32 y) {
+    static const u8 swizzle[8] = {
+        0x00, 0x01, 0x04, 0x05, 0x10, 0x11, 0x14, 0x15,
+    };
+    return ((y >> 3) * tilesw + (x >> 3)) * 64 +
+           (swizzle[x & 7] | swizzle[y & 7] << 1);
+}
+
+// walks the output in order, with the source pixel of each output line
+// starting at start and advancing by step
+#define EMIT(bpp, put)                                                         \
+    ({                                                                         \
+        for (u32 oy = 0; oy < oh; oy++) {                                      \
+            s32 start, step;                                                   \
+            switch (p->rotation) {                                             \
+                case YUV_ROT_90:                                               \
+                    start = (h - 1) * w + oy;                                  \
+                    step = -w;                                                 \
+                    break;                                                     \
+                case YUV_ROT_180:                                              \
+                    start = (h - 1 - oy) * w + w - 1;                          \
+                    step = -1;                                                 \
+                    break;                                                     \
+                case YUV_ROT_270:                                              \
+                    start = w - 1 - oy;                                        \
+                    step = w;                                                  \
+                    break;                                                     \
+                default:                                                       \
+                    start = oy * w;                                            \
+                    step = 1;                                                  \
+                    break;                                                     \
+            }                                                                  \
+            u32* src = &tmp[start];                                            \
+            for (u32 ox = 0; ox < ow; ox++, src += step) {                     \
+                u32 c = *src;                                                  \
+                u8* d = &dst[(block ? block_index(tilesw, ox, oy)              \
+                                    : oy * ow + ox) *                          \
+                             bpp];                                             \
+                put;                                                           \
+            }                                                                  \
+        }                                                                      \
+    })
+
+// the output formats have the same layout as textures
+static void emit(YUVParams* p, u32* tmp, u8* dst) {
+    u32 w = p->width;
+    u32 h = p->lines;
+    u32 ow = rotated(p) ? h : w;
+    u32 oh = rotated(p) ? w : h;
+    bool block = p->block == YUV_BLOCK8;
+    u32 tilesw = (ow + 7) >> 3;
+
+#define R (c & 0xff)
+#define G (c >> 8 & 0xff)
+#define B (c >> 16 & 0xff)
+    switch (p->outfmt) {
+        case YUV_OUT_RGBA8:
+            EMIT(4, ({
+                     u32 px = __builtin_bswap32(c);
+                     memcpy(d, &px, 4);
+                 }));
+            break;
+        case YUV_OUT_RGB8:
+            EMIT(3, ({
+                     d[0] = B;
+                     d[1] = G;
+                     d[2] = R;
+                 }));
+            break;
+        case YUV_OUT_RGB5A1:
+            EMIT(2, ({
+                     u16 px = (R >> 3) << 11 | (G >> 3) << 6 | (B >> 3) << 1 |
+                              c >> 31;
+                     memcpy(d, &px, 2);
+                 }));
+            break;
+        case YUV_OUT_RGB565:
+            EMIT(2, ({
+                     u16 px = (R >> 3) << 11 | (G >> 2) << 5 | (B >> 3);
+                     memcpy(d, &px, 2);
+                 }));
+            break;
+    }
+#undef R
+#undef G
+#undef B
+}
+
+void yuv_convert(YUVParams* p, u8* planes[3], u8* dst, u32* tmp) {
+    u8 yr[YUV_MAX_WIDTH], ur[YUV_MAX_WIDTH], vr[YUV_MAX_WIDTH];
+    u32 w = p->width;
+    for (u32 line = 0; line < p->lines; line++) {
+        load_line(p, planes, line, yr, ur, vr);
+        convert_row(&tmp[line * w], yr, ur, vr, w, p->coefs, p->alpha & 0xff);
+    }
+    emit(p, tmp, dst);
+}
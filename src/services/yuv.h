@@ -0,0 +1,66 @@
+#ifndef YUV_H
+#define YUV_H
+
+#include "common.h"
+
+// the conversion done by the y2r hardware, kept separate from the service so
+// it can be benchmarked on its own
+
+#define YUV_MAX_WIDTH 1024
+#define YUV_MAX_LINES 1024
+
+enum {
+    YUV_IN_422,
+    YUV_IN_420,
+    YUV_IN_422_16,
+    YUV_IN_420_16,
+    YUV_IN_YUYV,
+};
+
+enum {
+    YUV_OUT_RGBA8,
+    YUV_OUT_RGB8,
+    YUV_OUT_RGB5A1,
+    YUV_OUT_RGB565,
+};
+
+enum {
+    YUV_ROT_NONE,
+    YUV_ROT_90,
+    YUV_ROT_180,
+    YUV_ROT_270,
+};
+
+enum {
+    YUV_LINEAR,
+    YUV_BLOCK8,
+};
+
+enum {
+    YUV_Y,
+    YUV_U,
+    YUV_V,
+};
+
+typedef struct {
+    u8 infmt;
+    u8 outfmt;
+    u8 rotation;
+    u8 block;
+    // the width must be a multiple of 8
+    u16 width;
+    u16 lines;
+    s16 coefs[8];
+    u16 alpha;
+} YUVParams;
+
+extern const s16 yuv_std_coefs[4][8];
+
+u32 yuv_input_size(YUVParams* p, int plane);
+u32 yuv_output_size(YUVParams* p);
+
+// the planes are packed without gaps, a yuyv image is given as the y plane,
+// tmp needs room for width * lines pixels
+void yuv_convert(YUVParams* p, u8* planes[3], u8* dst, u32* tmp);
+
+#endif
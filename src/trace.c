@@ -0,0 +1,127 @@
+#include "trace.h"
+
+#ifdef TRACING
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// each thread has its own ring so recording needs no locks, the oldest
+// events are overwritten once it is full
+typedef struct _TraceBuf {
+    TraceEvent ev[BIT(TRACE_BUF_BITS)];
+    _Atomic u64 head;
+    int tid;
+    const char* name;
+    // set when the thread exits so another one can take the buffer
+    atomic_bool free;
+    struct _TraceBuf* next;
+} TraceBuf;
+
+static _Atomic(TraceBuf*) tracebufs;
+static atomic_int ntraced;
+static thread_local TraceBuf* curbuf;
+
+static pthread_key_t tracekey;
+static pthread_once_t traceonce = PTHREAD_ONCE_INIT;
+
+static void release_buf(void* p) {
+    atomic_store(&((TraceBuf*) p)->free, true);
+}
+
+static void init_key() {
+    pthread_key_create(&tracekey, release_buf);
+}
+
+static TraceBuf* get_buf() {
+    if (curbuf) return curbuf;
+    pthread_once(&traceonce, init_key);
+
+    for (TraceBuf* b = atomic_load(&tracebufs); b; b = b->next) {
+        bool expected = true;
+        if (atomic_compare_exchange_strong(&b->free, &expected, false)) {
+            curbuf = b;
+            break;
+        }
+    }
+    if (!curbuf) {
+        curbuf = calloc(1, sizeof *curbuf);
+        curbuf->tid = ++ntraced;
+        curbuf->next = atomic_load(&tracebufs);
+        while (!atomic_compare_exchange_weak(&tracebufs, &curbuf->next,
+                                             curbuf));
+    }
+    pthread_setspecific(tracekey, curbuf);
+    return curbuf;
+}
+
+void trace_thread_name(const char* name) {
+    get_buf()->name = name;
+}
+
+void trace_event(const char* name, u64 start, u64 end) {
+    TraceBuf* b = get_buf();
+    u64 head = atomic_load_explicit(&b->head, memory_order_relaxed);
+    b->ev[head & MASK(TRACE_BUF_BITS)] = (TraceEvent) {name, start, end};
+    atomic_store_explicit(&b->head, head + 1, memory_order_release);
+}
+
+// the other threads keep recording while this runs, so each ring is copied
+// first and anything overwritten during the copy is dropped
+bool trace_write(const char* path) {
+    FILE* fp = fopen(path, "w");
+    if (!fp) {
+        lerror("could not open %s", path);
+        return false;
+    }
+
+    u64 base = UINT64_MAX;
+    for (TraceBuf* b = atomic_load(&tracebufs); b; b = b->next) {
+        u64 n = atomic_load(&b->head);
+        if (n > BIT(TRACE_BUF_BITS)) n = BIT(TRACE_BUF_BITS);
+        for (u64 i = 0; i < n; i++) {
+            if (b->ev[i].start < base) base = b->ev[i].start;
+        }
+    }
+
+    TraceEvent* ev = malloc(sizeof ev[0] * BIT(TRACE_BUF_BITS));
+    size_t count = 0;
+    fprintf(fp, "{\"traceEvents\":[");
+    for (TraceBuf* b = atomic_load(&tracebufs); b; b = b->next) {
+        if (count++) fprintf(fp, ",");
+        if (b->name) {
+            fprintf(fp,
+                    "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                    "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    b->tid, b->name);
+        } else {
+            fprintf(fp,
+                    "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                    "\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                    b->tid, b->tid);
+        }
+
+        u64 end = atomic_load_explicit(&b->head, memory_order_acquire);
+        memcpy(ev, b->ev, sizeof b->ev);
+        u64 newend = atomic_load_explicit(&b->head, memory_order_acquire);
+        // the oldest slot may have been in the middle of being overwritten
+        u64 start = 0;
+        if (newend >= BIT(TRACE_BUF_BITS)) {
+            start = newend - BIT(TRACE_BUF_BITS) + 1;
+        }
+        for (u64 i = start; i < end; i++) {
+            TraceEvent* e = &ev[i & MASK(TRACE_BUF_BITS)];
+            fprintf(fp,
+                    ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3lf,\"dur\":%.3lf}",
+                    e->name, b->tid, (e->start - base) / 1e3,
+                    (e->end - e->start) / 1e3);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    free(ev);
+    fclose(fp);
+    linfo("wrote trace to %s", path);
+    return true;
+}
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "common.h"
+
+// spans of time spent in each part of a frame, written as a chrome trace
+// that can be opened in perfetto, only built with TRACING defined
+#ifdef TRACING
+
+#define TRACE_BUF_BITS 16
+
+typedef struct {
+    const char* name;
+    u64 start;
+    u64 end;
+} TraceEvent;
+
+void trace_thread_name(const char* name);
+void trace_event(const char* name, u64 start, u64 end);
+bool trace_write(const char* path);
+
+static inline void trace_scope_end(TraceEvent* e) {
+    trace_event(e->name, e->start, time_ns());
+}
+
+#define _TRACE_VAR(l) _trace_##l
+#define TRACE_VAR(l) _TRACE_VAR(l)
+// records a span from here until the end of the enclosing block
+#define TRACE_SCOPE(name)                                                      \
+    [[gnu::cleanup(trace_scope_end)]] TraceEvent TRACE_VAR(__COUNTER__) = {    \
+        name, time_ns()}
+
+#else
+
+#define TRACE_SCOPE(name)
+#define trace_thread_name(name) ((void) 0)
+
+#endif
+
+#endif
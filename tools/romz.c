@@ -0,0 +1,154 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#include "../src/kernel/zrom.h"
+
+bool g_infologs = false;
+
+// compresses a rom into fixed size zstd blocks, blocks which do not get
+// smaller are stored as is
+int compress(char* infile, char* outfile, int level) {
+    FILE* fp = fopen(infile, "rb");
+    if (!fp) return -1;
+    FILE* outfp = fopen(outfile, "wb");
+    if (!outfp) return -1;
+
+    fseek(fp, 0, SEEK_END);
+    u64 size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    ZRomHeader hdr = {
+        .magic = ZROM_MAGIC,
+        .version = ZROM_VERSION,
+        .blocksize = ZROM_BLOCK_SIZE,
+        .nblocks = (size + ZROM_BLOCK_SIZE - 1) / ZROM_BLOCK_SIZE,
+        .size = size,
+    };
+    if (!hdr.nblocks) return -1;
+    u64* index = calloc(hdr.nblocks + 1, sizeof(u64));
+
+    // the index is written again once the offsets are known
+    fwrite(&hdr, sizeof hdr, 1, outfp);
+    fwrite(index, sizeof(u64), hdr.nblocks + 1, outfp);
+
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    u8* buf = malloc(ZROM_BLOCK_SIZE);
+    size_t cbufsize = ZSTD_compressBound(ZROM_BLOCK_SIZE);
+    u8* cbuf = malloc(cbufsize);
+
+    u64 pos = ftell(outfp);
+    for (u32 i = 0; i < hdr.nblocks; i++) {
+        size_t len = fread(buf, 1, ZROM_BLOCK_SIZE, fp);
+        size_t clen = ZSTD_compressCCtx(cctx, cbuf, cbufsize, buf, len, level);
+        index[i] = pos;
+        if (ZSTD_isError(clen) || clen >= len) {
+            fwrite(buf, 1, len, outfp);
+            pos += len;
+        } else {
+            fwrite(cbuf, 1, clen, outfp);
+            pos += clen;
+        }
+        printf("\r%u/%u blocks", i + 1, hdr.nblocks);
+        fflush(stdout);
+    }
+    index[hdr.nblocks] = pos;
+    printf("\n%lu -> %lu bytes (%.1lf%%)\n", size, pos, 100.0 * pos / size);
+
+    fseek(outfp, sizeof hdr, SEEK_SET);
+    fwrite(index, sizeof(u64), hdr.nblocks + 1, outfp);
+
+    ZSTD_freeCCtx(cctx);
+    free(buf);
+    free(cbuf);
+    free(index);
+    fclose(fp);
+    fclose(outfp);
+
+    return 0;
+}
+
+double elapsed(struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// reads through the compressed rom and the original one with the same
+// pattern, checking the data matches, drop the page cache first to compare
+// cold reads
+int bench(char* zfile, char* rawfile) {
+    int zfd = open(zfile, O_RDONLY);
+    int rawfd = open(rawfile, O_RDONLY);
+    if (zfd < 0 || rawfd < 0) return -1;
+    ZRom* z = zrom_open(zfd);
+    if (!z) return -1;
+    u64 size = z->hdr.size;
+
+    u8* buf = malloc(BIT(20));
+    u8* rawbuf = malloc(BIT(20));
+
+    struct timespec start;
+    double ztime = 0, rawtime = 0;
+    for (u64 off = 0; off < size; off += BIT(20)) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        u32 n = zrom_read(z, buf, off, BIT(20));
+        ztime += elapsed(&start);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pread(rawfd, rawbuf, n, off);
+        rawtime += elapsed(&start);
+        if (memcmp(buf, rawbuf, n)) {
+            printf("mismatch at 0x%lx\n", off);
+            return -1;
+        }
+    }
+    printf("sequential 1 MiB: compressed %.1lf MB/s, raw %.1lf MB/s\n",
+           size / ztime / 1e6, size / rawtime / 1e6);
+
+    // random small reads like a game loading files from the romfs
+    srand(0);
+    u32 nreads = 4096;
+    u64 total = 0;
+    ztime = rawtime = 0;
+    for (u32 i = 0; i < nreads; i++) {
+        u64 off = ((u64) rand() << 16 ^ rand()) % size;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        u32 n = zrom_read(z, buf, off, BIT(16));
+        ztime += elapsed(&start);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pread(rawfd, rawbuf, n, off);
+        rawtime += elapsed(&start);
+        if (memcmp(buf, rawbuf, n)) {
+            printf("mismatch at 0x%lx\n", off);
+            return -1;
+        }
+        total += n;
+    }
+    printf("random 64 KiB: compressed %.1lf MB/s, raw %.1lf MB/s\n",
+           total / ztime / 1e6, total / rawtime / 1e6);
+    printf("cache: %lu hits, %lu misses\n", z->hits, z->misses);
+
+    zrom_close(z);
+    close(rawfd);
+    free(buf);
+    free(rawbuf);
+
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 4 && !strcmp(argv[1], "-b")) {
+        return bench(argv[2], argv[3]);
+    }
+    if (argc < 3) {
+        printf("usage: romz <rom> <out.3dz> [level]\n"
+               "       romz -b <rom.3dz> <rom>\n");
+        return -1;
+    }
+    int level = argc >= 4 ? atoi(argv[3]) : 12;
+    return compress(argv[1], argv[2], level);
+}
@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/services/yuv.h"
+
+bool g_infologs = false;
+
+// converts 400x240 frames for a second with each input and output format and
+// prints how many frames per second were done
+int main(int argc, char** argv) {
+    YUVParams p = {.width = 400, .lines = 240, .alpha = 0xff};
+    memcpy(p.coefs, yuv_std_coefs[0], sizeof p.coefs);
+    if (argc > 1) p.rotation = atoi(argv[1]) & 3;
+    if (argc > 2) p.block = atoi(argv[2]) & 1;
+
+    char* innames[] = {"yuv422", "yuv420", "yuv422/16", "yuv420/16", "yuyv"};
+    char* outnames[] = {"rgba8", "rgb8", "rgb5a1", "rgb565"};
+
+    u8* planes[3];
+    for (int i = 0; i < 3; i++) {
+        planes[i] = malloc(2 * 400 * 240);
+        for (int j = 0; j < 2 * 400 * 240; j++) planes[i][j] = rand();
+    }
+    u8* out = malloc(4 * 400 * 240);
+    u32* tmp = malloc(4 * 400 * 240);
+
+    printf("rotation %d, %s\n", p.rotation, p.block ? "blocks" : "lines");
+    for (int in = 0; in < 5; in++) {
+        for (int o = 0; o < 4; o++) {
+            p.infmt = in;
+            p.outfmt = o;
+            u64 frames = 0;
+            u64 start = time_ns();
+            u64 elapsed;
+            do {
+                yuv_convert(&p, planes, out, tmp);
+                frames++;
+                elapsed = time_ns() - start;
+            } while (elapsed < 1'000'000'000);
+            printf("%-10s -> %-7s %8.1lf fps\n", innames[in], outnames[o],
+                   frames * 1e9 / elapsed);
+        }
+    }
+
+    for (int i = 0; i < 3; i++) free(planes[i]);
+    free(out);
+    free(tmp);
+    return 0;
+}